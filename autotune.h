@@ -0,0 +1,454 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "matrix_kernels.h"
+
+using namespace std;
+
+/**
+ * Operations that are tuned.
+ */
+enum TunedOperation {
+    TUNE_MULTIPLY = 0,
+    TUNE_TRANSPOSE = 1
+};
+
+/**
+ * How to run one operation: the number of threads (1 is serial), the cache
+ * block sizes and the instruction set of the kernels.
+ */
+struct TuningConfig {
+    int numThreads;             // Threads to use, 1 runs serial
+    BlockSizes blockSizes;      // Cache block sizes for the multiply
+    KernelIsa isa;              // Instruction set of the kernels
+};
+
+/**
+ * Picks the number of threads, block sizes and kernels for each shape by timing
+ * them on this host.
+ *
+ * Shapes are grouped in buckets by the next power of 2 of each dimension, so one
+ * entry covers every shape of about the same size.  A bucket is tuned the first
+ * time it is used (if large enough to matter) or when tune() is called.  The table
+ * is saved to a text file so the tuning is only done once per host.  The file is
+ * MATRIX_TUNING_FILE if set, otherwise .matrix_tuning in the working directory.
+ *
+ * The tuner does not run the operations itself.  MatrixAlgebra gives it a function
+ * that runs the operation with a config and the tuner times it.
+ */
+class AutoTuner {
+
+    public:
+        /**
+         * Create the tuner and load the table if the file exists.
+         *
+         * :param path: File with the tuning table.
+         */
+        explicit AutoTuner(const string& path = defaultPath()) : mPath(path), mTuneOnFirstUse(true)
+        {
+            load();
+        }
+
+        /**
+         * File used when no path is given.
+         */
+        static string defaultPath()
+        {
+            const char* path = getenv("MATRIX_TUNING_FILE");
+            return path != nullptr ? string(path) : string(".matrix_tuning");
+        }
+
+        /**
+         * Tuner shared by every MatrixAlgebra that was not given its own tuner.
+         */
+        static shared_ptr<AutoTuner> defaultTuner()
+        {
+            static shared_ptr<AutoTuner> tuner = make_shared<AutoTuner>();
+            return tuner;
+        }
+
+        /**
+         * Turn tuning on first use on or off.  When off, shapes that are not in the
+         * table use the estimate from defaultConfig().
+         */
+        void setTuneOnFirstUse(bool tuneOnFirstUse)
+        {
+            lock_guard<mutex> lock(mMutex);
+            mTuneOnFirstUse = tuneOnFirstUse;
+        }
+
+        /**
+         * File with the tuning table.
+         */
+        const string& path() const
+        {
+            return mPath;
+        }
+
+        /**
+         * Look up the config for a shape.
+         *
+         * :param op: Operation.
+         * :param M: Rows of the result (or of the matrix to transpose).
+         * :param N: Columns of the result (or of the matrix to transpose).
+         * :param K: Shared dimension of a multiply.  0 for a transpose.
+         * :param config: Set to the tuned config if found.
+         * :return: True if the shape has been tuned.
+         */
+        bool lookup(TunedOperation op, int M, int N, int K, TuningConfig& config)
+        {
+            lock_guard<mutex> lock(mMutex);
+            auto entry = mTable.find(makeKey(op, M, N, K));
+            if(entry == mTable.end())
+            {
+                return false;
+            }
+            config = entry->second;
+            return true;
+        }
+
+        /**
+         * Config for a shape.  Uses the table, tunes the shape if allowed and large
+         * enough, or falls back to defaultConfig().
+         *
+         * :param op: Operation.
+         * :param M: Rows of the result (or of the matrix to transpose).
+         * :param N: Columns of the result (or of the matrix to transpose).
+         * :param K: Shared dimension of a multiply.  0 for a transpose.
+         * :param maxThreads: Most threads to try.
+         * :param run: Runs the operation on a M x K and K x N problem with a config.
+         * :return: The config to use.
+         */
+        template<typename Runner>
+        TuningConfig configFor(TunedOperation op, int M, int N, int K, int maxThreads, const Runner& run)
+        {
+            TuningConfig config;
+            if(lookup(op, M, N, K, config))
+            {
+                return config;
+            }
+
+            bool tuneOnFirstUse;
+            {
+                lock_guard<mutex> lock(mMutex);
+                tuneOnFirstUse = mTuneOnFirstUse;
+            }
+
+            // Small shapes cost less to run than to tune
+            if(tuneOnFirstUse && work(op, M, N, K) >= TUNE_MIN_WORK)
+            {
+                return tune(op, M, N, K, maxThreads, run);
+            }
+            return defaultConfig(op, M, N, K, maxThreads);
+        }
+
+        /**
+         * Time the candidate configs for the bucket of the shape, store the fastest
+         * in the table and save the table.
+         *
+         * The search goes one setting at a time: first the kernels, then the block
+         * sizes, then the number of threads.  The shape is scaled down to keep each
+         * run short.
+         *
+         * :param op: Operation.
+         * :param M: Rows of the result (or of the matrix to transpose).
+         * :param N: Columns of the result (or of the matrix to transpose).
+         * :param K: Shared dimension of a multiply.  0 for a transpose.
+         * :param maxThreads: Most threads to try.
+         * :param run: Runs the operation on a M x K and K x N problem with a config.
+         * :return: The fastest config.
+         */
+        template<typename Runner>
+        TuningConfig tune(TunedOperation op, int M, int N, int K, int maxThreads, const Runner& run)
+        {
+            // Time the bucket size, scaled down so a run stays short
+            int tuneM = bucketSize(M);
+            int tuneN = bucketSize(N);
+            int tuneK = op == TUNE_MULTIPLY ? bucketSize(K) : 0;
+            while(work(op, tuneM, tuneN, tuneK) > TUNE_MAX_WORK)
+            {
+                int& largest = (tuneM >= tuneN && tuneM >= tuneK) ? tuneM : (tuneN >= tuneK ? tuneN : tuneK);
+                largest = max(1, largest / 2);
+            }
+
+            TuningConfig best = defaultConfig(op, M, N, K, maxThreads);
+            double bestTime = timeConfig(run, tuneM, tuneN, tuneK, best);
+
+            if(op == TUNE_MULTIPLY)
+            {
+                // Kernels
+                for(int isa = ISA_SCALAR; isa <= ISA_AVX512; isa++)
+                {
+                    if(isa != best.isa && SimdKernels::isSupported((KernelIsa)isa))
+                    {
+                        TuningConfig candidate = best;
+                        candidate.isa = (KernelIsa)isa;
+                        tryConfig(run, tuneM, tuneN, tuneK, candidate, best, bestTime);
+                    }
+                }
+
+                // Block sizes
+                const int mcs[] = { 48, 96, 192 };
+                const int kcs[] = { 128, 256, 384 };
+                const int ncs[] = { 1024, 2048, 4096 };
+                TuningConfig start = best;
+                for(int mc : mcs)
+                {
+                    for(int kc : kcs)
+                    {
+                        TuningConfig candidate = start;
+                        candidate.blockSizes.mc = mc;
+                        candidate.blockSizes.kc = kc;
+                        tryConfig(run, tuneM, tuneN, tuneK, candidate, best, bestTime);
+                    }
+                }
+                start = best;
+                for(int nc : ncs)
+                {
+                    TuningConfig candidate = start;
+                    candidate.blockSizes.nc = nc;
+                    tryConfig(run, tuneM, tuneN, tuneK, candidate, best, bestTime);
+                }
+            }
+
+            // Threads: serial, powers of 2 and all of them
+            TuningConfig start = best;
+            vector<int> threadCounts;
+            for(int threads = 1; threads < maxThreads; threads *= 2)
+            {
+                threadCounts.push_back(threads);
+            }
+            threadCounts.push_back(maxThreads);
+            for(int threads : threadCounts)
+            {
+                TuningConfig candidate = start;
+                candidate.numThreads = threads;
+                tryConfig(run, tuneM, tuneN, tuneK, candidate, best, bestTime);
+            }
+
+            {
+                lock_guard<mutex> lock(mMutex);
+                mTable[makeKey(op, M, N, K)] = best;
+            }
+            save();
+            return best;
+        }
+
+        /**
+         * Estimate used for shapes that are not tuned.  Default block sizes and the
+         * best kernels, with about one thread per million multiply-adds.
+         */
+        static TuningConfig defaultConfig(TunedOperation op, int M, int N, int K, int maxThreads)
+        {
+            TuningConfig config;
+            config.blockSizes = MatrixKernels::defaultBlockSizes();
+            config.isa = SimdKernels::bestIsa();
+
+            double perThread = op == TUNE_MULTIPLY ? 1e6 : 2.5e5;
+            double threads = work(op, M, N, K) / perThread;
+            config.numThreads = (int)max(1.0, min((double)maxThreads, threads));
+            return config;
+        }
+
+        /**
+         * Load the table from the file.  Lines that can not be read, or that have
+         * buckets, threads or block sizes that can not be used, are skipped.
+         *
+         * :return: False if the file could not be opened.
+         */
+        bool load()
+        {
+            ifstream file(mPath.c_str());
+            if(!file)
+            {
+                return false;
+            }
+
+            lock_guard<mutex> lock(mMutex);
+            string line;
+            while(getline(file, line))
+            {
+                if(line.empty() || line[0] == '#')
+                {
+                    continue;
+                }
+
+                istringstream fields(line);
+                string op;
+                Key key;
+                TuningConfig config;
+                int isa;
+                if(fields >> op >> key.m >> key.n >> key.k >> config.numThreads
+                          >> config.blockSizes.mc >> config.blockSizes.kc >> config.blockSizes.nc >> isa)
+                {
+                    // The file can be edited or damaged.  Block sizes of 0 would make
+                    // the kernels loop forever.
+                    if(!validBucket(key.m) || !validBucket(key.n) || !validBucket(key.k) ||
+                       config.numThreads <= 0 || config.blockSizes.mc <= 0 ||
+                       config.blockSizes.kc <= 0 || config.blockSizes.nc <= 0)
+                    {
+                        continue;
+                    }
+
+                    key.op = op == "transpose" ? TUNE_TRANSPOSE : TUNE_MULTIPLY;
+                    config.isa = (KernelIsa)isa;
+
+                    // A file copied from another host may name kernels this CPU can not run
+                    if(!SimdKernels::isSupported(config.isa))
+                    {
+                        config.isa = SimdKernels::bestIsa();
+                    }
+                    mTable[key] = config;
+                }
+            }
+            return true;
+        }
+
+        /**
+         * Save the table to the file.
+         *
+         * :return: False if the file could not be written.
+         */
+        bool save()
+        {
+            ofstream file(mPath.c_str());
+            if(!file)
+            {
+                return false;
+            }
+
+            lock_guard<mutex> lock(mMutex);
+            file << "# operation log2(M) log2(N) log2(K) threads mc kc nc isa" << endl;
+            for(const auto& entry : mTable)
+            {
+                const Key& key = entry.first;
+                const TuningConfig& config = entry.second;
+                file << (key.op == TUNE_TRANSPOSE ? "transpose" : "multiply") << " "
+                     << key.m << " " << key.n << " " << key.k << " " << config.numThreads << " "
+                     << config.blockSizes.mc << " " << config.blockSizes.kc << " " << config.blockSizes.nc << " "
+                     << (int)config.isa << endl;
+            }
+            return (bool)file;
+        }
+
+        /**
+         * Number of tuned shapes.
+         */
+        int size()
+        {
+            lock_guard<mutex> lock(mMutex);
+            return (int)mTable.size();
+        }
+
+    private:
+        /**
+         * Shapes with less work than this use defaultConfig() instead of tuning.
+         */
+        static constexpr double TUNE_MIN_WORK = 1e7;
+
+        /**
+         * Shapes are scaled down to this much work for tuning.
+         */
+        static constexpr double TUNE_MAX_WORK = 2e8;
+
+        /**
+         * Bucket of a shape.  Each dimension is stored as the log2 of the next power of 2.
+         */
+        struct Key {
+            TunedOperation op;
+            int m;
+            int n;
+            int k;
+
+            bool operator<(const Key& other) const
+            {
+                if(op != other.op) return op < other.op;
+                if(m != other.m) return m < other.m;
+                if(n != other.n) return n < other.n;
+                return k < other.k;
+            }
+        };
+
+        static int log2Bucket(int size)
+        {
+            int bucket = 0;
+            while(bucket < 30 && (1 << bucket) < size)
+            {
+                bucket++;
+            }
+            return bucket;
+        }
+
+        static int bucketSize(int size)
+        {
+            return 1 << log2Bucket(size);
+        }
+
+        static bool validBucket(int bucket)
+        {
+            return bucket >= 0 && bucket <= 30;
+        }
+
+        static Key makeKey(TunedOperation op, int M, int N, int K)
+        {
+            Key key;
+            key.op = op;
+            key.m = log2Bucket(M);
+            key.n = log2Bucket(N);
+            key.k = op == TUNE_MULTIPLY ? log2Bucket(K) : 0;
+            return key;
+        }
+
+        /**
+         * Multiply-adds for a multiply, values moved for a transpose.
+         */
+        static double work(TunedOperation op, int M, int N, int K)
+        {
+            return op == TUNE_MULTIPLY ? (double)M * N * K : (double)M * N;
+        }
+
+        /**
+         * Fastest of 3 runs in seconds.  A first run warms up the caches and the pool.
+         */
+        template<typename Runner>
+        static double timeConfig(const Runner& run, int M, int N, int K, const TuningConfig& config)
+        {
+            run(M, N, K, config);
+
+            double best = 1e30;
+            for(int i = 0; i < 3; i++)
+            {
+                auto start = chrono::steady_clock::now();
+                run(M, N, K, config);
+                auto stop = chrono::steady_clock::now();
+                best = min(best, chrono::duration<double>(stop - start).count());
+            }
+            return best;
+        }
+
+        template<typename Runner>
+        static void tryConfig(const Runner& run, int M, int N, int K, const TuningConfig& candidate, TuningConfig& best, double& bestTime)
+        {
+            double time = timeConfig(run, M, N, K, candidate);
+            if(time < bestTime)
+            {
+                best = candidate;
+                bestTime = time;
+            }
+        }
+
+        string mPath;                       // File with the table
+        bool mTuneOnFirstUse;               // Tune shapes that are not in the table
+        map<Key, TuningConfig> mTable;      // Tuned configs
+        mutex mMutex;                       // Guards the table and the settings
+};
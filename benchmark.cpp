@@ -0,0 +1,489 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "matrix.h"
+#include "out_of_core.h"
+
+using namespace std;
+
+/**
+ * Result of one benchmark case.
+ */
+struct BenchmarkResult {
+    string operation;       // multiply, transpose or memcpy
+    string shape;           // square, strassen, file, tall, wide, long-k, serving, gemv, gevm, packed, batched, fixed
+    int m;                  // Rows of the result (or of the matrix to transpose)
+    int n;                  // Columns of the result (or of the matrix to transpose)
+    int k;                  // Shared dimension, 0 for a transpose
+    int batch;              // Number of problems per sample
+    int numThreads;         // Threads used
+    int samples;            // Number of timed runs
+    double medianUs;        // Median time of a sample in microseconds
+    double p99Us;           // 99th percentile time of a sample in microseconds
+    double minUs;           // Fastest sample in microseconds
+    double gflops;          // Multiply rate at the median, 0 for a transpose
+    double gbps;            // Bytes read and written at the median
+    double roofline;        // gbps as a fraction of the memcpy bandwidth
+};
+
+/**
+ * Benchmark for the multiply and the transpose.
+ *
+ * Each case is run once to warm up and then timed a number of times.  The median,
+ * the 99th percentile and the fastest sample are kept.  The multiply reports
+ * GFLOP/s (2 * M * N * K per problem).  Both report GB/s, counting each input read
+ * once and the output written once, and compare it to the bandwidth of memcpy on
+ * a buffer much larger than the caches.  The transpose can not go faster than
+ * memcpy, so the fraction is how close it is to the memory roofline.
+ */
+class Benchmark {
+
+    public:
+        Benchmark(int maxSamples, double maxSecondsPerCase) : mMaxSamples(maxSamples), mMaxSecondsPerCase(maxSecondsPerCase), mMemcpyGbps(0.0)
+        {
+        }
+
+        /**
+         * Measure the memcpy bandwidth used as the roofline.
+         *
+         * :param bytes: Size of the buffer to copy.
+         */
+        void runMemcpy(size_t bytes)
+        {
+            vector<char> src(bytes, 1);
+            vector<char> dst(bytes, 0);
+
+            BenchmarkResult result = time("memcpy", "copy", (int)(bytes / sizeof(double)), 1, 0, 1, 1, [&]()
+            {
+                memcpy(dst.data(), src.data(), bytes);
+            });
+
+            result.gbps = 2.0 * bytes / (result.medianUs * 1e3);
+            mMemcpyGbps = result.gbps;
+            result.roofline = 1.0;
+            mResults.push_back(result);
+        }
+
+        /**
+         * Time C = A * B for a M x K and a K x N matrix.
+         */
+        void runMultiply(const string& shape, int M, int N, int K, int numThreads)
+        {
+            MatrixAlgebra ma;
+            Matrix a = ma.createMatrix(M, K, 0.001, numThreads);
+            Matrix b = ma.createMatrix(K, N, -0.002, numThreads);
+
+            BenchmarkResult result = time("multiply", shape, M, N, K, 1, numThreads, [&]()
+            {
+                Matrix c = ma.matrixMultiply(a, b, numThreads);
+            });
+            addMultiply(result);
+        }
+
+        /**
+         * Time C = A * B for two size x size matrices with the Strassen-Winograd
+         * multiply, 2 steps deep.  Compare with the square case of the same size.
+         */
+        void runStrassenMultiply(int size, int numThreads)
+        {
+            MatrixAlgebra ma;
+            ma.setStrassenCrossover(size / 4);
+            Matrix a = ma.createMatrix(size, size, 0.001, numThreads);
+            Matrix b = ma.createMatrix(size, size, -0.002, numThreads);
+
+            BenchmarkResult result = time("multiply", "strassen", size, size, size, 1, numThreads, [&]()
+            {
+                Matrix c = ma.matrixMultiply(a, b, numThreads);
+            });
+            addMultiply(result);
+        }
+
+        /**
+         * Time C = A * B for two size x size matrices in files, with tile buffers of
+         * the size of one matrix.  Compare with the square case of the same size.
+         * The files are in the page cache, so this shows the cost of the tiling and
+         * not the speed of the disk.
+         */
+        void runOutOfCoreMultiply(int size, int numThreads)
+        {
+            MatrixAlgebra ma;
+            const string pathA = "/tmp/benchmark_matrix_a";
+            const string pathB = "/tmp/benchmark_matrix_b";
+            const string pathC = "/tmp/benchmark_matrix_c";
+            MatrixFile::save(pathA, ma.createMatrix(size, size, 0.001, numThreads));
+            MatrixFile::save(pathB, ma.createMatrix(size, size, -0.002, numThreads));
+            OutOfCoreMultiply outOfCore(ma, (size_t)size * size * sizeof(double));
+
+            BenchmarkResult result = time("multiply", "file", size, size, size, 1, numThreads, [&]()
+            {
+                outOfCore.multiply<double>(pathA, pathB, pathC, numThreads);
+            });
+            addMultiply(result);
+
+            remove(pathA.c_str());
+            remove(pathB.c_str());
+            remove(pathC.c_str());
+        }
+
+        /**
+         * Time C = A * B where B was packed with packMatrix() before the timing, like
+         * fixed weights multiplied by a stream of inputs.
+         */
+        void runPackedMultiply(int M, int N, int K, int numThreads)
+        {
+            MatrixAlgebra ma;
+            Matrix a = ma.createMatrix(M, K, 0.001, numThreads);
+            PackedMatrix b = ma.packMatrix(ma.createMatrix(K, N, -0.002, numThreads));
+
+            BenchmarkResult result = time("multiply", "packed", M, N, K, 1, numThreads, [&]()
+            {
+                Matrix c = ma.matrixMultiply(a, b, numThreads);
+            });
+            addMultiply(result);
+        }
+
+        /**
+         * Time one multiplyBatch() of small M x K and K x N matrices as one sample.
+         */
+        void runBatchedMultiply(int M, int N, int K, int batch, int numThreads)
+        {
+            MatrixCommon mc;
+            MatrixAlgebra ma;
+            MatrixBatch as(batch, M, K);
+            MatrixBatch bs(batch, K, N);
+            for(int i = 0; i < batch; i++)
+            {
+                as.setMatrix(i, mc.createMatrix(M, K, 0.001 * i));
+                bs.setMatrix(i, mc.createMatrix(K, N, -0.002 * i));
+            }
+            MatrixBatch cs(batch, M, N);
+
+            BenchmarkResult result = time("multiply", "batched", M, N, K, batch, numThreads, [&]()
+            {
+                ma.multiplyBatchStrided(M, N, K, as.data(), as.stride(), as.matrixStride(), bs.data(), bs.stride(), bs.matrixStride(),
+                                        cs.data(), cs.stride(), cs.matrixStride(), batch, numThreads);
+            });
+            addMultiply(result);
+        }
+
+        /**
+         * Time batch multiplies of N x N fixed size matrices as one sample.  Always
+         * 1 thread, the fixed multiply does not use the pool.
+         */
+        template<int N>
+        void runFixedMultiply(int batch)
+        {
+            MatrixCommon mc;
+            MatrixAlgebra ma;
+            vector<FixedMatrix<double, N, N> > as;
+            for(int i = 0; i < batch; i++)
+            {
+                as.push_back(FixedMatrix<double, N, N>(mc.createMatrix(N, N, 0.001 * i)));
+            }
+            FixedMatrix<double, N, N> b(mc.createMatrix(N, N, -0.002));
+            vector<FixedMatrix<double, N, N> > cs(batch);
+
+            BenchmarkResult result = time("multiply", "fixed", N, N, N, batch, 1, [&]()
+            {
+                for(int i = 0; i < batch; i++)
+                {
+                    cs[i] = ma.matrixMultiply(as[i], b);
+                }
+            });
+            addMultiply(result);
+        }
+
+        /**
+         * Time the transpose of a M x N matrix.
+         */
+        void runTranspose(const string& shape, int M, int N, int numThreads)
+        {
+            MatrixAlgebra ma;
+            Matrix a = ma.createMatrix(M, N, 0.5, numThreads);
+
+            BenchmarkResult result = time("transpose", shape, M, N, 0, 1, numThreads, [&]()
+            {
+                Matrix t = ma.transpose(a, numThreads);
+            });
+
+            result.gflops = 0.0;
+            result.gbps = 2.0 * M * N * sizeof(double) / (result.medianUs * 1e3);
+            result.roofline = mMemcpyGbps > 0.0 ? result.gbps / mMemcpyGbps : 0.0;
+            mResults.push_back(result);
+        }
+
+        /**
+         * Print the results as a table.
+         */
+        void printTable(ostream& out) const
+        {
+            out << left << setw(10) << "operation" << setw(9) << "shape" << right
+                << setw(9) << "M" << setw(9) << "N" << setw(9) << "K" << setw(7) << "batch" << setw(8) << "threads"
+                << setw(12) << "median_us" << setw(12) << "p99_us" << setw(10) << "GFLOP/s" << setw(9) << "GB/s" << setw(10) << "roofline" << endl;
+
+            out << fixed;
+            for(const BenchmarkResult& result : mResults)
+            {
+                out << left << setw(10) << result.operation << setw(9) << result.shape << right
+                    << setw(9) << result.m << setw(9) << result.n << setw(9) << result.k << setw(7) << result.batch << setw(8) << result.numThreads
+                    << setprecision(1) << setw(12) << result.medianUs << setw(12) << result.p99Us
+                    << setprecision(2) << setw(10) << result.gflops << setw(9) << result.gbps << setw(9) << 100.0 * result.roofline << "%" << endl;
+            }
+            out.unsetf(ios_base::floatfield);
+        }
+
+        /**
+         * Write the results as CSV, one line per case.
+         */
+        bool writeCsv(const string& path) const
+        {
+            ofstream out(path.c_str());
+            if(!out)
+            {
+                return false;
+            }
+
+            out << "operation,shape,m,n,k,batch,threads,samples,median_us,p99_us,min_us,gflops,gbps,roofline,isa,hardware_threads" << endl;
+            for(const BenchmarkResult& result : mResults)
+            {
+                out << result.operation << "," << result.shape << "," << result.m << "," << result.n << "," << result.k << ","
+                    << result.batch << "," << result.numThreads << "," << result.samples << ","
+                    << result.medianUs << "," << result.p99Us << "," << result.minUs << ","
+                    << result.gflops << "," << result.gbps << "," << result.roofline << ","
+                    << SimdKernels::active().name << "," << thread::hardware_concurrency() << endl;
+            }
+            return (bool)out;
+        }
+
+        /**
+         * Write the results as JSON.  The host is described once at the top.
+         */
+        bool writeJson(const string& path) const
+        {
+            ofstream out(path.c_str());
+            if(!out)
+            {
+                return false;
+            }
+
+            out << "{" << endl;
+            out << "  \"isa\": \"" << SimdKernels::active().name << "\"," << endl;
+            out << "  \"hardware_threads\": " << thread::hardware_concurrency() << "," << endl;
+            out << "  \"memcpy_gbps\": " << mMemcpyGbps << "," << endl;
+            out << "  \"results\": [" << endl;
+            for(size_t i = 0; i < mResults.size(); i++)
+            {
+                const BenchmarkResult& result = mResults[i];
+                out << "    {\"operation\": \"" << result.operation << "\", \"shape\": \"" << result.shape << "\", "
+                    << "\"m\": " << result.m << ", \"n\": " << result.n << ", \"k\": " << result.k << ", "
+                    << "\"batch\": " << result.batch << ", \"threads\": " << result.numThreads << ", \"samples\": " << result.samples << ", "
+                    << "\"median_us\": " << result.medianUs << ", \"p99_us\": " << result.p99Us << ", \"min_us\": " << result.minUs << ", "
+                    << "\"gflops\": " << result.gflops << ", \"gbps\": " << result.gbps << ", \"roofline\": " << result.roofline << "}"
+                    << (i + 1 < mResults.size() ? "," : "") << endl;
+            }
+            out << "  ]" << endl;
+            out << "}" << endl;
+            return (bool)out;
+        }
+
+    private:
+        /**
+         * Run fn once to warm up, then time it until there are mMaxSamples samples
+         * or mMaxSecondsPerCase has passed.  At least 5 samples are always taken.
+         */
+        template<typename Function>
+        BenchmarkResult time(const string& operation, const string& shape, int M, int N, int K, int batch, int numThreads, const Function& fn)
+        {
+            fn();
+
+            vector<double> samples;
+            auto caseStart = chrono::steady_clock::now();
+            while((int)samples.size() < mMaxSamples)
+            {
+                auto start = chrono::steady_clock::now();
+                fn();
+                auto stop = chrono::steady_clock::now();
+                samples.push_back(chrono::duration<double, micro>(stop - start).count());
+
+                double elapsed = chrono::duration<double>(stop - caseStart).count();
+                if(samples.size() >= 5 && elapsed > mMaxSecondsPerCase)
+                {
+                    break;
+                }
+            }
+            sort(samples.begin(), samples.end());
+
+            BenchmarkResult result;
+            result.operation = operation;
+            result.shape = shape;
+            result.m = M;
+            result.n = N;
+            result.k = K;
+            result.batch = batch;
+            result.numThreads = numThreads;
+            result.samples = (int)samples.size();
+            result.medianUs = percentile(samples, 0.5);
+            result.p99Us = percentile(samples, 0.99);
+            result.minUs = samples.front();
+            result.gflops = 0.0;
+            result.gbps = 0.0;
+            result.roofline = 0.0;
+            return result;
+        }
+
+        /**
+         * Fill in the rates of a multiply and keep the result.
+         */
+        void addMultiply(BenchmarkResult& result)
+        {
+            double flops = 2.0 * result.m * result.n * result.k * result.batch;
+            double bytes = ((double)result.m * result.k + (double)result.k * result.n + (double)result.m * result.n) * sizeof(double) * result.batch;
+            result.gflops = flops / (result.medianUs * 1e3);
+            result.gbps = bytes / (result.medianUs * 1e3);
+            result.roofline = mMemcpyGbps > 0.0 ? result.gbps / mMemcpyGbps : 0.0;
+            mResults.push_back(result);
+        }
+
+        /**
+         * Nearest rank percentile of sorted samples.
+         */
+        static double percentile(const vector<double>& sorted, double fraction)
+        {
+            size_t rank = (size_t)(fraction * sorted.size() + 0.999999);
+            rank = max((size_t)1, min(rank, sorted.size()));
+            return sorted[rank - 1];
+        }
+
+        int mMaxSamples;                    // Most timed runs per case
+        double mMaxSecondsPerCase;          // Stop sampling a case after this long
+        double mMemcpyGbps;                 // Roofline bandwidth
+        vector<BenchmarkResult> mResults;   // Results in the order they were run
+};
+
+/**
+ * Benchmark the multiply and the transpose.
+ *
+ * Arguments that are optional:
+ * [--quick] [--samples N] [--max-threads N] [--csv FILE] [--json FILE]
+ *
+ * :param --quick: Smaller shapes and fewer samples, for a smoke test.
+ * :param --samples: Most timed runs per case.  [DEFAULT: 50]
+ * :param --max-threads: Most threads to use.  [DEFAULT: hardware threads]
+ * :param --csv: Also write the results to FILE as CSV.
+ * :param --json: Also write the results to FILE as JSON.
+ *
+ * The shapes are square, strassen (a square multiply with Strassen-Winograd), file
+ * (a square multiply from and to files), tall (many rows), wide (many columns),
+ * long-k (small result with a long shared dimension), serving (few rows times a
+ * large matrix), gemv (a matrix times a vector), gevm (a vector times a matrix),
+ * packed (serving with the large matrix packed once) and batched (many small
+ * multiplies).  Each shape is run with 1 thread and with powers of 2 up to the
+ * most threads.  The fixed size 3x3 and 4x4 multiplies are run once, with 1 thread.
+ */
+int main(int argc, char** argv)
+{
+    bool quick = false;
+    int maxSamples = 50;
+    int maxThreads = max(1, (int)thread::hardware_concurrency());
+    string csvPath;
+    string jsonPath;
+
+    try
+    {
+        for(int i = 1; i < argc; i++)
+        {
+            string arg = argv[i];
+            bool hasValue = i + 1 < argc;
+            if(arg == "--quick")
+            {
+                quick = true;
+            }
+            else if(arg == "--samples" && hasValue)
+            {
+                maxSamples = max(1, stoi(argv[++i]));
+            }
+            else if(arg == "--max-threads" && hasValue)
+            {
+                maxThreads = max(1, stoi(argv[++i]));
+            }
+            else if(arg == "--csv" && hasValue)
+            {
+                csvPath = argv[++i];
+            }
+            else if(arg == "--json" && hasValue)
+            {
+                jsonPath = argv[++i];
+            }
+            else
+            {
+                cerr << "Usage: " << argv[0] << " [--quick] [--samples N] [--max-threads N] [--csv FILE] [--json FILE]" << endl;
+                return -1;
+            }
+        }
+    }
+    catch(exception &ex)
+    {
+        cerr << "Error processing input arguments [--quick] [--samples N] [--max-threads N] [--csv FILE] [--json FILE]" << endl;
+        return -1;
+    }
+
+    vector<int> threadCounts;
+    for(int threads = 1; threads < maxThreads; threads *= 2)
+    {
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(maxThreads);
+
+    const int scale = quick ? 4 : 1;
+    Benchmark benchmark(quick ? 5 : maxSamples, quick ? 0.2 : 2.0);
+
+    // Much larger than the caches
+    benchmark.runMemcpy((quick ? 32 : 256) << 20);
+
+    benchmark.runFixedMultiply<3>(65536 / scale);
+    benchmark.runFixedMultiply<4>(65536 / scale);
+
+    for(int threads : threadCounts)
+    {
+        const int squares[] = { 256, 512, 1024, 2048 };
+        for(int size : squares)
+        {
+            benchmark.runMultiply("square", size / scale, size / scale, size / scale, threads);
+        }
+        benchmark.runStrassenMultiply(2048 / scale, threads);
+        benchmark.runOutOfCoreMultiply(2048 / scale, threads);
+        benchmark.runMultiply("tall", 8192 / scale, 64, 64, threads);
+        benchmark.runMultiply("wide", 64, 8192 / scale, 64, threads);
+        benchmark.runMultiply("long-k", 16, 16, 262144 / scale, threads);
+        benchmark.runMultiply("serving", 16, 1024 / scale, 1024 / scale, threads);
+        benchmark.runMultiply("gemv", 8192 / scale, 1, 8192 / scale, threads);
+        benchmark.runMultiply("gevm", 1, 8192 / scale, 8192 / scale, threads);
+        benchmark.runPackedMultiply(16, 1024 / scale, 1024 / scale, threads);
+        benchmark.runBatchedMultiply(8, 8, 8, 4096 / scale, threads);
+        benchmark.runBatchedMultiply(32, 32, 32, 512 / scale, threads);
+
+        benchmark.runTranspose("square", 4096 / scale, 4096 / scale, threads);
+        benchmark.runTranspose("tall", 65536 / scale, 256, threads);
+        benchmark.runTranspose("wide", 256, 65536 / scale, threads);
+    }
+
+    benchmark.printTable(cout);
+
+    if(!csvPath.empty() && !benchmark.writeCsv(csvPath))
+    {
+        cerr << "Could not write " << csvPath << endl;
+        return -2;
+    }
+    if(!jsonPath.empty() && !benchmark.writeJson(jsonPath))
+    {
+        cerr << "Could not write " << jsonPath << endl;
+        return -2;
+    }
+    return 0;
+}
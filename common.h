@@ -1,12 +1,463 @@
+#pragma once
+
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <utility>
 #include <vector>
 
 using namespace std; 
 
+/**
+ * Alignment in bytes for the start of every Matrix buffer and every padded row.
+ * 64 bytes is a cache line and the width of an AVX-512 register.
+ */
+static const size_t MATRIX_ALIGNMENT = 64;
+
+/**
+ * How the values of a new Matrix are set.
+ */
+enum MatrixInit {
+    MATRIX_ZEROS,           // All the values are 0
+    MATRIX_UNINITIALIZED    // The values are not set, so the pages are not touched yet
+};
+
+/**
+ * Dense row-major matrix stored in one contiguous, 64 byte aligned buffer.
+ * 
+ * The old double** layout did one allocation per row and added a pointer chase to
+ * every element access.  Here all the rows live in a single allocation.  Row m starts
+ * at data() + m * stride().  The stride (leading dimension) is the number of columns
+ * rounded up so each row starts on a 64 byte boundary.  Very narrow matrices, like
+ * column vectors, are not padded so they do not waste memory.
+ * 
+ * The matrix owns its buffer and frees it when it goes out of scope.  Copies are deep
+ * copies.  Moves just hand over the buffer.  A matrix can also wrap a buffer owned by
+ * something else, like a mapped file (see MappedMatrixT).  It does not free it, and
+ * copies of it are deep copies that own their buffer.
+ * 
+ * The element type T can be float, double, int32_t, int64_t or a complex of float or
+ * double.  It is copied with memcpy and a buffer of zero bytes is a matrix of zeros.
+ * int8_t, bfloat16 and float16 are storage types for the mixed precision multiply.
+ * Matrix is the double version.
+ */
+template<typename T>
+class MatrixT {
+
+    public:
+        typedef T value_type;
+
+        /**
+         * Create an empty matrix with no rows or columns.
+         */
+        MatrixT() : mRows(0), mColumns(0), mStride(0), mCapacity(0), mBuffer(nullptr), mData(nullptr)
+        {
+        }
+
+        /**
+         * Create a matrix of the given size.  All the values are set to 0.
+         * 
+         * :param rows: The number of rows (height).
+         * :param columns: The number of columns (width).
+         */
+        MatrixT(int rows, int columns) : mRows(rows), mColumns(columns), mStride(paddedStride(columns)), mCapacity(0), mBuffer(nullptr), mData(nullptr)
+        {
+            allocate();
+        }
+
+        /**
+         * Create a matrix of the given size without setting the values.  The memory of
+         * a large matrix is not touched, so Linux places each page on the NUMA node of
+         * the thread that first writes it.  Every value, and the row padding, must be
+         * written before it is read.
+         * 
+         * :param rows: The number of rows (height).
+         * :param columns: The number of columns (width).
+         * :param init: MATRIX_ZEROS or MATRIX_UNINITIALIZED.
+         */
+        MatrixT(int rows, int columns, MatrixInit init) : mRows(rows), mColumns(columns), mStride(paddedStride(columns)), mCapacity(0), mBuffer(nullptr), mData(nullptr)
+        {
+            allocate(init);
+        }
+
+        /**
+         * Create a matrix of the given size with a given stride.  All the values are set to 0.
+         * 
+         * :param rows: The number of rows (height).
+         * :param columns: The number of columns (width).
+         * :param stride: Number of elements between the start of two rows.  Must be at least columns.
+         */
+        MatrixT(int rows, int columns, int stride) : mRows(rows), mColumns(columns), mStride(stride < columns ? columns : stride), mCapacity(0), mBuffer(nullptr), mData(nullptr)
+        {
+            allocate();
+        }
+
+        /**
+         * Wrap values owned by someone else.  Nothing is copied or freed, and the values
+         * must stay valid while the matrix is used.  reshape() can only change the shape
+         * within the rows * stride values given here.
+         * 
+         * :param data: First value of row 0.  Should be aligned to MATRIX_ALIGNMENT.
+         * :param rows: The number of rows (height).
+         * :param columns: The number of columns (width).
+         * :param stride: Number of elements between the start of two rows.  Must be at least columns.
+         */
+        MatrixT(T* data, int rows, int columns, int stride) : mRows(rows), mColumns(columns), mStride(stride < columns ? columns : stride), mCapacity((size_t)rows * mStride), mBuffer(nullptr), mData(data)
+        {
+        }
+
+        /**
+         * Deep copy of the other matrix.  The stride is kept.
+         */
+        MatrixT(const MatrixT& other) : mRows(other.mRows), mColumns(other.mColumns), mStride(other.mStride), mCapacity(0), mBuffer(nullptr), mData(nullptr)
+        {
+            allocate();
+            if(other.mData != nullptr)
+            {
+                memcpy(mData, other.mData, sizeInBytes());
+            }
+        }
+
+        /**
+         * Take over the buffer of the other matrix.  The other matrix is left empty.
+         */
+        MatrixT(MatrixT&& other) noexcept : mRows(other.mRows), mColumns(other.mColumns), mStride(other.mStride), mCapacity(other.mCapacity), mBuffer(other.mBuffer), mData(other.mData)
+        {
+            other.mRows = 0;
+            other.mColumns = 0;
+            other.mStride = 0;
+            other.mCapacity = 0;
+            other.mBuffer = nullptr;
+            other.mData = nullptr;
+        }
+
+        /**
+         * Copy or move assignment.  The argument is taken by value
+         * so the copy or the move is done by the constructors above.
+         */
+        MatrixT& operator=(MatrixT other) noexcept
+        {
+            swap(other);
+            return *this;
+        }
+
+        /**
+         * Free the buffer.
+         */
+        ~MatrixT()
+        {
+            delete [] mBuffer;
+        }
+
+        /**
+         * Swap the contents of the 2 matrices.
+         */
+        void swap(MatrixT& other) noexcept
+        {
+            std::swap(mRows, other.mRows);
+            std::swap(mColumns, other.mColumns);
+            std::swap(mStride, other.mStride);
+            std::swap(mCapacity, other.mCapacity);
+            std::swap(mBuffer, other.mBuffer);
+            std::swap(mData, other.mData);
+        }
+
+        int rows() const { return mRows; }
+        int columns() const { return mColumns; }
+        int stride() const { return mStride; }
+        bool empty() const { return mRows == 0 || mColumns == 0; }
+
+        T* data() { return mData; }
+        const T* data() const { return mData; }
+
+        /**
+         * Pointer to the first element of row m.
+         */
+        T* row(int m) { return mData + (size_t)m * mStride; }
+        const T* row(int m) const { return mData + (size_t)m * mStride; }
+
+        /**
+         * Element at row m and column n.
+         */
+        T& operator()(int m, int n) { return mData[(size_t)m * mStride + n]; }
+        const T& operator()(int m, int n) const { return mData[(size_t)m * mStride + n]; }
+
+        /**
+         * Number of bytes used by the rows, including the row padding.
+         */
+        size_t sizeInBytes() const { return (size_t)mRows * mStride * sizeof(T); }
+
+        /**
+         * Change the shape of the matrix without moving any values.  Used by the
+         * in-place transpose.  The new shape must fit in the buffer, or for wrapped
+         * values in the rows * stride values the matrix was created with.
+         * 
+         * :param rows: New number of rows.
+         * :param columns: New number of columns.
+         * :param stride: New stride.  Must be at least columns.
+         * :return: False if the shape does not fit.  The matrix is not changed.
+         */
+        bool reshape(int rows, int columns, int stride)
+        {
+            if(stride < columns || (size_t)rows * stride > mCapacity)
+            {
+                return false;
+            }
+            mRows = rows;
+            mColumns = columns;
+            mStride = stride;
+            return true;
+        }
+
+        /**
+         * Stride used for a given number of columns.  Rows are padded to a multiple
+         * of the alignment unless a row is smaller than the alignment.
+         * 
+         * :param columns: Number of columns.
+         * :return: Number of elements between the start of two rows.
+         */
+        static int paddedStride(int columns)
+        {
+            const int elementsPerAlignment = (int)(MATRIX_ALIGNMENT / sizeof(T));
+            if(columns < elementsPerAlignment)
+            {
+                return columns;
+            }
+            return ((columns + elementsPerAlignment - 1) / elementsPerAlignment) * elementsPerAlignment;
+        }
+
+    private:
+        /**
+         * Allocate the buffer and align the start of the data.  The buffer is
+         * zeroed unless init is MATRIX_UNINITIALIZED.  The extra alignment bytes are
+         * used to move the start of the data to the next 64 byte boundary.
+         */
+        void allocate(MatrixInit init = MATRIX_ZEROS)
+        {
+            size_t bytes = sizeInBytes();
+            mCapacity = (size_t)mRows * mStride;
+
+            mBuffer = new char[bytes + MATRIX_ALIGNMENT];
+            uintptr_t start = reinterpret_cast<uintptr_t>(mBuffer);
+            start = (start + MATRIX_ALIGNMENT - 1) & ~(uintptr_t)(MATRIX_ALIGNMENT - 1);
+            mData = reinterpret_cast<T*>(start);
+            if(init == MATRIX_ZEROS)
+            {
+                memset(static_cast<void*>(mData), 0, bytes);
+            }
+        }
+
+        int mRows;          // Number of rows
+        int mColumns;       // Number of columns
+        int mStride;        // Number of elements between the start of two rows
+        size_t mCapacity;   // Number of elements the buffer or the wrapped values hold
+        char* mBuffer;      // Allocation that is freed, null if the buffer is not owned
+        T* mData;           // Aligned start of the first row
+};
+
+/**
+ * Matrix of doubles.
+ */
+typedef MatrixT<double> Matrix;
+
+/**
+ * A batch of matrices of the same size stored in one contiguous, aligned buffer.
+ * 
+ * Matrix i starts at matrix(i) = data() + i * matrixStride().  Each matrix has the
+ * row stride a Matrix of the same size would have, and the matrices are padded so
+ * each one starts on a 64 byte boundary, unless a matrix is smaller than that.
+ * The whole batch is one allocation, however many matrices it holds.
+ */
+template<typename T>
+class MatrixBatchT {
+
+    public:
+        /**
+         * Create an empty batch.
+         */
+        MatrixBatchT() : mRows(0), mColumns(0), mStride(0)
+        {
+        }
+
+        /**
+         * Create a batch of count matrices of the given size.  All the values are set to 0.
+         * 
+         * :param count: Number of matrices.
+         * :param rows: The number of rows of each matrix.
+         * :param columns: The number of columns of each matrix.
+         */
+        MatrixBatchT(int count, int rows, int columns)
+            : mRows(rows), mColumns(columns), mStride(MatrixT<T>::paddedStride(columns)), mStorage(count, rows * mStride)
+        {
+        }
+
+        int count() const { return mStorage.rows(); }
+        int rows() const { return mRows; }
+        int columns() const { return mColumns; }
+        int stride() const { return mStride; }
+
+        /**
+         * Number of elements between the start of two matrices.
+         */
+        int matrixStride() const { return mStorage.stride(); }
+
+        T* data() { return mStorage.data(); }
+        const T* data() const { return mStorage.data(); }
+
+        /**
+         * Pointer to the first element of matrix i.
+         */
+        T* matrix(int i) { return mStorage.row(i); }
+        const T* matrix(int i) const { return mStorage.row(i); }
+
+        /**
+         * Element at row m and column n of matrix i.
+         */
+        T& operator()(int i, int m, int n) { return mStorage.row(i)[(size_t)m * mStride + n]; }
+        const T& operator()(int i, int m, int n) const { return mStorage.row(i)[(size_t)m * mStride + n]; }
+
+        /**
+         * Copy matrix i into a new Matrix.
+         */
+        MatrixT<T> toMatrix(int i) const
+        {
+            MatrixT<T> result(mRows, mColumns);
+            for(int m = 0; m < mRows; m++)
+            {
+                memcpy(result.row(m), matrix(i) + (size_t)m * mStride, mColumns * sizeof(T));
+            }
+            return result;
+        }
+
+        /**
+         * Copy a Matrix into matrix i.  The Matrix must be rows() x columns().
+         */
+        void setMatrix(int i, const MatrixT<T>& source)
+        {
+            for(int m = 0; m < mRows; m++)
+            {
+                memcpy(matrix(i) + (size_t)m * mStride, source.row(m), mColumns * sizeof(T));
+            }
+        }
+
+    private:
+        int mRows;              // Number of rows of each matrix
+        int mColumns;           // Number of columns of each matrix
+        int mStride;            // Number of elements between the start of two rows
+        MatrixT<T> mStorage;    // One matrix per row
+};
+
+/**
+ * Batch of double matrices.
+ */
+typedef MatrixBatchT<double> MatrixBatch;
+
 class MatrixCommon {
 
     public:
+        /**
+         * Create a matrix given a MxN (Row x Column).
+         * 
+         * :param rows: The number of rows (height)
+         * :param columns: The numbers of columns (width)
+         * :param startValue: Start value in the matrix.  The values are incremented.
+         *                   The type of the start value is the element type.
+         * :return A matrix with the given width and height.  The values are 
+         *         populated with a incrementing number.
+         */
+        template<typename T>
+        MatrixT<T> createMatrix(int rows, int columns, T startValue)
+        {
+            MatrixT<T> matrix(rows, columns);
+
+            T index = startValue;
+            for(int m = 0; m < rows; m++)
+            {
+                T* row = matrix.row(m);
+                for(int n = 0; n < columns; n++)
+                {
+                    row[n] = index;
+                    index += T(1);
+                }
+            }
+
+            return matrix;
+        }
+
+        /**
+         * Create a matrix given a MxN (Row x Column).  All the values are 0.
+         * 
+         * :param rows: The number of rows (height)
+         * :param columns: The numbers of columns (width)
+         * :return A matrix with the given width and height.
+         */
+        template<typename T = double>
+        MatrixT<T> createEmptyMatrix(int rows, int columns)
+        {
+            return MatrixT<T>(rows, columns);
+        }
+
+        /**
+         * Copy a 2D matrix into a Matrix.
+         * 
+         * :param matrix: 2D matrix to copy.
+         * :param rows: Number of rows.
+         * :param columns: Number of columns.
+         * :return: Matrix with the same values.
+         */
+        Matrix toMatrix(double** matrix, int rows, int columns)
+        {
+            Matrix result(rows, columns);
+            for(int m = 0; m < rows; m++)
+            {
+                memcpy(result.row(m), matrix[m], columns * sizeof(double));
+            }
+            return result;
+        }
+
+        /**
+         * Copy a Matrix into a new 2D matrix.  The 2D matrix must be 
+         * cleaned up with clean2DMatrix().
+         * 
+         * :param matrix: Matrix to copy.
+         * :return: 2D matrix with the same values.
+         */
+        double** to2DMatrix(const Matrix& matrix)
+        {
+            double** result = new double*[matrix.rows()];
+            for(int m = 0; m < matrix.rows(); m++)
+            {
+                result[m] = new double[matrix.columns()];
+                memcpy(result[m], matrix.row(m), matrix.columns() * sizeof(double));
+            }
+            return result;
+        }
+
+        /**
+         * Print the Matrix.
+         * 
+         * :param matrix: Matrix to print.
+         * :param printMatrix: If set to false, only the size is printed.
+         */
+        template<typename T>
+        void printMatrix(const MatrixT<T>& matrix, bool printMatrix)
+        {
+            printf("Matrix: [%i,%i] - %i Rows, %i Columns\n", matrix.rows(), matrix.columns(), matrix.rows(), matrix.columns());
+
+            // Only print the entire matrix if flag is set
+            if(printMatrix)
+            {
+                for(int m = 0; m < matrix.rows(); m++)
+                {
+                    for(int n = 0; n < matrix.columns(); n++) 
+                    {
+                        cout << matrix(m, n) << " ";
+                    }
+                    cout << endl;
+                }
+            }
+        }
 
         /**
          * Create a 2D matrix given a i,j.
@@ -76,12 +527,13 @@ class MatrixCommon {
 
         /**
          * Clean up the matrix to prevent memory leaks.
+         * The caller's pointer is set to nullptr.
          * 
          * :param matrix: Matrix to delete.
          * :param rows: Number of rows.
          * 
          */
-        void clean2DMatrix(double** matrix, int rows) 
+        void clean2DMatrix(double**& matrix, int rows) 
         {
             for(int m = 0; m < rows; m++)
             {
@@ -0,0 +1,557 @@
+#pragma once
+
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include "simd_kernels.h"
+
+using namespace std;
+
+/**
+ * Portable kernels for any element type.  Used for the element types that do not
+ * have hand written vector kernels (int64_t and the complex types) and as the
+ * scalar kernels of float and int32_t.
+ */
+class PortableKernels {
+
+    public:
+        /**
+         * acc += a * b.
+         */
+        template<typename T>
+        static void multiplyAdd(T& acc, const T& a, const T& b)
+        {
+            acc += a * b;
+        }
+
+        /**
+         * acc += a * b for complex values.  Written out so the compiler does not call
+         * the library multiply, which checks for infinities and NaNs on every value.
+         */
+        template<typename R>
+        static void multiplyAdd(complex<R>& acc, const complex<R>& a, const complex<R>& b)
+        {
+            acc = complex<R>(acc.real() + a.real() * b.real() - a.imag() * b.imag(),
+                             acc.imag() + a.real() * b.imag() + a.imag() * b.real());
+        }
+
+        /**
+         * Micro-kernel.  The loops have fixed bounds so the compiler can keep the
+         * tile in registers.
+         */
+        template<typename T, int MR, int NR>
+        static void microKernel(int kc, const T* a, const T* b, T* C, int ldc)
+        {
+            T acc[MR][NR];
+            for(int r = 0; r < MR; r++)
+            {
+                for(int c = 0; c < NR; c++)
+                {
+                    acc[r][c] = C[(size_t)r * ldc + c];
+                }
+            }
+
+            for(int k = 0; k < kc; k++)
+            {
+                for(int r = 0; r < MR; r++)
+                {
+                    const T aValue = a[r];
+                    for(int c = 0; c < NR; c++)
+                    {
+                        multiplyAdd(acc[r][c], aValue, b[c]);
+                    }
+                }
+                a += MR;
+                b += NR;
+            }
+
+            for(int r = 0; r < MR; r++)
+            {
+                for(int c = 0; c < NR; c++)
+                {
+                    C[(size_t)r * ldc + c] = acc[r][c];
+                }
+            }
+        }
+
+        /**
+         * Transpose of a BLOCK x BLOCK square.
+         */
+        template<typename T, int BLOCK>
+        static void transposeBlock(const T* src, int lds, T* dst, int ldd)
+        {
+            for(int r = 0; r < BLOCK; r++)
+            {
+                for(int c = 0; c < BLOCK; c++)
+                {
+                    dst[(size_t)c * ldd + r] = src[(size_t)r * lds + c];
+                }
+            }
+        }
+
+        /**
+         * Dot product.  4 sums hide the latency of the adds.
+         */
+        template<typename T>
+        static T dot(int n, const T* a, const T* x)
+        {
+            T acc[4] = { T(), T(), T(), T() };
+            int i = 0;
+            for(; i + 4 <= n; i += 4)
+            {
+                for(int j = 0; j < 4; j++)
+                {
+                    multiplyAdd(acc[j], a[i + j], x[i + j]);
+                }
+            }
+            for(; i < n; i++)
+            {
+                multiplyAdd(acc[0], a[i], x[i]);
+            }
+            return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+        }
+
+        /**
+         * y += alpha * x.
+         */
+        template<typename T>
+        static void axpy(int n, T alpha, const T* x, T* y)
+        {
+            for(int i = 0; i < n; i++)
+            {
+                multiplyAdd(y[i], alpha, x[i]);
+            }
+        }
+
+        /**
+         * Batch kernel.  c = a * b for BATCH_LANES interleaved problems, see
+         * SimdKernels::batchKernelScalar().
+         */
+        template<typename T>
+        static void batchKernel(int M, int N, int K, const T* a, const T* b, T* c)
+        {
+            for(int m = 0; m < M; m++)
+            {
+                for(int n = 0; n < N; n++)
+                {
+                    T acc[BATCH_LANES];
+                    for(int l = 0; l < BATCH_LANES; l++)
+                    {
+                        acc[l] = T();
+                    }
+                    for(int k = 0; k < K; k++)
+                    {
+                        const T* aValue = a + (size_t)(m * K + k) * BATCH_LANES;
+                        const T* bValue = b + (size_t)(k * N + n) * BATCH_LANES;
+                        for(int l = 0; l < BATCH_LANES; l++)
+                        {
+                            multiplyAdd(acc[l], aValue[l], bValue[l]);
+                        }
+                    }
+                    for(int l = 0; l < BATCH_LANES; l++)
+                    {
+                        c[(size_t)(m * N + n) * BATCH_LANES + l] = acc[l];
+                    }
+                }
+            }
+        }
+};
+
+/**
+ * Kernels for an element type.  The instruction set follows SimdKernels::active(),
+ * so SimdKernels::select() changes the kernels of every element type.  An element
+ * type without kernels for an instruction set uses the next slower kernels it has.
+ *
+ * This is the portable version used by int64_t and any other type.
+ */
+template<typename T>
+class ElementKernels {
+
+    public:
+        static const KernelTableT<T>& table(KernelIsa isa)
+        {
+            (void)isa;
+            static const KernelTableT<T> portable = { ISA_SCALAR, "scalar", 4, 8, PortableKernels::microKernel<T, 4, 8>, 4, PortableKernels::transposeBlock<T, 4>, PortableKernels::batchKernel<T>, PortableKernels::dot<T>, PortableKernels::axpy<T> };
+            return portable;
+        }
+
+        static const KernelTableT<T>& active()
+        {
+            return table(SimdKernels::active().isa);
+        }
+};
+
+/**
+ * Doubles use SimdKernels.
+ */
+template<>
+class ElementKernels<double> {
+
+    public:
+        static const KernelTableT<double>& table(KernelIsa isa)
+        {
+            return SimdKernels::table(isa);
+        }
+
+        static const KernelTableT<double>& active()
+        {
+            return SimdKernels::active();
+        }
+};
+
+/**
+ * Complex values.  A complex multiply-add is 4 multiplies, so a smaller 4x4 tile
+ * keeps the accumulators in registers.
+ */
+template<typename R>
+class ElementKernels<complex<R> > {
+
+    public:
+        static const KernelTableT<complex<R> >& table(KernelIsa isa)
+        {
+            (void)isa;
+            static const KernelTableT<complex<R> > portable = { ISA_SCALAR, "scalar", 4, 4, PortableKernels::microKernel<complex<R>, 4, 4>, 4, PortableKernels::transposeBlock<complex<R>, 4>, PortableKernels::batchKernel<complex<R> >, PortableKernels::dot<complex<R> >, PortableKernels::axpy<complex<R> > };
+            return portable;
+        }
+
+        static const KernelTableT<complex<R> >& active()
+        {
+            return table(SimdKernels::active().isa);
+        }
+};
+
+/**
+ * Floats.  A register holds twice as many floats as doubles, so the tiles are
+ * twice as wide as the double tiles and each row of B costs half the bandwidth.
+ */
+template<>
+class ElementKernels<float> {
+
+    public:
+        static const KernelTableT<float>& table(KernelIsa isa)
+        {
+            static const KernelTableT<float> tables[] = {
+                { ISA_SCALAR, "scalar", 4, 8, PortableKernels::microKernel<float, 4, 8>, 8, PortableKernels::transposeBlock<float, 8>, PortableKernels::batchKernel<float>, PortableKernels::dot<float>, PortableKernels::axpy<float> },
+        #ifdef MATRIX_SIMD_X86
+                { ISA_SSE2, "sse2", 4, 8, microKernelSse2, 8, PortableKernels::transposeBlock<float, 8>, PortableKernels::batchKernel<float>, PortableKernels::dot<float>, PortableKernels::axpy<float> },
+                { ISA_AVX2, "avx2", 6, 16, microKernelAvx2, 8, PortableKernels::transposeBlock<float, 8>, batchKernelAvx2, dotAvx2, axpyAvx2 },
+                { ISA_AVX512, "avx512", 8, 32, microKernelAvx512, 8, PortableKernels::transposeBlock<float, 8>, batchKernelAvx2, dotAvx2, axpyAvx2 },
+        #endif
+            };
+        #ifdef MATRIX_SIMD_X86
+            return tables[isa];
+        #else
+            (void)isa;
+            return tables[0];
+        #endif
+        }
+
+        static const KernelTableT<float>& active()
+        {
+            return table(SimdKernels::active().isa);
+        }
+
+    private:
+    #ifdef MATRIX_SIMD_X86
+        /**
+         * SSE2 4x8 micro-kernel.  Each row of the tile is 2 registers.
+         */
+        __attribute__((target("sse2")))
+        static void microKernelSse2(int kc, const float* a, const float* b, float* C, int ldc)
+        {
+            __m128 c[4][2];
+            for(int r = 0; r < 4; r++)
+            {
+                c[r][0] = _mm_loadu_ps(C + (size_t)r * ldc);
+                c[r][1] = _mm_loadu_ps(C + (size_t)r * ldc + 4);
+            }
+
+            for(int k = 0; k < kc; k++)
+            {
+                const __m128 b0 = _mm_load_ps(b);
+                const __m128 b1 = _mm_load_ps(b + 4);
+                for(int r = 0; r < 4; r++)
+                {
+                    const __m128 aValue = _mm_set1_ps(a[r]);
+                    c[r][0] = _mm_add_ps(c[r][0], _mm_mul_ps(aValue, b0));
+                    c[r][1] = _mm_add_ps(c[r][1], _mm_mul_ps(aValue, b1));
+                }
+                a += 4;
+                b += 8;
+            }
+
+            for(int r = 0; r < 4; r++)
+            {
+                _mm_storeu_ps(C + (size_t)r * ldc, c[r][0]);
+                _mm_storeu_ps(C + (size_t)r * ldc + 4, c[r][1]);
+            }
+        }
+
+        /**
+         * AVX2 6x16 micro-kernel with FMA.
+         */
+        __attribute__((target("avx2,fma")))
+        static void microKernelAvx2(int kc, const float* a, const float* b, float* C, int ldc)
+        {
+            __m256 c[6][2];
+            for(int r = 0; r < 6; r++)
+            {
+                c[r][0] = _mm256_loadu_ps(C + (size_t)r * ldc);
+                c[r][1] = _mm256_loadu_ps(C + (size_t)r * ldc + 8);
+            }
+
+            for(int k = 0; k < kc; k++)
+            {
+                const __m256 b0 = _mm256_load_ps(b);
+                const __m256 b1 = _mm256_load_ps(b + 8);
+                for(int r = 0; r < 6; r++)
+                {
+                    const __m256 aValue = _mm256_broadcast_ss(a + r);
+                    c[r][0] = _mm256_fmadd_ps(aValue, b0, c[r][0]);
+                    c[r][1] = _mm256_fmadd_ps(aValue, b1, c[r][1]);
+                }
+                a += 6;
+                b += 16;
+            }
+
+            for(int r = 0; r < 6; r++)
+            {
+                _mm256_storeu_ps(C + (size_t)r * ldc, c[r][0]);
+                _mm256_storeu_ps(C + (size_t)r * ldc + 8, c[r][1]);
+            }
+        }
+
+        /**
+         * AVX-512 8x32 micro-kernel with FMA.
+         */
+        __attribute__((target("avx512f")))
+        static void microKernelAvx512(int kc, const float* a, const float* b, float* C, int ldc)
+        {
+            __m512 c[8][2];
+            for(int r = 0; r < 8; r++)
+            {
+                c[r][0] = _mm512_loadu_ps(C + (size_t)r * ldc);
+                c[r][1] = _mm512_loadu_ps(C + (size_t)r * ldc + 16);
+            }
+
+            for(int k = 0; k < kc; k++)
+            {
+                const __m512 b0 = _mm512_load_ps(b);
+                const __m512 b1 = _mm512_load_ps(b + 16);
+                for(int r = 0; r < 8; r++)
+                {
+                    const __m512 aValue = _mm512_set1_ps(a[r]);
+                    c[r][0] = _mm512_fmadd_ps(aValue, b0, c[r][0]);
+                    c[r][1] = _mm512_fmadd_ps(aValue, b1, c[r][1]);
+                }
+                a += 8;
+                b += 32;
+            }
+
+            for(int r = 0; r < 8; r++)
+            {
+                _mm512_storeu_ps(C + (size_t)r * ldc, c[r][0]);
+                _mm512_storeu_ps(C + (size_t)r * ldc + 16, c[r][1]);
+            }
+        }
+
+        /**
+         * AVX2 batch kernel.  The 8 problems of an element are 1 register.  It is used
+         * for AVX-512 too, since 8 floats fill a 256 bit register and every CPU with
+         * AVX-512 has AVX2 and FMA.
+         */
+        __attribute__((target("avx2,fma")))
+        static void batchKernelAvx2(int M, int N, int K, const float* a, const float* b, float* c)
+        {
+            for(int m = 0; m < M; m++)
+            {
+                for(int n = 0; n < N; n++)
+                {
+                    __m256 acc = _mm256_setzero_ps();
+                    for(int k = 0; k < K; k++)
+                    {
+                        acc = _mm256_fmadd_ps(_mm256_load_ps(a + (size_t)(m * K + k) * BATCH_LANES),
+                                              _mm256_load_ps(b + (size_t)(k * N + n) * BATCH_LANES), acc);
+                    }
+                    _mm256_store_ps(c + (size_t)(m * N + n) * BATCH_LANES, acc);
+                }
+            }
+        }
+
+        /**
+         * AVX2 dot product with FMA.  Also used for AVX-512, since the rows are read
+         * from memory at the same speed either way.
+         */
+        __attribute__((target("avx2,fma")))
+        static float dotAvx2(int n, const float* a, const float* x)
+        {
+            __m256 acc[4] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+            int i = 0;
+            for(; i + 32 <= n; i += 32)
+            {
+                for(int j = 0; j < 4; j++)
+                {
+                    acc[j] = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8 * j), _mm256_loadu_ps(x + i + 8 * j), acc[j]);
+                }
+            }
+            for(; i + 8 <= n; i += 8)
+            {
+                acc[0] = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(x + i), acc[0]);
+            }
+            const __m256 total = _mm256_add_ps(_mm256_add_ps(acc[0], acc[1]), _mm256_add_ps(acc[2], acc[3]));
+            __m128 half = _mm_add_ps(_mm256_castps256_ps128(total), _mm256_extractf128_ps(total, 1));
+            half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+            float sum = _mm_cvtss_f32(_mm_add_ss(half, _mm_shuffle_ps(half, half, 1)));
+            for(; i < n; i++)
+            {
+                sum += a[i] * x[i];
+            }
+            return sum;
+        }
+
+        /**
+         * AVX2 y += alpha * x with FMA.  Also used for AVX-512.
+         */
+        __attribute__((target("avx2,fma")))
+        static void axpyAvx2(int n, float alpha, const float* x, float* y)
+        {
+            const __m256 a = _mm256_set1_ps(alpha);
+            int i = 0;
+            for(; i + 16 <= n; i += 16)
+            {
+                _mm256_storeu_ps(y + i, _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+                _mm256_storeu_ps(y + i + 8, _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8)));
+            }
+            for(; i < n; i++)
+            {
+                y[i] += alpha * x[i];
+            }
+        }
+    #endif
+};
+
+/**
+ * 32 bit integers.  Overflow is not checked, so keep the values small enough for
+ * the sums to fit.  SSE2 has no 32 bit multiply, so it uses the portable kernels.
+ */
+template<>
+class ElementKernels<int32_t> {
+
+    public:
+        static const KernelTableT<int32_t>& table(KernelIsa isa)
+        {
+            static const KernelTableT<int32_t> tables[] = {
+                { ISA_SCALAR, "scalar", 4, 8, PortableKernels::microKernel<int32_t, 4, 8>, 8, PortableKernels::transposeBlock<int32_t, 8>, PortableKernels::batchKernel<int32_t>, PortableKernels::dot<int32_t>, PortableKernels::axpy<int32_t> },
+        #ifdef MATRIX_SIMD_X86
+                { ISA_SCALAR, "scalar", 4, 8, PortableKernels::microKernel<int32_t, 4, 8>, 8, PortableKernels::transposeBlock<int32_t, 8>, PortableKernels::batchKernel<int32_t>, PortableKernels::dot<int32_t>, PortableKernels::axpy<int32_t> },
+                { ISA_AVX2, "avx2", 6, 16, microKernelAvx2, 8, PortableKernels::transposeBlock<int32_t, 8>, batchKernelAvx2, PortableKernels::dot<int32_t>, PortableKernels::axpy<int32_t> },
+                { ISA_AVX512, "avx512", 8, 32, microKernelAvx512, 8, PortableKernels::transposeBlock<int32_t, 8>, batchKernelAvx2, PortableKernels::dot<int32_t>, PortableKernels::axpy<int32_t> },
+        #endif
+            };
+        #ifdef MATRIX_SIMD_X86
+            return tables[isa];
+        #else
+            (void)isa;
+            return tables[0];
+        #endif
+        }
+
+        static const KernelTableT<int32_t>& active()
+        {
+            return table(SimdKernels::active().isa);
+        }
+
+    private:
+    #ifdef MATRIX_SIMD_X86
+        /**
+         * AVX2 6x16 micro-kernel.
+         */
+        __attribute__((target("avx2")))
+        static void microKernelAvx2(int kc, const int32_t* a, const int32_t* b, int32_t* C, int ldc)
+        {
+            __m256i c[6][2];
+            for(int r = 0; r < 6; r++)
+            {
+                c[r][0] = _mm256_loadu_si256((const __m256i*)(C + (size_t)r * ldc));
+                c[r][1] = _mm256_loadu_si256((const __m256i*)(C + (size_t)r * ldc + 8));
+            }
+
+            for(int k = 0; k < kc; k++)
+            {
+                const __m256i b0 = _mm256_load_si256((const __m256i*)b);
+                const __m256i b1 = _mm256_load_si256((const __m256i*)(b + 8));
+                for(int r = 0; r < 6; r++)
+                {
+                    const __m256i aValue = _mm256_set1_epi32(a[r]);
+                    c[r][0] = _mm256_add_epi32(c[r][0], _mm256_mullo_epi32(aValue, b0));
+                    c[r][1] = _mm256_add_epi32(c[r][1], _mm256_mullo_epi32(aValue, b1));
+                }
+                a += 6;
+                b += 16;
+            }
+
+            for(int r = 0; r < 6; r++)
+            {
+                _mm256_storeu_si256((__m256i*)(C + (size_t)r * ldc), c[r][0]);
+                _mm256_storeu_si256((__m256i*)(C + (size_t)r * ldc + 8), c[r][1]);
+            }
+        }
+
+        /**
+         * AVX-512 8x32 micro-kernel.
+         */
+        __attribute__((target("avx512f")))
+        static void microKernelAvx512(int kc, const int32_t* a, const int32_t* b, int32_t* C, int ldc)
+        {
+            __m512i c[8][2];
+            for(int r = 0; r < 8; r++)
+            {
+                c[r][0] = _mm512_loadu_si512(C + (size_t)r * ldc);
+                c[r][1] = _mm512_loadu_si512(C + (size_t)r * ldc + 16);
+            }
+
+            for(int k = 0; k < kc; k++)
+            {
+                const __m512i b0 = _mm512_load_si512(b);
+                const __m512i b1 = _mm512_load_si512(b + 16);
+                for(int r = 0; r < 8; r++)
+                {
+                    const __m512i aValue = _mm512_set1_epi32(a[r]);
+                    c[r][0] = _mm512_add_epi32(c[r][0], _mm512_mullo_epi32(aValue, b0));
+                    c[r][1] = _mm512_add_epi32(c[r][1], _mm512_mullo_epi32(aValue, b1));
+                }
+                a += 8;
+                b += 32;
+            }
+
+            for(int r = 0; r < 8; r++)
+            {
+                _mm512_storeu_si512(C + (size_t)r * ldc, c[r][0]);
+                _mm512_storeu_si512(C + (size_t)r * ldc + 16, c[r][1]);
+            }
+        }
+
+        /**
+         * AVX2 batch kernel.  The 8 problems of an element are 1 register.  Also used
+         * for AVX-512, see the float version.
+         */
+        __attribute__((target("avx2")))
+        static void batchKernelAvx2(int M, int N, int K, const int32_t* a, const int32_t* b, int32_t* c)
+        {
+            for(int m = 0; m < M; m++)
+            {
+                for(int n = 0; n < N; n++)
+                {
+                    __m256i acc = _mm256_setzero_si256();
+                    for(int k = 0; k < K; k++)
+                    {
+                        const __m256i aValue = _mm256_load_si256((const __m256i*)(a + (size_t)(m * K + k) * BATCH_LANES));
+                        const __m256i bValue = _mm256_load_si256((const __m256i*)(b + (size_t)(k * N + n) * BATCH_LANES));
+                        acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(aValue, bValue));
+                    }
+                    _mm256_store_si256((__m256i*)(c + (size_t)(m * N + n) * BATCH_LANES), acc);
+                }
+            }
+        }
+    #endif
+};
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <cstddef>
+#include "common.h"
+#include "element_kernels.h"
+
+using namespace std;
+
+// Inline every call in the function, so the lambdas given to Unroll are expanded too
+#if defined(__GNUC__)
+#define MATRIX_FLATTEN __attribute__((flatten))
+#else
+#define MATRIX_FLATTEN
+#endif
+
+/**
+ * Calls f(0), f(1), ... f(N - 1).  The recursion is expanded by the compiler, so
+ * once f is inlined every call has a constant index and there is no loop left.
+ */
+template<int N>
+struct Unroll {
+    template<typename F>
+    static void run(const F& f)
+    {
+        Unroll<N - 1>::run(f);
+        f(N - 1);
+    }
+};
+
+template<>
+struct Unroll<0> {
+    template<typename F>
+    static void run(const F&)
+    {
+    }
+};
+
+/**
+ * Matrix with the size fixed at compile time.  The values are stored in the object,
+ * so it lives on the stack (or inside another object) and is never allocated.  Rows
+ * are not padded, row m starts at data() + m * C.
+ *
+ * Used for the small shapes, like 3x3 and 4x4 transforms, where allocating a Matrix
+ * and running the blocked kernels costs more than the arithmetic.  A FixedMatrix can
+ * be multiplied with another FixedMatrix or with a Matrix of the same element type,
+ * see MatrixAlgebra::matrixMultiply().
+ */
+template<typename T, int R, int C>
+class FixedMatrix {
+
+    static_assert(R > 0 && C > 0, "FixedMatrix needs at least 1 row and 1 column");
+
+    public:
+        /**
+         * Create a matrix with all the values set to 0.
+         */
+        FixedMatrix()
+        {
+            Unroll<R * C>::run([&](int i) { mData[i] = T(); });
+        }
+
+        /**
+         * Copy the values of a Matrix.  The Matrix must be R x C.
+         */
+        explicit FixedMatrix(const MatrixT<T>& matrix)
+        {
+            Unroll<R>::run([&](int m)
+            {
+                Unroll<C>::run([&](int n) { mData[m * C + n] = matrix(m, n); });
+            });
+        }
+
+        /**
+         * Copy the values into a new Matrix.
+         */
+        MatrixT<T> toMatrix() const
+        {
+            MatrixT<T> result(R, C);
+            Unroll<R>::run([&](int m)
+            {
+                Unroll<C>::run([&](int n) { result(m, n) = mData[m * C + n]; });
+            });
+            return result;
+        }
+
+        static int rows() { return R; }
+        static int columns() { return C; }
+        static int stride() { return C; }
+
+        T* data() { return mData; }
+        const T* data() const { return mData; }
+
+        /**
+         * Pointer to the first element of row m.
+         */
+        T* row(int m) { return mData + m * C; }
+        const T* row(int m) const { return mData + m * C; }
+
+        /**
+         * Element at row m and column n.
+         */
+        T& operator()(int m, int n) { return mData[m * C + n]; }
+        const T& operator()(int m, int n) const { return mData[m * C + n]; }
+
+    private:
+        T mData[R * C];     // Values, row by row
+};
+
+/**
+ * Kernels where some or all of the sizes are template parameters.  The loops over
+ * the fixed sizes are unrolled with Unroll, so a 4x4 multiply is 64 multiply-adds
+ * with no loop counters or branches.  The values of C are summed in the order of the
+ * shared dimension, the same order as the other kernels.
+ */
+class FixedKernels {
+
+    public:
+        /**
+         * C = A * B, with A M x K, B K x N and C M x N, all unpadded.
+         */
+        template<typename T, int M, int N, int K>
+        MATRIX_FLATTEN static void multiply(const T* A, const T* B, T* C)
+        {
+            Unroll<M>::run([&](int m)
+            {
+                T c[N];
+                Unroll<N>::run([&](int n) { c[n] = T(); });
+                Unroll<K>::run([&](int k)
+                {
+                    const T a = A[m * K + k];
+                    Unroll<N>::run([&](int n) { PortableKernels::multiplyAdd(c[n], a, B[k * N + n]); });
+                });
+                Unroll<N>::run([&](int n) { C[m * N + n] = c[n]; });
+            });
+        }
+
+        /**
+         * B = A^T, with A R x C and B C x R, both unpadded.
+         */
+        template<typename T, int R, int C>
+        MATRIX_FLATTEN static void transpose(const T* A, T* B)
+        {
+            Unroll<R>::run([&](int m)
+            {
+                Unroll<C>::run([&](int n) { B[n * R + m] = A[m * C + n]; });
+            });
+        }
+
+        /**
+         * C += A * B where A is a fixed M x K matrix and B has N columns.  The rows
+         * of A are unrolled and the columns of B are a loop the compiler vectorizes.
+         * The columns are done in blocks so the rows of C stay in the L1 cache.
+         *
+         * :param A: Unpadded M x K matrix.
+         * :param B: K x N matrix.
+         * :param ldb: Stride of B.
+         * :param C: M x N matrix.
+         * :param ldc: Stride of C.
+         * :param N: Number of columns of B and C.
+         */
+        template<typename T, int M, int K>
+        MATRIX_FLATTEN static void multiplyFixedLeft(const T* A, const T* B, int ldb, T* C, int ldc, int N)
+        {
+            const int blockColumns = FIXED_BLOCK_BYTES / (M * (int)sizeof(T)) > 16 ? FIXED_BLOCK_BYTES / (M * (int)sizeof(T)) : 16;
+            for(int nBegin = 0; nBegin < N; nBegin += blockColumns)
+            {
+                const int nEnd = nBegin + blockColumns < N ? nBegin + blockColumns : N;
+                Unroll<M>::run([&](int m)
+                {
+                    T* c = C + (size_t)m * ldc;
+                    Unroll<K>::run([&](int k)
+                    {
+                        const T a = A[m * K + k];
+                        const T* b = B + (size_t)k * ldb;
+                        for(int n = nBegin; n < nEnd; n++)
+                        {
+                            PortableKernels::multiplyAdd(c[n], a, b[n]);
+                        }
+                    });
+                });
+            }
+        }
+
+        /**
+         * C = A * B where B is a fixed K x N matrix and A has M rows.  Each row of
+         * C is computed in registers with K and N unrolled.
+         *
+         * :param A: M x K matrix.
+         * :param lda: Stride of A.
+         * :param M: Number of rows of A and C.
+         * :param B: Unpadded K x N matrix.
+         * :param C: M x N matrix.
+         * :param ldc: Stride of C.
+         */
+        template<typename T, int K, int N>
+        MATRIX_FLATTEN static void multiplyFixedRight(const T* A, int lda, int M, const T* B, T* C, int ldc)
+        {
+            for(int m = 0; m < M; m++)
+            {
+                const T* a = A + (size_t)m * lda;
+                T c[N];
+                Unroll<N>::run([&](int n) { c[n] = T(); });
+                Unroll<K>::run([&](int k)
+                {
+                    Unroll<N>::run([&](int n) { PortableKernels::multiplyAdd(c[n], a[k], B[k * N + n]); });
+                });
+
+                T* out = C + (size_t)m * ldc;
+                Unroll<N>::run([&](int n) { out[n] = c[n]; });
+            }
+        }
+
+    private:
+        static const int FIXED_BLOCK_BYTES = 16 * 1024;     // Bytes of C per column block, half an L1 cache
+};
@@ -0,0 +1,419 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define MATRIX_PERF_EVENTS 1
+#endif
+
+using namespace std;
+
+/**
+ * Phases of a call.  The pack and compute times are added over all the threads,
+ * so with several threads they can be longer than the call.
+ */
+enum CallPhase {
+    PHASE_ALLOCATE = 0,     // Result, partial results and packing buffers
+    PHASE_PACK = 1,         // Copying blocks of the inputs into packed panels
+    PHASE_COMPUTE = 2,      // Micro-kernels, transpose blocks and reductions
+    PHASE_JOIN = 3,         // Caller waiting for the other threads to finish
+    PHASE_COUNT = 4
+};
+
+/**
+ * Seconds on a steady clock.
+ */
+inline double statsNow()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Work done by one thread during a call.
+ */
+struct ThreadStats {
+    double busySeconds;         // Time running tasks
+    double idleSeconds;         // Time in the parallel parts without a task
+    double allocateSeconds;     // Time allocating packing buffers
+    double packSeconds;         // Time packing
+    double computeSeconds;      // Time computing
+    uint64_t bytesPacked;       // Bytes written to packed panels
+
+    ThreadStats() : busySeconds(0.0), idleSeconds(0.0), allocateSeconds(0.0), packSeconds(0.0), computeSeconds(0.0), bytesPacked(0)
+    {
+    }
+};
+
+/**
+ * Hardware counters of the calling thread.  Only valid if perf_event_open worked,
+ * which depends on the kernel and on /proc/sys/kernel/perf_event_paranoid.
+ */
+struct HardwareCounters {
+    bool valid;                 // The counters were read
+    uint64_t cycles;            // CPU cycles
+    uint64_t instructions;      // Instructions retired
+    uint64_t cacheReferences;   // Last level cache references
+    uint64_t cacheMisses;       // Last level cache misses
+
+    HardwareCounters() : valid(false), cycles(0), instructions(0), cacheReferences(0), cacheMisses(0)
+    {
+    }
+
+    /**
+     * Instructions per cycle.
+     */
+    double ipc() const
+    {
+        return cycles > 0 ? (double)instructions / cycles : 0.0;
+    }
+};
+
+/**
+ * Stats of one call to MatrixAlgebra.
+ */
+struct CallStats {
+    const char* operation;              // multiply, multiplyPacked, multiplyBatch, pack, transpose or transposeInPlace
+    int rows;                           // Rows of the result
+    int columns;                        // Columns of the result
+    int depth;                          // Shared dimension of a multiply, 0 for a transpose
+    int numThreads;                     // Threads asked for
+    int count;                          // Number of problems, more than 1 for a batch
+    double totalSeconds;                // Time of the whole call
+    double phaseSeconds[PHASE_COUNT];   // Time in each phase
+    double parallelSeconds;             // Time in the parts run on the thread pool
+    uint64_t bytesRead;                 // Bytes of the inputs
+    uint64_t bytesWritten;              // Bytes of the result
+    uint64_t bytesPacked;               // Bytes written to packed panels
+    vector<ThreadStats> threads;        // One per participant, the caller is 0
+    HardwareCounters counters;          // Counters of the calling thread
+
+    CallStats(const char* operation, int rows, int columns, int depth, int numThreads)
+        : operation(operation), rows(rows), columns(columns), depth(depth), numThreads(numThreads), count(1),
+          totalSeconds(0.0), parallelSeconds(0.0), bytesRead(0), bytesWritten(0), bytesPacked(0)
+    {
+        for(int phase = 0; phase < PHASE_COUNT; phase++)
+        {
+            phaseSeconds[phase] = 0.0;
+        }
+    }
+
+    /**
+     * Make room for the stats of numThreads participants.
+     *
+     * :return: Stats of participant 0.
+     */
+    ThreadStats* beginThreads(int numThreads)
+    {
+        if((int)threads.size() < numThreads)
+        {
+            threads.resize(numThreads);
+        }
+        return threads.data();
+    }
+};
+
+/**
+ * Told about every call of a MatrixAlgebra it is attached to.  onCall() runs on the
+ * thread that ran the call, after it is done.  For the async calls that is a worker
+ * of the pool, and calls that do not depend on each other finish at the same time,
+ * so report() lets one onCall() of an observer run at a time.
+ */
+class CallObserver {
+
+    public:
+        virtual ~CallObserver()
+        {
+        }
+
+        /**
+         * Called once per call with its stats.  Never called by two threads at once.
+         */
+        virtual void onCall(const CallStats& stats) = 0;
+
+        /**
+         * Call onCall() while holding the lock of the observer.
+         */
+        void report(const CallStats& stats)
+        {
+            lock_guard<mutex> lock(mCallMutex);
+            onCall(stats);
+        }
+
+        /**
+         * Return true to read the hardware counters during each call.  Opening the
+         * counters costs a few system calls per call.
+         */
+        virtual bool wantsHardwareCounters() const
+        {
+            return false;
+        }
+
+    private:
+        mutex mCallMutex;   // Held while onCall() runs
+};
+
+/**
+ * Observer that prints one line per call.
+ */
+class StreamObserver : public CallObserver {
+
+    public:
+        explicit StreamObserver(ostream& out, bool hardwareCounters = false) : mOut(out), mHardwareCounters(hardwareCounters)
+        {
+        }
+
+        void onCall(const CallStats& stats) override
+        {
+            double busy = 0.0;
+            double idle = 0.0;
+            for(const ThreadStats& thread : stats.threads)
+            {
+                busy += thread.busySeconds;
+                idle += thread.idleSeconds;
+            }
+
+            mOut << stats.operation << " " << stats.rows << " x " << stats.columns;
+            if(stats.depth > 0)
+            {
+                mOut << " x " << stats.depth;
+            }
+            if(stats.count > 1)
+            {
+                mOut << ", " << stats.count << " problems";
+            }
+            mOut << ", " << stats.numThreads << " Thread Duration: " << microseconds(stats.totalSeconds) << " microseconds"
+                 << " (allocate " << microseconds(stats.phaseSeconds[PHASE_ALLOCATE])
+                 << ", pack " << microseconds(stats.phaseSeconds[PHASE_PACK])
+                 << ", compute " << microseconds(stats.phaseSeconds[PHASE_COMPUTE])
+                 << ", join " << microseconds(stats.phaseSeconds[PHASE_JOIN]) << ")";
+            if(busy + idle > 0.0)
+            {
+                mOut << ", busy " << (int)(100.0 * busy / (busy + idle) + 0.5) << "%";
+            }
+            mOut << ", " << (stats.bytesRead + stats.bytesWritten + stats.bytesPacked) << " bytes";
+            if(stats.counters.valid)
+            {
+                mOut << ", IPC " << stats.counters.ipc() << ", " << stats.counters.cacheMisses << " cache misses";
+            }
+            mOut << endl;
+        }
+
+        bool wantsHardwareCounters() const override
+        {
+            return mHardwareCounters;
+        }
+
+    private:
+        static long long microseconds(double seconds)
+        {
+            return (long long)(seconds * 1e6 + 0.5);
+        }
+
+        ostream& mOut;              // Where the lines are written
+        bool mHardwareCounters;     // Read the hardware counters
+};
+
+/**
+ * Adds the time from construction to destruction to a counter.  Does nothing if
+ * the counter is null, so the code timed costs one branch when stats are off.
+ */
+class PhaseTimer {
+
+    public:
+        explicit PhaseTimer(double* seconds) : mSeconds(seconds), mStart(seconds != nullptr ? statsNow() : 0.0)
+        {
+        }
+
+        ~PhaseTimer()
+        {
+            if(mSeconds != nullptr)
+            {
+                *mSeconds += statsNow() - mStart;
+            }
+        }
+
+    private:
+        PhaseTimer(const PhaseTimer&);
+        PhaseTimer& operator=(const PhaseTimer&);
+
+        double* mSeconds;       // Counter to add to, or null
+        double mStart;          // Start time
+};
+
+/**
+ * Cycles, instructions and last level cache references and misses of the calling
+ * thread, read with perf_event_open.  Other threads are not counted, because
+ * counters can only follow threads created after they are opened.
+ */
+class HardwareCounterGroup {
+
+    public:
+        HardwareCounterGroup()
+        {
+            for(int i = 0; i < NUM_COUNTERS; i++)
+            {
+                mFds[i] = -1;
+            }
+        }
+
+        ~HardwareCounterGroup()
+        {
+        #ifdef MATRIX_PERF_EVENTS
+            for(int i = 0; i < NUM_COUNTERS; i++)
+            {
+                if(mFds[i] >= 0)
+                {
+                    close(mFds[i]);
+                }
+            }
+        #endif
+        }
+
+        /**
+         * Open the counters and start counting.
+         *
+         * :return: False if the counters could not be opened.
+         */
+        bool start()
+        {
+        #ifdef MATRIX_PERF_EVENTS
+            const uint64_t configs[NUM_COUNTERS] = {
+                PERF_COUNT_HW_CPU_CYCLES,
+                PERF_COUNT_HW_INSTRUCTIONS,
+                PERF_COUNT_HW_CACHE_REFERENCES,
+                PERF_COUNT_HW_CACHE_MISSES
+            };
+
+            for(int i = 0; i < NUM_COUNTERS; i++)
+            {
+                perf_event_attr attr;
+                memset(&attr, 0, sizeof(attr));
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.size = sizeof(attr);
+                attr.config = configs[i];
+                attr.disabled = 1;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+
+                mFds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+                if(mFds[i] < 0)
+                {
+                    return false;
+                }
+            }
+
+            for(int i = 0; i < NUM_COUNTERS; i++)
+            {
+                ioctl(mFds[i], PERF_EVENT_IOC_RESET, 0);
+                ioctl(mFds[i], PERF_EVENT_IOC_ENABLE, 0);
+            }
+            return true;
+        #else
+            return false;
+        #endif
+        }
+
+        /**
+         * Stop counting and read the counters.
+         *
+         * :param counters: Set to the counts.  Left invalid if a counter could not be read.
+         */
+        void stop(HardwareCounters& counters)
+        {
+        #ifdef MATRIX_PERF_EVENTS
+            uint64_t values[NUM_COUNTERS];
+            for(int i = 0; i < NUM_COUNTERS; i++)
+            {
+                if(mFds[i] < 0)
+                {
+                    return;
+                }
+                ioctl(mFds[i], PERF_EVENT_IOC_DISABLE, 0);
+                if(read(mFds[i], &values[i], sizeof(uint64_t)) != (ssize_t)sizeof(uint64_t))
+                {
+                    return;
+                }
+            }
+
+            counters.valid = true;
+            counters.cycles = values[0];
+            counters.instructions = values[1];
+            counters.cacheReferences = values[2];
+            counters.cacheMisses = values[3];
+        #else
+            (void)counters;
+        #endif
+        }
+
+    private:
+        static const int NUM_COUNTERS = 4;
+
+        HardwareCounterGroup(const HardwareCounterGroup&);
+        HardwareCounterGroup& operator=(const HardwareCounterGroup&);
+
+        int mFds[NUM_COUNTERS];     // One file per counter, -1 if not open
+};
+
+/**
+ * Records one call.  Starts the clock (and the counters if the observer wants them)
+ * when created, and on finish() adds up the thread stats and gives the stats to
+ * the observer.
+ */
+class CallRecorder {
+
+    public:
+        CallRecorder(CallObserver& observer, CallStats& stats) : mObserver(observer), mStats(stats), mCounting(false)
+        {
+            if(observer.wantsHardwareCounters())
+            {
+                mCounting = mCounters.start();
+            }
+            mStart = statsNow();
+        }
+
+        /**
+         * End the call and tell the observer.
+         */
+        void finish()
+        {
+            mStats.totalSeconds = statsNow() - mStart;
+            if(mCounting)
+            {
+                mCounters.stop(mStats.counters);
+            }
+
+            for(ThreadStats& thread : mStats.threads)
+            {
+                if(mStats.parallelSeconds > 0.0)
+                {
+                    thread.idleSeconds = max(0.0, mStats.parallelSeconds - thread.busySeconds);
+                }
+                mStats.phaseSeconds[PHASE_ALLOCATE] += thread.allocateSeconds;
+                mStats.phaseSeconds[PHASE_PACK] += thread.packSeconds;
+                mStats.phaseSeconds[PHASE_COMPUTE] += thread.computeSeconds;
+                mStats.bytesPacked += thread.bytesPacked;
+            }
+
+            mObserver.report(mStats);
+        }
+
+    private:
+        CallRecorder(const CallRecorder&);
+        CallRecorder& operator=(const CallRecorder&);
+
+        CallObserver& mObserver;            // Told about the call
+        CallStats& mStats;                  // Stats being recorded
+        HardwareCounterGroup mCounters;     // Hardware counters of the caller
+        bool mCounting;                     // The counters were started
+        double mStart;                      // Start of the call
+};
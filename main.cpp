@@ -1,4 +1,5 @@
 #include "matrix.h"
+#include "out_of_core.h"
 #include "matrix_unittest.h"
 
 /**
@@ -11,7 +12,7 @@
  * :param M1_Columns: Number of columns in matrix 1. [DEFAULT: 3]
  * :param M2_Rows: Number of rows in matrix 2. [DEFAULT: 3]
  * :param M2_Columns: Number of columns in matrix 2.  [DEFAULT: 2]
- * :param NumThreads: Number threads to utilize.  [DEFAULT: 2]
+ * :param NumThreads: Number threads to utilize.  0 lets the auto-tuner pick.  [DEFAULT: 0]
  * :param M1_StartValue: The first value in matrix 1.  The values are incremented in the matrix. [DEFAULT: 0]
  * :param M2_StartValue: The first value in matrix 2.  The values are incremented in the matrix. [DEFAULT: 5]
  *  
@@ -20,8 +21,9 @@
  * defined in matrix.h.  The code has been optimized to utilize threads to increase
  * speed.  But sometimes multiple threads is not always needed.  
  * Typically 4-5 threads will help for very large matrix (10000 x 10000).
- * Using any threads will be slower if used for smaller matrices.  The overhead
- * in creating the threads and joining will be longer then the calculation.
+ * Using any threads will be slower if used for smaller matrices.  When the
+ * number of threads is 0, the auto-tuner picks the threads, block sizes and
+ * kernels for the shape (see autotune.h).
  * 
  * The matrix are created based on the start value.  The matrix will have the values incremeted.
  * The full matrix will NOT be displayed if the matrix exceeds 10 rows or columns.
@@ -36,7 +38,7 @@ int main(int argc, char** argv)
     int iM2Rows = 3;          // DEFAULT Number of rows (Height/rows)
     int iM2Columns = 2;       // DEFAULT Number of columns (Width/columns)
 
-    int iNumThreads = 2;      // DEFAULT Number of threads to utilize threads efficiently
+    int iNumThreads = 0;      // DEFAULT Number of threads, 0 lets the auto-tuner pick
     double iM1StartValue = 0;    // DEFAULT Start value in the matrix 1.
     double iM2StartValue = 5;    // DEFAULT start value for matrix 2
 
@@ -84,16 +86,6 @@ int main(int argc, char** argv)
         bPrintMatrix = false;
     }
 
-    // Verify the number of threads is not large for small matrices
-    // Threshold for now is 3x3 or smaller, but should be even larger
-    // But for testing purpose, the number is left low to allow to see the difference
-    int maxMatrix = max(max(max(iM1Rows, iM2Columns), iM2Rows), iM2Columns);
-    if(maxMatrix <= 3)
-    {
-        // Only use 1 thread
-        iNumThreads = 1;
-    }
-
     // Verify good values are given for the matrices
     if(iM1Rows <= 0 || iM2Rows <= 0 || iM1Columns <= 0 || iM2Columns <= 0)
     {
@@ -118,21 +110,24 @@ int main(int argc, char** argv)
     MatrixAlgebra ma;
     MatrixCommon mc;
 
-    // Create the initial thread
-    double** matrix1 = mc.create2DMatrix(iM1Rows, iM1Columns, iM1StartValue);
-    double** matrix2 = mc.create2DMatrix(iM2Rows, iM2Columns, iM2StartValue);
+    // Create the initial matrices on the threads
+    const int iFillThreads = iNumThreads > 0 ? iNumThreads : max(1, (int)thread::hardware_concurrency());
+    Matrix matrix1 = ma.createMatrix(iM1Rows, iM1Columns, iM1StartValue, iFillThreads);
+    Matrix matrix2 = ma.createMatrix(iM2Rows, iM2Columns, iM2StartValue, iFillThreads);
+
+    // Print the time of each call
+    ma.setObserver(make_shared<StreamObserver>(cout));
 
     cout << "Original Matrices: " << endl;
-    mc.print2DMatrix(matrix1, iM1Rows, iM1Columns, bPrintMatrix);
+    mc.printMatrix(matrix1, bPrintMatrix);
     cout << endl;
-    mc.print2DMatrix(matrix2, iM2Rows, iM2Columns, bPrintMatrix);
+    mc.printMatrix(matrix2, bPrintMatrix);
     cout << endl;
 
     // Matrix Multiply
     cout << "Result: " << endl;
-    double** resultT = ma.matrixMultiply(matrix1, matrix2, iM1Rows, iM1Columns, iM2Columns, iNumThreads);
-    mc.print2DMatrix(resultT, iM1Rows, iM2Columns, bPrintMatrix);
-    mc.clean2DMatrix(resultT, iM1Rows);
+    Matrix resultT = iNumThreads > 0 ? ma.matrixMultiply(matrix1, matrix2, iNumThreads) : ma.matrixMultiply(matrix1, matrix2);
+    mc.printMatrix(resultT, bPrintMatrix);
 
     /******************************************************/
 
@@ -145,19 +140,14 @@ int main(int argc, char** argv)
     cout << "---------------------------" << endl;
     // Create the initial matrix
     cout << "Original Matrix: " << endl;
-    mc.print2DMatrix(matrix1, iM1Rows, iM1Columns, bPrintMatrix);
+    mc.printMatrix(matrix1, bPrintMatrix);
 
     cout << endl;
 
     // Transpose the matrix
     cout << "Result: " << endl;
-    double** matrixT = ma.transpose(matrix1, iM1Rows, iM1Columns, iNumThreads);
-    mc.print2DMatrix(matrixT, iM1Columns, iM1Rows, bPrintMatrix);
-    mc.clean2DMatrix(matrixT, iM1Columns);
-
-    mc.clean2DMatrix(matrix1, iM1Rows);
-    mc.clean2DMatrix(matrix2, iM2Rows);
-
+    Matrix matrixT = iNumThreads > 0 ? ma.transpose(matrix1, iNumThreads) : ma.transpose(matrix1);
+    mc.printMatrix(matrixT, bPrintMatrix);
 
     cout << endl;
     cout << "---------------------------" << endl;
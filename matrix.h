@@ -1,12 +1,24 @@
+#pragma once
+
 #include <cstdio>
-#include <chrono> 
 #include <iostream>
-#include <thread>
+#include <limits>
+#include <type_traits>
 #include <vector>
+#include "autotune.h"
 #include "common.h"
+#include "fixed_matrix.h"
+#include "instrumentation.h"
+#include "matrix_file.h"
+#include "matrix_future.h"
+#include "matrix_kernels.h"
+#include "mixed_precision.h"
+#include "packed_matrix.h"
+#include "sparse_matrix.h"
+#include "strassen.h"
+#include "thread_pool.h"
 
 using namespace std;
-using namespace std::chrono; 
 
 class MatrixAlgebra {
 
@@ -20,389 +32,2428 @@ class MatrixAlgebra {
          * number of threads by trial.  At least 2 threads will improve things. You typically do not need to exceed
          * 4 or 5 threads for very large matrices. 
          * 
-         * The reason the threaded version are not good for small matrices is the because of the overhead
-         * of creating and disposing of the threads.  The time involved takes longer than just doing the calculation.
-         * After this, the number of threads can improved based on the matrix size.  Sometimes it is better to use
+         * The threads come from a ThreadPool that is created once and shared, so a call does not
+         * create or join any threads.  The pool can be given to the constructor, otherwise the
+         * default pool is used.  Waking the workers still costs a few microseconds, so very small
+         * matrices are faster with 1 thread.  After this, the number of threads can improved based on the matrix size.  Sometimes it is better to use
          * more than 2 threads.  You could plot this out to determine the optimal number of threads based on matrix 
          * size.
          * 
-         * I left the timing code in the file so the timing can be tested to show improvement.  You can comment
-         * out the define line to remove the timing.
+         * To see where the time goes, attach a CallObserver with setObserver().  It gets
+         * the phase times, the busy and idle time of each thread and the bytes touched of
+         * every call.  Without an observer the stats are not collected.
          * 
-         * I might be able to pull out a little more speed if I go from a 2D to a 1D array to represent the 
-         * matrix.  But I did not test this.
+         * The matrices are stored in a Matrix, which keeps all the rows in one aligned 1D buffer.
+         * The size and stride of the matrix are carried with it.  The double** functions are
+         * kept for older code.  They copy into a Matrix and back out.
          * 
-         * I am forcing the sizes of the matrix to be given.  This way the size does not
-         * need to be calculated.
+         * The calls are templates on the element type.  Matrix is MatrixT<double>, and
+         * float, int32_t, int64_t and complex matrices work the same way.  float and int32_t
+         * have their own SIMD kernels, the other types use portable kernels.
          * 
          */
 
-        // Display the timing information for the code
-        // Comment out this line to remove the timing information
-        #define TIMING
-
         /**
-         * Transpose the matrix.  This will create a new matrix and swap the
-         * rows in the original matrix as the column in the new matrix.
+         * Run function(task, threadStats) for every task on the thread pool.  With stats,
+         * the busy time of each thread, the time in the pool and the time the caller
+         * waits for the other threads are recorded.  Without stats, threadStats is null.
          * 
-         * :param origMatrix: Original matrix to transpose.
-         * :param rows: Number of rows in the original matrix.
-         * :param columns: Number of columns in the original matrix.
-         * :return: Transposed matrix.
+         * :param numTasks: Number of tasks.
+         * :param numThreads: Maximum number of threads, including the caller.
+         * :param stats: Stats of the call, or null.
+         * :param function: Called as function(int task, ThreadStats* threadStats).
          */
-        double** transpose2D(double** origMatrix, int rows, int columns)
+        template<typename Function>
+        void runTasks(int numTasks, int numThreads, CallStats* stats, const Function& function)
         {
-            // Create a new matrix based on the size of this matrix
-            MatrixCommon mc;
-            double** newMatrix = mc.create2DEmptyMatrix(columns, rows);
+            if(stats == nullptr)
+            {
+                mPool->parallelFor(numTasks, numThreads, [&](int task, int)
+                {
+                    function(task, (ThreadStats*)nullptr);
+                });
+                return;
+            }
 
-        #ifdef TIMING
-            // Used to Time the transpose process
-            auto start = high_resolution_clock::now(); 
-        #endif
+            ThreadStats* threads = stats->beginThreads(max(1, min(numThreads, THREAD_POOL_MAX_THREADS)));
+            const double start = statsNow();
+            double callerDone = start;
 
-            // Rows for original matrix
-            for(int m = 0; m < rows; m++)
+            mPool->parallelFor(numTasks, numThreads, [&](int task, int participant)
             {
-                // Columns for original matrix
-                for(int n = 0; n < columns; n++)
+                ThreadStats* thread = &threads[participant];
+                const double begin = statsNow();
+                function(task, thread);
+                const double end = statsNow();
+                thread->busySeconds += end - begin;
+                if(participant == 0)
                 {
-                    // Transpose the values
-                    newMatrix[n][m] = origMatrix[m][n];
+                    callerDone = end;
                 }
-            }
+            });
+
+            const double stop = statsNow();
+            stats->parallelSeconds += stop - start;
+            stats->phaseSeconds[PHASE_JOIN] += stop - callerDone;
+        }
 
-        #ifdef TIMING
-            // Used to calculate the transpose time
-            auto stop = high_resolution_clock::now();
-            auto duration = duration_cast<microseconds>(stop - start); 
-            cout << "Transpose Duration: " <<  duration.count() << " microseconds" << endl; 
-        #endif
+        /**
+         * Calls runTasks() with a fixed number of threads and stats, for kernels
+         * that take the way their tasks are run as a parameter.
+         */
+        struct PoolRunner {
+            MatrixAlgebra* algebra;     // Runs the tasks
+            int numThreads;             // Maximum number of threads, including the caller
+            CallStats* stats;           // Stats of the call, or null
 
-            return newMatrix;
+            template<typename Function>
+            void operator()(int numTasks, const Function& function) const
+            {
+                algebra->runTasks(numTasks, numThreads, stats, function);
+            }
+        };
+
+        /**
+         * Transpose the matrix.  This will swap the rows in the original matrix
+         * as the column in the new matrix.
+         * 
+         * :param origMatrix: Original matrix to transpose.
+         * :param newMatrix: The transposed matrix, already the size of the result.
+         * :param stats: Stats of the call, or null.
+         */
+        template<typename T>
+        void transpose2D(const MatrixT<T>& origMatrix, MatrixT<T>& newMatrix, CallStats* stats)
+        {
+            // Transpose the values in cache sized tiles
+            ThreadStats* thread = stats != nullptr ? stats->beginThreads(1) : nullptr;
+            PhaseTimer busy(thread != nullptr ? &thread->busySeconds : nullptr);
+            PhaseTimer compute(thread != nullptr ? &thread->computeSeconds : nullptr);
+            MatrixKernels::transpose(origMatrix.rows(), origMatrix.columns(), origMatrix.data(), origMatrix.stride(), newMatrix.data(), newMatrix.stride());
         }
 
         /**
          * WORKER THREAD FUNCTION
-         * Transpose a row in the matrix.  This will transpose the number of rows given in numRowsCompute.
-         * This is used to breakup the work into rows.
+         * Transpose one tile of the matrix.  The tile is rows [rowBegin, rowEnd) and
+         * columns [columnBegin, columnEnd) of the original matrix.
          * 
          * :param newMatrix: The transposed matrix.
          * :param origMatrix: The original matrix.
-         * :param rowStart: The row number to start with.
-         * :param numRowsCompute: The number of rows to compute.
-         * :param columns: The number of columns.
+         * :param rowBegin: First row of the tile.
+         * :param rowEnd: One past the last row of the tile.
+         * :param columnBegin: First column of the tile.
+         * :param columnEnd: One past the last column of the tile.
+         * :param stats: Stats of the thread, or null.
          */ 
-        static void workerTransposeThreadN(double** newMatrix, double** origMatrix, int rowStart, int numRowsCompute, int columns)
+        template<typename T>
+        static void workerTransposeThreadN(MatrixT<T>* newMatrix, const MatrixT<T>* origMatrix, int rowBegin, int rowEnd, int columnBegin, int columnEnd, ThreadStats* stats)
         {
-            for(int m = rowStart; m < numRowsCompute + rowStart; m++)
-            {
-                // Columns for original matrix
-                for(int n = 0; n < columns; n++)
-                {
-                    // Because this only going to touch very unique spots in the 
-                    // matrix, a lock is not needed
-                    newMatrix[n][m] = origMatrix[m][n];
-                }
-            }
+            PhaseTimer timer(stats != nullptr ? &stats->computeSeconds : nullptr);
+
+            // Because this only going to touch very unique spots in the 
+            // matrix, a lock is not needed
+            MatrixKernels::transpose(rowEnd - rowBegin, columnEnd - columnBegin, origMatrix->row(rowBegin) + columnBegin, origMatrix->stride(), newMatrix->row(columnBegin) + rowBegin, newMatrix->stride());
         }
 
         /**
-         * This will reduce the number of threads created.  This will only use
-         * numThreads threads.  Each thread will do 1/nth the work.
+         * Transpose the matrix with at most numThreads threads.
          * 
-         * At very large matrix sizes, more than 10000 rows, you start to see
-         * some improvements where threads could help.  But for smaller size
-         * matrix, the overhead in creating and disposing of the threads makes
-         * this function call slower.  Only use this for very large matrix.
+         * The matrix is split into 2D tiles, so matrices with only a few rows are
+         * split too.  The tiles are run on the thread pool with work stealing, so
+         * no threads are created.  For small matrices, waking the workers still
+         * takes longer than the transpose.
          * 
          * :param origMatrix: Original Matrix to transpose.
-         * :param rows: Number of rows.
-         * :param columns: Number of columns.
+         * :param newMatrix: The transposed Matrix, already the size of the result.
          * :param numThreads: Number of threads to use.
-         * :return Transposed Matrix.
+         * :param stats: Stats of the call, or null.
          */
-        double** transpose2DThreadN(double** origMatrix, int rows, int columns, int numThreads)
+        template<typename T>
+        void transpose2DThreadN(const MatrixT<T>& origMatrix, MatrixT<T>& newMatrix, int numThreads, CallStats* stats)
         {
-            // Create a new matrix based on the size of this matrix
-            MatrixCommon mc;
-            double** newMatrix = mc.create2DEmptyMatrix(columns, rows);
-
-        #ifdef TIMING
-            // Used to Time the transpose process
-            auto start = high_resolution_clock::now(); 
-        #endif
-
-            // Create an vector to hold all the threads
-            // I chose a vector here to just use something other than
-            // an array.  I would suggest an array
-            // A thread will be created for each row
-            vector<thread> threadHolder;
+            // Several tiles per thread so the work can be balanced
+            TileGrid grid(origMatrix.rows(), origMatrix.columns(), 256, 256, 32, 32, 4 * numThreads);
 
-            int rowsPerThread = rows / numThreads;
-
-            // Rows for original matrix
-            for(int m = 0; m < rows; m+=rowsPerThread)
+            runTasks(grid.count(), numThreads, stats, [&](int tile, ThreadStats* thread)
             {
-                // Determine how many rows to compute for each thread
-                // The last thread may not need to do a full work load
-                int numRowsCompute = rowsPerThread;
-                // Ensure the last value is not too large to go past the end of the array
-                if(rowsPerThread + m > rows)
-                {
-                    numRowsCompute = rows - m;
-                }
+                int rowBegin, rowEnd, columnBegin, columnEnd;
+                grid.tile(tile, rowBegin, rowEnd, columnBegin, columnEnd);
+                workerTransposeThreadN(&newMatrix, &origMatrix, rowBegin, rowEnd, columnBegin, columnEnd, thread);
+            });
+        }
 
-                // Create a thread to transpose this row
-                threadHolder.emplace_back(workerTransposeThreadN, newMatrix, origMatrix, m, numRowsCompute, columns);
-            }
+        /**
+         * Mutliply two matrices.  C = alpha * op(A) * op(B) + beta * C.
+         * 
+         * It is assumed that the matrices are the correct size to allow multiplication
+         * to be done.  This will not check the sizes.  The error checking of the
+         * 2 matrices should be done before calling this method.
+         * 
+         * :param operands: The matrices, how they are read and the factors.
+         * :param resultMaxtrix: C, already the size of the result.
+         * :param config: Block sizes and kernels to use.
+         * :param stats: Stats of the call, or null.
+         */ 
+        template<typename T>
+        void matrixMultiply2D(const GemmOperandsT<T>& operands, MatrixT<T>& resultMaxtrix, const TuningConfig& config, CallStats* stats)
+        {
+            ThreadStats* thread = stats != nullptr ? stats->beginThreads(1) : nullptr;
+            PhaseTimer busy(thread != nullptr ? &thread->busySeconds : nullptr);
+            multiplyThreadWorker(&resultMaxtrix, operands, config, 0, operands.rows(), 0, operands.columns(), thread);
+        }
 
-            // Wait for all the threads to complete
-            for(auto& t: threadHolder)
+        /**
+         * The thread worker that does the actual work in the thread.  This will multiply one
+         * tile of the result, rows [rowBegin, rowEnd) and columns [columnBegin, columnEnd).
+         * The tile uses the full shared dimension, so no other tile writes to it.
+         * 
+         * :param resultMatrix: The matrix to set the results.
+         * :param operands: The matrices, how they are read and the factors.
+         * :param config: Block sizes and kernels to use.
+         * :param rowBegin: First row of the tile.
+         * :param rowEnd: One past the last row of the tile.
+         * :param columnBegin: First column of the tile.
+         * :param columnEnd: One past the last column of the tile.
+         * :param stats: Stats of the thread, or null.
+         */ 
+        template<typename T>
+        static void multiplyThreadWorker(MatrixT<T>* resultMaxtrix, const GemmOperandsT<T>& operands, const TuningConfig& config, int rowBegin, int rowEnd, int columnBegin, int columnEnd, ThreadStats* stats)
+        {
+            T* c = resultMaxtrix->row(rowBegin) + columnBegin;
             {
-                t.join();
+                PhaseTimer timer(stats != nullptr ? &stats->computeSeconds : nullptr);
+                MatrixKernels::scale(rowEnd - rowBegin, columnEnd - columnBegin, operands.beta, c, resultMaxtrix->stride());
             }
 
-        #ifdef TIMING
-            // Used to calculate the transpose time
-            auto stop = high_resolution_clock::now();
-            auto duration = duration_cast<microseconds>(stop - start); 
-            cout << "Transpose " << numThreads <<  " Thread Duration: " <<  duration.count() << " microseconds" << endl; 
-        #endif
-
-            return newMatrix;
+            ScratchBufferT<T> packedA;
+            ScratchBufferT<T> packedB;
+            MatrixKernels::gemm(operands.opA, operands.opB, rowEnd - rowBegin, columnEnd - columnBegin, operands.depth(), operands.alpha,
+                                operands.a(rowBegin, 0), operands.A->stride(),
+                                operands.b(0, columnBegin), operands.B->stride(),
+                                c, resultMaxtrix->stride(), config.blockSizes, ElementKernels<T>::table(config.isa), packedA.buffer(), packedB.buffer(), stats);
         }
 
         /**
-         * Mutliply two matrices. Return the result.
+         * Do a matrix multiplication using threads.  The result is split into 2D
+         * tiles, several per thread.  The tiles are run on the thread pool with work
+         * stealing, so the load stays balanced for odd shapes and short, wide results
+         * use all the threads.  No threads are created or joined here.
          * 
-         * It is assumed that the matrices are the correct size to allow multiplication
-         * to be done.  This will not check the sizes.  The error checking of the
+         * It is assumed that the matrix are the correct size to allow multiplication
+         * to be done.  This will not check the sizes.  There error checking of the
          * 2 matrices should be done before calling this method.
          * 
-         * :param m1: First matrix to multiply.
-         * :param m2: Second matrix to multiply.
-         * :param m1Rows: Number of rows in the first matrix.
-         * :param m1Columns: Number of columns in the first matrix and the number of rows in the second matrix.
-         * :param m2Columsn: Number of columns in the second matrix.
-         * :return: Solution the multiplication of the 2 matrices.
+         * :param operands: The matrices, how they are read and the factors.
+         * :param resultMaxtrix: C, already the size of the result.
+         * :param config: Number of threads, block sizes and kernels to use.
+         * :param stats: Stats of the call, or null.
          */ 
-        double** matrixMultiply2D(double** m1, double** m2, int m1Rows, int m1Columns, int m2Columns)
+        template<typename T>
+        void matrixMultiplyThread(const GemmOperandsT<T>& operands, MatrixT<T>& resultMaxtrix, const TuningConfig& config, CallStats* stats)
         {
-            // Initialize the result
-            MatrixCommon mc;
-            double** resultMaxtrix = mc.create2DEmptyMatrix(m1Rows, m2Columns);
+            const int numThreads = config.numThreads;
+
+            // Tiles start at one cache block and are split until there are
+            // several per thread
+            TileGrid grid(operands.rows(), operands.columns(), config.blockSizes.mc, config.blockSizes.nc, 32, 64, 4 * numThreads);
+
+            runTasks(grid.count(), numThreads, stats, [&](int tile, ThreadStats* thread)
+            {
+                int rowBegin, rowEnd, columnBegin, columnEnd;
+                grid.tile(tile, rowBegin, rowEnd, columnBegin, columnEnd);
+                multiplyThreadWorker(&resultMaxtrix, operands, config, rowBegin, rowEnd, columnBegin, columnEnd, thread);
+            });
+        }
+
+        /**
+         * Do a matrix multiplication by splitting the shared dimension (K) between
+         * the threads.  Each slice of K computes a full size partial result in its own
+         * buffer, so no locks are needed.  The partial results are then added together
+         * in parallel.  The slices are added in order, so the result does not depend
+         * on which thread ran which slice.
+         * 
+         * This is used when the result is small and the shared dimension is long,
+         * where splitting the result gives most of the work to one thread.
+         * 
+         * :param operands: The matrices, how they are read and the factors.
+         * :param resultMaxtrix: C, already the size of the result.
+         * :param config: Number of threads, block sizes and kernels to use.
+         * :param stats: Stats of the call, or null.
+         */ 
+        template<typename T>
+        void matrixMultiplySplitK(const GemmOperandsT<T>& operands, MatrixT<T>& resultMaxtrix, const TuningConfig& config, CallStats* stats)
+        {
+            const int numThreads = config.numThreads;
+            const int m1Rows = operands.rows();
+            const int m1Columns = operands.depth();
+            const int m2Columns = operands.columns();
+
+            // Slices are whole cache blocks of K, a few per thread to balance the load
+            const int kc = config.blockSizes.kc;
+            const int numBlocks = (m1Columns + kc - 1) / kc;
+            const int numSlices = min(numBlocks, 4 * numThreads);
 
-        #ifdef TIMING
-            // Used to Time the transpose process
-            auto start = high_resolution_clock::now(); 
-        #endif
+            // The partial results follow each other in one scratch buffer, reused by the next call
+            const int partialStride = MatrixT<T>::paddedStride(m2Columns);
+            const size_t partialSize = (size_t)m1Rows * partialStride;
+            ScratchBufferT<T> partialBuffer;
+            T* partials;
+            {
+                PhaseTimer timer(stats != nullptr ? &stats->phaseSeconds[PHASE_ALLOCATE] : nullptr);
+                partials = partialBuffer.buffer().reserve(partialSize * numSlices);
+            }
 
-            // Preform the matrix multiplication
-            for(int i = 0; i < m1Rows; i++)
+            // Partial products over the slices of K
+            runTasks(numSlices, numThreads, stats, [&](int slice, ThreadStats* thread)
             {
-                for(int j = 0; j < m2Columns; j++)
+                int kBegin = (int)((long long)numBlocks * slice / numSlices) * kc;
+                int kEnd = min((int)((long long)numBlocks * (slice + 1) / numSlices) * kc, m1Columns);
+
+                T* partial = partials + partialSize * slice;
                 {
-                    for(int k = 0; k < m1Columns; k++)
-                    {
-                        resultMaxtrix[i][j] += m1[i][k] * m2[k][j];
-                    }
+                    PhaseTimer timer(thread != nullptr ? &thread->computeSeconds : nullptr);
+                    MatrixKernels::scale(m1Rows, m2Columns, T(), partial, partialStride);
                 }
-            }
 
-        #ifdef TIMING
-            // Used to calculate the transpose time
-            auto stop = high_resolution_clock::now();
-            auto duration = duration_cast<microseconds>(stop - start); 
-            cout << "Matrix Multiply Duration: " <<  duration.count() << " microseconds" << endl; 
-        #endif
+                ScratchBufferT<T> packedA;
+                ScratchBufferT<T> packedB;
+                MatrixKernels::gemm(operands.opA, operands.opB, m1Rows, m2Columns, kEnd - kBegin, operands.alpha,
+                                    operands.a(0, kBegin), operands.A->stride(),
+                                    operands.b(kBegin, 0), operands.B->stride(),
+                                    partial, partialStride, config.blockSizes, ElementKernels<T>::table(config.isa), packedA.buffer(), packedB.buffer(), thread);
+            });
 
-            // Return the result
-            return resultMaxtrix;
+            // Scale C and add the partial results in slice order, split over the rows and columns
+            TileGrid grid(m1Rows, m2Columns, 64, 1024, 1, 256, 4 * numThreads);
+            runTasks(grid.count(), numThreads, stats, [&](int tile, ThreadStats* thread)
+            {
+                PhaseTimer timer(thread != nullptr ? &thread->computeSeconds : nullptr);
+
+                int rowBegin, rowEnd, columnBegin, columnEnd;
+                grid.tile(tile, rowBegin, rowEnd, columnBegin, columnEnd);
+                MatrixKernels::scale(rowEnd - rowBegin, columnEnd - columnBegin, operands.beta, resultMaxtrix.row(rowBegin) + columnBegin, resultMaxtrix.stride());
+
+                for(int m = rowBegin; m < rowEnd; m++)
+                {
+                    T* c = resultMaxtrix.row(m);
+                    for(int slice = 0; slice < numSlices; slice++)
+                    {
+                        const T* p = partials + partialSize * slice + (size_t)m * partialStride;
+                        for(int n = columnBegin; n < columnEnd; n++)
+                        {
+                            c[n] += p[n];
+                        }
+                    }
+                }
+            });
         }
 
         /**
-         * The thread worker that does the actual work in the thread.  This will multiply a small
-         * portion of the 2 matrices given and set them in the result matrix.  
+         * Do a matrix-vector multiply, for a result with 1 column or 1 row.  The blocked
+         * multiply would pack panels of a vector that are mostly padding, and the tiles
+         * of a single column split badly between the threads.  Here every element of the
+         * matrix is read once, either by the dot product of its row (gemvDot) or by an
+         * axpy into a short range of the result (gemvAxpy), so the multiply runs at the
+         * speed of memory.
          * 
-         * Based on the input, this will determine which thread it is to know which section it needs
-         * to calculate.
+         * The result is split into ranges, several per thread.  When there are not
+         * enough ranges for the threads, like a dot product of two long vectors, the
+         * shared dimension is split too.  The partial results are then added in slice
+         * order like the split-K multiply, so the result does not depend on the threads.
          * 
-         * :param resultMatrix: The matrix to set the results.
-         * :param m1: First matrix to multiply.
-         * :param m2: Second matrix to multiply.
-         * :param m1Rows: Number of rows in the first matrix.
-         * :param m1Columns: Number of columns in the first matrix and number of rows in the second column.
-         * :param m2Columns: Number of columns in the second matrix.
-         * :param numThreads: Number of threads used to do the calculations.
-         * :param threadIndex: The index of the thread to know which chunck to work on.
+         * :param operands: The matrices, how they are read and the factors.
+         * :param resultMaxtrix: C, already the size of the result.
+         * :param config: Number of threads and kernels to use.
+         * :param stats: Stats of the call, or null.
          */ 
-        static void multiplyThreadWorker(double** resultMaxtrix, double** m1, double** m2, int m1Rows, int m1Columns, int m2Columns, int numThreads, int threadIndex)
+        template<typename T>
+        void matrixMultiplyVector(const GemmOperandsT<T>& operands, MatrixT<T>& resultMaxtrix, const TuningConfig& config, CallStats* stats)
         {
+            const int K = operands.depth();
+            const T alpha = operands.alpha;
+            const T beta = operands.beta;
 
-            // Calculate how many elements will be done for each thread
-            int elementsPerThread = m1Rows / numThreads;
+            // y = alpha * matrix * x.  With dot, row m of the matrix gives y[m].  Otherwise
+            // y is the sum of row k of the matrix times x[k].
+            const MatrixT<T>* matrix;
+            bool dot;
+            const T* x;
+            int incx;
+            int length;
+            int incy;
+            if(operands.columns() == 1)
+            {
+                matrix = operands.A;
+                dot = operands.opA == OP_NO_TRANSPOSE;
+                x = operands.b(0, 0);
+                incx = operands.opB == OP_TRANSPOSE ? 1 : operands.B->stride();
+                length = operands.rows();
+                incy = resultMaxtrix.stride();
+            }
+            else
+            {
+                matrix = operands.B;
+                dot = operands.opB == OP_TRANSPOSE;
+                x = operands.a(0, 0);
+                incx = operands.opA == OP_TRANSPOSE ? operands.A->stride() : 1;
+                length = operands.columns();
+                incy = 1;
+            }
+            T* y = resultMaxtrix.data();
 
-            // Because we are dividing, we may have a remainder
-            // Account for the remainder
-            int remainder = m1Rows % numThreads;
-            
-            // If we have a remainder, we need to make one of the thread do more work
-            // Use the first thread since it will be running the longest because
-            // int starts before the rest of the threads
-            int start, end;
-            if(threadIndex == 0)
+            // A column of a matrix is copied so the kernels read it in order
+            ScratchBufferT<T> xBuffer;
+            if(incx != 1 && K > 1)
             {
-                // Where to start the thread
-                start = elementsPerThread * threadIndex;
+                PhaseTimer timer(stats != nullptr ? &stats->phaseSeconds[PHASE_PACK] : nullptr);
+                T* packed = xBuffer.buffer().reserve(K);
+                for(int k = 0; k < K; k++)
+                {
+                    packed[k] = x[(size_t)k * incx];
+                }
+                x = packed;
+            }
 
-                // Where to end the thread, just after the elementsPerThread
-                // Also include the remainder in the first thread
-                end = (elementsPerThread * (threadIndex + 1)) + remainder;
+            // At least 32K elements of the matrix per task, so waking a thread pays off.
+            // The axpy ranges are whole cache lines and small enough for the L1 cache.
+            const KernelTableT<T>& kernels = ElementKernels<T>::table(config.isa);
+            const int numThreads = max(1, config.numThreads);
+            const long long work = (long long)length * max(K, 1);
+            const int numTasks = (int)max(1LL, min(4LL * numThreads, work / 32768));
+            int numRanges = max(1, min(numTasks, dot ? length : length / 64));
+            if(!dot)
+            {
+                numRanges = max(numRanges, (length + 2047) / 2048);
             }
-            else
+            const int numSlices = max(1, min(K, numTasks / numRanges));
+            auto rangeBound = [&](int range)
+            {
+                if(range == numRanges)
+                {
+                    return length;
+                }
+                const int bound = (int)((long long)length * range / numRanges);
+                return dot ? bound : bound - bound % 16;
+            };
+
+            if(numSlices == 1 && (dot || incy == 1))
             {
-                // Where to start in this thread
-                // Take into acount the remainder that the first thread did
-                start = elementsPerThread * threadIndex; + remainder;
+                runTasks(numRanges, numThreads, stats, [&](int range, ThreadStats* thread)
+                {
+                    PhaseTimer timer(thread != nullptr ? &thread->computeSeconds : nullptr);
+                    const int begin = rangeBound(range);
+                    const int end = rangeBound(range + 1);
+                    if(dot)
+                    {
+                        MatrixKernels::gemvDot(end - begin, K, alpha, matrix->row(begin), matrix->stride(), x, beta, y + (size_t)begin * incy, incy, kernels);
+                    }
+                    else
+                    {
+                        MatrixKernels::gemvAxpy(K, end - begin, alpha, x, matrix->data() + begin, matrix->stride(), beta, y + begin, kernels);
+                    }
+                });
+                return;
+            }
 
-                // Where to end this thread
-                end = (elementsPerThread * (threadIndex + 1)) + remainder;
+            // The partial results of the slices follow each other in one scratch buffer
+            ScratchBufferT<T> partialBuffer;
+            T* partials;
+            {
+                PhaseTimer timer(stats != nullptr ? &stats->phaseSeconds[PHASE_ALLOCATE] : nullptr);
+                partials = partialBuffer.buffer().reserve((size_t)length * numSlices);
             }
 
-            // Go through and do the multiplcation based on the
-            // batch size calculated for the thread
-            for(int i = start; i < end; i++)
+            runTasks(numRanges * numSlices, numThreads, stats, [&](int task, ThreadStats* thread)
             {
-                for(int j = 0; j < m2Columns; j++)
+                PhaseTimer timer(thread != nullptr ? &thread->computeSeconds : nullptr);
+                const int begin = rangeBound(task / numSlices);
+                const int end = rangeBound(task / numSlices + 1);
+                const int slice = task % numSlices;
+                const int kBegin = (int)((long long)K * slice / numSlices);
+                const int kEnd = (int)((long long)K * (slice + 1) / numSlices);
+                T* partial = partials + (size_t)slice * length + begin;
+                if(dot)
                 {
-                    for(int k = 0; k < m1Columns; k++)
+                    MatrixKernels::gemvDot(end - begin, kEnd - kBegin, alpha, matrix->row(begin) + kBegin, matrix->stride(), x + kBegin, T(), partial, 1, kernels);
+                }
+                else
+                {
+                    MatrixKernels::gemvAxpy(kEnd - kBegin, end - begin, alpha, x + kBegin, matrix->row(kBegin) + begin, matrix->stride(), T(), partial, kernels);
+                }
+            });
+
+            // Scale y and add the partial results in slice order
+            runTasks(numRanges, numThreads, stats, [&](int range, ThreadStats* thread)
+            {
+                PhaseTimer timer(thread != nullptr ? &thread->computeSeconds : nullptr);
+                for(int i = rangeBound(range); i < rangeBound(range + 1); i++)
+                {
+                    T& out = y[(size_t)i * incy];
+                    T sum = beta == T() ? T() : beta * out;
+                    for(int slice = 0; slice < numSlices; slice++)
                     {
-                        resultMaxtrix[i][j] += m1[i][k] * m2[k][j];
+                        sum += partials[(size_t)slice * length + i];
                     }
+                    out = sum;
                 }
-            }
+            });
         }
 
         /**
-         * Do a matrix multiplication using threads.  This will breakup the
-         * multiplication steps in parts based on the number of threads that
-         * are given to use.  Typically 4-5 threads will help for very large matrix.
-         * Using any threads will be slower if used for smaller matrices.  The overhead
-         * in creating the threads and joining will be longer then the calculation.
-         * 
-         * It is assumed that the matrix are the correct size to allow multiplication
-         * to be done.  This will not check the sizes.  There error checking of the
-         * 2 matrices should be done before calling this method.
-         * 
-         * :param m1: First matrix to multiply.
-         * :param m2: Second matrix to multiply.
-         * :param m1Rows: Number of rows in first matrix.
-         * :param m1Columns: Number of columns in first matrix and number of rows in second matrix.
-         * :param m2Columns: Number of columns in the second matrix.
-         * :param numThreads: Number of threads to use to do the calculation. Look above for suggested sizes.
-         * :return: The solution to multiplying the two matrices.
-         * 
+         * Check if the Strassen-Winograd multiply should be used.  It has to be turned
+         * on with setStrassenCrossover() and every side has to be longer than the
+         * crossover.  Integer types always use the classic multiply, since the block
+         * sums of Strassen can overflow where the classic products do not.
+         */
+        template<typename T>
+        bool useStrassen(int m1Rows, int m1Columns, int m2Columns) const
+        {
+            return mStrassenCrossover > 0 && !is_integral<T>::value &&
+                   m1Rows > mStrassenCrossover && m1Columns > mStrassenCrossover && m2Columns > mStrassenCrossover;
+        }
+
+        /**
+         * Do a matrix multiplication with Strassen-Winograd, see StrassenKernels.  The
+         * 7 products of the first step run on the thread pool, the steps below run on
+         * the thread of their product.  A transposed operand is copied first, and the
+         * product goes through a temporary matrix when alpha or beta need it.
          * 
+         * :param operands: The matrices, how they are read and the factors.
+         * :param resultMaxtrix: C, already the size of the result.
+         * :param config: Number of threads, block sizes and kernels to use.
+         * :param stats: Stats of the call, or null.
          */ 
-        double** matrixMultiplyThread(double** m1, double** m2, int m1Rows, int m1Columns, int m2Columns, int numThreads)
+        template<typename T>
+        void matrixMultiplyStrassen(const GemmOperandsT<T>& operands, MatrixT<T>& resultMaxtrix, const TuningConfig& config, CallStats* stats)
         {
-            // Initialize a thread for the results
-            MatrixCommon mc;
-            double** resultMaxtrix = mc.create2DEmptyMatrix(m1Rows, m2Columns);
+            const int M = operands.rows();
+            const int N = operands.columns();
+            const int K = operands.depth();
 
-        #ifdef TIMING
-            // Used to Time the transpose process
-            auto start = high_resolution_clock::now(); 
-        #endif
-
-            // Create an array to hold all the threads
-            // A thread will be created based on the input
-            thread threadHolder[numThreads];
+            MatrixT<T> aCopy, bCopy, product;
+            {
+                PhaseTimer timer(stats != nullptr ? &stats->phaseSeconds[PHASE_PACK] : nullptr);
+                if(operands.opA == OP_TRANSPOSE)
+                {
+                    aCopy = MatrixT<T>(M, K);
+                    MatrixKernels::transpose(K, M, operands.A->data(), operands.A->stride(), aCopy.data(), aCopy.stride());
+                }
+                if(operands.opB == OP_TRANSPOSE)
+                {
+                    bCopy = MatrixT<T>(K, N);
+                    MatrixKernels::transpose(N, K, operands.B->data(), operands.B->stride(), bCopy.data(), bCopy.stride());
+                }
+            }
+            const MatrixT<T>& a = operands.opA == OP_TRANSPOSE ? aCopy : *operands.A;
+            const MatrixT<T>& b = operands.opB == OP_TRANSPOSE ? bCopy : *operands.B;
 
-            // Create a thread and breakup the matrix calculations
-            for(int threadCtr = 0; threadCtr < numThreads; threadCtr++)
+            // The product goes straight into C unless the old values of C are needed
+            const bool direct = operands.beta == T();
+            if(!direct)
             {
-                // Create a thread to transpose this row
-                threadHolder[threadCtr] = thread(multiplyThreadWorker, resultMaxtrix, m1, m2, m1Rows, m1Columns, m2Columns, numThreads, threadCtr);
+                PhaseTimer timer(stats != nullptr ? &stats->phaseSeconds[PHASE_ALLOCATE] : nullptr);
+                product = MatrixT<T>(M, N);
             }
+            MatrixT<T>& target = direct ? resultMaxtrix : product;
+
+            PoolRunner run = { this, config.numThreads, stats };
+            StrassenKernels::multiply(M, N, K, a.data(), a.stride(), b.data(), b.stride(), target.data(), target.stride(), mStrassenCrossover,
+                                      config.blockSizes, ElementKernels<T>::table(config.isa), run);
 
-            // Wait for all the threads to complete
-            for(int x = 0; x < numThreads; x++)
+            if(direct && operands.alpha == T(1))
             {
-                threadHolder[x].join();
+                return;
             }
 
-        #ifdef TIMING
-            // Used to calculate the transpose time
-            auto stop = high_resolution_clock::now();
-            auto duration = duration_cast<microseconds>(stop - start); 
-            cout << "Matrix Multiply " << numThreads <<  " Thread Duration: " <<  duration.count() << " microseconds" << endl; 
-        #endif
+            // C = alpha * product + beta * C, split over the rows
+            TileGrid grid(M, N, 64, N, 1, N, 4 * config.numThreads);
+            runTasks(grid.count(), config.numThreads, stats, [&](int tile, ThreadStats* thread)
+            {
+                PhaseTimer timer(thread != nullptr ? &thread->computeSeconds : nullptr);
 
-            return resultMaxtrix;
+                int rowBegin, rowEnd, columnBegin, columnEnd;
+                grid.tile(tile, rowBegin, rowEnd, columnBegin, columnEnd);
+                for(int m = rowBegin; m < rowEnd; m++)
+                {
+                    T* c = resultMaxtrix.row(m);
+                    const T* p = target.row(m);
+                    for(int n = 0; n < N; n++)
+                    {
+                        c[n] = direct ? operands.alpha * c[n] : operands.alpha * p[n] + operands.beta * c[n];
+                    }
+                }
+            });
         }
 
-    public:
         /**
-         * Transpose the matrix.
-         * 
-         * Based on the number of threads, determine which is the best method
-         * to use.  When the matrix is small or only 1 thread is needed, 
-         * then do not use any threading.  It will be faster since you will not
-         * have to create a thread and wait for it to complete.
+         * Run the multiply with a config.  Picks the vector, serial, split-K or tiled
+         * threaded multiply.  If C is not the size of the result, it is replaced
+         * by a new matrix of zeros.
          * 
-         * :param origMatrix: Original matrix to transpose.
-         * :param rows: Number of rows in the original matrix.
-         * :param columns: Number of columns in the original matrix.
-         * :param numThreads: Number of threads to use.
-         * :return: Transposed matrix.
+         * :param operands: The matrices, how they are read and the factors.
+         * :param resultMaxtrix: C.
+         * :param config: Number of threads, block sizes and kernels to use.
+         * :param stats: Stats of the call, or null.
          */ 
-        double** transpose(double** origMatrix, int rows, int columns, int numThreads)
+        template<typename T>
+        void runMultiply(const GemmOperandsT<T>& operands, MatrixT<T>& resultMaxtrix, const TuningConfig& config, CallStats* stats)
         {
-            if(numThreads <= 1)
+            GemmOperandsT<T> scaled = operands;
+            if(resultMaxtrix.rows() != operands.rows() || resultMaxtrix.columns() != operands.columns())
+            {
+                PhaseTimer timer(stats != nullptr ? &stats->phaseSeconds[PHASE_ALLOCATE] : nullptr);
+                resultMaxtrix = MatrixT<T>(operands.rows(), operands.columns(), MATRIX_UNINITIALIZED);
+
+                // Each tile of a new matrix is zeroed by the thread that computes it,
+                // so the pages are placed on the NUMA node of that thread
+                scaled.beta = T();
+            }
+
+            if(scaled.rows() == 1 || scaled.columns() == 1)
+            {
+                // Matrix-vector or vector-matrix product
+                matrixMultiplyVector(scaled, resultMaxtrix, config, stats);
+            }
+            else if(useStrassen<T>(scaled.rows(), scaled.depth(), scaled.columns()))
+            {
+                // Large enough for the fast multiply, which was asked for
+                matrixMultiplyStrassen(scaled, resultMaxtrix, config, stats);
+            }
+            else if(config.numThreads <= 1)
             {
                 // No threads used
-                return transpose2D(origMatrix, rows, columns);
+                matrixMultiply2D(scaled, resultMaxtrix, config, stats);
+            }
+            else if(useSplitK(scaled.rows(), scaled.depth(), scaled.columns(), config.numThreads, config.blockSizes))
+            {
+                // Small result with a long shared dimension
+                matrixMultiplySplitK(scaled, resultMaxtrix, config, stats);
             }
             else
             {
                 // Use the given number of threads
-                return transpose2DThreadN(origMatrix, rows, columns, numThreads);
+                matrixMultiplyThread(scaled, resultMaxtrix, config, stats);
             }
         }
 
         /**
-         * Matrix Multiplication.  
-         * 
-         * Based on the number of threads, determine which is the best method
-         * to use.  When the matrix is small or only 1 thread is needed, 
-         * then do not use any threading.  It will be faster since you will not
-         * have to create a thread and wait for it to complete.
-         * 
-         * It is assumed that the matrix are the correct size to allow multiplication
-         * to be done.  This will not check the sizes.  There error checking of the
-         * 2 matrices should be done before calling this method.
+         * Run the multiply of two matrices into a new matrix.
+         */
+        template<typename T>
+        MatrixT<T> runMultiply(const MatrixT<T>& m1, const MatrixT<T>& m2, const TuningConfig& config, CallStats* stats)
+        {
+            GemmOperandsT<T> operands = { OP_NO_TRANSPOSE, OP_NO_TRANSPOSE, T(1), &m1, &m2, T() };
+            MatrixT<T> resultMaxtrix;
+            runMultiply(operands, resultMaxtrix, config, stats);
+            return resultMaxtrix;
+        }
+
+        /**
+         * Pack a matrix for the active kernels and the block sizes set on this object.
+         * See packMatrix().
+         */
+        template<typename T>
+        PackedMatrixT<T> runPack(const MatrixT<T>& matrix, MatrixOp op, CallStats* stats)
+        {
+            ThreadStats* thread = stats != nullptr ? stats->beginThreads(1) : nullptr;
+            PhaseTimer busy(thread != nullptr ? &thread->busySeconds : nullptr);
+            const double start = statsNow();
+
+            const KernelTableT<T>& kernels = ElementKernels<T>::active();
+            const int rows = op == OP_TRANSPOSE ? matrix.columns() : matrix.rows();
+            const int columns = op == OP_TRANSPOSE ? matrix.rows() : matrix.columns();
+            const int nc = MatrixKernels::roundUp(max(1, min(mBlockSizes.nc, columns)), kernels.nr);
+
+            PackedMatrixT<T> packed;
+            {
+                PhaseTimer timer(thread != nullptr ? &thread->allocateSeconds : nullptr);
+                packed = PackedMatrixT<T>(rows, columns, mBlockSizes.kc, nc, kernels.nr, kernels.isa);
+            }
+            {
+                PhaseTimer timer(thread != nullptr ? &thread->packSeconds : nullptr);
+                MatrixKernels::packMatrix(op, matrix.data(), matrix.stride(), packed);
+            }
+            if(thread != nullptr)
+            {
+                thread->bytesPacked += packed.bytes();
+            }
+
+            packed.setPackSeconds(statsNow() - start);
+            return packed;
+        }
+
+        /**
+         * Run a multiply by a packed matrix with a config.  result = alpha * op(m1) * m2 + beta * result.
+         * The result is split into 2D tiles like matrixMultiplyThread().  The columns
+         * of the tiles are whole panels of m2.  The split-K multiply is not used, since
+         * the blocks of m2 were packed with their own kc.
          * 
+         * :param op1: How m1 is read.
+         * :param alpha: Factor of the product.
          * :param m1: First matrix to multiply.
-         * :param m2: Second matrix to multiply.
-         * :param m1Rows: Number of rows in first matrix.
-         * :param m1Columns: Number of columns in first matrix and number of rows in second matrix.
-         * :param m2Columns: Number of columns in the second matrix.
-         * :param numThreads: Number of threads to use to do the calculation. Look above for suggested sizes.
-         * :return: The solution to multiplying the two matrices.
+         * :param m2: The packed second matrix.
+         * :param beta: Factor of the old values of result.
+         * :param resultMaxtrix: C.  If it is not the size of the result, it is replaced
+         *                       by a new matrix of zeros.
+         * :param config: Number of threads and the mc block size to use.  The other
+         *                block sizes and the kernels are the ones m2 was packed for.
+         * :param stats: Stats of the call, or null.
          */ 
-        double** matrixMultiply(double** m1, double** m2, int m1Rows, int m1Columns, int m2Columns, int numThreads)
+        template<typename T>
+        void runPackedMultiply(MatrixOp op1, T alpha, const MatrixT<T>& m1, const PackedMatrixT<T>& m2, T beta, MatrixT<T>& resultMaxtrix,
+                               const TuningConfig& config, CallStats* stats)
         {
-            if(numThreads <= 1)
+            const int m1Rows = op1 == OP_TRANSPOSE ? m1.columns() : m1.rows();
+            const int m2Columns = m2.columns();
+            if(resultMaxtrix.rows() != m1Rows || resultMaxtrix.columns() != m2Columns)
             {
-                // No threads used
-                return matrixMultiply2D(m1, m2, m1Rows, m1Columns, m2Columns);
+                PhaseTimer timer(stats != nullptr ? &stats->phaseSeconds[PHASE_ALLOCATE] : nullptr);
+                resultMaxtrix = MatrixT<T>(m1Rows, m2Columns, MATRIX_UNINITIALIZED);
+
+                // Each tile of a new matrix is zeroed by the thread that computes it
+                beta = T();
             }
-            else
+
+            auto worker = [&](int rowBegin, int rowEnd, int columnBegin, int columnEnd, ThreadStats* thread)
             {
-                // Use the given number of threads
-                return matrixMultiplyThread(m1, m2, m1Rows, m1Columns, m2Columns, numThreads);
+                T* c = resultMaxtrix.row(rowBegin) + columnBegin;
+                {
+                    PhaseTimer timer(thread != nullptr ? &thread->computeSeconds : nullptr);
+                    MatrixKernels::scale(rowEnd - rowBegin, columnEnd - columnBegin, beta, c, resultMaxtrix.stride());
+                }
+
+                ScratchBufferT<T> packedA;
+                const T* a = op1 == OP_TRANSPOSE ? m1.data() + rowBegin : m1.row(rowBegin);
+                MatrixKernels::gemm(op1, rowEnd - rowBegin, columnEnd - columnBegin, alpha, a, m1.stride(), m2, columnBegin,
+                                    c, resultMaxtrix.stride(), config.blockSizes.mc, packedA.buffer(), thread);
+            };
+
+            if(config.numThreads <= 1)
+            {
+                ThreadStats* thread = stats != nullptr ? stats->beginThreads(1) : nullptr;
+                PhaseTimer busy(thread != nullptr ? &thread->busySeconds : nullptr);
+                worker(0, m1Rows, 0, m2Columns, thread);
+                return;
+            }
+
+            TileGrid grid(m1Rows, m2Columns, config.blockSizes.mc, m2.nc(), 32, MatrixKernels::roundUp(64, m2.nr()), 4 * config.numThreads);
+            runTasks(grid.count(), config.numThreads, stats, [&](int tile, ThreadStats* thread)
+            {
+                int rowBegin, rowEnd, columnBegin, columnEnd;
+                grid.tile(tile, rowBegin, rowEnd, columnBegin, columnEnd);
+                worker(rowBegin, rowEnd, columnBegin, columnEnd, thread);
+            });
+        }
+
+        /**
+         * Run a multiply by a packed matrix and tell the observer, if there is one.
+         */
+        template<typename T>
+        void packedMultiplyWithConfig(MatrixOp op1, T alpha, const MatrixT<T>& m1, const PackedMatrixT<T>& m2, T beta, MatrixT<T>& resultMaxtrix,
+                                      const TuningConfig& config)
+        {
+            if(!mObserver)
+            {
+                runPackedMultiply(op1, alpha, m1, m2, beta, resultMaxtrix, config, nullptr);
+                return;
+            }
+
+            const int m1Rows = op1 == OP_TRANSPOSE ? m1.columns() : m1.rows();
+            const uint64_t resultSize = (uint64_t)m1Rows * m2.columns();
+            CallStats stats("multiplyPacked", m1Rows, m2.columns(), m2.rows(), config.numThreads);
+            stats.bytesRead = (uint64_t)m1.rows() * m1.columns() * sizeof(T) + m2.bytes();
+            if(!(beta == T()) && resultMaxtrix.rows() == m1Rows && resultMaxtrix.columns() == m2.columns())
+            {
+                stats.bytesRead += resultSize * sizeof(T);
+            }
+            stats.bytesWritten = resultSize * sizeof(T);
+
+            CallRecorder recorder(*mObserver, stats);
+            runPackedMultiply(op1, alpha, m1, m2, beta, resultMaxtrix, config, &stats);
+            recorder.finish();
+        }
+
+        /**
+         * C = A * B with A and B stored in a narrow type S and the sums in T.  The
+         * result is split into 2D tiles like matrixMultiplyThread().  Each value of A
+         * and B is converted to T once, when its block is packed, so the micro-kernel
+         * of T runs unchanged and the narrow values are what is read from memory.
+         * 
+         * :param m1: First matrix to multiply.
+         * :param m2: Second matrix.  It must have m1.columns() rows.
+         * :param resultMaxtrix: C.  If it is not the size of the result, it is replaced
+         *                       by a new matrix.  It is overwritten.
+         * :param config: Number of threads, block sizes and kernels to use.
+         * :param stats: Stats of the call, or null.
+         */ 
+        template<typename T, typename S>
+        void runMixedMultiply(const MatrixT<S>& m1, const MatrixT<S>& m2, MatrixT<T>& resultMaxtrix, const TuningConfig& config, CallStats* stats)
+        {
+            if(resultMaxtrix.rows() != m1.rows() || resultMaxtrix.columns() != m2.columns())
+            {
+                PhaseTimer timer(stats != nullptr ? &stats->phaseSeconds[PHASE_ALLOCATE] : nullptr);
+                resultMaxtrix = MatrixT<T>(m1.rows(), m2.columns(), MATRIX_UNINITIALIZED);
             }
+
+            auto worker = [&](int rowBegin, int rowEnd, int columnBegin, int columnEnd, ThreadStats* thread)
+            {
+                T* c = resultMaxtrix.row(rowBegin) + columnBegin;
+                {
+                    PhaseTimer timer(thread != nullptr ? &thread->computeSeconds : nullptr);
+                    MatrixKernels::scale(rowEnd - rowBegin, columnEnd - columnBegin, T(), c, resultMaxtrix.stride());
+                }
+
+                ScratchBufferT<T> packedA;
+                ScratchBufferT<T> packedB;
+                MatrixKernels::gemm(OP_NO_TRANSPOSE, OP_NO_TRANSPOSE, rowEnd - rowBegin, columnEnd - columnBegin, m1.columns(), T(1),
+                                    m1.row(rowBegin), m1.stride(), m2.data() + columnBegin, m2.stride(),
+                                    c, resultMaxtrix.stride(), config.blockSizes, ElementKernels<T>::table(config.isa), packedA.buffer(), packedB.buffer(), thread);
+            };
+            runTiles(m1.rows(), m2.columns(), config, stats, worker);
         }
+
+        /**
+         * C = A * B with A quantized per row and B per column.  The int8 values are
+         * multiplied into int32 sums for a tile at a time, which are then scaled by the
+         * scale of their row of A and column of B into C.  A long shared dimension is
+         * done in pieces of QUANTIZED_MAX_DEPTH, so the int32 sums can not overflow.
+         * 
+         * :param m1: First matrix, quantized per row.
+         * :param m2: Second matrix, quantized per column.  It must have m1.columns() rows.
+         * :param resultMaxtrix: C.  If it is not the size of the result, it is replaced
+         *                       by a new matrix.  It is overwritten.
+         * :param config: Number of threads, block sizes and kernels to use.
+         * :param stats: Stats of the call, or null.
+         */ 
+        void runQuantizedMultiply(const QuantizedMatrix& m1, const QuantizedMatrix& m2, MatrixT<float>& resultMaxtrix, const TuningConfig& config, CallStats* stats)
+        {
+            if(resultMaxtrix.rows() != m1.rows() || resultMaxtrix.columns() != m2.columns())
+            {
+                PhaseTimer timer(stats != nullptr ? &stats->phaseSeconds[PHASE_ALLOCATE] : nullptr);
+                resultMaxtrix = MatrixT<float>(m1.rows(), m2.columns(), MATRIX_UNINITIALIZED);
+            }
+
+            const int K = m1.columns();
+            const MatrixT<int8_t>& a = m1.values();
+            const MatrixT<int8_t>& b = m2.values();
+            auto worker = [&](int rowBegin, int rowEnd, int columnBegin, int columnEnd, ThreadStats* thread)
+            {
+                const int M = rowEnd - rowBegin;
+                const int N = columnEnd - columnBegin;
+                ScratchBufferT<int32_t> sums;
+                ScratchBufferT<int32_t> packedA;
+                ScratchBufferT<int32_t> packedB;
+                int32_t* s;
+                {
+                    PhaseTimer timer(thread != nullptr ? &thread->allocateSeconds : nullptr);
+                    s = sums.buffer().reserve((size_t)M * N);
+                }
+
+                for(int pc = 0; pc < K || pc == 0; pc += QUANTIZED_MAX_DEPTH)
+                {
+                    const int kcCur = min(QUANTIZED_MAX_DEPTH, K - pc);
+                    {
+                        PhaseTimer timer(thread != nullptr ? &thread->computeSeconds : nullptr);
+                        MatrixKernels::scale(M, N, int32_t(), s, N);
+                    }
+                    MatrixKernels::gemm(OP_NO_TRANSPOSE, OP_NO_TRANSPOSE, M, N, kcCur, int32_t(1), a.row(rowBegin) + pc, a.stride(),
+                                        b.row(pc) + columnBegin, b.stride(), s, N, config.blockSizes, ElementKernels<int32_t>::table(config.isa),
+                                        packedA.buffer(), packedB.buffer(), thread);
+
+                    PhaseTimer timer(thread != nullptr ? &thread->computeSeconds : nullptr);
+                    const float* columnScales = m2.scales().data() + columnBegin;
+                    for(int m = 0; m < M; m++)
+                    {
+                        const float rowScale = m1.scales()[rowBegin + m];
+                        const int32_t* sum = s + (size_t)m * N;
+                        float* c = resultMaxtrix.row(rowBegin + m) + columnBegin;
+                        for(int n = 0; n < N; n++)
+                        {
+                            const float value = (float)sum[n] * (rowScale * columnScales[n]);
+                            c[n] = pc == 0 ? value : c[n] + value;
+                        }
+                    }
+                }
+            };
+            runTiles(m1.rows(), m2.columns(), config, stats, worker);
+        }
+
+        /**
+         * Split a rows x columns result into 2D tiles like matrixMultiplyThread() and
+         * run worker(rowBegin, rowEnd, columnBegin, columnEnd, thread) on each.  With
+         * 1 thread the whole result is one tile.
+         */
+        template<typename Worker>
+        void runTiles(int rows, int columns, const TuningConfig& config, CallStats* stats, const Worker& worker)
+        {
+            if(config.numThreads <= 1)
+            {
+                ThreadStats* thread = stats != nullptr ? stats->beginThreads(1) : nullptr;
+                PhaseTimer busy(thread != nullptr ? &thread->busySeconds : nullptr);
+                worker(0, rows, 0, columns, thread);
+                return;
+            }
+
+            TileGrid grid(rows, columns, config.blockSizes.mc, config.blockSizes.nc, 32, 64, 4 * config.numThreads);
+            runTasks(grid.count(), config.numThreads, stats, [&](int tile, ThreadStats* thread)
+            {
+                int rowBegin, rowEnd, columnBegin, columnEnd;
+                grid.tile(tile, rowBegin, rowEnd, columnBegin, columnEnd);
+                worker(rowBegin, rowEnd, columnBegin, columnEnd, thread);
+            });
+        }
+
+        /**
+         * Run fillRow(m, row, stream) for every row of a matrix, in bands of rows like
+         * allocateMatrix(), and tell the observer, if there is one.  stream is set for
+         * a matrix of FILL_STREAM_BYTES or more.
+         */
+        template<typename T, typename RowFill>
+        void runFill(const char* name, MatrixT<T>& matrix, int numThreads, const RowFill& fillRow)
+        {
+            const int rows = matrix.rows();
+            const bool stream = matrix.sizeInBytes() >= FILL_STREAM_BYTES;
+            const int numBands = max(1, min(rows, numThreads));
+            auto run = [&](CallStats* stats)
+            {
+                runTasks(numBands, numThreads, stats, [&](int band, ThreadStats* thread)
+                {
+                    PhaseTimer timer(thread != nullptr ? &thread->computeSeconds : nullptr);
+                    const int rowBegin = (int)((long long)rows * band / numBands);
+                    const int rowEnd = (int)((long long)rows * (band + 1) / numBands);
+                    for(int m = rowBegin; m < rowEnd; m++)
+                    {
+                        fillRow(m, matrix.row(m), stream);
+                    }
+                });
+            };
+
+            if(!mObserver)
+            {
+                run(nullptr);
+                return;
+            }
+
+            CallStats stats(name, rows, matrix.columns(), 0, numThreads);
+            stats.bytesWritten = (uint64_t)rows * matrix.columns() * sizeof(T);
+
+            CallRecorder recorder(*mObserver, stats);
+            run(&stats);
+            recorder.finish();
+        }
+
+        /**
+         * C = A * B with A sparse CSR and B dense.  The rows of A are split into ranges
+         * with about the same number of nonzeros, a few per thread so a range with
+         * long rows does not hold up the others.  Every row of the result is written,
+         * so a result of the right size is reused as it is.
+         */
+        template<typename T>
+        void runSparseMultiply(const SparseMatrixT<T>& m1, const MatrixT<T>& m2, MatrixT<T>& resultMaxtrix, int numThreads, CallStats* stats)
+        {
+            if(resultMaxtrix.rows() != m1.rows() || resultMaxtrix.columns() != m2.columns())
+            {
+                PhaseTimer timer(stats != nullptr ? &stats->phaseSeconds[PHASE_ALLOCATE] : nullptr);
+                resultMaxtrix = MatrixT<T>(m1.rows(), m2.columns(), MATRIX_UNINITIALIZED);
+            }
+
+            const int numRanges = numThreads <= 1 ? 1 : min(m1.rows(), 4 * numThreads);
+            const vector<int> bounds = SparseKernels::balancedRows(m1, max(1, numRanges));
+            runTasks((int)bounds.size() - 1, numThreads, stats, [&](int range, ThreadStats* thread)
+            {
+                PhaseTimer timer(thread != nullptr ? &thread->computeSeconds : nullptr);
+                SparseKernels::multiplyDenseRows(m1, bounds[range], bounds[range + 1], m2.data(), m2.stride(), m2.columns(),
+                                                 resultMaxtrix.data(), resultMaxtrix.stride());
+            });
+        }
+
+        /**
+         * C = A * B with A and B sparse CSR.  Each range of rows is multiplied into
+         * its own arrays, since the number of nonzeros of a row is not known before it
+         * is computed.  The offsets are then summed and the ranges copied into place.
+         */
+        template<typename T>
+        SparseMatrixT<T> runSparseMultiply(const SparseMatrixT<T>& m1, const SparseMatrixT<T>& m2, int numThreads, CallStats* stats)
+        {
+            const int numRanges = max(1, numThreads <= 1 ? 1 : min(m1.rows(), 4 * numThreads));
+            const vector<int> bounds = SparseKernels::balancedRows(m1, numRanges);
+            vector<vector<size_t> > counts(numRanges);
+            vector<vector<int> > rangeIndices(numRanges);
+            vector<vector<T> > rangeValues(numRanges);
+
+            runTasks(numRanges, numThreads, stats, [&](int range, ThreadStats* thread)
+            {
+                PhaseTimer timer(thread != nullptr ? &thread->computeSeconds : nullptr);
+                SparseKernels::multiplySparseRows(m1, m2, bounds[range], bounds[range + 1], counts[range], rangeIndices[range], rangeValues[range]);
+            });
+
+            vector<size_t> offsets(m1.rows() + 1, 0);
+            vector<size_t> rangeStart(numRanges, 0);
+            for(int range = 0; range < numRanges; range++)
+            {
+                rangeStart[range] = offsets[bounds[range]];
+                for(int m = bounds[range]; m < bounds[range + 1]; m++)
+                {
+                    offsets[m + 1] = offsets[m] + counts[range][m - bounds[range]];
+                }
+            }
+
+            vector<int> indices;
+            vector<T> values;
+            {
+                PhaseTimer timer(stats != nullptr ? &stats->phaseSeconds[PHASE_ALLOCATE] : nullptr);
+                indices.resize(offsets[m1.rows()]);
+                values.resize(offsets[m1.rows()]);
+            }
+            runTasks(numRanges, numThreads, stats, [&](int range, ThreadStats* thread)
+            {
+                PhaseTimer timer(thread != nullptr ? &thread->computeSeconds : nullptr);
+                copy(rangeIndices[range].begin(), rangeIndices[range].end(), indices.begin() + rangeStart[range]);
+                copy(rangeValues[range].begin(), rangeValues[range].end(), values.begin() + rangeStart[range]);
+            });
+            return SparseMatrixT<T>(m1.rows(), m2.columns(), SPARSE_CSR, move(offsets), move(indices), move(values));
+        }
+
+        /**
+         * Number of threads for a sparse multiply doing about work multiply-adds.
+         * The same work per thread as the dense estimate is used.
+         */
+        static int sparseThreads(double work)
+        {
+            return (int)max(1.0, min((double)maxThreads(), work / 1e6));
+        }
+
+        /**
+         * Run the transpose with a config.  If the result is not the size of the
+         * transpose, it is replaced by a new matrix.
+         */
+        template<typename T>
+        void runTranspose(const MatrixT<T>& origMatrix, MatrixT<T>& resultMaxtrix, const TuningConfig& config, CallStats* stats)
+        {
+            if(resultMaxtrix.rows() != origMatrix.columns() || resultMaxtrix.columns() != origMatrix.rows())
+            {
+                PhaseTimer timer(stats != nullptr ? &stats->phaseSeconds[PHASE_ALLOCATE] : nullptr);
+                resultMaxtrix = MatrixT<T>(origMatrix.columns(), origMatrix.rows(), MATRIX_UNINITIALIZED);
+            }
+
+            if(config.numThreads <= 1)
+            {
+                transpose2D(origMatrix, resultMaxtrix, stats);
+                return;
+            }
+            transpose2DThreadN(origMatrix, resultMaxtrix, config.numThreads, stats);
+        }
+
+        /**
+         * Run the multiply and tell the observer, if there is one.
+         */
+        template<typename T>
+        void multiplyWithConfig(const GemmOperandsT<T>& operands, MatrixT<T>& resultMaxtrix, const TuningConfig& config)
+        {
+            if(!mObserver)
+            {
+                runMultiply(operands, resultMaxtrix, config, nullptr);
+                return;
+            }
+
+            const uint64_t resultSize = (uint64_t)operands.rows() * operands.columns();
+            CallStats stats("multiply", operands.rows(), operands.columns(), operands.depth(), config.numThreads);
+            stats.bytesRead = ((uint64_t)operands.A->rows() * operands.A->columns() + (uint64_t)operands.B->rows() * operands.B->columns()) * sizeof(T);
+            if(!(operands.beta == T()) && resultMaxtrix.rows() == operands.rows() && resultMaxtrix.columns() == operands.columns())
+            {
+                stats.bytesRead += resultSize * sizeof(T);
+            }
+            stats.bytesWritten = resultSize * sizeof(T);
+
+            CallRecorder recorder(*mObserver, stats);
+            runMultiply(operands, resultMaxtrix, config, &stats);
+            recorder.finish();
+        }
+
+        /**
+         * Run the transpose and tell the observer, if there is one.
+         */
+        template<typename T>
+        void transposeWithConfig(const MatrixT<T>& origMatrix, MatrixT<T>& resultMaxtrix, const TuningConfig& config)
+        {
+            if(!mObserver)
+            {
+                runTranspose(origMatrix, resultMaxtrix, config, nullptr);
+                return;
+            }
+
+            CallStats stats("transpose", origMatrix.columns(), origMatrix.rows(), 0, config.numThreads);
+            stats.bytesRead = (uint64_t)origMatrix.rows() * origMatrix.columns() * sizeof(T);
+            stats.bytesWritten = stats.bytesRead;
+
+            CallRecorder recorder(*mObserver, stats);
+            runTranspose(origMatrix, resultMaxtrix, config, &stats);
+            recorder.finish();
+        }
+
+        /**
+         * Run a batch of multiplies and tell the observer, if there is one.  The
+         * problems are split into groups of BATCH_LANES and the groups are run on
+         * the thread pool, so each problem runs on 1 thread.
+         * 
+         * :param count: Number of problems.
+         * :param M: Rows of the results, for the stats.
+         * :param N: Columns of the results, for the stats.
+         * :param K: Shared dimension, for the stats.
+         * :param config: Number of threads, block sizes and kernels to use.
+         * :param problem: Called as problem(int i) on the thread running problem i.
+         *                 Returns the BatchProblemT of problem i.
+         */
+        template<typename T, typename Problem>
+        void multiplyBatchWithConfig(int count, int M, int N, int K, const TuningConfig& config, const Problem& problem)
+        {
+            const KernelTableT<T>& kernels = ElementKernels<T>::table(config.isa);
+            const int numGroups = (count + BATCH_LANES - 1) / BATCH_LANES;
+            auto run = [&](CallStats* stats)
+            {
+                runTasks(numGroups, config.numThreads, stats, [&](int group, ThreadStats* thread)
+                {
+                    BatchProblemT<T> problems[BATCH_LANES];
+                    const int begin = group * BATCH_LANES;
+                    const int size = min(BATCH_LANES, count - begin);
+                    for(int i = 0; i < size; i++)
+                    {
+                        problems[i] = problem(begin + i);
+                    }
+                    MatrixKernels::multiplyBatch(problems, size, config.blockSizes, kernels, thread);
+                });
+            };
+
+            if(!mObserver)
+            {
+                run(nullptr);
+                return;
+            }
+
+            CallStats stats("multiplyBatch", M, N, K, config.numThreads);
+            stats.count = count;
+            stats.bytesRead = ((uint64_t)M * K + (uint64_t)K * N) * count * sizeof(T);
+            stats.bytesWritten = (uint64_t)M * N * count * sizeof(T);
+
+            CallRecorder recorder(*mObserver, stats);
+            run(&stats);
+            recorder.finish();
+        }
+
+        /**
+         * Config for a batch that did not give the number of threads.  The whole
+         * batch is estimated as one multiply with count times the rows.
+         */
+        TuningConfig autoBatchConfig(int M, int N, int K, int count) const
+        {
+            const int rows = (int)min((long long)M * count, (long long)numeric_limits<int>::max());
+            return explicitConfig(AutoTuner::defaultConfig(TUNE_MULTIPLY, rows, N, K, maxThreads()).numThreads);
+        }
+
+        /**
+         * Transpose in place.  See transposeInPlace().
+         */
+        template<typename T>
+        void runTransposeInPlace(MatrixT<T>& matrix, int numThreads, CallStats* stats)
+        {
+            const int rows = matrix.rows();
+            const int columns = matrix.columns();
+
+            if(rows == columns)
+            {
+                const int numBlocks = (rows + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE;
+                T* data = matrix.data();
+                const int stride = matrix.stride();
+
+                // One task per row of blocks, from the diagonal to the right
+                runTasks(numBlocks, numThreads, stats, [&](int blockRow, ThreadStats* thread)
+                {
+                    PhaseTimer timer(thread != nullptr ? &thread->computeSeconds : nullptr);
+
+                    int rowBegin = blockRow * TRANSPOSE_TILE;
+                    int blockRows = min(TRANSPOSE_TILE, rows - rowBegin);
+                    for(int columnBegin = rowBegin; columnBegin < columns; columnBegin += TRANSPOSE_TILE)
+                    {
+                        int blockColumns = min(TRANSPOSE_TILE, columns - columnBegin);
+                        MatrixKernels::transposeSwapBlocks(rowBegin, columnBegin, blockRows, blockColumns, data, stride);
+                    }
+                });
+                return;
+            }
+
+            ThreadStats* thread = stats != nullptr ? stats->beginThreads(1) : nullptr;
+            PhaseTimer busy(thread != nullptr ? &thread->busySeconds : nullptr);
+            PhaseTimer compute(thread != nullptr ? &thread->computeSeconds : nullptr);
+
+            // Set the new shape first, so a shape that does not fit leaves the values
+            // alone.  The packed shape is never larger than the old one.
+            const int stride = matrix.stride();
+            if(!matrix.reshape(columns, rows, rows))
+            {
+                return;
+            }
+
+            // Pack the rows so the stride equals the columns.  Rows only move
+            // toward the front, so each move reads values not yet written.
+            T* data = matrix.data();
+            for(int m = 1; m < rows; m++)
+            {
+                memmove(data + (size_t)m * columns, data + (size_t)m * stride, columns * sizeof(T));
+            }
+
+            MatrixKernels::transposeInPlaceCycles(rows, columns, data);
+        }
+
+        /**
+         * Config for a call that gave the number of threads.  Uses the block sizes
+         * set on this object and the active kernels.
+         */
+        TuningConfig explicitConfig(int numThreads) const
+        {
+            TuningConfig config;
+            config.numThreads = numThreads;
+            config.blockSizes = mBlockSizes;
+            config.isa = SimdKernels::active().isa;
+            return config;
+        }
+
+        /**
+         * Most threads the tuner may pick.
+         */
+        static int maxThreads()
+        {
+            return max(1, (int)thread::hardware_concurrency());
+        }
+
+        /**
+         * Config for a multiply that did not give the number of threads.
+         * The tuning table is checked, and the shape is tuned the first time if needed.
+         * The table is tuned with doubles, so other element types use the estimate.
+         */
+        template<typename T>
+        TuningConfig autoMultiplyConfig(int m1Rows, int m1Columns, int m2Columns)
+        {
+            if(!mTuner || !is_same<T, double>::value)
+            {
+                return AutoTuner::defaultConfig(TUNE_MULTIPLY, m1Rows, m2Columns, m1Columns, maxThreads());
+            }
+
+            // Matrices used for timing are only made once per shape
+            Matrix a, b;
+            auto run = [&](int M, int N, int K, const TuningConfig& config)
+            {
+                if(a.rows() != M || a.columns() != K || b.columns() != N)
+                {
+                    a = Matrix(M, K);
+                    b = Matrix(K, N);
+                }
+                runMultiply(a, b, config, nullptr);
+            };
+            return mTuner->configFor(TUNE_MULTIPLY, m1Rows, m2Columns, m1Columns, maxThreads(), run);
+        }
+
+        /**
+         * Config for a transpose that did not give the number of threads.
+         */
+        template<typename T>
+        TuningConfig autoTransposeConfig(int rows, int columns)
+        {
+            if(!mTuner || !is_same<T, double>::value)
+            {
+                return AutoTuner::defaultConfig(TUNE_TRANSPOSE, rows, columns, 0, maxThreads());
+            }
+
+            Matrix a, b;
+            auto run = [&](int M, int N, int, const TuningConfig& config)
+            {
+                if(a.rows() != M || a.columns() != N)
+                {
+                    a = Matrix(M, N);
+                }
+                runTranspose(a, b, config, nullptr);
+            };
+            return mTuner->configFor(TUNE_TRANSPOSE, rows, columns, 0, maxThreads(), run);
+        }
+
+        /**
+         * Post function(result) to the pool once the inputs are ready, and return the
+         * future of the result.  The last input to be ready posts the call, on the
+         * thread that made it ready.
+         * 
+         * :param first: Input of the call.
+         * :param second: Second input of the call, or an empty future.
+         * :param numThreads: Number of threads the call uses.
+         * :param function: Called as function(MatrixT<T>& result) on a worker.
+         */
+        template<typename T, typename Function>
+        MatrixFutureT<T> runAsync(const MatrixFutureT<T>& first, const MatrixFutureT<T>& second, int numThreads, const Function& function)
+        {
+            mPool->ensureWorkers(max(1, numThreads));
+
+            ThreadPool* pool = mPool.get();
+            MatrixFutureT<T> result = MatrixFutureT<T>::pending(pool);
+            shared_ptr<atomic<int> > remaining = make_shared<atomic<int> >(second.valid() ? 2 : 1);
+            auto start = [pool, result, remaining, function]()
+            {
+                if(--*remaining == 0)
+                {
+                    pool->post([result, function]()
+                    {
+                        MatrixT<T> resultMaxtrix;
+                        function(resultMaxtrix);
+                        result.complete(move(resultMaxtrix));
+                    });
+                }
+            };
+
+            first.onReady(start);
+            if(second.valid())
+            {
+                second.onReady(start);
+            }
+            return result;
+        }
+
+    public:
+        /**
+         * Create the matrix algebra with the default cache block sizes.
+         */
+        MatrixAlgebra() : mBlockSizes(MatrixKernels::defaultBlockSizes()), mPool(ThreadPool::defaultPool()), mTuner(AutoTuner::defaultTuner()), mStrassenCrossover(0)
+        {
+        }
+
+        /**
+         * Create the matrix algebra with a given thread pool.
+         * 
+         * :param pool: Pool used for all threaded calls.
+         */
+        explicit MatrixAlgebra(shared_ptr<ThreadPool> pool) : mBlockSizes(MatrixKernels::defaultBlockSizes()), mPool(pool), mTuner(AutoTuner::defaultTuner()), mStrassenCrossover(0)
+        {
+        }
+
+        /**
+         * Set the tuner used by the calls that do not give the number of threads.
+         * 
+         * :param tuner: Tuner to use.  If null, the calls use an estimate instead.
+         */
+        void setTuner(shared_ptr<AutoTuner> tuner)
+        {
+            mTuner = tuner;
+        }
+
+        /**
+         * Tune the multiply for the bucket of this shape now and save the table.
+         * 
+         * :param m1Rows: Number of rows in first matrix.
+         * :param m1Columns: Number of columns in first matrix and number of rows in second matrix.
+         * :param m2Columns: Number of columns in the second matrix.
+         * :return: The fastest config.
+         */
+        TuningConfig tuneMultiply(int m1Rows, int m1Columns, int m2Columns)
+        {
+            if(!mTuner)
+            {
+                mTuner = AutoTuner::defaultTuner();
+            }
+
+            Matrix a, b;
+            auto run = [&](int M, int N, int K, const TuningConfig& config)
+            {
+                if(a.rows() != M || a.columns() != K || b.columns() != N)
+                {
+                    a = Matrix(M, K);
+                    b = Matrix(K, N);
+                }
+                runMultiply(a, b, config, nullptr);
+            };
+            return mTuner->tune(TUNE_MULTIPLY, m1Rows, m2Columns, m1Columns, maxThreads(), run);
+        }
+
+        /**
+         * Set the observer told about every call.  Stats are only collected while an
+         * observer is set.
+         * 
+         * :param observer: Observer to use, or null to stop collecting stats.
+         */
+        void setObserver(shared_ptr<CallObserver> observer)
+        {
+            mObserver = observer;
+        }
+
+        /**
+         * Thread pool used for the threaded calls.
+         */
+        shared_ptr<ThreadPool> threadPool() const
+        {
+            return mPool;
+        }
+
+        /**
+         * Create a matrix of zeros, written in bands of rows by the threads of the pool.
+         * 
+         * Linux places each page on the NUMA node of the thread that first writes it.
+         * A matrix zeroed on one thread is all on one node, and the threads on the
+         * other socket read every value across the interconnect.  Here band b of
+         * numThreads is written by participant b, which is the participant that starts
+         * with the tiles of those rows in the threaded multiply.  Pin the workers with
+         * threadPool()->setAffinity(true) so a participant stays on the same node.
+         * 
+         * The results of matrixMultiply() and transpose() do not need this.  A new
+         * result is not zeroed up front, each tile is first written by the thread
+         * that computes it.
+         * 
+         * :param rows: The number of rows (height).
+         * :param columns: The number of columns (width).
+         * :param numThreads: Number of threads the matrix will be used with.
+         * :return: A matrix of zeros.
+         */
+        template<typename T>
+        MatrixT<T> allocateMatrix(int rows, int columns, int numThreads)
+        {
+            if(numThreads <= 1)
+            {
+                return MatrixT<T>(rows, columns);
+            }
+
+            MatrixT<T> matrix(rows, columns, MATRIX_UNINITIALIZED);
+            const int numBands = max(1, min(rows, numThreads));
+            mPool->parallelFor(numBands, numBands, [&](int band, int)
+            {
+                const int rowBegin = (int)((long long)rows * band / numBands);
+                const int rowEnd = (int)((long long)rows * (band + 1) / numBands);
+                memset(static_cast<void*>(matrix.row(rowBegin)), 0, (size_t)(rowEnd - rowBegin) * matrix.stride() * sizeof(T));
+            });
+            return matrix;
+        }
+
+        /**
+         * Fill a matrix with value on the threads of the pool.  The rows are split
+         * into bands like allocateMatrix(), so a new MATRIX_UNINITIALIZED matrix is
+         * placed on the NUMA nodes of the threads that use it.  A matrix of
+         * FILL_STREAM_BYTES or more is written with non-temporal stores, which do not
+         * read the old values into the cache first.
+         * 
+         * :param matrix: The matrix to fill.
+         * :param value: The value of every element.
+         * :param numThreads: Number of threads to use.
+         */
+        template<typename T>
+        void fillMatrix(MatrixT<T>& matrix, typename MatrixT<T>::value_type value, int numThreads)
+        {
+            runFill("fill", matrix, numThreads, [&](int, T* row, bool stream)
+            {
+                MatrixKernels::fillRow(row, matrix.columns(), value, stream);
+            });
+        }
+
+        /**
+         * Fill a matrix with the identity, 1 where the row and column are the same and
+         * 0 elsewhere, on the threads of the pool.  The matrix does not need to be
+         * square.  The zeros are written like fillMatrix().
+         * 
+         * :param matrix: The matrix to fill.
+         * :param numThreads: Number of threads to use.
+         */
+        template<typename T>
+        void fillIdentity(MatrixT<T>& matrix, int numThreads)
+        {
+            runFill("fillIdentity", matrix, numThreads, [&](int m, T* row, bool stream)
+            {
+                MatrixKernels::fillRow(row, matrix.columns(), T(), stream);
+                if(m < matrix.columns())
+                {
+                    row[m] = T(1);
+                }
+            });
+        }
+
+        /**
+         * Fill a matrix with incrementing values on the threads of the pool, like
+         * MatrixCommon::createMatrix().  Value (m, n) is startValue + m * columns + n,
+         * rounded once, so with a fraction in startValue it can differ from
+         * createMatrix() in the last bit.  The values are computed, which takes
+         * longer than the memory traffic saved by non-temporal stores, so they are
+         * written directly.
+         * 
+         * :param matrix: The matrix to fill.
+         * :param startValue: Value of element (0, 0).
+         * :param numThreads: Number of threads to use.
+         */
+        template<typename T>
+        void fillSequence(MatrixT<T>& matrix, typename MatrixT<T>::value_type startValue, int numThreads)
+        {
+            runFill("fillSequence", matrix, numThreads, [&](int m, T* row, bool)
+            {
+                const long long first = (long long)m * matrix.columns();
+                for(int n = 0; n < matrix.columns(); n++)
+                {
+                    row[n] = startValue + T(first + n);
+                }
+            });
+        }
+
+        /**
+         * Fill a matrix with uniform random values on the threads of the pool.  Each
+         * row has its own SplitMix64 stream made from the seed and the row number, so
+         * the values are the same for every number of threads, and a row does not
+         * depend on the number of rows.  Integer values are in [low, high], floating
+         * point values between low and high.  The real and imaginary parts of complex
+         * values are drawn separately, each between the parts of low and high.  The
+         * values are written directly like fillSequence().
+         * 
+         * :param matrix: The matrix to fill.
+         * :param low: Smallest value.
+         * :param high: Largest value.
+         * :param seed: Seed of the streams.  The same seed gives the same values.
+         * :param numThreads: Number of threads to use.
+         */
+        template<typename T>
+        void fillRandom(MatrixT<T>& matrix, typename MatrixT<T>::value_type low, typename MatrixT<T>::value_type high, uint64_t seed, int numThreads)
+        {
+            uint64_t mixed = seed;
+            const uint64_t base = MatrixKernels::splitMix64(mixed);
+            runFill("fillRandom", matrix, numThreads, [&](int m, T* row, bool)
+            {
+                // Streams of rows are 2^32 values apart
+                uint64_t state = base + ((uint64_t)m << 32) * 0x9E3779B97F4A7C15ull;
+                for(int n = 0; n < matrix.columns(); n++)
+                {
+                    row[n] = MatrixKernels::randomValue(state, low, high);
+                }
+            });
+        }
+
+        /**
+         * Create a matrix of incrementing values on the threads of the pool.  This is
+         * the threaded MatrixCommon::createMatrix(), see fillSequence().
+         * 
+         * :param rows: The number of rows (height).
+         * :param columns: The number of columns (width).
+         * :param startValue: Value of element (0, 0).  The type of the start value is the element type.
+         * :param numThreads: Number of threads to use.
+         * :return: The new matrix.
+         */
+        template<typename T>
+        MatrixT<T> createMatrix(int rows, int columns, T startValue, int numThreads)
+        {
+            MatrixT<T> matrix(rows, columns, MATRIX_UNINITIALIZED);
+            fillSequence(matrix, startValue, numThreads);
+            return matrix;
+        }
+
+        /**
+         * Check if the split-K multiply should be used.  This is the case when the
+         * result is too small to give every thread a tile, but the shared dimension
+         * is long.  For example 4 x 1,000,000 times 1,000,000 x 4.
+         * 
+         * :param m1Rows: Number of rows in the first matrix.
+         * :param m1Columns: Number of columns in the first matrix (the shared dimension).
+         * :param m2Columns: Number of columns in the second matrix.
+         * :param numThreads: Number of threads to use.
+         * :return: True if the split-K multiply should be used.
+         */
+        bool useSplitK(int m1Rows, int m1Columns, int m2Columns, int numThreads) const
+        {
+            return useSplitK(m1Rows, m1Columns, m2Columns, numThreads, mBlockSizes);
+        }
+
+        /**
+         * Check if the split-K multiply should be used with the given block sizes.
+         */
+        static bool useSplitK(int m1Rows, int m1Columns, int m2Columns, int numThreads, const BlockSizes& blockSizes)
+        {
+            if(numThreads <= 1 || m1Columns < 2 * blockSizes.kc)
+            {
+                return false;
+            }
+
+            TileGrid grid(m1Rows, m2Columns, blockSizes.mc, blockSizes.nc, 32, 64, numThreads);
+            return grid.count() < numThreads && (long long)m1Columns >= 4LL * max(m1Rows, m2Columns);
+        }
+
+        /**
+         * Turn on the Strassen-Winograd multiply for large matrices.  Multiplies where
+         * every side is longer than the crossover use it, the steps recurse until a
+         * side is no longer than the crossover.  It does about 7/8 of the work per step,
+         * but the result is less accurate than the classic multiply, see StrassenKernels
+         * for the error bound.  It is off by default.  Integer types never use it.
+         * 
+         * The best crossover depends on the host.  The benchmark runs the strassen shape
+         * with a few crossovers to pick from.
+         * 
+         * :param crossover: Largest side multiplied without Strassen, or 0 to turn it off.
+         */
+        void setStrassenCrossover(int crossover)
+        {
+            mStrassenCrossover = max(0, crossover);
+        }
+
+        /**
+         * Set the cache block sizes used by the multiply.
+         * 
+         * :param blockSizes: Block sizes to use.
+         */
+        void setBlockSizes(const BlockSizes& blockSizes)
+        {
+            mBlockSizes = blockSizes;
+        }
+
+        /**
+         * Transpose the matrix.
+         * 
+         * Based on the number of threads, determine which is the best method
+         * to use.  When the matrix is small or only 1 thread is needed, 
+         * then do not use any threading.  It will be faster since you will not
+         * have to wake a pool thread and wait for it to complete.
+         * 
+         * :param origMatrix: Original matrix to transpose.
+         * :param numThreads: Number of threads to use.
+         * :return: Transposed matrix.
+         */ 
+        template<typename T>
+        MatrixT<T> transpose(const MatrixT<T>& origMatrix, int numThreads)
+        {
+            MatrixT<T> resultMaxtrix;
+            transposeWithConfig(origMatrix, resultMaxtrix, explicitConfig(numThreads));
+            return resultMaxtrix;
+        }
+
+        /**
+         * Transpose the matrix with the number of threads picked by the tuner
+         * for this shape.
+         * 
+         * :param origMatrix: Original matrix to transpose.
+         * :return: Transposed matrix.
+         */ 
+        template<typename T>
+        MatrixT<T> transpose(const MatrixT<T>& origMatrix)
+        {
+            MatrixT<T> resultMaxtrix;
+            transposeWithConfig(origMatrix, resultMaxtrix, autoTransposeConfig<T>(origMatrix.rows(), origMatrix.columns()));
+            return resultMaxtrix;
+        }
+
+        /**
+         * Transpose the matrix into a given result.  A result that is already the
+         * size of the transpose is overwritten in place, so a loop that transposes
+         * matrices of the same shape allocates nothing after the first call.
+         * 
+         * :param origMatrix: Original matrix to transpose.
+         * :param resultMaxtrix: The result.  If it is not the size of the transpose,
+         *                       it is replaced by a new matrix.
+         * :param numThreads: Number of threads to use.
+         */ 
+        template<typename T>
+        void transpose(const MatrixT<T>& origMatrix, MatrixT<T>& resultMaxtrix, int numThreads)
+        {
+            transposeWithConfig(origMatrix, resultMaxtrix, explicitConfig(numThreads));
+        }
+
+        /**
+         * Transpose the matrix into a given result with the number of threads picked
+         * by the tuner for this shape.
+         */ 
+        template<typename T>
+        void transpose(const MatrixT<T>& origMatrix, MatrixT<T>& resultMaxtrix)
+        {
+            transposeWithConfig(origMatrix, resultMaxtrix, autoTransposeConfig<T>(origMatrix.rows(), origMatrix.columns()));
+        }
+
+        /**
+         * Transpose the matrix in place, without a second copy of the matrix.  This
+         * is used for matrices too large to hold twice in memory.
+         * 
+         * A square matrix is cut into blocks.  Each block above the diagonal is swapped
+         * with its mirror block below the diagonal, and both are transposed.  The pairs
+         * of blocks are independent, so they are run on the thread pool.
+         * 
+         * A rectangular matrix is first packed so the stride equals the columns.  The
+         * values are then moved by following the cycles of the permutation, which
+         * needs 1 extra bit per value.  This part runs on 1 thread.  The result
+         * keeps the packed stride.  This also works for a matrix that wraps values
+         * owned by someone else, as the packed result fits in the rows * stride
+         * values it was created with.
+         * 
+         * :param matrix: Matrix to transpose.  It is changed to columns x rows.
+         * :param numThreads: Number of threads to use for a square matrix.
+         */ 
+        template<typename T>
+        void transposeInPlace(MatrixT<T>& matrix, int numThreads)
+        {
+            if(!mObserver)
+            {
+                runTransposeInPlace(matrix, numThreads, nullptr);
+                return;
+            }
+
+            CallStats stats("transposeInPlace", matrix.columns(), matrix.rows(), 0, numThreads);
+            stats.bytesRead = (uint64_t)matrix.rows() * matrix.columns() * sizeof(T);
+            stats.bytesWritten = stats.bytesRead;
+
+            CallRecorder recorder(*mObserver, stats);
+            runTransposeInPlace(matrix, numThreads, &stats);
+            recorder.finish();
+        }
+
+        /**
+         * Matrix Multiplication.  
+         * 
+         * Based on the number of threads, determine which is the best method
+         * to use.  When the matrix is small or only 1 thread is needed, 
+         * then do not use any threading.  It will be faster since you will not
+         * have to wake a pool thread and wait for it to complete.  When the result
+         * is small but the shared dimension is long, the shared dimension is split
+         * between the threads instead of the result.
+         * 
+         * It is assumed that the matrix are the correct size to allow multiplication
+         * to be done.  This will not check the sizes.  There error checking of the
+         * 2 matrices should be done before calling this method.
+         * 
+         * :param m1: First matrix to multiply.
+         * :param m2: Second matrix to multiply.
+         * :param numThreads: Number of threads to use to do the calculation. Look above for suggested sizes.
+         * :return: The solution to multiplying the two matrices.
+         */ 
+        template<typename T>
+        MatrixT<T> matrixMultiply(const MatrixT<T>& m1, const MatrixT<T>& m2, int numThreads)
+        {
+            return matrixMultiply(OP_NO_TRANSPOSE, OP_NO_TRANSPOSE, m1, m2, numThreads);
+        }
+
+        /**
+         * Matrix Multiplication with the number of threads, block sizes and kernels
+         * picked by the tuner for this shape.  The shape is tuned on this host the
+         * first time it is seen, unless it is too small to matter.
+         * 
+         * :param m1: First matrix to multiply.
+         * :param m2: Second matrix to multiply.
+         * :return: The solution to multiplying the two matrices.
+         */ 
+        template<typename T>
+        MatrixT<T> matrixMultiply(const MatrixT<T>& m1, const MatrixT<T>& m2)
+        {
+            return matrixMultiply(OP_NO_TRANSPOSE, OP_NO_TRANSPOSE, m1, m2);
+        }
+
+        /**
+         * Matrix Multiplication of op(m1) and op(m2), where op is the matrix or its
+         * transpose.  A transposed matrix is read transposed while it is packed, so no
+         * transposed copy is made.  For example m1 * m2^T is
+         * matrixMultiply(OP_NO_TRANSPOSE, OP_TRANSPOSE, m1, m2, numThreads).
+         * 
+         * :param op1: How m1 is read.
+         * :param op2: How m2 is read.
+         * :param m1: First matrix to multiply.
+         * :param m2: Second matrix to multiply.
+         * :param numThreads: Number of threads to use to do the calculation.
+         * :return: The solution to multiplying the two matrices.
+         */ 
+        template<typename T>
+        MatrixT<T> matrixMultiply(MatrixOp op1, MatrixOp op2, const MatrixT<T>& m1, const MatrixT<T>& m2, int numThreads)
+        {
+            MatrixT<T> resultMaxtrix;
+            matrixMultiply(op1, op2, T(1), m1, m2, T(), resultMaxtrix, numThreads);
+            return resultMaxtrix;
+        }
+
+        /**
+         * Matrix Multiplication of op(m1) and op(m2) with the config picked by the
+         * tuner for the shape of the result.
+         */ 
+        template<typename T>
+        MatrixT<T> matrixMultiply(MatrixOp op1, MatrixOp op2, const MatrixT<T>& m1, const MatrixT<T>& m2)
+        {
+            MatrixT<T> resultMaxtrix;
+            matrixMultiply(op1, op2, T(1), m1, m2, T(), resultMaxtrix);
+            return resultMaxtrix;
+        }
+
+        /**
+         * General Matrix Multiplication into a given result, like BLAS gemm:
+         * result = alpha * op(m1) * op(m2) + beta * result.
+         * 
+         * alpha is applied while m1 is packed and result is scaled by beta one tile at
+         * a time, just before the tile is computed, so there are no extra passes over
+         * the matrices.  A beta of 0 ignores the old values of result.
+         * 
+         * :param op1: How m1 is read.
+         * :param op2: How m2 is read.
+         * :param alpha: Factor of the product.
+         * :param m1: First matrix to multiply.
+         * :param m2: Second matrix to multiply.
+         * :param beta: Factor of the old values of result.
+         * :param resultMaxtrix: The result.  If it is not the size of the product, it is
+         *                       replaced by a new matrix and beta is ignored.
+         * :param numThreads: Number of threads to use to do the calculation.
+         */ 
+        template<typename T>
+        void matrixMultiply(MatrixOp op1, MatrixOp op2, typename MatrixT<T>::value_type alpha, const MatrixT<T>& m1, const MatrixT<T>& m2,
+                            typename MatrixT<T>::value_type beta, MatrixT<T>& resultMaxtrix, int numThreads)
+        {
+            GemmOperandsT<T> operands = { op1, op2, alpha, &m1, &m2, beta };
+            multiplyWithConfig(operands, resultMaxtrix, explicitConfig(numThreads));
+        }
+
+        /**
+         * General Matrix Multiplication into a given result with the config picked by
+         * the tuner for the shape of the result.
+         */ 
+        template<typename T>
+        void matrixMultiply(MatrixOp op1, MatrixOp op2, typename MatrixT<T>::value_type alpha, const MatrixT<T>& m1, const MatrixT<T>& m2,
+                            typename MatrixT<T>::value_type beta, MatrixT<T>& resultMaxtrix)
+        {
+            GemmOperandsT<T> operands = { op1, op2, alpha, &m1, &m2, beta };
+            multiplyWithConfig(operands, resultMaxtrix, autoMultiplyConfig<T>(operands.rows(), operands.depth(), operands.columns()));
+        }
+
+        /**
+         * Transpose on the thread pool without waiting for the result.  The transpose
+         * starts when origMatrix is ready, so it can be the result of another async
+         * call.  Use MatrixFutureT<T>::wrap() to pass a matrix that is already there.
+         * 
+         * The MatrixAlgebra and its pool must stay alive until the result is ready.
+         * 
+         * :param origMatrix: Original matrix to transpose.
+         * :param numThreads: Number of threads to use.
+         * :return: Future of the transposed matrix.
+         */ 
+        template<typename T>
+        MatrixFutureT<T> transposeAsync(const MatrixFutureT<T>& origMatrix, int numThreads)
+        {
+            return runAsync(origMatrix, MatrixFutureT<T>(), numThreads, [this, origMatrix, numThreads](MatrixT<T>& resultMaxtrix)
+            {
+                transpose(origMatrix.get(), resultMaxtrix, numThreads);
+            });
+        }
+
+        /**
+         * Matrix Multiplication on the thread pool without waiting for the result.
+         * The multiply starts when both matrices are ready, so a chain of calls can be
+         * queued at once, for example:
+         * 
+         *     MatrixFuture t = ma.transposeAsync(MatrixFuture::wrap(a), 4);
+         *     MatrixFuture p = ma.matrixMultiplyAsync(t, MatrixFuture::wrap(b), 4);
+         *     MatrixFuture q = ma.matrixMultiplyAsync(p, MatrixFuture::wrap(c), 4);
+         *     ... other work ...
+         *     const Matrix& result = q.get();
+         * 
+         * Calls that do not wait for each other run at the same time, each on its
+         * own worker, and share the other workers of the pool.  The pool is grown to
+         * numThreads workers so one call can use all its threads.
+         * 
+         * The MatrixAlgebra and its pool must stay alive until the result is ready.
+         * 
+         * :param op1: How m1 is read.
+         * :param op2: How m2 is read.
+         * :param m1: First matrix to multiply.
+         * :param m2: Second matrix to multiply.
+         * :param numThreads: Number of threads to use to do the calculation.
+         * :return: Future of the product.
+         */ 
+        template<typename T>
+        MatrixFutureT<T> matrixMultiplyAsync(MatrixOp op1, MatrixOp op2, const MatrixFutureT<T>& m1, const MatrixFutureT<T>& m2, int numThreads)
+        {
+            return runAsync(m1, m2, numThreads, [this, op1, op2, m1, m2, numThreads](MatrixT<T>& resultMaxtrix)
+            {
+                matrixMultiply(op1, op2, T(1), m1.get(), m2.get(), T(), resultMaxtrix, numThreads);
+            });
+        }
+
+        /**
+         * Matrix Multiplication of m1 and m2 on the thread pool without waiting for
+         * the result.  See the version with ops.
+         */ 
+        template<typename T>
+        MatrixFutureT<T> matrixMultiplyAsync(const MatrixFutureT<T>& m1, const MatrixFutureT<T>& m2, int numThreads)
+        {
+            return matrixMultiplyAsync(OP_NO_TRANSPOSE, OP_NO_TRANSPOSE, m1, m2, numThreads);
+        }
+
+        /**
+         * Pack a matrix once so it can be the second matrix of many multiplies.  The
+         * multiplies by the packed matrix skip packing it, which is the only pass
+         * over it that is not in the cache-friendly layout.  Use this for a matrix
+         * that does not change, multiplied by many first matrices.
+         * 
+         * The matrix is packed for the active kernels and the kc and nc block sizes
+         * set on this object.  The packed copy does not refer to the matrix.  The
+         * time and bytes of the packing are kept in the handle, and the observer is
+         * told about the call as "pack".
+         * 
+         * :param matrix: Matrix to pack.
+         * :param op: How the matrix is read.  With OP_TRANSPOSE, a N x K matrix is
+         *            packed as its K x N transpose.
+         * :return: The packed matrix.
+         */ 
+        template<typename T>
+        PackedMatrixT<T> packMatrix(const MatrixT<T>& matrix, MatrixOp op = OP_NO_TRANSPOSE)
+        {
+            if(!mObserver)
+            {
+                return runPack(matrix, op, nullptr);
+            }
+
+            CallStats stats("pack", op == OP_TRANSPOSE ? matrix.columns() : matrix.rows(), op == OP_TRANSPOSE ? matrix.rows() : matrix.columns(), 0, 1);
+            stats.bytesRead = (uint64_t)matrix.rows() * matrix.columns() * sizeof(T);
+
+            CallRecorder recorder(*mObserver, stats);
+            PackedMatrixT<T> packed = runPack(matrix, op, &stats);
+            stats.bytesWritten = packed.bytes();
+            recorder.finish();
+            return packed;
+        }
+
+        /**
+         * Matrix Multiplication by a matrix packed with packMatrix().
+         * 
+         * :param m1: First matrix to multiply.
+         * :param m2: The packed second matrix.  m1 must have m2.rows() columns.
+         * :param numThreads: Number of threads to use to do the calculation.
+         * :return: The solution to multiplying the two matrices.
+         */ 
+        template<typename T>
+        MatrixT<T> matrixMultiply(const MatrixT<T>& m1, const PackedMatrixT<T>& m2, int numThreads)
+        {
+            MatrixT<T> resultMaxtrix;
+            matrixMultiply(OP_NO_TRANSPOSE, T(1), m1, m2, T(), resultMaxtrix, numThreads);
+            return resultMaxtrix;
+        }
+
+        /**
+         * Matrix Multiplication by a packed matrix with the number of threads
+         * estimated for the shape.
+         */ 
+        template<typename T>
+        MatrixT<T> matrixMultiply(const MatrixT<T>& m1, const PackedMatrixT<T>& m2)
+        {
+            MatrixT<T> resultMaxtrix;
+            matrixMultiply(OP_NO_TRANSPOSE, T(1), m1, m2, T(), resultMaxtrix);
+            return resultMaxtrix;
+        }
+
+        /**
+         * General Matrix Multiplication by a packed matrix into a given result:
+         * result = alpha * op(m1) * m2 + beta * result.  See the general
+         * matrixMultiply() for alpha, beta and the result.
+         * 
+         * :param op1: How m1 is read.
+         * :param alpha: Factor of the product.
+         * :param m1: First matrix to multiply.
+         * :param m2: The packed second matrix.  op(m1) must have m2.rows() columns.
+         * :param beta: Factor of the old values of result.
+         * :param resultMaxtrix: The result.
+         * :param numThreads: Number of threads to use to do the calculation.
+         */ 
+        template<typename T>
+        void matrixMultiply(MatrixOp op1, typename MatrixT<T>::value_type alpha, const MatrixT<T>& m1, const PackedMatrixT<T>& m2,
+                            typename MatrixT<T>::value_type beta, MatrixT<T>& resultMaxtrix, int numThreads)
+        {
+            packedMultiplyWithConfig(op1, alpha, m1, m2, beta, resultMaxtrix, explicitConfig(numThreads));
+        }
+
+        /**
+         * General Matrix Multiplication by a packed matrix into a given result with
+         * the number of threads estimated for the shape.  The tuning table is not
+         * used, its configs are timed with the packing included.
+         */ 
+        template<typename T>
+        void matrixMultiply(MatrixOp op1, typename MatrixT<T>::value_type alpha, const MatrixT<T>& m1, const PackedMatrixT<T>& m2,
+                            typename MatrixT<T>::value_type beta, MatrixT<T>& resultMaxtrix)
+        {
+            const int m1Rows = op1 == OP_TRANSPOSE ? m1.columns() : m1.rows();
+            const int numThreads = AutoTuner::defaultConfig(TUNE_MULTIPLY, m1Rows, m2.columns(), m2.rows(), maxThreads()).numThreads;
+            packedMultiplyWithConfig(op1, alpha, m1, m2, beta, resultMaxtrix, explicitConfig(numThreads));
+        }
+
+        /**
+         * Matrix Multiplication with narrow storage and wide sums.  The products are
+         * summed in AccumulatorType<S>::type: float matrices in double, bfloat16 and
+         * float16 in float and int8_t in int32_t.  The narrow values halve (or quarter)
+         * the memory read, and the wide sums keep the rounding error of a long shared
+         * dimension down to that of the inputs.  The values are converted while they
+         * are packed, so the kernels of the wide type do the work.
+         * 
+         * :param m1: First matrix to multiply.
+         * :param m2: Second matrix.  It must have m1.columns() rows.
+         * :param numThreads: Number of threads to use to do the calculation.
+         * :return: The product in the wide type.
+         */ 
+        template<typename S>
+        MatrixT<typename AccumulatorType<S>::type> matrixMultiplyMixed(const MatrixT<S>& m1, const MatrixT<S>& m2, int numThreads)
+        {
+            MatrixT<typename AccumulatorType<S>::type> resultMaxtrix;
+            matrixMultiplyMixed(m1, m2, resultMaxtrix, numThreads);
+            return resultMaxtrix;
+        }
+
+        /**
+         * Matrix Multiplication with narrow storage and wide sums into a given result.
+         * 
+         * :param m1: First matrix to multiply.
+         * :param m2: Second matrix.  It must have m1.columns() rows.
+         * :param resultMaxtrix: The result.  If it is not the size of the product, it
+         *                       is replaced by a new matrix.
+         * :param numThreads: Number of threads to use to do the calculation.
+         */ 
+        template<typename S>
+        void matrixMultiplyMixed(const MatrixT<S>& m1, const MatrixT<S>& m2, MatrixT<typename AccumulatorType<S>::type>& resultMaxtrix, int numThreads)
+        {
+            typedef typename AccumulatorType<S>::type T;
+            const TuningConfig config = explicitConfig(numThreads);
+            if(!mObserver)
+            {
+                runMixedMultiply(m1, m2, resultMaxtrix, config, nullptr);
+                return;
+            }
+
+            CallStats stats("multiplyMixed", m1.rows(), m2.columns(), m1.columns(), numThreads);
+            stats.bytesRead = ((uint64_t)m1.rows() * m1.columns() + (uint64_t)m2.rows() * m2.columns()) * sizeof(S);
+            stats.bytesWritten = (uint64_t)m1.rows() * m2.columns() * sizeof(T);
+
+            CallRecorder recorder(*mObserver, stats);
+            runMixedMultiply(m1, m2, resultMaxtrix, config, &stats);
+            recorder.finish();
+        }
+
+        /**
+         * Matrix Multiplication with narrow storage and wide sums with the number of
+         * threads estimated for the shape.
+         */ 
+        template<typename S>
+        MatrixT<typename AccumulatorType<S>::type> matrixMultiplyMixed(const MatrixT<S>& m1, const MatrixT<S>& m2)
+        {
+            return matrixMultiplyMixed(m1, m2, AutoTuner::defaultConfig(TUNE_MULTIPLY, m1.rows(), m2.columns(), m1.columns(), maxThreads()).numThreads);
+        }
+
+        /**
+         * Multiply two quantized matrices.  The int8 values are multiplied with int32
+         * sums, and each sum is scaled by the scale of its row of m1 and column of m2.
+         * If m1 is not quantized per row, or m2 per column, it is quantized again that
+         * way first, which adds to the error.
+         * 
+         * The error of value (m, n) compared to the product of the matrices that were
+         * quantized is at most sum over k of |m1(m, k)| * s2 / 2 + |m2(k, n)| * s1 / 2
+         * + s1 * s2 / 4, with s1 the scale of row m and s2 the scale of column n, plus
+         * the float rounding.
+         * 
+         * :param m1: First matrix to multiply.
+         * :param m2: Second matrix.  It must have m1.columns() rows.
+         * :param numThreads: Number of threads to use to do the calculation.
+         * :return: The product.
+         */ 
+        MatrixT<float> matrixMultiply(const QuantizedMatrix& m1, const QuantizedMatrix& m2, int numThreads)
+        {
+            MatrixT<float> resultMaxtrix;
+            matrixMultiply(m1, m2, resultMaxtrix, numThreads);
+            return resultMaxtrix;
+        }
+
+        /**
+         * Multiply two quantized matrices into a given result.
+         * 
+         * :param m1: First matrix to multiply.
+         * :param m2: Second matrix.  It must have m1.columns() rows.
+         * :param resultMaxtrix: The result.  If it is not the size of the product, it
+         *                       is replaced by a new matrix.
+         * :param numThreads: Number of threads to use to do the calculation.
+         */ 
+        void matrixMultiply(const QuantizedMatrix& m1, const QuantizedMatrix& m2, MatrixT<float>& resultMaxtrix, int numThreads)
+        {
+            if(m1.axis() != QUANTIZE_ROWS || m2.axis() != QUANTIZE_COLUMNS)
+            {
+                matrixMultiply(m1.axis() == QUANTIZE_ROWS ? m1 : QuantizedMatrix(m1.dequantize<float>(), QUANTIZE_ROWS),
+                               m2.axis() == QUANTIZE_COLUMNS ? m2 : QuantizedMatrix(m2.dequantize<float>(), QUANTIZE_COLUMNS),
+                               resultMaxtrix, numThreads);
+                return;
+            }
+
+            const TuningConfig config = explicitConfig(numThreads);
+            if(!mObserver)
+            {
+                runQuantizedMultiply(m1, m2, resultMaxtrix, config, nullptr);
+                return;
+            }
+
+            CallStats stats("multiplyQuantized", m1.rows(), m2.columns(), m1.columns(), numThreads);
+            stats.bytesRead = m1.sizeInBytes() + m2.sizeInBytes();
+            stats.bytesWritten = (uint64_t)m1.rows() * m2.columns() * sizeof(float);
+
+            CallRecorder recorder(*mObserver, stats);
+            runQuantizedMultiply(m1, m2, resultMaxtrix, config, &stats);
+            recorder.finish();
+        }
+
+        /**
+         * Multiply two quantized matrices with the number of threads estimated for
+         * the shape.
+         */ 
+        MatrixT<float> matrixMultiply(const QuantizedMatrix& m1, const QuantizedMatrix& m2)
+        {
+            return matrixMultiply(m1, m2, AutoTuner::defaultConfig(TUNE_MULTIPLY, m1.rows(), m2.columns(), m1.columns(), maxThreads()).numThreads);
+        }
+
+        /**
+         * Multiply a batch of independent pairs, Cs[i] = As[i] * Bs[i].
+         * 
+         * The batch is split between the threads instead of each multiply, so each
+         * pair runs on 1 thread and there is one trip to the thread pool for the whole
+         * batch.  Pairs of 8 x 8 or smaller are computed BATCH_LANES at a time with
+         * the interleaved SIMD kernel.  The pairs can have different shapes.
+         * 
+         * :param As: First matrix of each pair.
+         * :param Bs: Second matrix of each pair.  Bs[i] must have As[i].columns() rows.
+         * :param Cs: Set to the results.  A result of the right size is reused,
+         *            otherwise a new Matrix is made.
+         * :param count: Number of pairs.
+         * :param numThreads: Number of threads to use.
+         */ 
+        template<typename T>
+        void multiplyBatch(const MatrixT<T>* As, const MatrixT<T>* Bs, MatrixT<T>* Cs, int count, int numThreads)
+        {
+            if(count <= 0)
+            {
+                return;
+            }
+            multiplyBatchWithConfig<T>(count, As[0].rows(), Bs[0].columns(), As[0].columns(), explicitConfig(numThreads), [&](int i) -> BatchProblemT<T>
+            {
+                if(Cs[i].rows() != As[i].rows() || Cs[i].columns() != Bs[i].columns())
+                {
+                    Cs[i] = MatrixT<T>(As[i].rows(), Bs[i].columns());
+                }
+                BatchProblemT<T> problem = { As[i].rows(), Bs[i].columns(), As[i].columns(), As[i].data(), As[i].stride(), Bs[i].data(), Bs[i].stride(), Cs[i].data(), Cs[i].stride() };
+                return problem;
+            });
+        }
+
+        /**
+         * Multiply a batch of independent pairs with the number of threads estimated
+         * from the size of the whole batch.
+         */ 
+        template<typename T>
+        void multiplyBatch(const MatrixT<T>* As, const MatrixT<T>* Bs, MatrixT<T>* Cs, int count)
+        {
+            if(count <= 0)
+            {
+                return;
+            }
+            multiplyBatch(As, Bs, Cs, count, autoBatchConfig(As[0].rows(), Bs[0].columns(), As[0].columns(), count).numThreads);
+        }
+
+        /**
+         * Multiply a strided batch, C_i = A_i * B_i for i in [0, count), where A_i
+         * starts at A + i * strideA and the same for B and C.  All the problems have
+         * the same shape.  C does not need to be zeroed.
+         * 
+         * :param M: Rows of each A and C.
+         * :param N: Columns of each B and C.
+         * :param K: Columns of each A and rows of each B.
+         * :param A: First element of A_0.
+         * :param lda: Stride between the rows of an A.
+         * :param strideA: Elements between the starts of two As.
+         * :param B: First element of B_0.
+         * :param ldb: Stride between the rows of a B.
+         * :param strideB: Elements between the starts of two Bs.
+         * :param C: First element of C_0.
+         * :param ldc: Stride between the rows of a C.
+         * :param strideC: Elements between the starts of two Cs.
+         * :param count: Number of problems.
+         * :param numThreads: Number of threads to use.
+         */ 
+        template<typename T>
+        void multiplyBatchStrided(int M, int N, int K, const T* A, int lda, size_t strideA, const T* B, int ldb, size_t strideB,
+                                  T* C, int ldc, size_t strideC, int count, int numThreads)
+        {
+            multiplyBatchWithConfig<T>(count, M, N, K, explicitConfig(numThreads), [&](int i) -> BatchProblemT<T>
+            {
+                BatchProblemT<T> problem = { M, N, K, A + i * strideA, lda, B + i * strideB, ldb, C + i * strideC, ldc };
+                return problem;
+            });
+        }
+
+        /**
+         * Multiply two batches, result i = As matrix i times Bs matrix i.
+         * 
+         * :param As: Batch of M x K matrices.
+         * :param Bs: Batch of K x N matrices, the same count as As.
+         * :param numThreads: Number of threads to use.
+         * :return: Batch of the M x N results.
+         */ 
+        template<typename T>
+        MatrixBatchT<T> multiplyBatch(const MatrixBatchT<T>& As, const MatrixBatchT<T>& Bs, int numThreads)
+        {
+            MatrixBatchT<T> resultBatch(As.count(), As.rows(), Bs.columns());
+            multiplyBatchStrided(As.rows(), Bs.columns(), As.columns(), As.data(), As.stride(), As.matrixStride(), Bs.data(), Bs.stride(), Bs.matrixStride(),
+                                 resultBatch.data(), resultBatch.stride(), resultBatch.matrixStride(), As.count(), numThreads);
+            return resultBatch;
+        }
+
+        /**
+         * Multiply two batches with the number of threads estimated from the size of
+         * the whole batch.
+         */ 
+        template<typename T>
+        MatrixBatchT<T> multiplyBatch(const MatrixBatchT<T>& As, const MatrixBatchT<T>& Bs)
+        {
+            return multiplyBatch(As, Bs, autoBatchConfig(As.rows(), Bs.columns(), As.columns(), As.count()).numThreads);
+        }
+
+        /**
+         * Multiply a sparse matrix by a dense matrix.  Only the nonzeros of m1 are
+         * multiplied, so the time is about m1.nonZeros() * m2.columns() multiply-adds,
+         * whatever the shape of m1.  The rows of the result are split between the
+         * threads by the nonzeros of m1.  A CSC m1 is converted to CSR first.
+         * 
+         * :param m1: Sparse first matrix.
+         * :param m2: Dense second matrix.  It must have m1.columns() rows.
+         * :param numThreads: Number of threads to use.
+         * :return: The dense product.
+         */ 
+        template<typename T>
+        MatrixT<T> matrixMultiply(const SparseMatrixT<T>& m1, const MatrixT<T>& m2, int numThreads)
+        {
+            MatrixT<T> resultMaxtrix;
+            matrixMultiply(m1, m2, resultMaxtrix, numThreads);
+            return resultMaxtrix;
+        }
+
+        /**
+         * Multiply a sparse matrix by a dense matrix into a given result.  A result
+         * that is already the size of the product is overwritten in place.
+         * 
+         * :param m1: Sparse first matrix.
+         * :param m2: Dense second matrix.  It must have m1.columns() rows.
+         * :param resultMaxtrix: The result.  If it is not the size of the product, it
+         *                       is replaced by a new matrix.
+         * :param numThreads: Number of threads to use.
+         */ 
+        template<typename T>
+        void matrixMultiply(const SparseMatrixT<T>& m1, const MatrixT<T>& m2, MatrixT<T>& resultMaxtrix, int numThreads)
+        {
+            if(m1.format() != SPARSE_CSR)
+            {
+                matrixMultiply(SparseKernels::convert(m1, SPARSE_CSR), m2, resultMaxtrix, numThreads);
+                return;
+            }
+
+            if(!mObserver)
+            {
+                runSparseMultiply(m1, m2, resultMaxtrix, numThreads, nullptr);
+                return;
+            }
+
+            CallStats stats("multiplySparse", m1.rows(), m2.columns(), m1.columns(), numThreads);
+            stats.bytesRead = m1.sizeInBytes() + (uint64_t)m2.rows() * m2.columns() * sizeof(T);
+            stats.bytesWritten = (uint64_t)m1.rows() * m2.columns() * sizeof(T);
+
+            CallRecorder recorder(*mObserver, stats);
+            runSparseMultiply(m1, m2, resultMaxtrix, numThreads, &stats);
+            recorder.finish();
+        }
+
+        /**
+         * Multiply a sparse matrix by a dense matrix with the number of threads
+         * estimated from the nonzeros.
+         */ 
+        template<typename T>
+        MatrixT<T> matrixMultiply(const SparseMatrixT<T>& m1, const MatrixT<T>& m2)
+        {
+            return matrixMultiply(m1, m2, sparseThreads((double)m1.nonZeros() * m2.columns()));
+        }
+
+        /**
+         * Multiply two sparse matrices.  Each row of the result is summed from the rows
+         * of m2 picked by the nonzeros of the row of m1, so the time and memory follow
+         * the nonzeros of the operands and the result, not their shapes.  The rows are
+         * split between the threads by the nonzeros of m1.  CSC operands are converted
+         * to CSR first.
+         * 
+         * :param m1: Sparse first matrix.
+         * :param m2: Sparse second matrix.  It must have m1.columns() rows.
+         * :param numThreads: Number of threads to use.
+         * :return: The product in CSR form.  Products that sum to 0 are kept.
+         */ 
+        template<typename T>
+        SparseMatrixT<T> matrixMultiply(const SparseMatrixT<T>& m1, const SparseMatrixT<T>& m2, int numThreads)
+        {
+            if(m1.format() != SPARSE_CSR || m2.format() != SPARSE_CSR)
+            {
+                return matrixMultiply(SparseKernels::convert(m1, SPARSE_CSR), SparseKernels::convert(m2, SPARSE_CSR), numThreads);
+            }
+
+            if(!mObserver)
+            {
+                return runSparseMultiply(m1, m2, numThreads, nullptr);
+            }
+
+            CallStats stats("multiplySparse", m1.rows(), m2.columns(), m1.columns(), numThreads);
+            stats.bytesRead = m1.sizeInBytes() + m2.sizeInBytes();
+
+            CallRecorder recorder(*mObserver, stats);
+            SparseMatrixT<T> resultMaxtrix = runSparseMultiply(m1, m2, numThreads, &stats);
+            stats.bytesWritten = resultMaxtrix.sizeInBytes();
+            recorder.finish();
+            return resultMaxtrix;
+        }
+
+        /**
+         * Multiply two sparse matrices with the number of threads estimated from the
+         * number of products of nonzeros.
+         */ 
+        template<typename T>
+        SparseMatrixT<T> matrixMultiply(const SparseMatrixT<T>& m1, const SparseMatrixT<T>& m2)
+        {
+            if(m1.format() != SPARSE_CSR || m2.format() != SPARSE_CSR)
+            {
+                return matrixMultiply(SparseKernels::convert(m1, SPARSE_CSR), SparseKernels::convert(m2, SPARSE_CSR));
+            }
+
+            double products = 0.0;
+            for(size_t at = 0; at < m1.nonZeros(); at++)
+            {
+                const int k = m1.indices()[at];
+                products += (double)(m2.offsets()[k + 1] - m2.offsets()[k]);
+            }
+            return matrixMultiply(m1, m2, sparseThreads(products));
+        }
+
+        /**
+         * Transpose a sparse matrix.  The result has the same format.  This is a
+         * counting sort of the nonzeros, so it takes time in the number of nonzeros
+         * plus the rows and columns.  Use SparseKernels::convert() to change between
+         * CSR and CSC instead, which is the same work.
+         * 
+         * :param origMatrix: Matrix to transpose.
+         * :return: Transposed matrix.
+         */ 
+        template<typename T>
+        SparseMatrixT<T> transpose(const SparseMatrixT<T>& origMatrix)
+        {
+            return SparseKernels::transpose(origMatrix);
+        }
+
+        /**
+         * Multiply two fixed size matrices.  The sizes are checked at compile time and
+         * the kernel is fully unrolled.  Nothing is allocated, no threads are used and
+         * the observer is not told, since timing the call would cost more than the call.
+         * 
+         * :param m1: First matrix to multiply, R x K.
+         * :param m2: Second matrix to multiply, K x C.
+         * :return: The R x C solution.
+         */ 
+        template<typename T, int R, int K, int C>
+        FixedMatrix<T, R, C> matrixMultiply(const FixedMatrix<T, R, K>& m1, const FixedMatrix<T, K, C>& m2)
+        {
+            FixedMatrix<T, R, C> resultMaxtrix;
+            FixedKernels::multiply<T, R, C, K>(m1.data(), m2.data(), resultMaxtrix.data());
+            return resultMaxtrix;
+        }
+
+        /**
+         * Multiply a fixed size matrix by a Matrix.  The rows and columns of the fixed
+         * matrix are unrolled and the columns of m2 are a vectorized loop.  When m2 is
+         * large the fixed matrix is copied into a Matrix and the tuned, threaded
+         * multiply is used instead.
+         * 
+         * :param m1: First matrix to multiply, R x K.
+         * :param m2: Second matrix to multiply.  Must have K rows.
+         * :return: The solution to multiplying the two matrices.
+         */ 
+        template<typename T, int R, int K>
+        MatrixT<T> matrixMultiply(const FixedMatrix<T, R, K>& m1, const MatrixT<T>& m2)
+        {
+            if((long long)R * K * m2.columns() >= FIXED_DYNAMIC_LIMIT)
+            {
+                return matrixMultiply(m1.toMatrix(), m2);
+            }
+
+            MatrixT<T> resultMaxtrix(R, m2.columns());
+            FixedKernels::multiplyFixedLeft<T, R, K>(m1.data(), m2.data(), m2.stride(), resultMaxtrix.data(), resultMaxtrix.stride(), m2.columns());
+            return resultMaxtrix;
+        }
+
+        /**
+         * Multiply a Matrix by a fixed size matrix.  Each row of the result is
+         * computed with the shared dimension and the columns unrolled.  When m1 is
+         * large the fixed matrix is copied into a Matrix and the tuned, threaded
+         * multiply is used instead.
+         * 
+         * :param m1: First matrix to multiply.  Must have K columns.
+         * :param m2: Second matrix to multiply, K x C.
+         * :return: The solution to multiplying the two matrices.
+         */ 
+        template<typename T, int K, int C>
+        MatrixT<T> matrixMultiply(const MatrixT<T>& m1, const FixedMatrix<T, K, C>& m2)
+        {
+            if((long long)m1.rows() * K * C >= FIXED_DYNAMIC_LIMIT)
+            {
+                return matrixMultiply(m1, m2.toMatrix());
+            }
+
+            MatrixT<T> resultMaxtrix(m1.rows(), C);
+            FixedKernels::multiplyFixedRight<T, K, C>(m1.data(), m1.stride(), m1.rows(), m2.data(), resultMaxtrix.data(), resultMaxtrix.stride());
+            return resultMaxtrix;
+        }
+
+        /**
+         * Transpose a fixed size matrix.  Fully unrolled, nothing is allocated.
+         * 
+         * :param origMatrix: Original matrix to transpose, R x C.
+         * :return: The C x R transposed matrix.
+         */ 
+        template<typename T, int R, int C>
+        FixedMatrix<T, C, R> transpose(const FixedMatrix<T, R, C>& origMatrix)
+        {
+            FixedMatrix<T, C, R> newMatrix;
+            FixedKernels::transpose<T, R, C>(origMatrix.data(), newMatrix.data());
+            return newMatrix;
+        }
+
+        /**
+         * Transpose a 2D matrix.
+         * 
+         * The 2D matrix is copied into a Matrix, transposed and copied back out.  Use the
+         * Matrix version to skip the copies.  The result must be cleaned up with
+         * MatrixCommon::clean2DMatrix().
+         * 
+         * :param origMatrix: Original matrix to transpose.
+         * :param rows: Number of rows in the original matrix.
+         * :param columns: Number of columns in the original matrix.
+         * :param numThreads: Number of threads to use.
+         * :return: Transposed matrix.
+         */ 
+        double** transpose(double** origMatrix, int rows, int columns, int numThreads)
+        {
+            MatrixCommon mc;
+            return mc.to2DMatrix(transpose(mc.toMatrix(origMatrix, rows, columns), numThreads));
+        }
+
+        /**
+         * Matrix Multiplication of 2D matrices.
+         * 
+         * The 2D matrices are copied into a Matrix, multiplied and the result is copied back
+         * out.  Use the Matrix version to skip the copies.  The result must be cleaned up with
+         * MatrixCommon::clean2DMatrix().
+         * 
+         * :param m1: First matrix to multiply.
+         * :param m2: Second matrix to multiply.
+         * :param m1Rows: Number of rows in first matrix.
+         * :param m1Columns: Number of columns in first matrix and number of rows in second matrix.
+         * :param m2Columns: Number of columns in the second matrix.
+         * :param numThreads: Number of threads to use to do the calculation. Look above for suggested sizes.
+         * :return: The solution to multiplying the two matrices.
+         */ 
+        double** matrixMultiply(double** m1, double** m2, int m1Rows, int m1Columns, int m2Columns, int numThreads)
+        {
+            MatrixCommon mc;
+            return mc.to2DMatrix(matrixMultiply(mc.toMatrix(m1, m1Rows, m1Columns), mc.toMatrix(m2, m1Columns, m2Columns), numThreads));
+        }
+
+    private:
+        // Multiply-adds above which a fixed and a dynamic matrix use the Matrix multiply
+        static const long long FIXED_DYNAMIC_LIMIT = 1LL << 18;
+
+        BlockSizes mBlockSizes;             // Cache block sizes used by the multiply
+        shared_ptr<ThreadPool> mPool;       // Threads used by the threaded calls
+        shared_ptr<AutoTuner> mTuner;       // Configs for calls that do not give the number of threads
+        shared_ptr<CallObserver> mObserver; // Told about every call, null if stats are off
+        int mStrassenCrossover;             // Largest side multiplied without Strassen, 0 if Strassen is off
 };
\ No newline at end of file
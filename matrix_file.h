@@ -0,0 +1,404 @@
+#pragma once
+
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include "common.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MATRIX_MMAP 1
+#endif
+
+using namespace std;
+
+/**
+ * Type of the values in a matrix file.
+ */
+enum ElementType {
+    ELEMENT_FLOAT = 1,          // float
+    ELEMENT_DOUBLE = 2,         // double
+    ELEMENT_INT32 = 3,          // int32_t
+    ELEMENT_INT64 = 4,          // int64_t
+    ELEMENT_COMPLEX_FLOAT = 5,  // complex<float>
+    ELEMENT_COMPLEX_DOUBLE = 6  // complex<double>
+};
+
+template<typename T> struct ElementTypeOf;
+template<> struct ElementTypeOf<float> { static const ElementType value = ELEMENT_FLOAT; };
+template<> struct ElementTypeOf<double> { static const ElementType value = ELEMENT_DOUBLE; };
+template<> struct ElementTypeOf<int32_t> { static const ElementType value = ELEMENT_INT32; };
+template<> struct ElementTypeOf<int64_t> { static const ElementType value = ELEMENT_INT64; };
+template<> struct ElementTypeOf<complex<float> > { static const ElementType value = ELEMENT_COMPLEX_FLOAT; };
+template<> struct ElementTypeOf<complex<double> > { static const ElementType value = ELEMENT_COMPLEX_DOUBLE; };
+
+/**
+ * Version written in new files.  Files with another version are not read.
+ */
+static const uint32_t MATRIX_FILE_VERSION = 1;
+
+/**
+ * Written as a uint32_t so a file from a host with the other byte order is detected.
+ */
+static const uint32_t MATRIX_FILE_BYTE_ORDER = 0x01020304;
+
+/**
+ * Header at the start of a matrix file.  The rows follow at dataOffset, in the
+ * layout of a Matrix: row m starts stride * m values after row 0, and the row
+ * padding is zeros.  dataOffset and the rows are aligned like a Matrix, so the
+ * file can be mapped and used in place.
+ */
+struct MatrixFileHeader {
+    char magic[8];          // "MATRIXF" and a 0
+    uint32_t version;       // MATRIX_FILE_VERSION
+    uint32_t byteOrder;     // MATRIX_FILE_BYTE_ORDER in the byte order of the values
+    uint32_t elementType;   // ElementType of the values
+    uint32_t elementSize;   // Bytes per value
+    uint32_t alignment;     // Alignment of dataOffset and of the rows, in bytes
+    uint32_t reserved;      // 0
+    int64_t rows;           // Number of rows
+    int64_t columns;        // Number of columns
+    int64_t stride;         // Number of values between the start of two rows
+    uint64_t dataOffset;    // Bytes from the start of the file to row 0
+};
+
+static_assert(sizeof(MatrixFileHeader) == 64, "The matrix file header is 64 bytes");
+
+/**
+ * Reads and checks the header of matrix files.
+ */
+class MatrixFile {
+
+    public:
+        /**
+         * Header of a new file for a rows x columns matrix of T.
+         */
+        template<typename T>
+        static MatrixFileHeader header(int rows, int columns)
+        {
+            MatrixFileHeader header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, "MATRIXF", 8);
+            header.version = MATRIX_FILE_VERSION;
+            header.byteOrder = MATRIX_FILE_BYTE_ORDER;
+            header.elementType = ElementTypeOf<T>::value;
+            header.elementSize = sizeof(T);
+            header.alignment = MATRIX_ALIGNMENT;
+            header.rows = rows;
+            header.columns = columns;
+            header.stride = MatrixT<T>::paddedStride(columns);
+            header.dataOffset = (sizeof(MatrixFileHeader) + MATRIX_ALIGNMENT - 1) / MATRIX_ALIGNMENT * MATRIX_ALIGNMENT;
+            return header;
+        }
+
+        /**
+         * Check a header read from a file of fileSize bytes.
+         *
+         * :return: True if the file holds a matrix of T that fits in a Matrix.
+         */
+        template<typename T>
+        static bool isValid(const MatrixFileHeader& header, uint64_t fileSize)
+        {
+            if(memcmp(header.magic, "MATRIXF", 8) != 0 || header.version != MATRIX_FILE_VERSION || header.byteOrder != MATRIX_FILE_BYTE_ORDER ||
+               header.elementType != (uint32_t)ElementTypeOf<T>::value || header.elementSize != sizeof(T))
+            {
+                return false;
+            }
+            if(header.rows < 0 || header.columns < 0 || header.stride < header.columns ||
+               header.rows > INT32_MAX || header.stride > INT32_MAX || header.dataOffset < sizeof(MatrixFileHeader) ||
+               header.dataOffset % MATRIX_ALIGNMENT != 0 || header.dataOffset > fileSize)
+            {
+                return false;
+            }
+
+            // Divide instead of multiply, so a damaged header can not wrap around
+            const uint64_t rowBytes = (uint64_t)header.stride * sizeof(T);
+            return header.rows == 0 || rowBytes == 0 || (fileSize - header.dataOffset) / rowBytes >= (uint64_t)header.rows;
+        }
+
+        /**
+         * Read the header of a file.
+         *
+         * :return: False if the file could not be read.  The header is not checked.
+         */
+        static bool readHeader(const string& path, MatrixFileHeader& header)
+        {
+            ifstream file(path.c_str(), ios::binary);
+            return (bool)file.read(reinterpret_cast<char*>(&header), sizeof(header));
+        }
+
+        /**
+         * Write a whole matrix to a file.
+         *
+         * :return: False if the file could not be written.
+         */
+        template<typename T>
+        static bool save(const string& path, const MatrixT<T>& matrix);
+};
+
+/**
+ * Read-only matrix from a file, without copying the values.
+ *
+ * The file is mapped into memory and matrix() is a Matrix whose rows are the pages
+ * of the file.  Opening takes about the same time whatever the size of the file,
+ * the values are read from the disk the first time they are touched.  The pages are
+ * shared with the page cache and can be dropped by the kernel under memory
+ * pressure, so a matrix larger than the free memory can be used without being held
+ * twice.  Where mmap is not available the file is read into a Matrix instead.
+ *
+ * matrix() is valid until the file is closed or this object goes away.  It can be
+ * passed to every MatrixAlgebra call that takes a const Matrix.
+ */
+template<typename T>
+class MappedMatrixT {
+
+    public:
+        MappedMatrixT() : mMapping(nullptr), mMappingSize(0)
+        {
+        }
+
+        ~MappedMatrixT()
+        {
+            close();
+        }
+
+        /**
+         * Map a matrix file.  A file that is already open is closed first.
+         *
+         * :param path: File written by MatrixFileWriterT or MatrixFile::save().
+         * :return: False if the file could not be read or does not hold a matrix of T.
+         */
+        bool open(const string& path)
+        {
+            close();
+
+#if defined(MATRIX_MMAP)
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if(fd < 0)
+            {
+                return false;
+            }
+
+            struct stat info;
+            MatrixFileHeader header;
+            bool valid = fstat(fd, &info) == 0 && (uint64_t)info.st_size >= sizeof(header) &&
+                         pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+                         MatrixFile::isValid<T>(header, (uint64_t)info.st_size);
+            if(!valid)
+            {
+                ::close(fd);
+                return false;
+            }
+
+            // The mapping keeps the file open, the descriptor is not needed
+            void* mapping = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if(mapping == MAP_FAILED)
+            {
+                return false;
+            }
+            mMapping = mapping;
+            mMappingSize = (size_t)info.st_size;
+
+            T* data = reinterpret_cast<T*>(static_cast<char*>(mapping) + header.dataOffset);
+            mMatrix = MatrixT<T>(data, (int)header.rows, (int)header.columns, (int)header.stride);
+            return true;
+#else
+            ifstream file(path.c_str(), ios::binary);
+            MatrixFileHeader header;
+            if(!file.read(reinterpret_cast<char*>(&header), sizeof(header)))
+            {
+                return false;
+            }
+            file.seekg(0, ios::end);
+            if(!MatrixFile::isValid<T>(header, (uint64_t)file.tellg()))
+            {
+                return false;
+            }
+
+            MatrixT<T> matrix((int)header.rows, (int)header.columns, (int)header.stride);
+            file.seekg((streamoff)header.dataOffset);
+            if(!file.read(reinterpret_cast<char*>(matrix.data()), matrix.sizeInBytes()))
+            {
+                return false;
+            }
+            mMatrix = move(matrix);
+            return true;
+#endif
+        }
+
+        /**
+         * Unmap the file.  matrix() is empty after this.
+         */
+        void close()
+        {
+            mMatrix = MatrixT<T>();
+#if defined(MATRIX_MMAP)
+            if(mMapping != nullptr)
+            {
+                munmap(mMapping, mMappingSize);
+            }
+#endif
+            mMapping = nullptr;
+            mMappingSize = 0;
+        }
+
+        /**
+         * The matrix in the file.  Empty if no file is open.
+         */
+        const MatrixT<T>& matrix() const
+        {
+            return mMatrix;
+        }
+
+    private:
+        MappedMatrixT(const MappedMatrixT&);
+        MappedMatrixT& operator=(const MappedMatrixT&);
+
+        void* mMapping;         // Start of the mapped file, or null
+        size_t mMappingSize;    // Bytes mapped
+        MatrixT<T> mMatrix;     // Rows in the mapping, it does not own them
+};
+
+typedef MappedMatrixT<double> MappedMatrix;
+
+/**
+ * Writes a matrix file a piece at a time, so a result does not have to be held in
+ * memory to be saved.  The file is made at its full size by create(), then rows or
+ * blocks are written at their place in any order.  Parts that are never written
+ * read as zeros.
+ */
+template<typename T>
+class MatrixFileWriterT {
+
+    public:
+        MatrixFileWriterT() : mNextRow(0)
+        {
+            memset(&mHeader, 0, sizeof(mHeader));
+        }
+
+        /**
+         * Create the file and write the header.  An existing file is replaced.
+         *
+         * :param path: File to write.
+         * :param rows: Rows of the matrix.
+         * :param columns: Columns of the matrix.
+         * :return: False if the file could not be written.
+         */
+        bool create(const string& path, int rows, int columns)
+        {
+            mFile.close();
+            mFile.clear();
+            mNextRow = 0;
+            mHeader = MatrixFile::header<T>(rows, columns);
+
+            mFile.open(path.c_str(), ios::binary | ios::trunc | ios::out);
+            if(!mFile.write(reinterpret_cast<const char*>(&mHeader), sizeof(mHeader)))
+            {
+                return false;
+            }
+
+            // Set the size of the file by writing its last byte.  The rest reads as zeros.
+            const uint64_t end = mHeader.dataOffset + (uint64_t)mHeader.rows * mHeader.stride * sizeof(T);
+            if(end > sizeof(mHeader))
+            {
+                mFile.seekp((streamoff)(end - 1));
+                mFile.put(0);
+            }
+            return (bool)mFile;
+        }
+
+        /**
+         * Write the next rows, after the rows written by the last call.
+         *
+         * :param data: First value of the rows.
+         * :param rows: Number of rows.
+         * :param ld: Stride of the rows.
+         * :return: False if the rows could not be written or go past the last row.
+         */
+        bool writeRows(const T* data, int rows, int ld)
+        {
+            if(!writeBlock(mNextRow, 0, rows, (int)mHeader.columns, data, ld))
+            {
+                return false;
+            }
+            mNextRow += rows;
+            return true;
+        }
+
+        /**
+         * Write the next rows of a matrix with the same number of columns.
+         */
+        bool writeRows(const MatrixT<T>& matrix)
+        {
+            return matrix.columns() == mHeader.columns && writeRows(matrix.data(), matrix.rows(), matrix.stride());
+        }
+
+        /**
+         * Write a rows x columns block of the matrix.
+         *
+         * :param rowBegin: First row of the block in the matrix.
+         * :param columnBegin: First column of the block in the matrix.
+         * :param rows: Rows in the block.
+         * :param columns: Columns in the block.
+         * :param data: First value of the block.
+         * :param ld: Stride of the block.
+         * :return: False if the block could not be written or is not inside the matrix.
+         */
+        bool writeBlock(int rowBegin, int columnBegin, int rows, int columns, const T* data, int ld)
+        {
+            if(!mFile.is_open() || rowBegin < 0 || columnBegin < 0 || rows < 0 || columns < 0 ||
+               rowBegin + rows > mHeader.rows || columnBegin + columns > mHeader.columns)
+            {
+                return false;
+            }
+
+            for(int r = 0; r < rows; r++)
+            {
+                const uint64_t offset = mHeader.dataOffset + ((uint64_t)(rowBegin + r) * mHeader.stride + columnBegin) * sizeof(T);
+                mFile.seekp((streamoff)offset);
+                mFile.write(reinterpret_cast<const char*>(data + (size_t)r * ld), (streamsize)columns * sizeof(T));
+            }
+            return (bool)mFile;
+        }
+
+        /**
+         * Flush and close the file.
+         *
+         * :return: False if any write failed.
+         */
+        bool close()
+        {
+            if(!mFile.is_open())
+            {
+                return false;
+            }
+            mFile.flush();
+            const bool good = (bool)mFile;
+            mFile.close();
+            return good;
+        }
+
+    private:
+        MatrixFileWriterT(const MatrixFileWriterT&);
+        MatrixFileWriterT& operator=(const MatrixFileWriterT&);
+
+        MatrixFileHeader mHeader;   // Header of the file being written
+        ofstream mFile;             // The file
+        int mNextRow;               // Row written by the next writeRows()
+};
+
+typedef MatrixFileWriterT<double> MatrixFileWriter;
+
+template<typename T>
+bool MatrixFile::save(const string& path, const MatrixT<T>& matrix)
+{
+    MatrixFileWriterT<T> writer;
+    return writer.create(path, matrix.rows(), matrix.columns()) && writer.writeRows(matrix) && writer.close();
+}
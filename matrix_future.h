@@ -0,0 +1,189 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "common.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+class MatrixAlgebra;
+
+/**
+ * Result of an async call of MatrixAlgebra, like transposeAsync() or
+ * matrixMultiplyAsync().  The call returns right away and the matrix is computed
+ * on the thread pool.  A future can be the input of another async call, which
+ * starts when its inputs are ready, so a chain like transpose, multiply, multiply
+ * is queued at once as a small graph.  Calls that do not depend on each other run
+ * at the same time on the pool.
+ *
+ * Copies of a future share the same result.  The result stays valid while any copy,
+ * or any call waiting for it as an input, is alive.
+ *
+ * get() and wait() block until the matrix is ready.  While a thread waits, it runs
+ * the calls queued on the pool, so waiting from inside a task does not dead lock
+ * the pool.
+ */
+template<typename T>
+class MatrixFutureT {
+
+    public:
+        /**
+         * Empty future.  It has no result and can not be waited for.
+         */
+        MatrixFutureT()
+        {
+        }
+
+        /**
+         * Future that is already ready with the given matrix.  The matrix is moved in.
+         *
+         * :param matrix: The result.
+         */
+        explicit MatrixFutureT(MatrixT<T>&& matrix) : mState(make_shared<State>(nullptr))
+        {
+            mState->matrix = move(matrix);
+            mState->done = true;
+        }
+
+        /**
+         * Future that is ready with a matrix owned by the caller.  Nothing is copied,
+         * so the matrix must not change or go away until every call that reads it is
+         * done.
+         *
+         * :param matrix: The matrix.
+         * :return: A ready future.
+         */
+        static MatrixFutureT wrap(const MatrixT<T>& matrix)
+        {
+            MatrixFutureT future;
+            future.mState = make_shared<State>(nullptr);
+            future.mState->matrix = MatrixT<T>(const_cast<T*>(matrix.data()), matrix.rows(), matrix.columns(), matrix.stride());
+            future.mState->done = true;
+            return future;
+        }
+
+        /**
+         * True if the future has a result, ready or not.
+         */
+        bool valid() const { return mState != nullptr; }
+
+        /**
+         * True if the result is ready.  Does not block.
+         */
+        bool ready() const
+        {
+            lock_guard<mutex> lock(mState->stateMutex);
+            return mState->done;
+        }
+
+        /**
+         * Block until the result is ready.  The thread runs calls queued on the pool
+         * while it waits.
+         */
+        void wait() const
+        {
+            unique_lock<mutex> lock(mState->stateMutex);
+            while(!mState->done)
+            {
+                if(mState->pool != nullptr)
+                {
+                    lock.unlock();
+                    const bool ran = mState->pool->runPostedTask();
+                    lock.lock();
+                    if(ran)
+                    {
+                        continue;
+                    }
+                }
+
+                // A call posted later is only seen after the timeout
+                mState->readyChanged.wait_for(lock, chrono::milliseconds(1));
+            }
+        }
+
+        /**
+         * The result.  Blocks until it is ready.
+         */
+        const MatrixT<T>& get() const
+        {
+            wait();
+            return mState->matrix;
+        }
+
+    private:
+        friend class MatrixAlgebra;
+
+        struct State {
+            explicit State(ThreadPool* pool) : done(false), pool(pool)
+            {
+            }
+
+            mutex stateMutex;                           // Guards the fields below
+            condition_variable readyChanged;            // Signaled when done is set
+            bool done;                                  // The matrix is ready
+            MatrixT<T> matrix;                          // The result
+            vector<function<void()> > continuations;    // Run when the result is ready
+            ThreadPool* pool;                           // Pool the result is computed on, or null
+        };
+
+        /**
+         * Future for a result that will be computed on the pool.
+         */
+        static MatrixFutureT pending(ThreadPool* pool)
+        {
+            MatrixFutureT future;
+            future.mState = make_shared<State>(pool);
+            return future;
+        }
+
+        /**
+         * Call continuation when the result is ready.  If it already is, it is
+         * called now on this thread.
+         */
+        void onReady(function<void()> continuation) const
+        {
+            {
+                lock_guard<mutex> lock(mState->stateMutex);
+                if(!mState->done)
+                {
+                    mState->continuations.push_back(move(continuation));
+                    return;
+                }
+            }
+            continuation();
+        }
+
+        /**
+         * Set the result, wake the threads that wait for it and start the calls that
+         * were waiting for it.  The continuations are dropped after they run, so the
+         * futures they hold are freed.
+         */
+        void complete(MatrixT<T>&& matrix) const
+        {
+            vector<function<void()> > continuations;
+            {
+                lock_guard<mutex> lock(mState->stateMutex);
+                mState->matrix = move(matrix);
+                mState->done = true;
+                continuations.swap(mState->continuations);
+            }
+            mState->readyChanged.notify_all();
+
+            for(auto& continuation : continuations)
+            {
+                continuation();
+            }
+        }
+
+        shared_ptr<State> mState;   // Result shared by the copies
+};
+
+/**
+ * Future of a double matrix.
+ */
+typedef MatrixFutureT<double> MatrixFuture;
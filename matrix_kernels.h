@@ -0,0 +1,1200 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+#include "common.h"
+#include "element_kernels.h"
+#include "instrumentation.h"
+#include "packed_matrix.h"
+#include "simd_kernels.h"
+
+using namespace std;
+
+/**
+ * Largest piece of a transpose done without cutting it in half.  A 32 x 32
+ * piece of doubles is 8 KB, so the source and destination fit in the L1 cache.
+ */
+static const int TRANSPOSE_TILE = 32;
+
+/**
+ * Matrices of at least this many bytes are filled with non-temporal stores, which
+ * write around the caches.  A smaller matrix is likely read again soon and is
+ * better left in the cache.
+ */
+static const size_t FILL_STREAM_BYTES = 16 << 20;
+
+/**
+ * Bytes of the block of values a streamed fill copies from, small enough to stay
+ * in L1.
+ */
+static const int FILL_CHUNK_BYTES = 1024;
+
+/**
+ * Cache block sizes for the blocked multiply.
+ *
+ * mc x kc is the block of A that is packed and kept in the L2 cache.
+ * kc x nc is the block of B that is packed and kept in the L3 cache.
+ * A kc x nr micro-panel of B stays in the L1 cache while the micro-kernel
+ * walks down the packed block of A.
+ */
+struct BlockSizes {
+    int mc;         // Rows of A in a packed block
+    int kc;         // Shared dimension in a packed block
+    int nc;         // Columns of B in a packed block
+};
+
+/**
+ * How an operand of a multiply is read, like the op(A) of BLAS gemm.  A transposed
+ * operand is read transposed while it is packed, so no transposed copy is made.
+ */
+enum MatrixOp {
+    OP_NO_TRANSPOSE = 0,    // Use the matrix as it is
+    OP_TRANSPOSE = 1        // Use the transpose of the matrix
+};
+
+/**
+ * Buffer aligned to MATRIX_ALIGNMENT used to hold packed panels.
+ * The buffer only grows, so it can be reused between blocks.
+ */
+template<typename T>
+class AlignedBufferT {
+
+    public:
+        AlignedBufferT() : mBuffer(nullptr), mData(nullptr), mSize(0)
+        {
+        }
+
+        ~AlignedBufferT()
+        {
+            delete [] mBuffer;
+        }
+
+        /**
+         * Make sure the buffer holds at least size elements.  The old values
+         * are not kept when the buffer grows.
+         *
+         * :param size: Number of elements needed.
+         * :return: Aligned pointer to the buffer.
+         */
+        T* reserve(size_t size)
+        {
+            if(size > mSize)
+            {
+                delete [] mBuffer;
+                mBuffer = new char[size * sizeof(T) + MATRIX_ALIGNMENT];
+                uintptr_t start = reinterpret_cast<uintptr_t>(mBuffer);
+                start = (start + MATRIX_ALIGNMENT - 1) & ~(uintptr_t)(MATRIX_ALIGNMENT - 1);
+                mData = reinterpret_cast<T*>(start);
+                mSize = size;
+            }
+            return mData;
+        }
+
+        T* data() { return mData; }
+
+        /**
+         * Number of elements the buffer holds.
+         */
+        size_t size() const { return mSize; }
+
+    private:
+        AlignedBufferT(const AlignedBufferT&);
+        AlignedBufferT& operator=(const AlignedBufferT&);
+
+        char* mBuffer;      // Allocation that is freed
+        T* mData;           // Aligned start of the buffer
+        size_t mSize;       // Number of elements in the buffer
+};
+
+typedef AlignedBufferT<double> AlignedBuffer;
+
+/**
+ * Buffers kept by each thread for the packed blocks and partial sums of the calls,
+ * so a call reuses the buffers of the calls before it instead of allocating new
+ * ones.  Buffers are taken with ScratchBufferT and given back when it goes out of
+ * scope.  The buffers only grow, so once a thread has run a call of some shape,
+ * the next calls of that shape or smaller allocate nothing.  A nested call on the
+ * same thread takes other buffers, so it does not overwrite the ones in use.
+ *
+ * The threads of the pool keep their buffers while they run.  The packing buffers
+ * are at most the block sizes, a few MB per thread.  The split-K partial sums are
+ * the size of the result times the slices, so clear() frees the buffers of the
+ * calling thread after a large call that will not be repeated.
+ */
+template<typename T>
+class ScratchPoolT {
+
+    public:
+        ScratchPoolT() : mCreated(0)
+        {
+        }
+
+        ~ScratchPoolT()
+        {
+            clear();
+        }
+
+        /**
+         * The pool of the calling thread.
+         */
+        static ScratchPoolT& local()
+        {
+            static thread_local ScratchPoolT pool;
+            return pool;
+        }
+
+        /**
+         * Take a free buffer, or make a new one if all of them are in use.
+         */
+        AlignedBufferT<T>* acquire()
+        {
+            if(mFree.empty())
+            {
+                mCreated++;
+                return new AlignedBufferT<T>();
+            }
+            AlignedBufferT<T>* buffer = mFree.back();
+            mFree.pop_back();
+            return buffer;
+        }
+
+        /**
+         * Give back a buffer taken with acquire().
+         */
+        void release(AlignedBufferT<T>* buffer)
+        {
+            mFree.push_back(buffer);
+        }
+
+        /**
+         * Free the buffers that are not in use.
+         */
+        void clear()
+        {
+            for(AlignedBufferT<T>* buffer : mFree)
+            {
+                delete buffer;
+            }
+            mFree.clear();
+        }
+
+        /**
+         * Number of buffers made by this pool, to check that a loop allocates nothing.
+         */
+        size_t created() const { return mCreated; }
+
+        /**
+         * Bytes held by the free buffers.
+         */
+        size_t bytes() const
+        {
+            size_t total = 0;
+            for(const AlignedBufferT<T>* buffer : mFree)
+            {
+                total += buffer->size() * sizeof(T);
+            }
+            return total;
+        }
+
+    private:
+        ScratchPoolT(const ScratchPoolT&);
+        ScratchPoolT& operator=(const ScratchPoolT&);
+
+        vector<AlignedBufferT<T>*> mFree;   // Buffers not in use
+        size_t mCreated;                    // Number of buffers made
+};
+
+/**
+ * Buffer taken from the ScratchPoolT of the calling thread while in scope.  It must
+ * go out of scope on the thread that made it.
+ */
+template<typename T>
+class ScratchBufferT {
+
+    public:
+        ScratchBufferT() : mPool(ScratchPoolT<T>::local()), mBuffer(mPool.acquire())
+        {
+        }
+
+        ~ScratchBufferT()
+        {
+            mPool.release(mBuffer);
+        }
+
+        AlignedBufferT<T>& buffer() { return *mBuffer; }
+
+    private:
+        ScratchBufferT(const ScratchBufferT&);
+        ScratchBufferT& operator=(const ScratchBufferT&);
+
+        ScratchPoolT<T>& mPool;         // Pool the buffer goes back to
+        AlignedBufferT<T>* mBuffer;     // The buffer
+};
+
+/**
+ * One problem of a batch, C = A * B with A M x K and B K x N.
+ */
+template<typename T>
+struct BatchProblemT {
+    int M;          // Rows of A and C
+    int N;          // Columns of B and C
+    int K;          // Columns of A and rows of B
+    const T* A;     // First element of A
+    int lda;        // Stride of A
+    const T* B;     // First element of B
+    int ldb;        // Stride of B
+    T* C;           // First element of C
+    int ldc;        // Stride of C
+};
+
+/**
+ * Operands of C = alpha * op(A) * op(B) + beta * C.  op(A) is M x K and op(B) is K x N.
+ */
+template<typename T>
+struct GemmOperandsT {
+    MatrixOp opA;           // How A is read
+    MatrixOp opB;           // How B is read
+    T alpha;                // Factor of the product
+    const MatrixT<T>* A;    // First matrix as it is stored
+    const MatrixT<T>* B;    // Second matrix as it is stored
+    T beta;                 // Factor of C
+
+    int rows() const { return opA == OP_TRANSPOSE ? A->columns() : A->rows(); }
+    int columns() const { return opB == OP_TRANSPOSE ? B->rows() : B->columns(); }
+    int depth() const { return opA == OP_TRANSPOSE ? A->rows() : A->columns(); }
+
+    /**
+     * Pointer to element (m, k) of op(A).
+     */
+    const T* a(int m, int k) const { return opA == OP_TRANSPOSE ? A->row(k) + m : A->row(m) + k; }
+
+    /**
+     * Pointer to element (k, n) of op(B).
+     */
+    const T* b(int k, int n) const { return opB == OP_TRANSPOSE ? B->row(n) + k : B->row(k) + n; }
+};
+
+/**
+ * Largest M, N and K of the problems that use the interleaved batch kernel.  Larger
+ * problems fill the registers of the micro-kernels on their own.
+ */
+static const int BATCH_INTERLEAVE_MAX = 8;
+
+/**
+ * Compute kernels that work on raw row-major buffers.
+ *
+ * The multiply is the blocked algorithm used by most BLAS libraries.  The
+ * matrices are split into blocks that fit in the caches.  Each block of A and B
+ * is packed into a contiguous buffer in the order the micro-kernel reads it.
+ * The micro-kernel then computes a small tile of C that is held in registers.
+ *
+ * The micro-kernel and its tile size come from ElementKernels<T>::active(), so the
+ * packing follows the tile size of the element type and of the instruction set
+ * picked at runtime.  The block sizes are in elements, so a float block takes half
+ * the cache of a double block.
+ */
+class MatrixKernels {
+
+    public:
+        /**
+         * Default block sizes.  The packed A block is about 192 KB (L2) and
+         * the packed B block is about 4 MB (L3).
+         */
+        static BlockSizes defaultBlockSizes()
+        {
+            BlockSizes blockSizes;
+            blockSizes.mc = 96;
+            blockSizes.kc = 256;
+            blockSizes.nc = 2048;
+            return blockSizes;
+        }
+
+        /**
+         * Blocked matrix multiply C += A * B.
+         *
+         * Each element of C is accumulated in k order.  With the scalar kernels the
+         * result is the same as the simple i-j-k loop.  The FMA kernels round once
+         * per multiply-add, so the last bits can differ.
+         *
+         * :param M: Number of rows in A and C.
+         * :param N: Number of columns in B and C.
+         * :param K: Number of columns in A and rows in B.
+         * :param A: First element of A.
+         * :param lda: Stride of A.
+         * :param B: First element of B.
+         * :param ldb: Stride of B.
+         * :param C: First element of C.
+         * :param ldc: Stride of C.
+         * :param blockSizes: Cache block sizes to use.
+         */
+        template<typename T>
+        static void gemm(int M, int N, int K, const T* A, int lda, const T* B, int ldb, T* C, int ldc, const BlockSizes& blockSizes)
+        {
+            gemm(M, N, K, A, lda, B, ldb, C, ldc, blockSizes, ElementKernels<T>::active());
+        }
+
+        /**
+         * Blocked matrix multiply C += A * B with the given kernels.
+         *
+         * :param kernels: Kernels to use.  The CPU must support them.
+         * :param stats: If not null, the allocate, pack and compute times and the
+         *               packed bytes are added to it.
+         */
+        template<typename T>
+        static void gemm(int M, int N, int K, const T* A, int lda, const T* B, int ldb, T* C, int ldc, const BlockSizes& blockSizes, const KernelTableT<T>& kernels, ThreadStats* stats = nullptr)
+        {
+            ScratchBufferT<T> packedA;
+            ScratchBufferT<T> packedB;
+            gemm(M, N, K, A, lda, B, ldb, C, ldc, blockSizes, kernels, packedA.buffer(), packedB.buffer(), stats);
+        }
+
+        /**
+         * Blocked matrix multiply C += A * B with the given kernels and packing buffers.
+         * The buffers only grow, so a caller doing many multiplies allocates them once.
+         *
+         * :param packedA: Buffer for the packed blocks of A.
+         * :param packedB: Buffer for the packed blocks of B.
+         */
+        template<typename T>
+        static void gemm(int M, int N, int K, const T* A, int lda, const T* B, int ldb, T* C, int ldc, const BlockSizes& blockSizes, const KernelTableT<T>& kernels,
+                         AlignedBufferT<T>& packedA, AlignedBufferT<T>& packedB, ThreadStats* stats)
+        {
+            gemm(OP_NO_TRANSPOSE, OP_NO_TRANSPOSE, M, N, K, T(1), A, lda, B, ldb, C, ldc, blockSizes, kernels, packedA, packedB, stats);
+        }
+
+        /**
+         * Blocked matrix multiply C += alpha * op(A) * op(B).
+         *
+         * op(A) is M x K and op(B) is K x N.  A transposed operand is stored K x M
+         * (or N x K) and is read transposed while it is packed.  alpha is applied
+         * while A is packed.  Scale C first for the beta of BLAS gemm, see scale().
+         *
+         * :param opA: How A is read.
+         * :param opB: How B is read.
+         * :param alpha: Factor of the product.
+         * :param A: First element of A as it is stored.
+         * :param lda: Stride of A as it is stored.
+         * :param B: First element of B as it is stored.
+         * :param ldb: Stride of B as it is stored.
+         *
+         * A and B can be stored in a narrower type S than the T of the sums, like float
+         * for double sums.  The values are converted to T while they are packed, so
+         * the micro-kernel of T runs unchanged.
+         */
+        template<typename T, typename S>
+        static void gemm(MatrixOp opA, MatrixOp opB, int M, int N, int K, T alpha, const S* A, int lda, const S* B, int ldb, T* C, int ldc,
+                         const BlockSizes& blockSizes, const KernelTableT<T>& kernels, AlignedBufferT<T>& packedA, AlignedBufferT<T>& packedB, ThreadStats* stats)
+        {
+            if(M <= 0 || N <= 0 || K <= 0)
+            {
+                return;
+            }
+
+            // Round the block sizes to whole micro-panels
+            const int mc = roundUp(min(blockSizes.mc, M), kernels.mr);
+            const int nc = roundUp(min(blockSizes.nc, N), kernels.nr);
+            const int kc = min(blockSizes.kc, K);
+
+            T* aBuffer;
+            T* bBuffer;
+            {
+                PhaseTimer timer(stats != nullptr ? &stats->allocateSeconds : nullptr);
+                aBuffer = packedA.reserve((size_t)mc * kc);
+                bBuffer = packedB.reserve((size_t)kc * nc);
+            }
+
+            for(int jc = 0; jc < N; jc += nc)
+            {
+                const int ncCur = min(nc, N - jc);
+
+                for(int pc = 0; pc < K; pc += kc)
+                {
+                    const int kcCur = min(kc, K - pc);
+
+                    // Pack the block of B into nr wide panels
+                    {
+                        PhaseTimer timer(stats != nullptr ? &stats->packSeconds : nullptr);
+                        const S* block = opB == OP_TRANSPOSE ? B + (size_t)jc * ldb + pc : B + (size_t)pc * ldb + jc;
+                        packB(opB, kcCur, ncCur, kernels.nr, block, ldb, bBuffer);
+                    }
+                    if(stats != nullptr)
+                    {
+                        stats->bytesPacked += (size_t)kcCur * roundUp(ncCur, kernels.nr) * sizeof(T);
+                    }
+
+                    for(int ic = 0; ic < M; ic += mc)
+                    {
+                        const int mcCur = min(mc, M - ic);
+
+                        // Pack the block of A into mr tall panels
+                        {
+                            PhaseTimer timer(stats != nullptr ? &stats->packSeconds : nullptr);
+                            const S* block = opA == OP_TRANSPOSE ? A + (size_t)pc * lda + ic : A + (size_t)ic * lda + pc;
+                            packA(opA, mcCur, kcCur, kernels.mr, alpha, block, lda, aBuffer);
+                        }
+                        if(stats != nullptr)
+                        {
+                            stats->bytesPacked += (size_t)roundUp(mcCur, kernels.mr) * kcCur * sizeof(T);
+                        }
+
+                        PhaseTimer timer(stats != nullptr ? &stats->computeSeconds : nullptr);
+                        macroKernel(kernels, mcCur, ncCur, kcCur, aBuffer, bBuffer, C + (size_t)ic * ldc + jc, ldc);
+                    }
+                }
+            }
+        }
+
+        /**
+         * Blocked matrix multiply C += alpha * op(A) * B where B was packed before
+         * with packMatrix().  The packing of B is skipped, only A is packed.
+         *
+         * :param opA: How A is read.
+         * :param M: Number of rows in op(A) and C.
+         * :param N: Number of columns of B to use, from column columnBegin.
+         * :param alpha: Factor of the product.
+         * :param A: First element of A as it is stored.
+         * :param lda: Stride of A as it is stored.
+         * :param B: The packed matrix.  op(A) has B.rows() columns.
+         * :param columnBegin: First column of B to use, a multiple of B.nr().
+         * :param C: First element of C.
+         * :param ldc: Stride of C.
+         * :param mcBlock: Rows of A in a packed block.
+         * :param packedA: Buffer for the packed blocks of A.
+         * :param stats: If not null, the allocate, pack and compute times and the
+         *               packed bytes are added to it.
+         */
+        template<typename T>
+        static void gemm(MatrixOp opA, int M, int N, T alpha, const T* A, int lda, const PackedMatrixT<T>& B, int columnBegin, T* C, int ldc,
+                         int mcBlock, AlignedBufferT<T>& packedA, ThreadStats* stats)
+        {
+            const int K = B.rows();
+            if(M <= 0 || N <= 0 || K <= 0)
+            {
+                return;
+            }
+
+            const KernelTableT<T>& kernels = ElementKernels<T>::table(B.isa());
+            const int mc = roundUp(min(mcBlock, M), kernels.mr);
+            const int kc = B.kc();
+            const int nc = B.nc();
+            const int columnEnd = columnBegin + N;
+
+            T* aBuffer;
+            {
+                PhaseTimer timer(stats != nullptr ? &stats->allocateSeconds : nullptr);
+                aBuffer = packedA.reserve((size_t)mc * kc);
+            }
+
+            // Walk the columns in pieces that stay inside one packed block of B
+            for(int jc = columnBegin; jc < columnEnd; )
+            {
+                const int blockEnd = jc - jc % nc + nc;
+                const int ncCur = min(blockEnd, columnEnd) - jc;
+
+                for(int pc = 0; pc < K; pc += kc)
+                {
+                    const int kcCur = min(kc, K - pc);
+                    const T* bBuffer = B.panel(pc, jc);
+
+                    for(int ic = 0; ic < M; ic += mc)
+                    {
+                        const int mcCur = min(mc, M - ic);
+
+                        // Pack the block of A into mr tall panels
+                        {
+                            PhaseTimer timer(stats != nullptr ? &stats->packSeconds : nullptr);
+                            const T* block = opA == OP_TRANSPOSE ? A + (size_t)pc * lda + ic : A + (size_t)ic * lda + pc;
+                            packA(opA, mcCur, kcCur, kernels.mr, alpha, block, lda, aBuffer);
+                        }
+                        if(stats != nullptr)
+                        {
+                            stats->bytesPacked += (size_t)roundUp(mcCur, kernels.mr) * kcCur * sizeof(T);
+                        }
+
+                        PhaseTimer timer(stats != nullptr ? &stats->computeSeconds : nullptr);
+                        macroKernel(kernels, mcCur, ncCur, kcCur, aBuffer, bBuffer, C + (size_t)ic * ldc + (jc - columnBegin), ldc);
+                    }
+                }
+                jc += ncCur;
+            }
+        }
+
+        /**
+         * Pack op(B) into a PackedMatrixT made for it, one block at a time with packB().
+         *
+         * :param op: How B is read.
+         * :param B: First element of B as it is stored.
+         * :param ldb: Stride of B as it is stored.
+         * :param packed: Made with the rows and columns of op(B).  Set to the packed values.
+         */
+        template<typename T>
+        static void packMatrix(MatrixOp op, const T* B, int ldb, PackedMatrixT<T>& packed)
+        {
+            const int K = packed.rows();
+            const int N = packed.columns();
+            for(int jc = 0; jc < N; jc += packed.nc())
+            {
+                const int ncCur = min(packed.nc(), N - jc);
+                for(int pc = 0; pc < K; pc += packed.kc())
+                {
+                    const int kcCur = min(packed.kc(), K - pc);
+                    const T* block = op == OP_TRANSPOSE ? B + (size_t)jc * ldb + pc : B + (size_t)pc * ldb + jc;
+                    packB(op, kcCur, ncCur, packed.nr(), block, ldb, packed.panel(pc, jc));
+                }
+            }
+        }
+
+        /**
+         * Multiply a batch of independent problems, C = A * B for each.  C does not
+         * need to be zeroed.
+         *
+         * Runs of up to BATCH_LANES problems with the same small shape are computed
+         * together with the interleaved batch kernel.  The other problems use the
+         * blocked multiply one at a time and share the packing buffers.
+         *
+         * :param problems: The problems.
+         * :param count: Number of problems.
+         * :param blockSizes: Cache block sizes for the blocked multiply.
+         * :param kernels: Kernels to use.  The CPU must support them.
+         * :param stats: If not null, the times and packed bytes are added to it.
+         */
+        template<typename T>
+        static void multiplyBatch(const BatchProblemT<T>* problems, int count, const BlockSizes& blockSizes, const KernelTableT<T>& kernels, ThreadStats* stats)
+        {
+            ScratchBufferT<T> packedA;
+            ScratchBufferT<T> packedB;
+
+            int begin = 0;
+            while(begin < count)
+            {
+                const BatchProblemT<T>& first = problems[begin];
+                if(first.M <= BATCH_INTERLEAVE_MAX && first.N <= BATCH_INTERLEAVE_MAX && first.K <= BATCH_INTERLEAVE_MAX)
+                {
+                    int lanes = 1;
+                    while(lanes < BATCH_LANES && begin + lanes < count && problems[begin + lanes].M == first.M &&
+                          problems[begin + lanes].N == first.N && problems[begin + lanes].K == first.K)
+                    {
+                        lanes++;
+                    }
+                    multiplyInterleaved(problems + begin, lanes, kernels, stats);
+                    begin += lanes;
+                    continue;
+                }
+
+                for(int m = 0; m < first.M; m++)
+                {
+                    fill(first.C + (size_t)m * first.ldc, first.C + (size_t)m * first.ldc + first.N, T());
+                }
+                gemm(first.M, first.N, first.K, first.A, first.lda, first.B, first.ldb, first.C, first.ldc, blockSizes, kernels, packedA.buffer(), packedB.buffer(), stats);
+                begin++;
+            }
+        }
+
+        /**
+         * Multiply up to BATCH_LANES problems of the same small shape with the
+         * interleaved batch kernel.  The problems are packed so element (m, k) of all
+         * of them is one vector, which fills the registers however small the
+         * matrices are.  Missing lanes are zeros.
+         *
+         * :param problems: The problems.  M, N and K are at most BATCH_INTERLEAVE_MAX.
+         * :param lanes: Number of problems, at most BATCH_LANES.
+         */
+        template<typename T>
+        static void multiplyInterleaved(const BatchProblemT<T>* problems, int lanes, const KernelTableT<T>& kernels, ThreadStats* stats)
+        {
+            const int M = problems[0].M;
+            const int N = problems[0].N;
+            const int K = problems[0].K;
+
+            alignas(64) T a[BATCH_INTERLEAVE_MAX * BATCH_INTERLEAVE_MAX * BATCH_LANES];
+            alignas(64) T b[BATCH_INTERLEAVE_MAX * BATCH_INTERLEAVE_MAX * BATCH_LANES];
+            alignas(64) T c[BATCH_INTERLEAVE_MAX * BATCH_INTERLEAVE_MAX * BATCH_LANES];
+
+            {
+                PhaseTimer timer(stats != nullptr ? &stats->packSeconds : nullptr);
+                for(int m = 0; m < M; m++)
+                {
+                    for(int k = 0; k < K; k++)
+                    {
+                        T* lane = a + (size_t)(m * K + k) * BATCH_LANES;
+                        for(int l = 0; l < BATCH_LANES; l++)
+                        {
+                            lane[l] = l < lanes ? problems[l].A[(size_t)m * problems[l].lda + k] : T();
+                        }
+                    }
+                }
+                for(int k = 0; k < K; k++)
+                {
+                    for(int n = 0; n < N; n++)
+                    {
+                        T* lane = b + (size_t)(k * N + n) * BATCH_LANES;
+                        for(int l = 0; l < BATCH_LANES; l++)
+                        {
+                            lane[l] = l < lanes ? problems[l].B[(size_t)k * problems[l].ldb + n] : T();
+                        }
+                    }
+                }
+            }
+            if(stats != nullptr)
+            {
+                stats->bytesPacked += (size_t)(M * K + K * N) * BATCH_LANES * sizeof(T);
+            }
+
+            PhaseTimer timer(stats != nullptr ? &stats->computeSeconds : nullptr);
+            kernels.batchKernel(M, N, K, a, b, c);
+            for(int l = 0; l < lanes; l++)
+            {
+                for(int m = 0; m < M; m++)
+                {
+                    T* row = problems[l].C + (size_t)m * problems[l].ldc;
+                    for(int n = 0; n < N; n++)
+                    {
+                        row[n] = c[(size_t)(m * N + n) * BATCH_LANES + l];
+                    }
+                }
+            }
+        }
+
+        /**
+         * Matrix-vector product y = alpha * A * x + beta * y with one dot product per
+         * row of A.  Each row is read once from start to end, which the hardware
+         * prefetcher follows, and x stays in the cache.  A beta of 0 does not read y.
+         *
+         * :param M: Number of rows in A and values in y.
+         * :param K: Number of columns in A and values in x.
+         * :param alpha: Factor of the product.
+         * :param A: First element of A.
+         * :param lda: Stride of A.
+         * :param x: First value of x.  The values are next to each other.
+         * :param beta: Factor of y.
+         * :param y: First value of y.
+         * :param incy: Number of elements between two values of y.
+         * :param kernels: Kernels to use.  The CPU must support them.
+         */
+        template<typename T>
+        static void gemvDot(int M, int K, T alpha, const T* A, int lda, const T* x, T beta, T* y, int incy, const KernelTableT<T>& kernels)
+        {
+            for(int m = 0; m < M; m++)
+            {
+                const T value = alpha * kernels.dotKernel(K, A + (size_t)m * lda, x);
+                T& out = y[(size_t)m * incy];
+                out = beta == T() ? value : value + beta * out;
+            }
+        }
+
+        /**
+         * Vector-matrix product y = alpha * x * A + beta * y, adding alpha * x[k] times
+         * row k of A to y.  y should be short enough to stay in the L1 or L2 cache
+         * while the rows of A are read, so split long rows into column ranges.  A beta
+         * of 0 does not read y.
+         *
+         * :param K: Number of rows in A and values in x.
+         * :param N: Number of columns in A and values in y.
+         * :param alpha: Factor of the product.
+         * :param x: First value of x.  The values are next to each other.
+         * :param A: First element of A.
+         * :param lda: Stride of A.
+         * :param beta: Factor of y.
+         * :param y: First value of y.  The values are next to each other.
+         * :param kernels: Kernels to use.  The CPU must support them.
+         */
+        template<typename T>
+        static void gemvAxpy(int K, int N, T alpha, const T* x, const T* A, int lda, T beta, T* y, const KernelTableT<T>& kernels)
+        {
+            scale(1, N, beta, y, N);
+            for(int k = 0; k < K; k++)
+            {
+                kernels.axpyKernel(N, alpha * x[k], A + (size_t)k * lda, y);
+            }
+        }
+
+        /**
+         * Set a row to one value.
+         *
+         * With stream, a chunk of the value is made once in the L1 cache and copied
+         * out with non-temporal stores.  The row is not read into the cache before
+         * it is written and does not push other data out of it.  Without SSE2, or
+         * for a row that is not 16 byte aligned, the values are written directly.
+         *
+         * :param row: First value of the row.
+         * :param columns: Number of values.
+         * :param value: The value.
+         * :param stream: Use non-temporal stores.
+         */
+        template<typename T>
+        static void fillRow(T* row, int columns, T value, bool stream)
+        {
+        #ifdef MATRIX_SIMD_X86
+            if(stream && (uintptr_t)row % 16 == 0 && FILL_CHUNK_BYTES % sizeof(T) == 0)
+            {
+                const int chunkValues = FILL_CHUNK_BYTES / sizeof(T);
+                alignas(64) T chunk[FILL_CHUNK_BYTES / sizeof(T)];
+                fill(chunk, chunk + min(chunkValues, columns), value);
+
+                const __m128i* in = reinterpret_cast<const __m128i*>(chunk);
+                for(int n = 0; n < columns; n += chunkValues)
+                {
+                    const size_t bytes = (size_t)min(chunkValues, columns - n) * sizeof(T);
+                    const size_t vectors = bytes / 16;
+                    char* out = reinterpret_cast<char*>(row + n);
+                    for(size_t v = 0; v < vectors; v++)
+                    {
+                        _mm_stream_si128(reinterpret_cast<__m128i*>(out) + v, _mm_load_si128(in + v));
+                    }
+                    memcpy(out + vectors * 16, reinterpret_cast<const char*>(chunk) + vectors * 16, bytes - vectors * 16);
+                }
+
+                // The streamed stores are weakly ordered, so they must be done before
+                // the row is written again or the thread says it is ready
+                _mm_sfence();
+                return;
+            }
+        #endif
+            (void)stream;
+            fill(row, row + columns, value);
+        }
+
+        /**
+         * Next value of a SplitMix64 random stream.  The state is a counter, so
+         * streams that start far enough apart never overlap.
+         *
+         * :param state: State of the stream.  It is advanced.
+         * :return: 64 random bits.
+         */
+        static uint64_t splitMix64(uint64_t& state)
+        {
+            state += 0x9E3779B97F4A7C15ull;
+            uint64_t z = state;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            return z ^ (z >> 31);
+        }
+
+        /**
+         * Next random value between low and high from a SplitMix64 stream, see the
+         * overloads below.
+         */
+        template<typename T>
+        static T randomValue(uint64_t& state, T low, T high)
+        {
+            return randomValue(splitMix64(state), low, high, is_integral<T>());
+        }
+
+        /**
+         * Next random complex value from a SplitMix64 stream.  The real and the
+         * imaginary part are drawn separately, each between the parts of low and high.
+         */
+        template<typename R>
+        static complex<R> randomValue(uint64_t& state, complex<R> low, complex<R> high)
+        {
+            const R real = randomValue(splitMix64(state), low.real(), high.real(), false_type());
+            const R imag = randomValue(splitMix64(state), low.imag(), high.imag(), false_type());
+            return complex<R>(real, imag);
+        }
+
+        /**
+         * Random integer in [low, high] from 64 random bits.  The range is computed
+         * in uint64 arithmetic, which wraps instead of overflowing, so the full range
+         * of int64 works too.
+         */
+        template<typename T>
+        static T randomValue(uint64_t bits, T low, T high, true_type)
+        {
+            const uint64_t range = (uint64_t)high - (uint64_t)low + 1;
+            return range == 0 ? T(bits) : T((uint64_t)low + bits % range);
+        }
+
+        /**
+         * Random value between low and high from 64 random bits, for the floating
+         * point types.  The top 53 bits are used.
+         */
+        template<typename T>
+        static T randomValue(uint64_t bits, T low, T high, false_type)
+        {
+            const double unit = (double)(bits >> 11) * (1.0 / 9007199254740992.0);
+            return T(low + (high - low) * unit);
+        }
+
+        /**
+         * C = beta * C.  A beta of 0 sets C to 0 without reading it, so NaNs in
+         * C do not carry over.  A beta of 1 does nothing.
+         *
+         * :param M: Number of rows in C.
+         * :param N: Number of columns in C.
+         * :param beta: Factor.
+         * :param C: First element of C.
+         * :param ldc: Stride of C.
+         */
+        template<typename T>
+        static void scale(int M, int N, T beta, T* C, int ldc)
+        {
+            if(beta == T(1))
+            {
+                return;
+            }
+            for(int m = 0; m < M; m++)
+            {
+                T* c = C + (size_t)m * ldc;
+                if(beta == T())
+                {
+                    fill(c, c + N, T());
+                    continue;
+                }
+                for(int n = 0; n < N; n++)
+                {
+                    c[n] *= beta;
+                }
+            }
+        }
+
+        /**
+         * Pack a mc x kc block of op(A) into panels mr rows tall.  In a panel the
+         * mr values of each column are next to each other.  The last panel
+         * is padded with zeros.  The values are multiplied by alpha.
+         *
+         * :param op: How A is read.  A transposed block is stored kc x mc.
+         * :param mc: Number of rows to pack.
+         * :param kc: Number of columns to pack.
+         * :param mr: Rows in a panel.
+         * :param alpha: Factor for the values.
+         * :param A: First element of the block.
+         * :param lda: Stride of A.
+         * :param packed: Buffer with room for roundUp(mc, mr) * kc values.  A is
+         *               converted to its type.
+         */
+        template<typename T, typename S>
+        static void packA(MatrixOp op, int mc, int kc, int mr, T alpha, const S* A, int lda, T* packed)
+        {
+            // Rows of op(A) are lda apart and columns 1 apart, or the other way round
+            const size_t rowStep = op == OP_TRANSPOSE ? 1 : (size_t)lda;
+            const size_t columnStep = op == OP_TRANSPOSE ? (size_t)lda : 1;
+            const bool scaled = !(alpha == T(1));
+
+            for(int i = 0; i < mc; i += mr)
+            {
+                const int rows = min(mr, mc - i);
+                for(int k = 0; k < kc; k++)
+                {
+                    const S* a = A + (size_t)i * rowStep + (size_t)k * columnStep;
+                    for(int r = 0; r < rows; r++)
+                    {
+                        const T value = T(a[(size_t)r * rowStep]);
+                        packed[r] = scaled ? alpha * value : value;
+                    }
+                    for(int r = rows; r < mr; r++)
+                    {
+                        packed[r] = T();
+                    }
+                    packed += mr;
+                }
+            }
+        }
+
+        /**
+         * Pack a kc x nc block of op(B) into panels nr columns wide.  In a panel the
+         * nr values of each row are next to each other.  The last panel is
+         * padded with zeros.
+         *
+         * :param op: How B is read.  A transposed block is stored nc x kc.
+         * :param kc: Number of rows to pack.
+         * :param nc: Number of columns to pack.
+         * :param nr: Columns in a panel.
+         * :param B: First element of the block.
+         * :param ldb: Stride of B.
+         * :param packed: Buffer with room for kc * roundUp(nc, nr) values.  B is
+         *               converted to its type.
+         */
+        template<typename T, typename S>
+        static void packB(MatrixOp op, int kc, int nc, int nr, const S* B, int ldb, T* packed)
+        {
+            for(int j = 0; j < nc; j += nr)
+            {
+                const int columns = min(nr, nc - j);
+                if(op == OP_TRANSPOSE)
+                {
+                    // Read each column of the panel along a row of B, so the reads are contiguous
+                    for(int c = 0; c < columns; c++)
+                    {
+                        const S* b = B + (size_t)(j + c) * ldb;
+                        for(int k = 0; k < kc; k++)
+                        {
+                            packed[(size_t)k * nr + c] = T(b[k]);
+                        }
+                    }
+                    for(int k = 0; k < kc; k++)
+                    {
+                        for(int c = columns; c < nr; c++)
+                        {
+                            packed[(size_t)k * nr + c] = T();
+                        }
+                    }
+                    packed += (size_t)kc * nr;
+                    continue;
+                }
+
+                for(int k = 0; k < kc; k++)
+                {
+                    const S* b = B + (size_t)k * ldb + j;
+                    for(int c = 0; c < columns; c++)
+                    {
+                        packed[c] = T(b[c]);
+                    }
+                    for(int c = columns; c < nr; c++)
+                    {
+                        packed[c] = T();
+                    }
+                    packed += nr;
+                }
+            }
+        }
+
+        /**
+         * Transpose a rows x columns matrix from src into dst.
+         *
+         * This is a cache-oblivious transpose.  The larger side is cut in half until
+         * the piece fits in the L1 cache, whatever the size of the caches.  Reads and
+         * writes then stay within a few rows and pages at a time.  Each piece is
+         * transposed with the transpose block of the active kernels for the element type.
+         *
+         * :param rows: Number of rows in src.
+         * :param columns: Number of columns in src.
+         * :param src: First element of the source.
+         * :param lds: Stride of the source.
+         * :param dst: First element of the destination.  Has columns rows.
+         * :param ldd: Stride of the destination.
+         */
+        template<typename T>
+        static void transpose(int rows, int columns, const T* src, int lds, T* dst, int ldd)
+        {
+            if(rows <= TRANSPOSE_TILE && columns <= TRANSPOSE_TILE)
+            {
+                transposeTile(ElementKernels<T>::active(), rows, columns, src, lds, dst, ldd);
+            }
+            else if(rows >= columns)
+            {
+                // Cut on a multiple of 8 so the vector blocks line up
+                int half = splitPoint(rows);
+                transpose(half, columns, src, lds, dst, ldd);
+                transpose(rows - half, columns, src + (size_t)half * lds, lds, dst + half, ldd);
+            }
+            else
+            {
+                int half = splitPoint(columns);
+                transpose(rows, half, src, lds, dst, ldd);
+                transpose(rows, columns - half, src + half, lds, dst + (size_t)half * ldd, ldd);
+            }
+        }
+
+        /**
+         * Transpose one pair of blocks of a square matrix in place.  The block at
+         * (rowBegin, columnBegin) is swapped with the block at (columnBegin, rowBegin),
+         * and both are transposed.  A block on the diagonal is transposed in place.
+         *
+         * Every pair of blocks can be done at the same time, so this is the unit
+         * of work for the threaded in-place transpose.
+         *
+         * :param rowBegin: First row of the block above the diagonal.
+         * :param columnBegin: First column of the block above the diagonal.
+         * :param rows: Rows in the block.  At most TRANSPOSE_TILE.
+         * :param columns: Columns in the block.  At most TRANSPOSE_TILE.
+         * :param data: First element of the matrix.
+         * :param ld: Stride of the matrix.
+         */
+        template<typename T>
+        static void transposeSwapBlocks(int rowBegin, int columnBegin, int rows, int columns, T* data, int ld)
+        {
+            T* upper = data + (size_t)rowBegin * ld + columnBegin;
+
+            if(rowBegin == columnBegin)
+            {
+                // Diagonal block, swap across its own diagonal
+                for(int m = 0; m < rows; m++)
+                {
+                    for(int n = m + 1; n < columns; n++)
+                    {
+                        swap(upper[(size_t)m * ld + n], upper[(size_t)n * ld + m]);
+                    }
+                }
+                return;
+            }
+
+            T* lower = data + (size_t)columnBegin * ld + rowBegin;
+            T tile[TRANSPOSE_TILE * TRANSPOSE_TILE];
+
+            // tile = transpose(upper), upper = transpose(lower), lower = tile
+            transpose(rows, columns, upper, ld, tile, rows);
+            transpose(columns, rows, lower, ld, upper, ld);
+            for(int n = 0; n < columns; n++)
+            {
+                memcpy(lower + (size_t)n * ld, tile + (size_t)n * rows, rows * sizeof(T));
+            }
+        }
+
+        /**
+         * Transpose a rows x columns matrix in place by following the cycles of
+         * the permutation.  The matrix must be packed, with a stride equal to its
+         * columns.  The result is a packed columns x rows matrix in the same memory.
+         *
+         * Value p = m * columns + n moves to n * rows + m.  Each cycle is walked once
+         * while carrying one value.  A bit per value marks the values already moved,
+         * so the extra memory is 1/64 of the matrix.
+         *
+         * :param rows: Number of rows.
+         * :param columns: Number of columns.
+         * :param data: First element of the packed matrix.
+         */
+        template<typename T>
+        static void transposeInPlaceCycles(int rows, int columns, T* data)
+        {
+            const size_t count = (size_t)rows * columns;
+            if(rows <= 1 || columns <= 1)
+            {
+                // A single row or column is already in transposed order
+                return;
+            }
+
+            vector<bool> moved(count, false);
+
+            // The first and the last value never move
+            for(size_t start = 1; start + 1 < count; start++)
+            {
+                if(moved[start])
+                {
+                    continue;
+                }
+
+                size_t position = start;
+                T value = data[start];
+                do
+                {
+                    size_t target = (position % columns) * rows + position / columns;
+                    swap(value, data[target]);
+                    moved[target] = true;
+                    position = target;
+                }
+                while(position != start);
+            }
+        }
+
+        /**
+         * Round value up to the next multiple.
+         */
+        static int roundUp(int value, int multiple)
+        {
+            return ((value + multiple - 1) / multiple) * multiple;
+        }
+
+    private:
+        /**
+         * Macro-kernel.  Multiply a packed mc x kc block of A by a packed kc x nc
+         * block of B and add it to the mc x nc block of C, one micro-tile at a time.
+         *
+         * Tiles on the edge of C are copied into a full size scratch tile so the
+         * micro-kernel only has to handle full tiles.
+         *
+         * :param kernels: Kernels to use.
+         * :param mc: Number of rows in the block.
+         * :param nc: Number of columns in the block.
+         * :param kc: Length of the shared dimension.
+         * :param packedA: Packed block of A.
+         * :param packedB: Packed block of B.
+         * :param C: First element of the block of C.
+         * :param ldc: Stride of C.
+         */
+        template<typename T>
+        static void macroKernel(const KernelTableT<T>& kernels, int mc, int nc, int kc, const T* packedA, const T* packedB, T* C, int ldc)
+        {
+            const int MR = kernels.mr;
+            const int NR = kernels.nr;
+
+            for(int jr = 0; jr < nc; jr += NR)
+            {
+                const int nr = min(NR, nc - jr);
+                const T* b = packedB + (size_t)jr * kc;
+
+                for(int ir = 0; ir < mc; ir += MR)
+                {
+                    const int mr = min(MR, mc - ir);
+                    const T* a = packedA + (size_t)ir * kc;
+                    T* c = C + (size_t)ir * ldc + jr;
+
+                    if(mr == MR && nr == NR)
+                    {
+                        kernels.microKernel(kc, a, b, c, ldc);
+                    }
+                    else
+                    {
+                        T tile[GEMM_MAX_MR * GEMM_MAX_NR];
+                        for(int r = 0; r < MR; r++)
+                        {
+                            for(int n = 0; n < NR; n++)
+                            {
+                                tile[r * NR + n] = (r < mr && n < nr) ? c[(size_t)r * ldc + n] : T();
+                            }
+                        }
+
+                        kernels.microKernel(kc, a, b, tile, NR);
+
+                        for(int r = 0; r < mr; r++)
+                        {
+                            for(int n = 0; n < nr; n++)
+                            {
+                                c[(size_t)r * ldc + n] = tile[r * NR + n];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        /**
+         * Transpose a piece that fits in the L1 cache.  The full blocks use the vector
+         * transpose block and the edges are done one value at a time.
+         */
+        template<typename T>
+        static void transposeTile(const KernelTableT<T>& kernels, int rows, int columns, const T* src, int lds, T* dst, int ldd)
+        {
+            const int block = kernels.transposeBlock;
+
+            int m = 0;
+            for(; m + block <= rows; m += block)
+            {
+                int n = 0;
+                for(; n + block <= columns; n += block)
+                {
+                    kernels.transposeKernel(src + (size_t)m * lds + n, lds, dst + (size_t)n * ldd + m, ldd);
+                }
+                transposeScalar(m, m + block, n, columns, src, lds, dst, ldd);
+            }
+            transposeScalar(m, rows, 0, columns, src, lds, dst, ldd);
+        }
+
+        /**
+         * Where to cut a side of the transpose in two.  Half of the side,
+         * rounded down to a multiple of 8 when possible.
+         */
+        static int splitPoint(int size)
+        {
+            int half = (size / 2) & ~7;
+            return half > 0 ? half : size / 2;
+        }
+
+        /**
+         * Transpose the rows [mBegin, mEnd) and columns [nBegin, nEnd) one value at a time.
+         */
+        template<typename T>
+        static void transposeScalar(int mBegin, int mEnd, int nBegin, int nEnd, const T* src, int lds, T* dst, int ldd)
+        {
+            for(int m = mBegin; m < mEnd; m++)
+            {
+                for(int n = nBegin; n < nEnd; n++)
+                {
+                    dst[(size_t)n * ldd + m] = src[(size_t)m * lds + n];
+                }
+            }
+        }
+};
\ No newline at end of file
@@ -1,6 +1,12 @@
 #include <iostream>
 #include <assert.h>
 #include <cmath>
+#include <complex>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <sstream>
+#include <string>
 
 using namespace std;
 
@@ -53,11 +59,8 @@ class TestMatrix {
 
             mc.clean2DMatrix(test1M, 2);
 
-
-            assert(test1M[0][0] != 2.0);
-            assert(test1M[0][1] != 3.0);
-            assert(test1M[1][0] != 4.0);
-            assert(test1M[1][1] != 5.0);
+            // Reading the freed rows is undefined, so check the pointer was cleared
+            assert(test1M == nullptr);
 
             cout << "PASS - Test Matrix Clean PASS" << endl;
         }
@@ -142,7 +145,7 @@ class TestMatrix {
             assert(fabs(result[2][2] - 69.995) < 0.01f);
 
             mc.clean2DMatrix(test1M, 3);
-            mc.clean2DMatrix(test2M, 3);
+            mc.clean2DMatrix(test2M, 2);
             mc.clean2DMatrix(result, 3);
 
             cout << "PASS - Test Matrix Multiply" << endl;
@@ -173,6 +176,2124 @@ class TestMatrix {
         }
 
 
+        void test_matrix_class() 
+        {
+            Matrix test1M(3, 10);
+
+            assert(test1M.rows() == 3);
+            assert(test1M.columns() == 10);
+            assert(test1M.stride() == 16);
+            assert(reinterpret_cast<uintptr_t>(test1M.data()) % MATRIX_ALIGNMENT == 0);
+            assert(reinterpret_cast<uintptr_t>(test1M.row(1)) % MATRIX_ALIGNMENT == 0);
+            assert(test1M(2, 9) == 0.0);
+
+            // Narrow matrices are not padded
+            Matrix vector1M(100, 1);
+            assert(vector1M.stride() == 1);
+
+            test1M(1, 2) = 7.0;
+            Matrix copyM(test1M);
+            assert(copyM(1, 2) == 7.0);
+            assert(copyM.data() != test1M.data());
+
+            Matrix moveM(std::move(copyM));
+            assert(moveM(1, 2) == 7.0);
+            assert(copyM.empty());
+
+            cout << "PASS - Test Matrix Class" << endl;
+        }
+
+        void test_matrix_multiply_matrix() 
+        {
+            MatrixCommon mc;
+            Matrix test1M = mc.createMatrix(3, 2, 2.15);
+            Matrix test2M = mc.createMatrix(2, 3, 1.65);
+
+            MatrixAlgebra ma;
+            Matrix result = ma.matrixMultiply(test1M, test2M, 1);
+            Matrix resultThread = ma.matrixMultiply(test1M, test2M, 3);
+
+            assert(result.rows() == 3);
+            assert(result.columns() == 3);
+            assert(fabs(result(0, 0) - 18.195) < 0.01f);
+            assert(fabs(result(1, 1) - 40.095) < 0.01f);
+            assert(fabs(result(2, 2) - 69.995) < 0.01f);
+
+            for(int m = 0; m < 3; m++)
+            {
+                for(int n = 0; n < 3; n++)
+                {
+                    assert(result(m, n) == resultThread(m, n));
+                }
+            }
+
+            cout << "PASS - Test Matrix Multiply Matrix Class" << endl;
+        }
+
+        void test_transpose_matrix() 
+        {
+            MatrixCommon mc;
+            Matrix test1M = mc.createMatrix(3, 20, 1.0);
+
+            MatrixAlgebra ma;
+            Matrix result = ma.transpose(test1M, 1);
+            Matrix resultThread = ma.transpose(test1M, 2);
+
+            assert(result.rows() == 20);
+            assert(result.columns() == 3);
+            for(int m = 0; m < 3; m++)
+            {
+                for(int n = 0; n < 20; n++)
+                {
+                    assert(result(n, m) == test1M(m, n));
+                    assert(resultThread(n, m) == test1M(m, n));
+                }
+            }
+
+            cout << "PASS - Test Matrix Transpose Matrix Class" << endl;
+        }
+
+        /**
+         * Simple i-j-k multiply used to check the optimized kernels.
+         */
+        template<typename T>
+        MatrixT<T> referenceMultiply(const MatrixT<T>& m1, const MatrixT<T>& m2)
+        {
+            MatrixT<T> result(m1.rows(), m2.columns());
+            for(int i = 0; i < m1.rows(); i++)
+            {
+                for(int j = 0; j < m2.columns(); j++)
+                {
+                    for(int k = 0; k < m1.columns(); k++)
+                    {
+                        result(i, j) += m1(i, k) * m2(k, j);
+                    }
+                }
+            }
+            return result;
+        }
+
+        void test_matrix_multiply_blocked() 
+        {
+            MatrixCommon mc;
+            MatrixAlgebra ma;
+
+            // Small blocks so the edges of every block are used
+            BlockSizes blockSizes;
+            blockSizes.mc = 8;
+            blockSizes.kc = 5;
+            blockSizes.nc = 16;
+            ma.setBlockSizes(blockSizes);
+
+            // The scalar kernels add in the same order as the simple loop
+            KernelIsa isa = SimdKernels::active().isa;
+            SimdKernels::select(ISA_SCALAR);
+
+            const int shapes[][3] = { {1, 1, 1}, {3, 7, 2}, {17, 13, 19}, {33, 40, 9}, {4, 8, 8} };
+            for(const auto& shape : shapes)
+            {
+                Matrix test1M = mc.createMatrix(shape[0], shape[1], 0.15);
+                Matrix test2M = mc.createMatrix(shape[1], shape[2], -3.3);
+
+                Matrix expected = referenceMultiply(test1M, test2M);
+                Matrix result = ma.matrixMultiply(test1M, test2M, 1);
+
+                for(int m = 0; m < expected.rows(); m++)
+                {
+                    for(int n = 0; n < expected.columns(); n++)
+                    {
+                        assert(result(m, n) == expected(m, n));
+                    }
+                }
+            }
+
+            SimdKernels::select(isa);
+
+            cout << "PASS - Test Matrix Multiply Blocked" << endl;
+        }
+
+        void test_simd_kernels() 
+        {
+            MatrixCommon mc;
+            MatrixAlgebra ma;
+            KernelIsa isa = SimdKernels::active().isa;
+
+            // The active kernels are the best the CPU supports
+            assert(isa == SimdKernels::bestIsa());
+
+            Matrix test1M = mc.createMatrix(37, 41, 0.25);
+            Matrix test2M = mc.createMatrix(41, 29, -7.5);
+            Matrix expected = referenceMultiply(test1M, test2M);
+
+            for(int i = ISA_SCALAR; i <= ISA_AVX512; i++)
+            {
+                if(!SimdKernels::select((KernelIsa)i))
+                {
+                    cout << "SKIP - " << SimdKernels::table((KernelIsa)i).name << " not supported" << endl;
+                    continue;
+                }
+
+                Matrix result = ma.matrixMultiply(test1M, test2M, 1);
+                Matrix resultT = ma.transpose(test1M, 1);
+
+                for(int m = 0; m < expected.rows(); m++)
+                {
+                    for(int n = 0; n < expected.columns(); n++)
+                    {
+                        // FMA rounds once per multiply-add
+                        assert(fabs(result(m, n) - expected(m, n)) <= 1e-12 * fabs(expected(m, n)));
+                    }
+                }
+                for(int m = 0; m < test1M.rows(); m++)
+                {
+                    for(int n = 0; n < test1M.columns(); n++)
+                    {
+                        assert(resultT(n, m) == test1M(m, n));
+                    }
+                }
+            }
+
+            SimdKernels::select(isa);
+
+            cout << "PASS - Test SIMD Kernels" << endl;
+        }
+
+        void test_thread_pool() 
+        {
+            shared_ptr<ThreadPool> pool = make_shared<ThreadPool>(0);
+
+            // Every task runs once
+            vector<atomic<int>> counts(100);
+            for(auto& count : counts)
+            {
+                count = 0;
+            }
+            pool->parallelFor(100, 4, [&](int task, int participant)
+            {
+                assert(participant >= 0 && participant < 4);
+                counts[task]++;
+            });
+            for(auto& count : counts)
+            {
+                assert(count == 1);
+            }
+            assert(pool->numWorkers() == 3);
+
+            // The workers are reused
+            MatrixCommon mc;
+            MatrixAlgebra ma(pool);
+            assert(ma.threadPool() == pool);
+            Matrix test1M = mc.createMatrix(40, 30, 1.0);
+            Matrix test2M = mc.createMatrix(30, 20, 2.0);
+            for(int i = 0; i < 10; i++)
+            {
+                Matrix result = ma.matrixMultiply(test1M, test2M, 2);
+                Matrix resultT = ma.transpose(test1M, 3);
+            }
+            assert(pool->numWorkers() == 3);
+
+            // A parallelFor inside a task does not dead lock
+            atomic<int> total(0);
+            pool->parallelFor(4, 4, [&](int, int)
+            {
+                pool->parallelFor(8, 4, [&](int, int)
+                {
+                    total++;
+                });
+            });
+            assert(total == 32);
+
+            cout << "PASS - Test Thread Pool" << endl;
+        }
+
+        void test_work_stealing() 
+        {
+            // Uneven tasks still run once each
+            shared_ptr<ThreadPool> pool = make_shared<ThreadPool>(0);
+            vector<atomic<int>> counts(1000);
+            for(auto& count : counts)
+            {
+                count = 0;
+            }
+            pool->parallelFor(1000, 5, [&](int task, int)
+            {
+                if(task < 10)
+                {
+                    this_thread::sleep_for(chrono::microseconds(200));
+                }
+                counts[task]++;
+            });
+            for(auto& count : counts)
+            {
+                assert(count == 1);
+            }
+
+            // Wide and short shapes are split across the columns
+            TileGrid grid(4, 100000, 96, 2048, 32, 64, 16);
+            assert(grid.rowTiles == 1);
+            assert(grid.count() >= 16);
+
+            // Rows that do not divide by the number of threads
+            MatrixCommon mc;
+            MatrixAlgebra ma(pool);
+            const int shapes[][3] = { {5, 7, 3}, {37, 53, 29}, {3, 20, 700}, {130, 9, 2} };
+            for(const auto& shape : shapes)
+            {
+                Matrix test1M = mc.createMatrix(shape[0], shape[1], 0.5);
+                Matrix test2M = mc.createMatrix(shape[1], shape[2], -1.0);
+                Matrix expected = ma.matrixMultiply(test1M, test2M, 1);
+                Matrix expectedT = ma.transpose(test1M, 1);
+
+                for(int numThreads = 2; numThreads <= 5; numThreads++)
+                {
+                    Matrix result = ma.matrixMultiply(test1M, test2M, numThreads);
+                    Matrix resultT = ma.transpose(test1M, numThreads);
+                    for(int m = 0; m < expected.rows(); m++)
+                    {
+                        for(int n = 0; n < expected.columns(); n++)
+                        {
+                            assert(result(m, n) == expected(m, n));
+                        }
+                    }
+                    for(int m = 0; m < expectedT.rows(); m++)
+                    {
+                        for(int n = 0; n < expectedT.columns(); n++)
+                        {
+                            assert(resultT(m, n) == expectedT(m, n));
+                        }
+                    }
+                }
+            }
+
+            cout << "PASS - Test Work Stealing" << endl;
+        }
+
+        void test_matrix_multiply_split_k() 
+        {
+            MatrixCommon mc;
+            MatrixAlgebra ma;
+
+            // Tall, skinny shapes use split-K
+            assert(ma.useSplitK(4, 100000, 4, 4));
+            assert(!ma.useSplitK(1000, 1000, 1000, 4));
+            assert(!ma.useSplitK(4, 100000, 4, 1));
+
+            Matrix test1M = mc.createMatrix(3, 5000, 0.001);
+            Matrix test2M = mc.createMatrix(5000, 5, -0.002);
+            Matrix expected = referenceMultiply(test1M, test2M);
+
+            for(int numThreads = 2; numThreads <= 4; numThreads++)
+            {
+                Matrix result = ma.matrixMultiply(test1M, test2M, numThreads);
+                Matrix again = ma.matrixMultiply(test1M, test2M, numThreads);
+                for(int m = 0; m < expected.rows(); m++)
+                {
+                    for(int n = 0; n < expected.columns(); n++)
+                    {
+                        // The slices are added in a different order than the simple loop
+                        assert(fabs(result(m, n) - expected(m, n)) <= 1e-10 * fabs(expected(m, n)));
+
+                        // but always in the same order
+                        assert(result(m, n) == again(m, n));
+                    }
+                }
+            }
+
+            cout << "PASS - Test Matrix Multiply Split-K" << endl;
+        }
+
+        void test_transpose_in_place() 
+        {
+            MatrixCommon mc;
+            MatrixAlgebra ma;
+
+            // Large enough for the recursive transpose to cut both sides
+            Matrix large = mc.createMatrix(300, 170, 0.0);
+            Matrix largeT = ma.transpose(large, 1);
+            for(int m = 0; m < large.rows(); m++)
+            {
+                for(int n = 0; n < large.columns(); n++)
+                {
+                    assert(largeT(n, m) == large(m, n));
+                }
+            }
+
+            // Square with padded rows, rectangular, a single row and a single column
+            const int shapes[][2] = { {37, 37}, {100, 100}, {3, 20}, {37, 53}, {64, 9}, {1, 12}, {12, 1} };
+            for(const auto& shape : shapes)
+            {
+                for(int numThreads = 1; numThreads <= 3; numThreads++)
+                {
+                    Matrix original = mc.createMatrix(shape[0], shape[1], 1.0);
+                    Matrix matrix = original;
+                    ma.transposeInPlace(matrix, numThreads);
+
+                    assert(matrix.rows() == shape[1]);
+                    assert(matrix.columns() == shape[0]);
+                    for(int m = 0; m < original.rows(); m++)
+                    {
+                        for(int n = 0; n < original.columns(); n++)
+                        {
+                            assert(matrix(n, m) == original(m, n));
+                        }
+                    }
+                }
+            }
+
+            // Wrapped values, packed and with a stride larger than the columns
+            double packed[] = { 0, 1, 2, 3, 4, 5 };
+            Matrix wrapped(packed, 2, 3, 3);
+            ma.transposeInPlace(wrapped, 1);
+            assert(wrapped.rows() == 3 && wrapped.columns() == 2 && wrapped.data() == packed);
+            const double expectedPacked[] = { 0, 3, 1, 4, 2, 5 };
+            for(int i = 0; i < 6; i++)
+            {
+                assert(packed[i] == expectedPacked[i]);
+            }
+            double padded[] = { 0, 1, 2, -1, 3, 4, 5, -1 };
+            Matrix wrappedPadded(padded, 2, 3, 4);
+            ma.transposeInPlace(wrappedPadded, 1);
+            assert(wrappedPadded.rows() == 3 && wrappedPadded.columns() == 2 && wrappedPadded.stride() == 2);
+            for(int m = 0; m < 2; m++)
+            {
+                for(int n = 0; n < 3; n++)
+                {
+                    assert(wrappedPadded(n, m) == m * 3 + n);
+                }
+            }
+
+            cout << "PASS - Test Matrix Transpose In Place" << endl;
+        }
+
+        void test_auto_tuner() 
+        {
+            MatrixCommon mc;
+            MatrixAlgebra ma;
+
+            // Start with an empty table
+            const string path = "/tmp/matrix_unittest_tuning";
+            remove(path.c_str());
+            shared_ptr<AutoTuner> tuner = make_shared<AutoTuner>(path);
+            ma.setTuner(tuner);
+            assert(tuner->size() == 0);
+
+            // Tuning stores the config for the bucket and saves it
+            TuningConfig tuned = ma.tuneMultiply(60, 50, 40);
+            assert(tuner->size() == 1);
+            assert(tuned.numThreads >= 1);
+            assert(SimdKernels::isSupported(tuned.isa));
+
+            // Every shape in the bucket uses it, and a new tuner loads it
+            AutoTuner reloaded(path);
+            TuningConfig config;
+            assert(reloaded.size() == 1);
+            assert(reloaded.lookup(TUNE_MULTIPLY, 64, 33, 63, config));
+            assert(config.numThreads == tuned.numThreads);
+            assert(config.blockSizes.mc == tuned.blockSizes.mc);
+            assert(config.blockSizes.kc == tuned.blockSizes.kc);
+            assert(config.blockSizes.nc == tuned.blockSizes.nc);
+            assert(config.isa == tuned.isa);
+            assert(!reloaded.lookup(TUNE_MULTIPLY, 65, 50, 40, config));
+
+            // The calls without a number of threads give the same results
+            tuner->setTuneOnFirstUse(false);
+            Matrix test1M = mc.createMatrix(60, 40, 0.5);
+            Matrix test2M = mc.createMatrix(40, 50, -1.0);
+            Matrix expected = referenceMultiply(test1M, test2M);
+            Matrix result = ma.matrixMultiply(test1M, test2M);
+            for(int m = 0; m < expected.rows(); m++)
+            {
+                for(int n = 0; n < expected.columns(); n++)
+                {
+                    assert(fabs(result(m, n) - expected(m, n)) <= 1e-12 * fabs(expected(m, n)) + 1e-9);
+                }
+            }
+
+            Matrix resultT = ma.transpose(test1M);
+            assert(resultT.rows() == test1M.columns());
+            for(int m = 0; m < test1M.rows(); m++)
+            {
+                for(int n = 0; n < test1M.columns(); n++)
+                {
+                    assert(resultT(n, m) == test1M(m, n));
+                }
+            }
+
+            // Shapes that are not tuned do not change the table
+            assert(tuner->size() == 1);
+            remove(path.c_str());
+
+            // Lines with block sizes, threads or buckets that can not be used are
+            // skipped, and do not replace a good line for the same bucket
+            const string damagedPath = "/tmp/matrix_unittest_tuning_damaged";
+            {
+                ofstream damaged(damagedPath.c_str());
+                damaged << "multiply 9 9 9 4 96 256 2048 0\n"
+                        << "multiply 9 9 9 4 0 0 0 0\n"
+                        << "multiply 9 9 9 4 96 0 2048 0\n"
+                        << "multiply 9 9 9 0 96 256 2048 0\n"
+                        << "multiply 8 8 8 4 -96 256 2048 0\n"
+                        << "multiply 31 9 9 4 96 256 2048 0\n"
+                        << "transpose -1 9 0 4 96 256 2048 0\n";
+            }
+            shared_ptr<AutoTuner> damagedTuner = make_shared<AutoTuner>(damagedPath);
+            assert(damagedTuner->size() == 1);
+            assert(damagedTuner->lookup(TUNE_MULTIPLY, 400, 400, 400, config));
+            assert(config.numThreads == 4 && config.blockSizes.mc == 96);
+            assert(config.blockSizes.kc == 256 && config.blockSizes.nc == 2048);
+            damagedTuner->setTuneOnFirstUse(false);
+            MatrixAlgebra damagedMa;
+            damagedMa.setTuner(damagedTuner);
+            Matrix squareA = mc.createMatrix(400, 400, 0.5);
+            Matrix squareB = mc.createMatrix(400, 400, -1.0);
+            Matrix squareExpected = referenceMultiply(squareA, squareB);
+            Matrix squareResult = damagedMa.matrixMultiply(squareA, squareB);
+            assert(fabs(squareResult(399, 399) - squareExpected(399, 399)) <= 1e-12 * fabs(squareExpected(399, 399)));
+            remove(damagedPath.c_str());
+
+            cout << "PASS - Test Auto Tuner" << endl;
+        }
+
+        void test_instrumentation() 
+        {
+            MatrixCommon mc;
+            MatrixAlgebra ma;
+
+            // Keeps the stats of every call
+            class RecordingObserver : public CallObserver {
+                public:
+                    explicit RecordingObserver(bool hardwareCounters) : mHardwareCounters(hardwareCounters)
+                    {
+                    }
+
+                    void onCall(const CallStats& stats) override
+                    {
+                        calls.push_back(stats);
+                    }
+
+                    bool wantsHardwareCounters() const override
+                    {
+                        return mHardwareCounters;
+                    }
+
+                    vector<CallStats> calls;
+
+                private:
+                    bool mHardwareCounters;
+            };
+
+            shared_ptr<RecordingObserver> observer = make_shared<RecordingObserver>(true);
+            ma.setObserver(observer);
+
+            Matrix test1M = mc.createMatrix(200, 300, 0.01);
+            Matrix test2M = mc.createMatrix(300, 150, -0.02);
+            Matrix expected = ma.matrixMultiply(test1M, test2M, 1);
+            assert(observer->calls.size() == 1);
+
+            const CallStats& serial = observer->calls[0];
+            assert(string(serial.operation) == "multiply");
+            assert(serial.rows == 200 && serial.columns == 150 && serial.depth == 300);
+            assert(serial.threads.size() == 1);
+            assert(serial.bytesRead == (200 * 300 + 300 * 150) * sizeof(double));
+            assert(serial.bytesWritten == 200 * 150 * sizeof(double));
+            assert(serial.bytesPacked >= serial.bytesRead);
+            assert(serial.phaseSeconds[PHASE_PACK] > 0.0);
+            assert(serial.phaseSeconds[PHASE_COMPUTE] > 0.0);
+            assert(serial.threads[0].busySeconds <= serial.totalSeconds);
+            assert(serial.phaseSeconds[PHASE_PACK] + serial.phaseSeconds[PHASE_COMPUTE] <= serial.threads[0].busySeconds);
+            if(serial.counters.valid)
+            {
+                assert(serial.counters.instructions > 0);
+            }
+
+            // Threaded calls record every participant and give the same results
+            for(int numThreads = 2; numThreads <= 3; numThreads++)
+            {
+                Matrix result = ma.matrixMultiply(test1M, test2M, numThreads);
+                const CallStats& threaded = observer->calls.back();
+                assert(threaded.numThreads == numThreads);
+                assert((int)threaded.threads.size() == numThreads);
+                assert(threaded.parallelSeconds > 0.0);
+                assert(threaded.phaseSeconds[PHASE_JOIN] >= 0.0);
+                for(const ThreadStats& thread : threaded.threads)
+                {
+                    assert(thread.busySeconds + thread.idleSeconds >= 0.0);
+                    assert(thread.busySeconds <= threaded.parallelSeconds);
+                }
+                for(int m = 0; m < expected.rows(); m++)
+                {
+                    for(int n = 0; n < expected.columns(); n++)
+                    {
+                        assert(result(m, n) == expected(m, n));
+                    }
+                }
+            }
+
+            // Split-K, transposes and in-place transposes are recorded too
+            Matrix longK1 = mc.createMatrix(3, 5000, 0.001);
+            Matrix longK2 = mc.createMatrix(5000, 5, -0.002);
+            ma.matrixMultiply(longK1, longK2, 2);
+            assert(observer->calls.back().threads.size() == 2);
+            assert(observer->calls.back().phaseSeconds[PHASE_ALLOCATE] > 0.0);
+
+            ma.transpose(test1M, 2);
+            assert(string(observer->calls.back().operation) == "transpose");
+            assert(observer->calls.back().rows == 300);
+            assert(observer->calls.back().phaseSeconds[PHASE_PACK] == 0.0);
+
+            Matrix square = mc.createMatrix(100, 100, 1.0);
+            ma.transposeInPlace(square, 2);
+            assert(string(observer->calls.back().operation) == "transposeInPlace");
+            assert(observer->calls.size() == 6);
+
+            // No stats without an observer
+            ma.setObserver(nullptr);
+            ma.matrixMultiply(test1M, test2M, 2);
+            assert(observer->calls.size() == 6);
+
+            cout << "PASS - Test Instrumentation" << endl;
+        }
+
+        /**
+         * Multiply and transpose one element type with the active kernels.  Results
+         * must be within tolerance of the reference, relative to the largest possible
+         * sum.  A tolerance of 0 means the results must be exact.
+         */
+        template<typename T>
+        void checkElementType(T start1, T start2, double tolerance)
+        {
+            MatrixCommon mc;
+            MatrixAlgebra ma;
+
+            MatrixT<T> test1M = mc.createMatrix(37, 53, start1);
+            MatrixT<T> test2M = mc.createMatrix(53, 29, start2);
+            MatrixT<T> expected = referenceMultiply(test1M, test2M);
+            double bound = 53.0 * max(abs(test1M(0, 0)), abs(test1M(36, 52))) * max(abs(test2M(0, 0)), abs(test2M(52, 28)));
+
+            for(int numThreads = 0; numThreads <= 3; numThreads += 3)
+            {
+                MatrixT<T> result = numThreads > 0 ? ma.matrixMultiply(test1M, test2M, numThreads) : ma.matrixMultiply(test1M, test2M);
+                for(int m = 0; m < expected.rows(); m++)
+                {
+                    for(int n = 0; n < expected.columns(); n++)
+                    {
+                        assert(abs(result(m, n) - expected(m, n)) <= tolerance * bound);
+                    }
+                }
+            }
+
+            for(int numThreads = 1; numThreads <= 3; numThreads += 2)
+            {
+                MatrixT<T> resultT = ma.transpose(test1M, numThreads);
+                MatrixT<T> square = mc.createMatrix(53, 53, start2);
+                MatrixT<T> squareT = square;
+                MatrixT<T> rectangleT = test1M;
+                ma.transposeInPlace(squareT, numThreads);
+                ma.transposeInPlace(rectangleT, numThreads);
+                for(int m = 0; m < test1M.rows(); m++)
+                {
+                    for(int n = 0; n < test1M.columns(); n++)
+                    {
+                        assert(resultT(n, m) == test1M(m, n));
+                        assert(rectangleT(n, m) == test1M(m, n));
+                    }
+                }
+                for(int m = 0; m < square.rows(); m++)
+                {
+                    for(int n = 0; n < square.columns(); n++)
+                    {
+                        assert(squareT(n, m) == square(m, n));
+                    }
+                }
+            }
+        }
+
+        void test_element_types()
+        {
+            MatrixCommon mc;
+            MatrixAlgebra ma;
+            KernelIsa isa = SimdKernels::active().isa;
+
+            // float and int32_t have kernels for each instruction set
+            for(int i = ISA_SCALAR; i <= ISA_AVX512; i++)
+            {
+                if(!SimdKernels::select((KernelIsa)i))
+                {
+                    continue;
+                }
+                assert(ElementKernels<float>::active().isa == (KernelIsa)i);
+                checkElementType<float>(0.25f, -7.5f, 1e-5);
+                checkElementType<int32_t>(-900, 3, 0.0);
+            }
+            SimdKernels::select(isa);
+
+            // The other types use the portable kernels
+            checkElementType<int64_t>(-3000000000LL, 7, 0.0);
+            checkElementType<complex<float> >(complex<float>(0.5f, -0.25f), complex<float>(-3.0f, 2.0f), 1e-5);
+            checkElementType<complex<double> >(complex<double>(0.5, -0.25), complex<double>(-3.0, 2.0), 1e-12);
+
+            // Split-K adds the partial results in the element type
+            MatrixT<int32_t> longK1 = mc.createMatrix(3, 600, -900);
+            MatrixT<int32_t> longK2 = mc.createMatrix(600, 5, -1500);
+            assert(ma.useSplitK(3, 600, 5, 2));
+            MatrixT<int32_t> expected = referenceMultiply(longK1, longK2);
+            MatrixT<int32_t> result = ma.matrixMultiply(longK1, longK2, 2);
+            for(int m = 0; m < expected.rows(); m++)
+            {
+                for(int n = 0; n < expected.columns(); n++)
+                {
+                    assert(result(m, n) == expected(m, n));
+                }
+            }
+
+            cout << "PASS - Test Element Types" << endl;
+        }
+
+        /**
+         * Check a fixed size matrix against a Matrix with the same values.
+         */
+        template<typename T, int R, int C>
+        static bool sameValues(const FixedMatrix<T, R, C>& fixed, const MatrixT<T>& matrix)
+        {
+            if(matrix.rows() != R || matrix.columns() != C)
+            {
+                return false;
+            }
+            for(int m = 0; m < R; m++)
+            {
+                for(int n = 0; n < C; n++)
+                {
+                    if(fixed(m, n) != matrix(m, n))
+                    {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        void test_fixed_matrix()
+        {
+            MatrixCommon mc;
+            MatrixAlgebra ma;
+
+            // The default shapes of main.cpp, all values are small integers so the results are exact
+            FixedMatrix<double, 2, 3> a23(mc.createMatrix(2, 3, 0.0));
+            FixedMatrix<double, 3, 2> b32(mc.createMatrix(3, 2, 5.0));
+            FixedMatrix<double, 2, 2> c22 = ma.matrixMultiply(a23, b32);
+            assert(c22(0, 0) == 25 && c22(0, 1) == 28 && c22(1, 0) == 88 && c22(1, 1) == 100);
+            assert(sameValues(ma.transpose(a23), ma.transpose(a23.toMatrix(), 1)));
+
+            FixedMatrix<float, 3, 3> a33(mc.createMatrix(3, 3, -4.0f));
+            FixedMatrix<float, 3, 3> b33(mc.createMatrix(3, 3, 2.0f));
+            assert(sameValues(ma.matrixMultiply(a33, b33), referenceMultiply(a33.toMatrix(), b33.toMatrix())));
+
+            FixedMatrix<complex<double>, 4, 4> a44(mc.createMatrix(4, 4, complex<double>(1.0, -2.0)));
+            FixedMatrix<complex<double>, 4, 4> b44(mc.createMatrix(4, 4, complex<double>(-3.0, 1.0)));
+            assert(sameValues(ma.matrixMultiply(a44, b44), referenceMultiply(a44.toMatrix(), b44.toMatrix())));
+            assert(sameValues(ma.transpose(ma.transpose(a44)), a44.toMatrix()));
+
+            // A new fixed matrix is all zeros
+            FixedMatrix<int32_t, 4, 3> zeros;
+            assert(sameValues(zeros, MatrixT<int32_t>(4, 3)));
+
+            // Fixed times dynamic, small and large enough to use the Matrix multiply
+            FixedMatrix<double, 4, 4> transform(mc.createMatrix(4, 4, -7.0));
+            for(int points = 1; points <= 20001; points += 20000)
+            {
+                Matrix right = mc.createMatrix(4, points, -3.0);
+                Matrix left = mc.createMatrix(points, 4, 2.0);
+                Matrix result = ma.matrixMultiply(transform, right);
+                Matrix expected = referenceMultiply(transform.toMatrix(), right);
+                for(int m = 0; m < expected.rows(); m++)
+                {
+                    for(int n = 0; n < expected.columns(); n++)
+                    {
+                        assert(result(m, n) == expected(m, n));
+                    }
+                }
+
+                result = ma.matrixMultiply(left, transform);
+                expected = referenceMultiply(left, transform.toMatrix());
+                for(int m = 0; m < expected.rows(); m++)
+                {
+                    for(int n = 0; n < expected.columns(); n++)
+                    {
+                        assert(result(m, n) == expected(m, n));
+                    }
+                }
+            }
+
+            cout << "PASS - Test Fixed Matrix" << endl;
+        }
+
+        /**
+         * Multiply a batch of M x K and K x N matrices of small integers, which is exact
+         * for every element type, and check each result against the reference.
+         */
+        template<typename T>
+        void checkBatch(int M, int N, int K, int count, int numThreads)
+        {
+            MatrixCommon mc;
+            MatrixAlgebra ma;
+
+            MatrixBatchT<T> as(count, M, K);
+            MatrixBatchT<T> bs(count, K, N);
+            for(int i = 0; i < count; i++)
+            {
+                as.setMatrix(i, mc.createMatrix(M, K, T(i % 7 - 3)));
+                bs.setMatrix(i, mc.createMatrix(K, N, T(2 - i % 5)));
+            }
+
+            MatrixBatchT<T> cs = numThreads > 0 ? ma.multiplyBatch(as, bs, numThreads) : ma.multiplyBatch(as, bs);
+            assert(cs.count() == count && cs.rows() == M && cs.columns() == N);
+            for(int i = 0; i < count; i++)
+            {
+                MatrixT<T> expected = referenceMultiply(as.toMatrix(i), bs.toMatrix(i));
+                for(int m = 0; m < M; m++)
+                {
+                    for(int n = 0; n < N; n++)
+                    {
+                        assert(cs(i, m, n) == expected(m, n));
+                    }
+                }
+            }
+        }
+
+        void test_multiply_batch()
+        {
+            MatrixCommon mc;
+            MatrixAlgebra ma;
+            KernelIsa isa = SimdKernels::active().isa;
+
+            // Interleaved kernels for each instruction set, with a partial last group
+            for(int i = ISA_SCALAR; i <= ISA_AVX512; i++)
+            {
+                if(!SimdKernels::select((KernelIsa)i))
+                {
+                    continue;
+                }
+                checkBatch<double>(8, 8, 8, 37, 1);
+                checkBatch<double>(3, 2, 5, 9, 3);
+                checkBatch<float>(4, 4, 4, 21, 2);
+                checkBatch<int32_t>(7, 1, 8, 15, 1);
+            }
+            SimdKernels::select(isa);
+
+            // Portable interleaved kernels, the blocked multiply and the estimated threads
+            checkBatch<complex<double> >(2, 3, 4, 11, 2);
+            checkBatch<int64_t>(5, 5, 5, 8, 1);
+            checkBatch<double>(33, 17, 20, 10, 3);
+            checkBatch<double>(8, 8, 8, 1000, 0);
+            checkBatch<double>(8, 8, 8, 0, 2);
+
+            // Pairs with different shapes, given as arrays of Matrix
+            vector<Matrix> as;
+            vector<Matrix> bs;
+            for(int i = 0; i < 30; i++)
+            {
+                int M = 1 + i % 4 * 7;
+                int K = 1 + i % 3 * 9;
+                int N = 2 + i % 5;
+                as.push_back(mc.createMatrix(M, K, (double)(i % 3)));
+                bs.push_back(mc.createMatrix(K, N, -2.0));
+            }
+            vector<Matrix> cs(as.size());
+
+            // The second call reuses the results, which must be overwritten
+            for(int numThreads = 1; numThreads <= 3; numThreads += 2)
+            {
+                ma.multiplyBatch(as.data(), bs.data(), cs.data(), (int)as.size(), numThreads);
+                for(size_t i = 0; i < as.size(); i++)
+                {
+                    Matrix expected = referenceMultiply(as[i], bs[i]);
+                    assert(cs[i].rows() == expected.rows() && cs[i].columns() == expected.columns());
+                    for(int m = 0; m < expected.rows(); m++)
+                    {
+                        for(int n = 0; n < expected.columns(); n++)
+                        {
+                            assert(cs[i](m, n) == expected(m, n));
+                        }
+                    }
+                }
+            }
+
+            // The batch is one call for the observer
+            class CountingObserver : public CallObserver {
+                public:
+                    void onCall(const CallStats& stats) override
+                    {
+                        calls.push_back(stats);
+                    }
+
+                    vector<CallStats> calls;
+            };
+            shared_ptr<CountingObserver> observer = make_shared<CountingObserver>();
+            ma.setObserver(observer);
+            ma.multiplyBatch(as.data(), bs.data(), cs.data(), (int)as.size(), 2);
+            assert(observer->calls.size() == 1);
+            assert(string(observer->calls[0].operation) == "multiplyBatch");
+            assert(observer->calls[0].count == 30);
+            assert(observer->calls[0].threads.size() == 2);
+
+            cout << "PASS - Test Multiply Batch" << endl;
+        }
+
+        /**
+         * Inputs of a multiply and their product, shared by the tests that check the
+         * product and the transpose of A computed in different ways.
+         */
+        struct ProductCase {
+            Matrix a;           // 70 x 300
+            Matrix b;           // 300 x 50
+            Matrix expected;    // a * b from referenceMultiply()
+        };
+
+        ProductCase productCase()
+        {
+            MatrixCommon mc;
+            ProductCase productCase;
+            productCase.a = mc.createMatrix(70, 300, 0.5);
+            productCase.b = mc.createMatrix(300, 50, -1.0);
+            productCase.expected = referenceMultiply(productCase.a, productCase.b);
+            return productCase;
+        }
+
+        /**
+         * Check a product of the case and a transpose of its first matrix.
+         */
+        void checkProductCase(const ProductCase& productCase, const Matrix& result, const Matrix& transposed)
+        {
+            const Matrix& a = productCase.a;
+            assert(result.rows() == a.rows() && result.columns() == productCase.b.columns());
+            assert(transposed.rows() == a.columns() && transposed.columns() == a.rows());
+            for(int m = 0; m < a.rows(); m++)
+            {
+                for(int n = 0; n < result.columns(); n++)
+                {
+                    assert(result(m, n) == productCase.expected(m, n));
+                }
+                for(int k = 0; k < a.columns(); k++)
+                {
+                    assert(transposed(k, m) == a(m, k));
+                }
+            }
+        }
+
+        /**
+         * Check C = alpha * op(A) * op(B) + beta * C for every op against the reference,
+         * with small integers so the results are exact.
+         */
+        template<typename T>
+        void checkTransposedOperands(int M, int N, int K, int numThreads)
+        {
+            MatrixCommon mc;
+            MatrixAlgebra ma;
+
+            Matrix a = mc.createMatrix(M, K, -5.0);
+            Matrix b = mc.createMatrix(K, N, 3.0);
+            MatrixT<T> aT = mc.createMatrix(K, M, T(0));
+            MatrixT<T> bT = mc.createMatrix(N, K, T(0));
+            MatrixT<T> aN = mc.createMatrix(M, K, T(0));
+            MatrixT<T> bN = mc.createMatrix(K, N, T(0));
+            for(int m = 0; m < M; m++)
+            {
+                for(int k = 0; k < K; k++)
+                {
+                    aN(m, k) = aT(k, m) = T((int)a(m, k) % 11);
+                }
+            }
+            for(int k = 0; k < K; k++)
+            {
+                for(int n = 0; n < N; n++)
+                {
+                    bN(k, n) = bT(n, k) = T((int)b(k, n) % 13);
+                }
+            }
+            MatrixT<T> product = referenceMultiply(aN, bN);
+            MatrixT<T> start = mc.createMatrix(M, N, T(-7));
+
+            for(int op1 = OP_NO_TRANSPOSE; op1 <= OP_TRANSPOSE; op1++)
+            {
+                for(int op2 = OP_NO_TRANSPOSE; op2 <= OP_TRANSPOSE; op2++)
+                {
+                    const MatrixT<T>& m1 = op1 == OP_TRANSPOSE ? aT : aN;
+                    const MatrixT<T>& m2 = op2 == OP_TRANSPOSE ? bT : bN;
+
+                    MatrixT<T> result = ma.matrixMultiply((MatrixOp)op1, (MatrixOp)op2, m1, m2, numThreads);
+                    MatrixT<T> general = start;
+                    ma.matrixMultiply((MatrixOp)op1, (MatrixOp)op2, 2, m1, m2, -1, general, numThreads);
+                    assert(result.rows() == M && result.columns() == N);
+                    for(int m = 0; m < M; m++)
+                    {
+                        for(int n = 0; n < N; n++)
+                        {
+                            assert(result(m, n) == product(m, n));
+                            assert(general(m, n) == T(2) * product(m, n) - start(m, n));
+                        }
+                    }
+                }
+            }
+        }
+
+        void test_transposed_operands()
+        {
+            MatrixCommon mc;
+            MatrixAlgebra ma;
+
+            checkTransposedOperands<double>(37, 29, 53, 1);
+            checkTransposedOperands<double>(130, 300, 70, 3);
+            checkTransposedOperands<int32_t>(19, 41, 23, 2);
+            checkTransposedOperands<float>(5, 3, 17, 1);
+
+            // Split-K, and enough rows and columns for several blocks of both operands
+            assert(ma.useSplitK(3, 2000, 5, 2));
+            checkTransposedOperands<double>(3, 5, 2000, 2);
+            BlockSizes small = { 16, 32, 64 };
+            ma.setBlockSizes(small);
+            MatrixT<double> a = mc.createMatrix(150, 90, 1.0);
+            MatrixT<double> b = mc.createMatrix(130, 90, -2.0);
+            MatrixT<double> expected = referenceMultiply(a, ma.transpose(b, 1));
+            MatrixT<double> result = ma.matrixMultiply(OP_NO_TRANSPOSE, OP_TRANSPOSE, a, b, 3);
+            for(int m = 0; m < expected.rows(); m++)
+            {
+                for(int n = 0; n < expected.columns(); n++)
+                {
+                    assert(result(m, n) == expected(m, n));
+                }
+            }
+
+            // A beta of 0 does not read the old values, so NaNs do not carry over
+            MatrixT<double> nans(150, 130);
+            for(int m = 0; m < nans.rows(); m++)
+            {
+                for(int n = 0; n < nans.columns(); n++)
+                {
+                    nans(m, n) = NAN;
+                }
+            }
+            for(int numThreads = 1; numThreads <= 3; numThreads += 2)
+            {
+                MatrixT<double> overwritten = nans;
+                ma.matrixMultiply(OP_NO_TRANSPOSE, OP_TRANSPOSE, 1.0, a, b, 0.0, overwritten, numThreads);
+                for(int m = 0; m < expected.rows(); m++)
+                {
+                    for(int n = 0; n < expected.columns(); n++)
+                    {
+                        assert(overwritten(m, n) == expected(m, n));
+                    }
+                }
+            }
+
+            cout << "PASS - Test Transposed Operands" << endl;
+        }
+
+        void test_packed_operand()
+        {
+            MatrixCommon mc;
+            MatrixAlgebra ma;
+
+            // Small blocks, so the result tiles cut across the packed blocks of B
+            BlockSizes small = { 16, 32, 72 };
+            ma.setBlockSizes(small);
+            Matrix a = mc.createMatrix(70, 100, 1.0);
+            Matrix b = mc.createMatrix(100, 230, -3.0);
+            Matrix expected = ma.matrixMultiply(a, b, 1);
+
+            PackedMatrix packed = ma.packMatrix(b);
+            const int nr = ElementKernels<double>::active().nr;
+            assert(packed.rows() == 100 && packed.columns() == 230);
+            assert(packed.bytes() == (size_t)100 * ((230 + nr - 1) / nr * nr) * sizeof(double));
+            assert(packed.packSeconds() >= 0.0);
+
+            for(int numThreads = 1; numThreads <= 4; numThreads++)
+            {
+                Matrix result = ma.matrixMultiply(a, packed, numThreads);
+                assert(result.rows() == 70 && result.columns() == 230);
+                for(int m = 0; m < 70; m++)
+                {
+                    for(int n = 0; n < 230; n++)
+                    {
+                        assert(result(m, n) == expected(m, n));
+                    }
+                }
+            }
+
+            // The packed copy does not change with b, and the transpose packs the same values
+            Matrix bT = ma.transpose(b, 1);
+            b = Matrix(1, 1);
+            PackedMatrix packedT = ma.packMatrix(bT, OP_TRANSPOSE);
+            Matrix aT = ma.transpose(a, 1);
+            Matrix start = mc.createMatrix(70, 230, 5.0);
+            Matrix general = start;
+            ma.matrixMultiply(OP_TRANSPOSE, 2.0, aT, packedT, -1.0, general, 3);
+            Matrix result = ma.matrixMultiply(a, packed);
+            for(int m = 0; m < 70; m++)
+            {
+                for(int n = 0; n < 230; n++)
+                {
+                    assert(result(m, n) == expected(m, n));
+                    assert(general(m, n) == 2.0 * expected(m, n) - start(m, n));
+                }
+            }
+
+            // Other element types, and a packed B used by a second MatrixAlgebra
+            MatrixT<float> af = mc.createMatrix(9, 33, 1.0f);
+            MatrixT<float> bf = mc.createMatrix(33, 17, 2.0f);
+            PackedMatrixT<float> packedF = ma.packMatrix(bf);
+            MatrixAlgebra other;
+            MatrixT<float> resultF = other.matrixMultiply(af, packedF, 2);
+            MatrixT<float> expectedF = referenceMultiply(af, bf);
+            for(int m = 0; m < 9; m++)
+            {
+                for(int n = 0; n < 17; n++)
+                {
+                    assert(fabs(resultF(m, n) - expectedF(m, n)) <= 1e-5f * fabs(expectedF(m, n)));
+                }
+            }
+
+            // The pack and the multiplies are reported with their own names
+            class CountingObserver : public CallObserver {
+                public:
+                    void onCall(const CallStats& stats) override
+                    {
+                        calls.push_back(stats);
+                    }
+
+                    vector<CallStats> calls;
+            };
+            shared_ptr<CountingObserver> observer = make_shared<CountingObserver>();
+            ma.setObserver(observer);
+            PackedMatrix again = ma.packMatrix(bT, OP_TRANSPOSE);
+            ma.matrixMultiply(a, again, 2);
+            assert(observer->calls.size() == 2);
+            assert(string(observer->calls[0].operation) == "pack");
+            assert(observer->calls[0].bytesPacked == again.bytes());
+            assert(string(observer->calls[1].operation) == "multiplyPacked");
+            assert(observer->calls[1].bytesRead == (uint64_t)70 * 100 * sizeof(double) + again.bytes());
+
+            cout << "PASS - Test Packed Operand" << endl;
+        }
+
+        void test_strassen()
+        {
+            MatrixCommon mc;
+            MatrixAlgebra ma;
+            MatrixAlgebra classic;
+
+            // Small integers, so every block sum and product is exact and Strassen gives
+            // the same values.  The odd sizes peel a row, column or index at some steps.
+            Matrix a(67, 45);
+            Matrix b(45, 53);
+            for(int m = 0; m < a.rows(); m++)
+            {
+                for(int k = 0; k < a.columns(); k++)
+                {
+                    a(m, k) = (m * 7 + k * 3) % 11 - 5;
+                }
+            }
+            for(int k = 0; k < b.rows(); k++)
+            {
+                for(int n = 0; n < b.columns(); n++)
+                {
+                    b(k, n) = (k * 5 + n) % 9 - 4;
+                }
+            }
+            Matrix expected = classic.matrixMultiply(a, b, 1);
+            ma.setStrassenCrossover(8);
+
+            for(int numThreads = 1; numThreads <= 3; numThreads += 2)
+            {
+                Matrix result = ma.matrixMultiply(a, b, numThreads);
+                Matrix general = mc.createMatrix(67, 53, 1.0);
+                Matrix start = general;
+                ma.matrixMultiply(OP_TRANSPOSE, OP_TRANSPOSE, -2.0, ma.transpose(a, 1), ma.transpose(b, 1), 3.0, general, numThreads);
+                assert(result.rows() == 67 && result.columns() == 53);
+                for(int m = 0; m < 67; m++)
+                {
+                    for(int n = 0; n < 53; n++)
+                    {
+                        assert(result(m, n) == expected(m, n));
+                        assert(general(m, n) == -2.0 * expected(m, n) + 3.0 * start(m, n));
+                    }
+                }
+            }
+
+            // Values that round, within the error bound of StrassenKernels with n = 150 and n0 = 8
+            Matrix x = mc.createMatrix(150, 150, 0.37);
+            Matrix y = mc.createMatrix(150, 150, -1.13);
+            for(int m = 0; m < 150; m++)
+            {
+                for(int n = 0; n < 150; n++)
+                {
+                    x(m, n) = sin(x(m, n));
+                    y(m, n) = cos(y(m, n));
+                }
+            }
+            expected = classic.matrixMultiply(x, y, 1);
+            Matrix fast = ma.matrixMultiply(x, y, 2);
+            const double bound = (pow(150.0 / 8.0, log2(18.0)) * (8.0 * 8.0 + 6.0 * 8.0) - 6.0 * 150.0) * numeric_limits<double>::epsilon();
+            double largest = 0.0;
+            for(int m = 0; m < 150; m++)
+            {
+                for(int n = 0; n < 150; n++)
+                {
+                    largest = max(largest, fabs(fast(m, n) - expected(m, n)));
+                }
+            }
+            assert(largest <= bound);
+
+            // Other element types.  Integers always use the classic multiply.
+            MatrixT<float> af = mc.createMatrix(40, 40, 0.5f);
+            MatrixT<float> expectedF = referenceMultiply(af, af);
+            MatrixT<float> resultF = ma.matrixMultiply(af, af, 2);
+            MatrixT<int32_t> ai = mc.createMatrix(40, 40, 3);
+            MatrixT<int32_t> expectedI = referenceMultiply(ai, ai);
+            MatrixT<int32_t> resultI = ma.matrixMultiply(ai, ai, 2);
+            for(int m = 0; m < 40; m++)
+            {
+                for(int n = 0; n < 40; n++)
+                {
+                    assert(fabs(resultF(m, n) - expectedF(m, n)) <= 1e-4f * fabs(expectedF(m, n)));
+                    assert(resultI(m, n) == expectedI(m, n));
+                }
+            }
+
+            cout << "PASS - Test Strassen" << endl;
+        }
+
+        /**
+         * Write a header, padded to its dataOffset when it is small, then the rows.
+         */
+        void writeMatrixFile(const string& path, const MatrixFileHeader& header, const Matrix& matrix)
+        {
+            ofstream file(path.c_str(), ios::binary | ios::trunc);
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            const uint64_t padding = header.dataOffset < 4096 ? header.dataOffset - sizeof(header) : 0;
+            const string zeros(padding, '\0');
+            file.write(zeros.data(), zeros.size());
+            file.write(reinterpret_cast<const char*>(matrix.data()), matrix.sizeInBytes());
+        }
+
+        void test_matrix_file()
+        {
+            MatrixCommon mc;
+            MatrixAlgebra ma;
+            const string path = "/tmp/matrix_unittest_file";
+
+            // A saved matrix maps back with the same values, in place in the mapping
+            Matrix a = mc.createMatrix(37, 21, -4.0);
+            assert(MatrixFile::save(path, a));
+            MappedMatrix mapped;
+            assert(mapped.open(path));
+            const Matrix& view = mapped.matrix();
+            assert(view.rows() == 37 && view.columns() == 21 && view.stride() == a.stride());
+            assert(reinterpret_cast<uintptr_t>(view.data()) % MATRIX_ALIGNMENT == 0);
+            for(int m = 0; m < 37; m++)
+            {
+                for(int n = 0; n < 21; n++)
+                {
+                    assert(view(m, n) == a(m, n));
+                }
+            }
+
+            // The view works as an operand, and a copy of it owns its values
+            Matrix product = ma.matrixMultiply(view, ma.transpose(a, 1), 2);
+            Matrix expected = referenceMultiply(a, ma.transpose(a, 1));
+            Matrix copy = view;
+            assert(copy.data() != view.data());
+            mapped.close();
+            assert(mapped.matrix().empty());
+            for(int m = 0; m < 37; m++)
+            {
+                for(int n = 0; n < 37; n++)
+                {
+                    assert(product(m, n) == expected(m, n));
+                }
+                for(int n = 0; n < 21; n++)
+                {
+                    assert(copy(m, n) == a(m, n));
+                }
+            }
+
+            // Rows are streamed in pieces and blocks land at their place
+            MatrixT<float> f = mc.createMatrix(10, 5, 1.0f);
+            MatrixFileWriterT<float> writer;
+            assert(writer.create(path, 10, 5));
+            assert(writer.writeRows(f.data(), 4, f.stride()));
+            assert(writer.writeRows(f.row(4), 6, f.stride()));
+            assert(!writer.writeRows(f.data(), 1, f.stride()));
+            const float block[2] = { -1.0f, -2.0f };
+            assert(writer.writeBlock(9, 3, 1, 2, block, 2));
+            assert(!writer.writeBlock(9, 4, 1, 2, block, 2));
+            assert(writer.close());
+
+            MappedMatrixT<float> mappedF;
+            assert(mappedF.open(path));
+            f(9, 3) = -1.0f;
+            f(9, 4) = -2.0f;
+            for(int m = 0; m < 10; m++)
+            {
+                for(int n = 0; n < 5; n++)
+                {
+                    assert(mappedF.matrix()(m, n) == f(m, n));
+                }
+            }
+
+            // A file of another type, a missing file and a cut file are not opened
+            MatrixFileHeader header;
+            assert(MatrixFile::readHeader(path, header));
+            assert(header.elementType == ELEMENT_FLOAT && header.rows == 10 && header.columns == 5);
+            assert(!mapped.open(path));
+            assert(!mapped.open("/tmp/matrix_unittest_missing"));
+            {
+                ofstream cut(path.c_str(), ios::binary | ios::trunc);
+                cut.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            }
+            assert(!mappedF.open(path));
+
+            // A damaged header with a data offset or a size that would wrap around
+            Matrix small = mc.createMatrix(1, 8, 1.0);
+            MatrixFileHeader damaged = MatrixFile::header<double>(1, 8);
+            damaged.dataOffset = 0xFFFFFFFFFFFFFFC0ull;
+            writeMatrixFile(path, damaged, small);
+            assert(!mapped.open(path));
+            damaged = MatrixFile::header<double>(1, 8);
+            damaged.dataOffset += 8;
+            writeMatrixFile(path, damaged, small);
+            assert(!mapped.open(path));
+            damaged = MatrixFile::header<double>(1, 8);
+            damaged.rows = INT32_MAX;
+            damaged.stride = INT32_MAX;
+            writeMatrixFile(path, damaged, small);
+            assert(!mapped.open(path));
+            writeMatrixFile(path, MatrixFile::header<double>(1, 8), small);
+            assert(mapped.open(path) && mapped.matrix()(0, 7) == 8.0);
+            mapped.close();
+            remove(path.c_str());
+
+            cout << "PASS - Test Matrix File" << endl;
+        }
+
+        void test_out_of_core()
+        {
+            MatrixCommon mc;
+            MatrixAlgebra ma;
+            const string pathA = "/tmp/matrix_unittest_a";
+            const string pathB = "/tmp/matrix_unittest_b";
+            const string pathC = "/tmp/matrix_unittest_c";
+
+            Matrix a = mc.createMatrix(150, 110, -3.0);
+            Matrix b = mc.createMatrix(110, 90, 1.0);
+            assert(MatrixFile::save(pathA, a));
+            assert(MatrixFile::save(pathB, b));
+            Matrix expected = referenceMultiply(a, b);
+
+            // A budget for tiles of 32, so there are edge tiles in every direction, and
+            // one for tiles larger than the matrices
+            const size_t budgets[] = { 6 * 40 * 40 * sizeof(double), 8 << 20 };
+            for(size_t budget : budgets)
+            {
+                OutOfCoreMultiply outOfCore(ma, budget);
+                assert(outOfCore.multiply<double>(pathA, pathB, pathC, 2));
+
+                const OutOfCoreStats& stats = outOfCore.stats();
+                assert(stats.bufferBytes <= budget);
+                assert(stats.bytesWritten == (uint64_t)150 * 90 * sizeof(double));
+                if(budget < (1 << 20))
+                {
+                    assert(stats.tileRows == 32 && stats.tileColumns == 32 && stats.tileProducts > 5 * 3);
+                }
+                else
+                {
+                    assert(stats.tileProducts == 1);
+                }
+
+                MappedMatrix c;
+                assert(c.open(pathC));
+                assert(c.matrix().rows() == 150 && c.matrix().columns() == 90);
+                for(int m = 0; m < 150; m++)
+                {
+                    for(int n = 0; n < 90; n++)
+                    {
+                        assert(c.matrix()(m, n) == expected(m, n));
+                    }
+                }
+            }
+
+            // Shapes that do not match, files of another type and a budget that is too small
+            OutOfCoreMultiply outOfCore(ma, 1 << 20);
+            assert(!outOfCore.multiply<double>(pathA, pathA, pathC, 1));
+            assert(!outOfCore.multiply<float>(pathA, pathB, pathC, 1));
+            OutOfCoreMultiply tiny(ma, 1024);
+            assert(!tiny.multiply<double>(pathA, pathB, pathC, 1));
+
+            // C can not replace A or B, also through another spelling of the path
+            Matrix square = mc.createMatrix(110, 110, 2.0);
+            assert(MatrixFile::save(pathB, square));
+            assert(!outOfCore.multiply<double>(pathA, pathB, pathA, 1));
+            assert(!outOfCore.multiply<double>(pathA, pathB, "/tmp/./matrix_unittest_b", 1));
+            MappedMatrix unchanged;
+            assert(unchanged.open(pathB));
+            assert(unchanged.matrix().rows() == 110 && unchanged.matrix()(109, 109) == square(109, 109));
+
+            remove(pathA.c_str());
+            remove(pathB.c_str());
+            remove(pathC.c_str());
+            cout << "PASS - Test Out Of Core" << endl;
+        }
+
+        /**
+         * Dense matrix with about 1 value in every period, small integers so the
+         * sums are exact in any order.
+         */
+        Matrix sparseValues(int rows, int columns, int period)
+        {
+            Matrix matrix(rows, columns);
+            for(int m = 0; m < rows; m++)
+            {
+                for(int n = 0; n < columns; n++)
+                {
+                    if((m * 7 + n * 13) % period == 0)
+                    {
+                        matrix(m, n) = (m + 2 * n) % 9 - 4;
+                    }
+                }
+            }
+            return matrix;
+        }
+
+        void test_sparse()
+        {
+            MatrixAlgebra ma;
+            Matrix a = sparseValues(97, 61, 5);
+            Matrix b = sparseValues(61, 43, 3);
+            Matrix dense = sparseValues(61, 43, 1);
+
+            // Dense to sparse and back, in both formats
+            SparseMatrix csr(a);
+            SparseMatrix csc(a, SPARSE_CSC);
+            assert(csr.nonZeros() == csc.nonZeros() && csr.nonZeros() < (size_t)(97 * 61 / 4));
+            assert(csr.sizeInBytes() == 98 * sizeof(size_t) + csr.nonZeros() * (sizeof(int) + sizeof(double)));
+            Matrix back = csr.toMatrix();
+            Matrix backCsc = csc.toMatrix();
+            Matrix converted = SparseKernels::convert(csr, SPARSE_CSC).toMatrix();
+            Matrix convertedBack = SparseKernels::convert(csc, SPARSE_CSR).toMatrix();
+            Matrix transposed = ma.transpose(csr).toMatrix();
+            Matrix transposedCsc = ma.transpose(csc).toMatrix();
+            assert(transposed.rows() == 61 && transposedCsc.columns() == 97);
+            for(int m = 0; m < 97; m++)
+            {
+                for(int n = 0; n < 61; n++)
+                {
+                    assert(back(m, n) == a(m, n) && backCsc(m, n) == a(m, n));
+                    assert(converted(m, n) == a(m, n) && convertedBack(m, n) == a(m, n));
+                    assert(transposed(n, m) == a(m, n) && transposedCsc(n, m) == a(m, n));
+                }
+            }
+            assert(SparseKernels::convert(csr, SPARSE_CSC).indices() == csc.indices());
+
+            // Sparse times dense and sparse times sparse, against the dense multiply
+            Matrix expectedDense = referenceMultiply(a, dense);
+            Matrix expectedSparse = referenceMultiply(a, b);
+            const int threads[] = { 1, 3 };
+            for(int numThreads : threads)
+            {
+                Matrix result = ma.matrixMultiply(csr, dense, numThreads);
+                Matrix resultCsc = ma.matrixMultiply(csc, dense, numThreads);
+                SparseMatrix product = ma.matrixMultiply(csr, SparseMatrix(b), numThreads);
+                SparseMatrix productCsc = ma.matrixMultiply(csc, SparseMatrix(b, SPARSE_CSC), numThreads);
+                assert(product.format() == SPARSE_CSR && product.indices() == productCsc.indices());
+                Matrix productDense = product.toMatrix();
+                for(int m = 0; m < 97; m++)
+                {
+                    for(int n = 0; n < 43; n++)
+                    {
+                        assert(result(m, n) == expectedDense(m, n) && resultCsc(m, n) == expectedDense(m, n));
+                        assert(productDense(m, n) == expectedSparse(m, n));
+                    }
+                    for(size_t at = product.offsets()[m] + 1; at < product.offsets()[m + 1]; at++)
+                    {
+                        assert(product.indices()[at - 1] < product.indices()[at]);
+                    }
+                }
+            }
+
+            // Empty rows, and a matrix with no nonzeros
+            Matrix empty(5, 61);
+            Matrix emptyResult = ma.matrixMultiply(SparseMatrix(empty), dense);
+            SparseMatrix emptyProduct = ma.matrixMultiply(SparseMatrix(empty), SparseMatrix(b));
+            assert(emptyResult.rows() == 5 && emptyResult(4, 42) == 0.0);
+            assert(emptyProduct.rows() == 5 && emptyProduct.nonZeros() == 0 && emptyProduct.offsets().size() == 6);
+
+            cout << "PASS - Test Sparse" << endl;
+        }
+
+        void test_caller_output()
+        {
+            MatrixAlgebra ma;
+            const ProductCase product = productCase();
+            const Matrix& a = product.a;
+            const Matrix& b = product.b;
+            ScratchPoolT<double>& pool = ScratchPoolT<double>::local();
+
+            // Buffers taken at the same time are different, and come back to the pool
+            {
+                ScratchBufferT<double> first;
+                ScratchBufferT<double> second;
+                assert(&first.buffer() != &second.buffer());
+            }
+
+            // After the first call, the result and the scratch buffers are reused
+            Matrix result, transposed;
+            SparseMatrix sparse(sparseValues(70, 300, 4));
+            Matrix sparseResult;
+            const int threads[] = { 1, 2 };
+            for(int numThreads : threads)
+            {
+                ma.matrixMultiply(OP_NO_TRANSPOSE, OP_NO_TRANSPOSE, 1.0, a, b, 0.0, result, numThreads);
+                ma.transpose(a, transposed, numThreads);
+                ma.matrixMultiply(sparse, b, sparseResult, numThreads);
+                const double* resultData = result.data();
+                const double* transposedData = transposed.data();
+                const double* sparseData = sparseResult.data();
+                const size_t created = pool.created();
+
+                for(int i = 0; i < 3; i++)
+                {
+                    ma.matrixMultiply(OP_NO_TRANSPOSE, OP_NO_TRANSPOSE, 1.0, a, b, 0.0, result, numThreads);
+                    ma.transpose(a, transposed, numThreads);
+                    ma.matrixMultiply(sparse, b, sparseResult, numThreads);
+                }
+                assert(result.data() == resultData && transposed.data() == transposedData && sparseResult.data() == sparseData);
+                assert(pool.created() == created && pool.bytes() > 0);
+                checkProductCase(product, result, transposed);
+            }
+
+            // A result of the wrong size is replaced
+            Matrix small(3, 3);
+            ma.transpose(a, small, 1);
+            assert(small.rows() == 300 && small.columns() == 70 && small(299, 69) == a(69, 299));
+
+            pool.clear();
+            assert(pool.bytes() == 0);
+            cout << "PASS - Test Caller Output" << endl;
+        }
+
+        void test_numa_affinity()
+        {
+            shared_ptr<ThreadPool> pool = make_shared<ThreadPool>(0);
+            vector<int> cpus = ThreadPool::cpuOrder();
+#if defined(THREAD_POOL_AFFINITY)
+            assert(!cpus.empty());
+            assert(pool->setAffinity(true));
+#else
+            pool->setAffinity(true);
+#endif
+            assert(pool->affinity());
+
+            // With affinity a participant is always the same worker
+            mutex idsMutex;
+            vector<thread::id> ids(4);
+            for(int i = 0; i < 3; i++)
+            {
+                pool->parallelFor(8, 4, [&](int, int participant)
+                {
+                    this_thread::sleep_for(chrono::microseconds(500));
+                    if(participant == 0)
+                    {
+                        return;
+                    }
+                    lock_guard<mutex> lock(idsMutex);
+                    if(ids[participant] == thread::id())
+                    {
+                        ids[participant] = this_thread::get_id();
+                    }
+                    assert(ids[participant] == this_thread::get_id());
+                });
+            }
+
+            // A parallelFor inside a task does not dead lock
+            atomic<int> total(0);
+            pool->parallelFor(4, 4, [&](int, int)
+            {
+                pool->parallelFor(8, 4, [&](int, int)
+                {
+                    total++;
+                });
+            });
+            assert(total == 32);
+
+            // The bands of a new matrix are zeroed by the pool
+            MatrixAlgebra ma(pool);
+            const int threads[] = { 1, 3, 8 };
+            for(int numThreads : threads)
+            {
+                Matrix zeros = ma.allocateMatrix<double>(37, 70, numThreads);
+                assert(zeros.rows() == 37 && zeros.columns() == 70);
+                for(int m = 0; m < 37; m++)
+                {
+                    for(int n = 0; n < zeros.stride(); n++)
+                    {
+                        assert(zeros.row(m)[n] == 0.0);
+                    }
+                }
+            }
+
+            // New results are not zeroed up front, every value is still written
+            const ProductCase product = productCase();
+            for(int numThreads = 1; numThreads <= 4; numThreads++)
+            {
+                Matrix result = ma.matrixMultiply(product.a, product.b, numThreads);
+                Matrix resultT = ma.transpose(product.a, numThreads);
+                checkProductCase(product, result, resultT);
+            }
+
+            // Back to free workers
+            pool->setAffinity(false);
+            assert(!pool->affinity());
+            pool->parallelFor(100, 4, [&](int, int participant)
+            {
+                assert(participant >= 0 && participant < 4);
+            });
+
+#if defined(THREAD_POOL_AFFINITY)
+            // A caller pinned to one CPU sees all the CPUs of the process, and the
+            // workers of its pool are let go on all of them
+            thread pinnedCaller([&]()
+            {
+                cpu_set_t one;
+                CPU_ZERO(&one);
+                CPU_SET(cpus[0], &one);
+                assert(pthread_setaffinity_np(pthread_self(), sizeof(one), &one) == 0);
+                assert(ThreadPool::cpuOrder() == cpus);
+
+                ThreadPool local(3);
+                assert(local.setAffinity(true));
+                assert(local.setAffinity(false));
+                local.parallelFor(8, 4, [&](int, int participant)
+                {
+                    cpu_set_t allowed;
+                    CPU_ZERO(&allowed);
+                    assert(sched_getaffinity(0, sizeof(allowed), &allowed) == 0);
+                    assert(participant == 0 || CPU_COUNT(&allowed) == (int)cpus.size());
+                });
+            });
+            pinnedCaller.join();
+#endif
+
+            cout << "PASS - Test NUMA Affinity" << endl;
+        }
+
+        void test_matrix_vector()
+        {
+            // Matrix-vector, vector-matrix and dot products with every op, alpha and beta
+            const int threads[] = { 1, 3 };
+            for(int numThreads : threads)
+            {
+                checkTransposedOperands<double>(300, 1, 257, numThreads);
+                checkTransposedOperands<double>(1, 301, 257, numThreads);
+                checkTransposedOperands<double>(1, 1, 1000, numThreads);
+                checkTransposedOperands<float>(67, 1, 45, numThreads);
+                checkTransposedOperands<float>(1, 67, 45, numThreads);
+                checkTransposedOperands<int32_t>(1, 33, 70, numThreads);
+                checkTransposedOperands<complex<double> >(19, 1, 33, numThreads);
+            }
+
+            // Long enough to split the result, or only the shared dimension, between threads
+            checkTransposedOperands<double>(5000, 1, 200, 4);
+            checkTransposedOperands<double>(1, 5000, 200, 4);
+            checkTransposedOperands<double>(3, 1, 40000, 4);
+            checkTransposedOperands<double>(1, 1, 200000, 4);
+
+            // A result column with a stride, read as y += x * A
+            MatrixCommon mc;
+            MatrixAlgebra ma;
+            Matrix a = mc.createMatrix(4000, 70, 1.0);
+            Matrix x = mc.createMatrix(4000, 1, -3.0);
+            Matrix expected = referenceMultiply(ma.transpose(a, 1), x);
+            for(int numThreads = 1; numThreads <= 4; numThreads += 3)
+            {
+                Matrix strided(70, 1, 8);
+                ma.matrixMultiply(OP_TRANSPOSE, OP_NO_TRANSPOSE, 1.0, a, x, 0.0, strided, numThreads);
+                assert(strided.stride() == 8);
+                for(int m = 0; m < 70; m++)
+                {
+                    assert(strided(m, 0) == expected(m, 0));
+                }
+            }
+
+            // Every dot and axpy kernel, for every length around the vector widths
+            KernelIsa isa = SimdKernels::active().isa;
+            Matrix values = mc.createMatrix(3, 80, -20.0);
+            MatrixT<float> floatValues = mc.createMatrix(3, 80, -20.0f);
+            for(int i = ISA_SCALAR; i <= ISA_AVX512; i++)
+            {
+                if(!SimdKernels::select((KernelIsa)i))
+                {
+                    continue;
+                }
+                const KernelTable& kernels = ElementKernels<double>::active();
+                const KernelTableT<float>& floatKernels = ElementKernels<float>::active();
+                for(int n = 0; n <= 70; n++)
+                {
+                    double dot = 0.0;
+                    float floatDot = 0.0f;
+                    for(int k = 0; k < n; k++)
+                    {
+                        dot += values(0, k) * values(1, k);
+                        floatDot += floatValues(0, k) * floatValues(1, k);
+                    }
+                    assert(kernels.dotKernel(n, values.row(0), values.row(1)) == dot);
+                    assert(floatKernels.dotKernel(n, floatValues.row(0), floatValues.row(1)) == floatDot);
+
+                    Matrix y = values;
+                    MatrixT<float> floatY = floatValues;
+                    kernels.axpyKernel(n, 2.0, values.row(0), y.row(2));
+                    floatKernels.axpyKernel(n, 2.0f, floatValues.row(0), floatY.row(2));
+                    for(int k = 0; k < 80; k++)
+                    {
+                        assert(y(2, k) == values(2, k) + (k < n ? 2.0 * values(0, k) : 0.0));
+                        assert(floatY(2, k) == floatValues(2, k) + (k < n ? 2.0f * floatValues(0, k) : 0.0f));
+                    }
+                }
+            }
+            SimdKernels::select(isa);
+
+            cout << "PASS - Test Matrix Vector" << endl;
+        }
+
+        void test_async()
+        {
+            MatrixCommon mc;
+            shared_ptr<ThreadPool> pool = make_shared<ThreadPool>(0);
+            MatrixAlgebra ma(pool);
+            Matrix a = mc.createMatrix(90, 70, 0.5);
+            Matrix b = mc.createMatrix(90, 40, -1.0);
+            Matrix c = mc.createMatrix(40, 30, 2.0);
+            Matrix expected = referenceMultiply(referenceMultiply(ma.transpose(a, 1), b), c);
+
+            // Transpose then multiply then multiply, queued at once
+            MatrixFuture t = ma.transposeAsync(MatrixFuture::wrap(a), 2);
+            MatrixFuture p = ma.matrixMultiplyAsync(t, MatrixFuture::wrap(b), 3);
+            MatrixFuture q = ma.matrixMultiplyAsync(p, MatrixFuture::wrap(c), 2);
+            assert(q.valid() && !MatrixFuture().valid());
+            const Matrix& result = q.get();
+            assert(q.ready() && p.ready() && t.ready());
+            assert(result.rows() == 70 && result.columns() == 30);
+            for(int m = 0; m < 70; m++)
+            {
+                for(int n = 0; n < 30; n++)
+                {
+                    assert(result(m, n) == expected(m, n));
+                }
+            }
+
+            // Many independent calls and calls that share an input, with ops
+            MatrixFuture owned(mc.createMatrix(40, 90, 1.0));
+            vector<MatrixFuture> products;
+            for(int i = 0; i < 20; i++)
+            {
+                products.push_back(ma.matrixMultiplyAsync(OP_TRANSPOSE, OP_TRANSPOSE, MatrixFuture::wrap(b), owned, 1 + i % 3));
+            }
+            Matrix expectedProduct = ma.matrixMultiply(OP_TRANSPOSE, OP_TRANSPOSE, b, owned.get(), 1);
+            for(const MatrixFuture& product : products)
+            {
+                const Matrix& value = product.get();
+                for(int m = 0; m < 40; m++)
+                {
+                    for(int n = 0; n < 40; n++)
+                    {
+                        assert(value(m, n) == expectedProduct(m, n));
+                    }
+                }
+            }
+
+            // Independent calls finish on several workers and report to one observer
+            ostringstream log;
+            ma.setObserver(make_shared<StreamObserver>(log));
+            vector<MatrixFuture> observed;
+            for(int i = 0; i < 8; i++)
+            {
+                observed.push_back(ma.matrixMultiplyAsync(OP_TRANSPOSE, OP_NO_TRANSPOSE, MatrixFuture::wrap(a), MatrixFuture::wrap(b), 1 + i % 2));
+            }
+            for(const MatrixFuture& product : observed)
+            {
+                product.wait();
+            }
+            ma.setObserver(nullptr);
+            int lines = 0;
+            string line;
+            istringstream reader(log.str());
+            while(getline(reader, line))
+            {
+                assert(line.compare(0, 9, "multiply ") == 0);
+                lines++;
+            }
+            assert(lines == 8);
+
+            // Waiting inside a task of a pool with one worker runs the queued call
+            shared_ptr<ThreadPool> single = make_shared<ThreadPool>(1);
+            MatrixAlgebra singleMa(single);
+            atomic<bool> done(false);
+            single->post([&]()
+            {
+                MatrixFuture inner = singleMa.transposeAsync(MatrixFuture::wrap(a), 1);
+                assert(inner.get()(3, 5) == a(5, 3));
+                done = true;
+            });
+            while(!done)
+            {
+                this_thread::sleep_for(chrono::milliseconds(1));
+            }
+            assert(single->numWorkers() == 1);
+
+            cout << "PASS - Test Async" << endl;
+        }
+
+        /**
+         * M x N matrix of values in [-scale, scale] that change sign, unlike the
+         * incrementing matrices of createMatrix().
+         */
+        Matrix wavyMatrix(int rows, int columns, double scale, int seed)
+        {
+            Matrix matrix(rows, columns);
+            for(int m = 0; m < rows; m++)
+            {
+                for(int n = 0; n < columns; n++)
+                {
+                    matrix(m, n) = scale * sin(0.37 * m + 1.13 * n + seed);
+                }
+            }
+            return matrix;
+        }
+
+        /**
+         * Check that |result - expected| <= (relative * |m1| * |m2|) for every value.
+         */
+        template<typename T>
+        void checkErrorBound(const MatrixT<T>& result, const Matrix& expected, const Matrix& m1, const Matrix& m2, double relative)
+        {
+            Matrix abs1(m1.rows(), m1.columns());
+            Matrix abs2(m2.rows(), m2.columns());
+            for(int m = 0; m < m1.rows(); m++)
+            {
+                for(int k = 0; k < m1.columns(); k++)
+                {
+                    abs1(m, k) = fabs(m1(m, k));
+                }
+            }
+            for(int k = 0; k < m2.rows(); k++)
+            {
+                for(int n = 0; n < m2.columns(); n++)
+                {
+                    abs2(k, n) = fabs(m2(k, n));
+                }
+            }
+            MatrixAlgebra ma;
+            Matrix bound = ma.matrixMultiply(abs1, abs2, 1);
+            assert(result.rows() == expected.rows() && result.columns() == expected.columns());
+            for(int m = 0; m < expected.rows(); m++)
+            {
+                for(int n = 0; n < expected.columns(); n++)
+                {
+                    assert(fabs((double)result(m, n) - expected(m, n)) <= relative * bound(m, n));
+                }
+            }
+        }
+
+        void test_mixed_precision()
+        {
+            // Rounding of the software conversions, ties go to the even value
+            assert(bfloat16(1.0f).bits == 0x3F80);
+            assert(bfloat16(1.0f + ldexp(1.0f, -8)).bits == 0x3F80);
+            assert(bfloat16(1.0f + 3.0f * ldexp(1.0f, -8)).bits == 0x3F82);
+            assert(bfloat16(-2.5f).bits == 0xC020);
+            assert(std::isnan((float)bfloat16(NAN)));
+            assert(float16(1.0f).bits == 0x3C00);
+            assert(float16(-2.0f).bits == 0xC000);
+            assert(float16(1.0f + ldexp(1.0f, -11)).bits == 0x3C00);
+            assert(float16(1.0f + 3.0f * ldexp(1.0f, -11)).bits == 0x3C02);
+            assert(float16(65504.0f).bits == 0x7BFF);
+            assert(float16(65519.0f).bits == 0x7BFF);
+            assert(float16(65520.0f).bits == 0x7C00);
+            assert(float16(INFINITY).bits == 0x7C00);
+            assert(float16(ldexp(1.0f, -24)).bits == 0x0001);
+            assert(float16(ldexp(1.0f, -25)).bits == 0x0000);
+            assert(float16(ldexp(1.5f, -25)).bits == 0x0001);
+            assert(float16(ldexp(1.0f, -14) - ldexp(1.0f, -26)).bits == 0x0400);
+            assert(std::isnan((float)float16(NAN)));
+
+            // Every value that is not a NaN converts back to the same bits
+            for(uint32_t bits = 0; bits <= 0xFFFF; bits++)
+            {
+                float16 half;
+                half.bits = (uint16_t)bits;
+                if(!std::isnan((float)half))
+                {
+                    assert(float16((float)half).bits == bits);
+                }
+                bfloat16 brain;
+                brain.bits = (uint16_t)bits;
+                if(!std::isnan((float)brain))
+                {
+                    assert(bfloat16((float)brain).bits == bits);
+                }
+            }
+
+            MatrixAlgebra ma;
+            const int shapes[][4] = { { 37, 29, 53, 1 }, { 130, 90, 3000, 3 }, { 1, 70, 300, 2 } };
+            for(const int* shape : shapes)
+            {
+                const int M = shape[0];
+                const int N = shape[1];
+                const int K = shape[2];
+                const int numThreads = shape[3];
+                Matrix a = wavyMatrix(M, K, 2.0, 1);
+                Matrix b = wavyMatrix(K, N, 3.0, 2);
+                Matrix exact = ma.matrixMultiply(a, b, 1);
+
+                // float storage, double sums: only the float rounding of the inputs shows
+                MatrixT<float> floatA = MixedPrecision::convert<float>(a);
+                MatrixT<float> floatB = MixedPrecision::convert<float>(b);
+                Matrix wide = ma.matrixMultiplyMixed(floatA, floatB, numThreads);
+                checkErrorBound(wide, exact, a, b, ldexp(1.0, -23) + K * ldexp(1.0, -52));
+                Matrix widened = ma.matrixMultiply(MixedPrecision::convert<double>(floatA), MixedPrecision::convert<double>(floatB), 1);
+                checkErrorBound(wide, widened, a, b, K * ldexp(1.0, -52));
+                Matrix oneThread = ma.matrixMultiplyMixed(floatA, floatB, 1);
+                for(int m = 0; m < M; m++)
+                {
+                    for(int n = 0; n < N; n++)
+                    {
+                        assert(wide(m, n) == oneThread(m, n));
+                    }
+                }
+
+                // 16 bit storage, float sums
+                MatrixT<float> brain = ma.matrixMultiplyMixed(MixedPrecision::convert<bfloat16>(a), MixedPrecision::convert<bfloat16>(b), numThreads);
+                checkErrorBound(brain, exact, a, b, ldexp(1.0, -7) + K * ldexp(1.0, -23));
+                MatrixT<float> half = ma.matrixMultiplyMixed(MixedPrecision::convert<float16>(a), MixedPrecision::convert<float16>(b), numThreads);
+                checkErrorBound(half, exact, a, b, ldexp(1.0, -10) + K * ldexp(1.0, -23));
+
+                // int8 quantized, bounded by half a scale per value
+                QuantizedMatrix qa(a, QUANTIZE_ROWS);
+                QuantizedMatrix qb(b, QUANTIZE_COLUMNS);
+                MatrixT<float> quantized = ma.matrixMultiply(qa, qb, numThreads);
+                for(int m = 0; m < M; m++)
+                {
+                    for(int n = 0; n < N; n++)
+                    {
+                        const double sa = qa.scales()[m];
+                        const double sb = qb.scales()[n];
+                        double bound = 0.0;
+                        double magnitude = 0.0;
+                        for(int k = 0; k < K; k++)
+                        {
+                            bound += fabs(a(m, k)) * sb / 2 + fabs(b(k, n)) * sa / 2 + sa * sb / 4;
+                            magnitude += fabs(a(m, k) * b(k, n));
+                        }
+                        assert(fabs(quantized(m, n) - exact(m, n)) <= bound + (magnitude + bound) * ldexp(1.0, -22));
+                    }
+                }
+                assert(qa.sizeInBytes() == (size_t)M * K + M * sizeof(float));
+
+                // Quantized along the other axis, so they are quantized again
+                MatrixT<float> requantized = ma.matrixMultiply(QuantizedMatrix(a, QUANTIZE_COLUMNS), QuantizedMatrix(b, QUANTIZE_ROWS), numThreads);
+                checkErrorBound(requantized, exact, a, b, 0.05);
+            }
+
+            // int8 storage with int32 sums is exact
+            MatrixT<int8_t> smallA(23, 41);
+            MatrixT<int8_t> smallB(41, 19);
+            for(int k = 0; k < 41; k++)
+            {
+                for(int m = 0; m < 23; m++)
+                {
+                    smallA(m, k) = (int8_t)((m * 7 + k * 3) % 255 - 127);
+                }
+                for(int n = 0; n < 19; n++)
+                {
+                    smallB(k, n) = (int8_t)((k * 5 + n * 11) % 255 - 127);
+                }
+            }
+            MatrixT<int32_t> integers = ma.matrixMultiplyMixed(smallA, smallB, 2);
+            MatrixT<int32_t> expected = referenceMultiply(MixedPrecision::convert<int32_t>(smallA), MixedPrecision::convert<int32_t>(smallB));
+            for(int m = 0; m < 23; m++)
+            {
+                for(int n = 0; n < 19; n++)
+                {
+                    assert(integers(m, n) == expected(m, n));
+                }
+            }
+
+            // A shared dimension longer than one int32 sum can hold at full scale
+            const int longK = QUANTIZED_MAX_DEPTH + 1000;
+            Matrix ones(2, longK);
+            Matrix column(longK, 3);
+            for(int k = 0; k < longK; k++)
+            {
+                ones(0, k) = 1.0;
+                ones(1, k) = -1.0;
+                column(k, 0) = 1.0;
+                column(k, 1) = -1.0;
+                column(k, 2) = k % 2 == 0 ? 1.0 : 0.0;
+            }
+            MatrixT<float> sums = ma.matrixMultiply(QuantizedMatrix(ones, QUANTIZE_ROWS), QuantizedMatrix(column, QUANTIZE_COLUMNS), 2);
+            assert(sums(0, 0) == longK && sums(0, 1) == -longK && sums(1, 0) == -longK && sums(0, 2) == (longK + 1) / 2);
+
+            cout << "PASS - Test Mixed Precision" << endl;
+        }
+
+        void test_fill()
+        {
+            MatrixCommon mc;
+            MatrixAlgebra ma;
+            const int threads[] = { 1, 4 };
+            for(int numThreads : threads)
+            {
+                // Incrementing values, the same as createMatrix() when they are exact
+                Matrix sequence = ma.createMatrix(37, 53, 0.5, numThreads);
+                Matrix expected = mc.createMatrix(37, 53, 0.5);
+                MatrixT<int32_t> integers = ma.createMatrix(5, 70, int32_t(-100), numThreads);
+                MatrixT<int32_t> expectedIntegers = mc.createMatrix(5, 70, int32_t(-100));
+                for(int m = 0; m < 37; m++)
+                {
+                    for(int n = 0; n < 53; n++)
+                    {
+                        assert(sequence(m, n) == expected(m, n));
+                    }
+                }
+                for(int m = 0; m < 5; m++)
+                {
+                    for(int n = 0; n < 70; n++)
+                    {
+                        assert(integers(m, n) == expectedIntegers(m, n));
+                    }
+                }
+
+                // Constant and identity, with a result that is not square
+                MatrixT<float> constant(20, 9, MATRIX_UNINITIALIZED);
+                ma.fillMatrix(constant, 2.5f, numThreads);
+                Matrix identity(6, 11, MATRIX_UNINITIALIZED);
+                ma.fillIdentity(identity, numThreads);
+                for(int m = 0; m < 20; m++)
+                {
+                    for(int n = 0; n < 9; n++)
+                    {
+                        assert(constant(m, n) == 2.5f);
+                    }
+                }
+                for(int m = 0; m < 6; m++)
+                {
+                    for(int n = 0; n < 11; n++)
+                    {
+                        assert(identity(m, n) == (m == n ? 1.0 : 0.0));
+                    }
+                }
+            }
+
+            // Random values do not depend on the threads or the number of rows
+            Matrix random(300, 257);
+            Matrix randomOneThread(300, 257);
+            Matrix firstRows(3, 257);
+            ma.fillRandom(random, -2.0, 3.0, 42, 4);
+            ma.fillRandom(randomOneThread, -2.0, 3.0, 42, 1);
+            ma.fillRandom(firstRows, -2.0, 3.0, 42, 1);
+            double sum = 0.0;
+            for(int m = 0; m < 300; m++)
+            {
+                for(int n = 0; n < 257; n++)
+                {
+                    assert(random(m, n) == randomOneThread(m, n));
+                    assert(random(m, n) >= -2.0 && random(m, n) < 3.0);
+                    assert(m >= 3 || random(m, n) == firstRows(m, n));
+                    sum += random(m, n);
+                }
+            }
+            assert(fabs(sum / (300 * 257) - 0.5) < 0.05);
+            Matrix otherSeed(3, 257);
+            ma.fillRandom(otherSeed, -2.0, 3.0, 43, 1);
+            assert(otherSeed(0, 0) != firstRows(0, 0) && otherSeed(2, 256) != firstRows(2, 256));
+
+            // Integers cover both ends of the range
+            MatrixT<int32_t> dice(10, 100);
+            ma.fillRandom(dice, int32_t(1), int32_t(6), 7, 2);
+            int counts[7] = { 0 };
+            for(int m = 0; m < 10; m++)
+            {
+                for(int n = 0; n < 100; n++)
+                {
+                    assert(dice(m, n) >= 1 && dice(m, n) <= 6);
+                    counts[dice(m, n)]++;
+                }
+            }
+            for(int face = 1; face <= 6; face++)
+            {
+                assert(counts[face] > 100);
+            }
+
+            // The full range of int64 does not overflow, and gives both signs
+            MatrixT<int64_t> wide(4, 50);
+            ma.fillRandom(wide, INT64_MIN, INT64_MAX, 9, 2);
+            int negatives = 0;
+            for(int m = 0; m < 4; m++)
+            {
+                for(int n = 0; n < 50; n++)
+                {
+                    negatives += wide(m, n) < 0 ? 1 : 0;
+                }
+            }
+            assert(negatives > 50 && negatives < 150);
+
+            // Complex values have parts that are drawn separately, each in its range
+            MatrixT<complex<float> > complexFloats(8, 40);
+            MatrixT<complex<double> > complexDoubles(8, 40);
+            ma.fillRandom(complexFloats, complex<float>(0.0f, -1.0f), complex<float>(1.0f, 1.0f), 11, 2);
+            ma.fillRandom(complexDoubles, complex<double>(-1.0, 0.0), complex<double>(1.0, 2.0), 11, 2);
+            int crossed = 0;
+            for(int m = 0; m < 8; m++)
+            {
+                for(int n = 0; n < 40; n++)
+                {
+                    const complex<float> f = complexFloats(m, n);
+                    const complex<double> d = complexDoubles(m, n);
+                    assert(f.real() >= 0.0f && f.real() <= 1.0f && f.imag() >= -1.0f && f.imag() <= 1.0f);
+                    assert(d.real() >= -1.0 && d.real() < 1.0 && d.imag() >= 0.0 && d.imag() < 2.0);
+
+                    // With correlated parts the imaginary part would be the real part plus 1
+                    crossed += d.imag() < d.real() + 1.0 ? 1 : 0;
+                }
+            }
+            assert(crossed > 100 && crossed < 220);
+
+            // Large enough for the non-temporal stores, with rows that are not all
+            // 16 byte aligned
+            const int rows = 1500;
+            const int columns = 1400;
+            Matrix streamed(rows, columns, columns + 1);
+            assert(streamed.sizeInBytes() >= FILL_STREAM_BYTES);
+            ma.fillSequence(streamed, 1.0, 4);
+            ma.fillIdentity(streamed, 4);
+            for(int m = 0; m < rows; m += 7)
+            {
+                for(int n = 0; n < columns; n++)
+                {
+                    assert(streamed(m, n) == (m == n ? 1.0 : 0.0));
+                }
+            }
+            MatrixT<float> streamedConstant(rows, 3000, MATRIX_UNINITIALIZED);
+            ma.fillMatrix(streamedConstant, -1.0f, 3);
+            for(int m = 0; m < rows; m += 3)
+            {
+                for(int n = 0; n < 3000; n++)
+                {
+                    assert(streamedConstant(m, n) == -1.0f);
+                }
+            }
+
+            cout << "PASS - Test Fill" << endl;
+        }
+
         void test_all()
         {
             test_matrix_create();
@@ -182,5 +2303,31 @@ class TestMatrix {
             test_matrix_multiply();
             test_matrix_multiply_1();
             test_matrix_clean();
+            test_matrix_class();
+            test_matrix_multiply_matrix();
+            test_transpose_matrix();
+            test_matrix_multiply_blocked();
+            test_simd_kernels();
+            test_thread_pool();
+            test_work_stealing();
+            test_matrix_multiply_split_k();
+            test_transpose_in_place();
+            test_auto_tuner();
+            test_instrumentation();
+            test_element_types();
+            test_fixed_matrix();
+            test_multiply_batch();
+            test_transposed_operands();
+            test_packed_operand();
+            test_strassen();
+            test_matrix_file();
+            test_out_of_core();
+            test_sparse();
+            test_caller_output();
+            test_numa_affinity();
+            test_matrix_vector();
+            test_async();
+            test_mixed_precision();
+            test_fill();
         }
 };
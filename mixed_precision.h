@@ -0,0 +1,322 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "common.h"
+
+using namespace std;
+
+/**
+ * 16 bit brain float: the sign, the 8 bit exponent and the top 7 bits of the
+ * mantissa of a float.  It has the range of a float with about 3 decimal digits.
+ * The conversions are done in software, rounding to the nearest even value.
+ */
+struct bfloat16 {
+    uint16_t bits;      // The top 16 bits of the float
+
+    bfloat16() : bits(0)
+    {
+    }
+
+    explicit bfloat16(float value) : bits(fromFloat(value))
+    {
+    }
+
+    operator float() const
+    {
+        const uint32_t x = (uint32_t)bits << 16;
+        float value;
+        memcpy(&value, &x, sizeof(value));
+        return value;
+    }
+
+    /**
+     * Round a float to the bits of a bfloat16.  A NaN stays a NaN.
+     */
+    static uint16_t fromFloat(float value)
+    {
+        uint32_t x;
+        memcpy(&x, &value, sizeof(x));
+        if((x & 0x7FFFFFFF) > 0x7F800000)
+        {
+            return (uint16_t)((x >> 16) | 0x40);
+        }
+
+        // Adding 0x7FFF plus the lowest kept bit rounds ties to even.  Too large
+        // values carry into the exponent and become infinity.
+        x += 0x7FFF + ((x >> 16) & 1);
+        return (uint16_t)(x >> 16);
+    }
+};
+
+/**
+ * IEEE 754 half precision float: 1 sign bit, 5 exponent bits and 10 mantissa bits.
+ * The largest value is 65504 and the smallest normal one 2^-14.  The conversions
+ * are done in software, rounding to the nearest even value, with subnormals,
+ * infinities and NaNs kept.
+ */
+struct float16 {
+    uint16_t bits;      // The half precision bits
+
+    float16() : bits(0)
+    {
+    }
+
+    explicit float16(float value) : bits(fromFloat(value))
+    {
+    }
+
+    operator float() const
+    {
+        const uint32_t sign = (uint32_t)(bits & 0x8000) << 16;
+        const uint32_t exponent = (bits >> 10) & 0x1F;
+        const uint32_t mantissa = bits & 0x3FF;
+
+        uint32_t x;
+        if(exponent == 0x1F)
+        {
+            x = sign | 0x7F800000 | (mantissa << 13);
+        }
+        else if(exponent != 0)
+        {
+            x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+        }
+        else
+        {
+            // Zero or subnormal, mantissa * 2^-24, which a float has exactly
+            const float value = ldexp((float)mantissa, -24);
+            return sign != 0 ? -value : value;
+        }
+
+        float value;
+        memcpy(&value, &x, sizeof(value));
+        return value;
+    }
+
+    /**
+     * Round a float to the bits of a float16.
+     */
+    static uint16_t fromFloat(float value)
+    {
+        uint32_t x;
+        memcpy(&x, &value, sizeof(x));
+        const uint16_t sign = (uint16_t)((x >> 16) & 0x8000);
+        const uint32_t magnitude = x & 0x7FFFFFFF;
+
+        if(magnitude >= 0x7F800000)
+        {
+            // Infinity, or a NaN that keeps a mantissa bit set
+            return sign | 0x7C00 | (magnitude > 0x7F800000 ? 0x200 : 0);
+        }
+        if(magnitude >= 0x477FF000)
+        {
+            // 65520 and up round to infinity
+            return sign | 0x7C00;
+        }
+        if(magnitude >= 0x38800000)
+        {
+            // Normal: move the exponent bias from 127 to 15 and round off 13 bits
+            uint32_t half = (magnitude - 0x38000000) >> 13;
+            const uint32_t rest = magnitude & 0x1FFF;
+            if(rest > 0x1000 || (rest == 0x1000 && (half & 1) != 0))
+            {
+                half++;
+            }
+            return sign | (uint16_t)half;
+        }
+        if(magnitude <= 0x33000000)
+        {
+            // 2^-25 and less round to 0
+            return sign;
+        }
+
+        // Subnormal: the value in units of 2^-24.  Rounding up to 0x400 gives the
+        // smallest normal value, which is the right bits.
+        const int shift = 126 - (int)(magnitude >> 23);
+        const uint32_t mantissa = (magnitude & 0x7FFFFF) | 0x800000;
+        uint32_t half = mantissa >> shift;
+        const uint32_t rest = mantissa & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        if(rest > halfway || (rest == halfway && (half & 1) != 0))
+        {
+            half++;
+        }
+        return sign | (uint16_t)half;
+    }
+};
+
+/**
+ * Type the products of a storage type are summed in by
+ * MatrixAlgebra::matrixMultiplyMixed().  Only the listed storage types have one.
+ */
+template<typename S>
+struct AccumulatorType;
+
+template<> struct AccumulatorType<float> { typedef double type; };
+template<> struct AccumulatorType<bfloat16> { typedef float type; };
+template<> struct AccumulatorType<float16> { typedef float type; };
+template<> struct AccumulatorType<int8_t> { typedef int32_t type; };
+
+/**
+ * Longest shared dimension summed in one int32 sum by the quantized multiply.
+ * 127 * 127 * QUANTIZED_MAX_DEPTH still fits in an int32.
+ */
+static const int QUANTIZED_MAX_DEPTH = 131072;
+
+/**
+ * Which values of a QuantizedMatrix share a scale.
+ */
+enum QuantizeAxis {
+    QUANTIZE_ROWS = 0,      // One scale per row
+    QUANTIZE_COLUMNS = 1    // One scale per column
+};
+
+/**
+ * Matrix of int8 values with a float scale per row or per column, so value (m, n)
+ * is about scale * values()(m, n).  The quantization is symmetric: the largest
+ * magnitude of a row or column maps to 127 and 0 stays exactly 0.  -128 is not
+ * used, so a product of two values fits in 15 bits.
+ *
+ * The matrix takes a quarter of the memory of a float matrix and an eighth of a
+ * double one.  Value m, n has an error of at most half a scale.  It is multiplied
+ * with MatrixAlgebra::matrixMultiply(), a first matrix with a scale per row by a
+ * second with a scale per column, so the scales come out of the int32 sums.
+ */
+class QuantizedMatrix {
+
+    public:
+        /**
+         * Create an empty matrix with no rows or columns.
+         */
+        QuantizedMatrix() : mAxis(QUANTIZE_ROWS)
+        {
+        }
+
+        /**
+         * Quantize a matrix.
+         *
+         * :param matrix: The values.  They should be finite.
+         * :param axis: Whether each row or each column gets a scale.
+         */
+        template<typename T>
+        QuantizedMatrix(const MatrixT<T>& matrix, QuantizeAxis axis)
+            : mValues(matrix.rows(), matrix.columns()), mAxis(axis),
+              mScales(axis == QUANTIZE_ROWS ? matrix.rows() : matrix.columns(), 0.0f)
+        {
+            const int rows = matrix.rows();
+            const int columns = matrix.columns();
+
+            // Largest magnitude of each row or column
+            for(int m = 0; m < rows; m++)
+            {
+                const T* row = matrix.row(m);
+                for(int n = 0; n < columns; n++)
+                {
+                    float& scale = mScales[axis == QUANTIZE_ROWS ? m : n];
+                    scale = max(scale, (float)fabs(row[n]));
+                }
+            }
+
+            vector<float> inverses(mScales.size());
+            for(size_t i = 0; i < mScales.size(); i++)
+            {
+                mScales[i] /= 127.0f;
+                inverses[i] = mScales[i] > 0.0f ? 1.0f / mScales[i] : 0.0f;
+            }
+
+            for(int m = 0; m < rows; m++)
+            {
+                const T* row = matrix.row(m);
+                int8_t* out = mValues.row(m);
+                for(int n = 0; n < columns; n++)
+                {
+                    const float value = (float)row[n] * inverses[axis == QUANTIZE_ROWS ? m : n];
+                    out[n] = (int8_t)max(-127.0f, min(127.0f, nearbyint(value)));
+                }
+            }
+        }
+
+        int rows() const { return mValues.rows(); }
+        int columns() const { return mValues.columns(); }
+        QuantizeAxis axis() const { return mAxis; }
+
+        /**
+         * The int8 values.
+         */
+        const MatrixT<int8_t>& values() const { return mValues; }
+
+        /**
+         * The scale of each row or column, depending on axis().
+         */
+        const vector<float>& scales() const { return mScales; }
+
+        /**
+         * Scale of value m, n.
+         */
+        float scale(int m, int n) const { return mScales[mAxis == QUANTIZE_ROWS ? m : n]; }
+
+        /**
+         * Copy the scaled values into a new matrix.
+         */
+        template<typename T>
+        MatrixT<T> dequantize() const
+        {
+            MatrixT<T> matrix(rows(), columns());
+            for(int m = 0; m < rows(); m++)
+            {
+                const int8_t* row = mValues.row(m);
+                T* out = matrix.row(m);
+                for(int n = 0; n < columns(); n++)
+                {
+                    out[n] = T(scale(m, n) * row[n]);
+                }
+            }
+            return matrix;
+        }
+
+        /**
+         * Bytes used by the values and the scales.
+         */
+        size_t sizeInBytes() const
+        {
+            return (size_t)rows() * columns() + mScales.size() * sizeof(float);
+        }
+
+    private:
+        MatrixT<int8_t> mValues;    // The quantized values
+        QuantizeAxis mAxis;         // Whether the scales are per row or per column
+        vector<float> mScales;      // Scale of each row or column
+};
+
+/**
+ * Conversions between the storage types.
+ */
+class MixedPrecision {
+
+    public:
+        /**
+         * Copy a matrix into a new one of another type, like double to bfloat16 or
+         * float16 to float.  Narrowing rounds to the nearest value.
+         *
+         * :param matrix: The matrix to convert.
+         * :return: The converted matrix.
+         */
+        template<typename D, typename S>
+        static MatrixT<D> convert(const MatrixT<S>& matrix)
+        {
+            MatrixT<D> converted(matrix.rows(), matrix.columns());
+            for(int m = 0; m < matrix.rows(); m++)
+            {
+                const S* row = matrix.row(m);
+                D* out = converted.row(m);
+                for(int n = 0; n < matrix.columns(); n++)
+                {
+                    out[n] = D(row[n]);
+                }
+            }
+            return converted;
+        }
+};
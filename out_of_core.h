@@ -0,0 +1,270 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <string>
+#include "common.h"
+#include "instrumentation.h"
+#include "matrix.h"
+#include "matrix_file.h"
+
+using namespace std;
+
+/**
+ * Stats of the last OutOfCoreMultiply::multiply().
+ */
+struct OutOfCoreStats {
+    int tileRows;               // Rows of A and C in a tile
+    int tileColumns;            // Columns of B and C in a tile
+    int tileDepth;              // Shared dimension in a tile
+    int tileProducts;           // Number of tile multiplies
+    size_t bufferBytes;         // Bytes of the tile buffers
+    double totalSeconds;        // Time of the whole multiply
+    double computeSeconds;      // Time in the tile multiplies
+    double waitSeconds;         // Time waiting for reads and writes that were not done yet
+    uint64_t bytesRead;         // Bytes of A and B copied into tiles
+    uint64_t bytesWritten;      // Bytes of C written
+
+    OutOfCoreStats() : tileRows(0), tileColumns(0), tileDepth(0), tileProducts(0), bufferBytes(0), totalSeconds(0.0),
+                       computeSeconds(0.0), waitSeconds(0.0), bytesRead(0), bytesWritten(0)
+    {
+    }
+};
+
+/**
+ * Multiply of matrices in files that do not fit in memory, C = A * B.
+ *
+ * A and B are mapped with MappedMatrixT and C is written with MatrixFileWriterT.  C is
+ * computed one tile at a time.  For each tile, the tiles of A and B along the shared
+ * dimension are copied into memory and multiplied into the tile of C with the
+ * threaded multiply of MatrixAlgebra.  The tiles of A and B for the next product are
+ * read on another thread while the current product is computed, and a finished tile
+ * of C is written on another thread while the next one is computed.  When the disk
+ * keeps up, the multiply runs at the speed of the in-memory multiply of a tile.
+ *
+ * The tile buffers (2 tiles of A, B and C) fit in the memory budget.  The tiles are
+ * as large as the budget allows, since each tile of C reads a strip of A and B from
+ * the file: A is read once per column of tiles and B once per row of tiles.  The
+ * pages of the mapped files are only cached by the kernel, which drops them when the
+ * memory is needed, so they are not counted in the budget.
+ */
+class OutOfCoreMultiply {
+
+    public:
+        /**
+         * :param algebra: Runs the tile multiplies.  Its observer sees each of them.
+         * :param memoryBytes: Most bytes used by the tile buffers.
+         */
+        OutOfCoreMultiply(MatrixAlgebra& algebra, size_t memoryBytes) : mAlgebra(algebra), mMemoryBytes(memoryBytes)
+        {
+        }
+
+        /**
+         * C = A * B from and to matrix files.
+         *
+         * :param pathA: File of A, M x K.
+         * :param pathB: File of B, K x N.
+         * :param pathC: File written with C, M x N.  An existing file is replaced.  It can
+         *               not be the file of A or B, which are read while C is written.
+         * :param numThreads: Number of threads for the tile multiplies.
+         * :return: False if a file could not be read or written, C is the file of A or
+         *          B, the shapes do not match or the memory budget is too small for
+         *          tiles of MIN_TILE.
+         */
+        template<typename T>
+        bool multiply(const string& pathA, const string& pathB, const string& pathC, int numThreads)
+        {
+            mStats = OutOfCoreStats();
+            const double start = statsNow();
+
+            MappedMatrixT<T> fileA, fileB;
+            if(!fileA.open(pathA) || !fileB.open(pathB) || fileA.matrix().columns() != fileB.matrix().rows())
+            {
+                return false;
+            }
+            const MatrixT<T>& A = fileA.matrix();
+            const MatrixT<T>& B = fileB.matrix();
+            const int M = A.rows();
+            const int N = B.columns();
+            const int K = A.columns();
+
+            // Replacing A or B while they are mapped would read zeros or fault
+            if(sameFile(pathC, pathA) || sameFile(pathC, pathB))
+            {
+                return false;
+            }
+
+            MatrixFileWriterT<T> writer;
+            if(!pickTiles(M, N, K, sizeof(T)) || !writer.create(pathC, M, N))
+            {
+                return false;
+            }
+            if(M == 0 || N == 0 || K == 0)
+            {
+                // Nothing to multiply, the new file is all zeros
+                mStats.totalSeconds = statsNow() - start;
+                return writer.close();
+            }
+
+            const int tm = mStats.tileRows;
+            const int tn = mStats.tileColumns;
+            const int tk = mStats.tileDepth;
+            const int rowTiles = (M + tm - 1) / tm;
+            const int columnTiles = (N + tn - 1) / tn;
+            const int depthTiles = (K + tk - 1) / tk;
+            const int steps = rowTiles * columnTiles * depthTiles;
+
+            MatrixT<T> a[2] = { MatrixT<T>(tm, tk), MatrixT<T>(tm, tk) };
+            MatrixT<T> b[2] = { MatrixT<T>(tk, tn), MatrixT<T>(tk, tn) };
+            MatrixT<T> c[2] = { MatrixT<T>(tm, tn), MatrixT<T>(tm, tn) };
+            mStats.bufferBytes = 2 * (a[0].sizeInBytes() + b[0].sizeInBytes() + c[0].sizeInBytes());
+
+            // Step s is depth tile s % depthTiles of C tile s / depthTiles, across the rows first
+            auto load = [&](int step, int buffer)
+            {
+                const int tile = step / depthTiles;
+                const int rowBegin = (tile / columnTiles) * tm;
+                const int columnBegin = (tile % columnTiles) * tn;
+                const int depthBegin = (step % depthTiles) * tk;
+                copyTile(A, rowBegin, depthBegin, min(tm, M - rowBegin), min(tk, K - depthBegin), a[buffer]);
+                copyTile(B, depthBegin, columnBegin, min(tk, K - depthBegin), min(tn, N - columnBegin), b[buffer]);
+            };
+
+            future<void> pendingLoad;
+            future<bool> pendingWrite;
+            bool written = true;
+            int cBuffer = 0;
+            load(0, 0);
+
+            for(int step = 0; step < steps; step++)
+            {
+                const int current = step % 2;
+                if(step + 1 < steps)
+                {
+                    pendingLoad = async(launch::async, load, step + 1, 1 - current);
+                }
+
+                const int tile = step / depthTiles;
+                const int depthTile = step % depthTiles;
+                MatrixT<T>& cTile = c[cBuffer];
+                cTile.reshape(a[current].rows(), b[current].columns(), cTile.stride());
+                {
+                    PhaseTimer timer(&mStats.computeSeconds);
+                    mAlgebra.matrixMultiply(OP_NO_TRANSPOSE, OP_NO_TRANSPOSE, T(1), a[current], b[current], depthTile == 0 ? T() : T(1), cTile, numThreads);
+                }
+                mStats.tileProducts++;
+                mStats.bytesRead += a[current].rows() * (uint64_t)a[current].columns() * sizeof(T) + b[current].rows() * (uint64_t)b[current].columns() * sizeof(T);
+
+                if(depthTile == depthTiles - 1)
+                {
+                    // The tile of C is done.  It is written while the next one is computed.
+                    {
+                        PhaseTimer timer(&mStats.waitSeconds);
+                        written = (!pendingWrite.valid() || pendingWrite.get()) && written;
+                    }
+                    const int rowBegin = (tile / columnTiles) * tm;
+                    const int columnBegin = (tile % columnTiles) * tn;
+                    pendingWrite = async(launch::async, [&writer, &cTile, rowBegin, columnBegin]() -> bool
+                    {
+                        return writer.writeBlock(rowBegin, columnBegin, cTile.rows(), cTile.columns(), cTile.data(), cTile.stride());
+                    });
+                    mStats.bytesWritten += cTile.rows() * (uint64_t)cTile.columns() * sizeof(T);
+                    cBuffer = 1 - cBuffer;
+                }
+
+                if(pendingLoad.valid())
+                {
+                    PhaseTimer timer(&mStats.waitSeconds);
+                    pendingLoad.get();
+                }
+            }
+
+            {
+                PhaseTimer timer(&mStats.waitSeconds);
+                written = (!pendingWrite.valid() || pendingWrite.get()) && written;
+            }
+            written = writer.close() && written;
+            mStats.totalSeconds = statsNow() - start;
+            return written;
+        }
+
+        /**
+         * Stats of the last multiply.
+         */
+        const OutOfCoreStats& stats() const
+        {
+            return mStats;
+        }
+
+        /**
+         * Smallest tile side.  Smaller tiles would spend more time reading than computing.
+         */
+        static const int MIN_TILE = 16;
+
+    private:
+        OutOfCoreMultiply(const OutOfCoreMultiply&);
+        OutOfCoreMultiply& operator=(const OutOfCoreMultiply&);
+
+        /**
+         * True if both paths name the same existing file, also through links or
+         * different spellings of the path.
+         */
+        static bool sameFile(const string& first, const string& second)
+        {
+#if defined(MATRIX_MMAP)
+            struct stat firstInfo, secondInfo;
+            return stat(first.c_str(), &firstInfo) == 0 && stat(second.c_str(), &secondInfo) == 0 &&
+                   firstInfo.st_dev == secondInfo.st_dev && firstInfo.st_ino == secondInfo.st_ino;
+#else
+            return first == second;
+#endif
+        }
+
+        /**
+         * Pick the largest tiles whose buffers fit in the budget.  The tiles start square
+         * and are cut to the size of the matrices.  Budget left by a short side goes to
+         * the shared dimension, which is read most.
+         *
+         * :return: False if tiles of MIN_TILE do not fit.
+         */
+        bool pickTiles(int M, int N, int K, size_t elementSize)
+        {
+            // 2 tiles each of A, B and C, with some room for the row padding
+            const double elements = (double)mMemoryBytes / elementSize * 0.9;
+            int side = (int)sqrt(elements / 6.0);
+            if(side < MIN_TILE)
+            {
+                return false;
+            }
+            side = side / MIN_TILE * MIN_TILE;
+
+            const int tm = max(1, min(side, M));
+            const int tn = max(1, min(side, N));
+            const double depth = (elements - 2.0 * tm * tn) / (2.0 * (tm + tn));
+            mStats.tileRows = tm;
+            mStats.tileColumns = tn;
+            mStats.tileDepth = max(1, (int)min((double)K, depth));
+            return true;
+        }
+
+        /**
+         * Copy a rows x columns block of a matrix, starting at (rowBegin, columnBegin),
+         * into a tile buffer.  The tile keeps its stride.
+         */
+        template<typename T>
+        static void copyTile(const MatrixT<T>& matrix, int rowBegin, int columnBegin, int rows, int columns, MatrixT<T>& tile)
+        {
+            tile.reshape(rows, columns, tile.stride());
+            for(int r = 0; r < rows; r++)
+            {
+                memcpy(tile.row(r), matrix.row(rowBegin + r) + columnBegin, (size_t)columns * sizeof(T));
+            }
+        }
+
+        MatrixAlgebra& mAlgebra;    // Runs the tile multiplies
+        size_t mMemoryBytes;        // Most bytes used by the tile buffers
+        OutOfCoreStats mStats;      // Stats of the last multiply
+};
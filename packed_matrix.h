@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include "common.h"
+#include "simd_kernels.h"
+
+using namespace std;
+
+/**
+ * Matrix packed once into the panels read by the micro-kernel, so it can be the
+ * second operand of many multiplies without being packed again.  This is for a
+ * matrix that does not change, like the weights of a model, multiplied by a
+ * stream of first matrices.  Made by MatrixAlgebra::packMatrix().
+ *
+ * The layout follows the kernels and the kc and nc block sizes used to pack it,
+ * so it is only read by MatrixKernels.  The matrix is cut into blocks of nc
+ * columns.  Each block is cut into kc rows, and each of those is stored as nr
+ * wide panels like packB() writes them.  The blocks follow each other in
+ * column order, then row order, with no gaps.
+ */
+template<typename T>
+class PackedMatrixT {
+
+    public:
+        /**
+         * Empty handle.  It can not be multiplied.
+         */
+        PackedMatrixT() : mRows(0), mColumns(0), mKc(0), mNc(0), mNr(0), mIsa(ISA_SCALAR), mPackSeconds(0.0)
+        {
+        }
+
+        /**
+         * Make room for a rows x columns matrix packed for the given kernels.  The
+         * values are packed by MatrixKernels::packMatrix().
+         *
+         * :param rows: Rows of the matrix, the shared dimension of the multiplies.
+         * :param columns: Columns of the matrix.
+         * :param kc: Rows in a packed block.
+         * :param nc: Columns in a packed block.  A multiple of nr.
+         * :param nr: Columns in a panel, the nr of the kernels.
+         * :param isa: Instruction set of the kernels.
+         */
+        PackedMatrixT(int rows, int columns, int kc, int nc, int nr, KernelIsa isa)
+            : mRows(rows), mColumns(columns), mKc(kc), mNc(nc), mNr(nr), mIsa(isa), mPackSeconds(0.0),
+              mPanels(rows, roundUp(columns, nr), roundUp(columns, nr))
+        {
+        }
+
+        bool empty() const { return mRows == 0 || mColumns == 0; }
+
+        int rows() const { return mRows; }
+        int columns() const { return mColumns; }
+        int kc() const { return mKc; }
+        int nc() const { return mNc; }
+        int nr() const { return mNr; }
+        KernelIsa isa() const { return mIsa; }
+
+        /**
+         * Bytes used by the packed panels.
+         */
+        size_t bytes() const
+        {
+            return (size_t)mPanels.rows() * mPanels.stride() * sizeof(T);
+        }
+
+        /**
+         * Seconds spent packing the matrix.
+         */
+        double packSeconds() const { return mPackSeconds; }
+        void setPackSeconds(double seconds) { mPackSeconds = seconds; }
+
+        /**
+         * First panel of the packed block with rows [k, k + kc) that holds column n.
+         *
+         * :param k: First row of the block, a multiple of kc.
+         * :param n: Column, a multiple of nr.
+         * :return: Panel holding columns [n, n + nr).  The next panels of the block follow it.
+         */
+        const T* panel(int k, int n) const
+        {
+            return mPanels.data() + offset(k, n);
+        }
+
+        T* panel(int k, int n)
+        {
+            return mPanels.data() + offset(k, n);
+        }
+
+    private:
+        size_t offset(int k, int n) const
+        {
+            // Blocks before this one are nc wide, and panels are padded to nr
+            const int jc = n - n % mNc;
+            const int blockColumns = roundUp(min(mNc, mColumns - jc), mNr);
+            const int blockRows = min(mKc, mRows - k);
+            return (size_t)jc * mRows + (size_t)k * blockColumns + (size_t)(n - jc) * blockRows;
+        }
+
+        static int roundUp(int value, int multiple)
+        {
+            return ((value + multiple - 1) / multiple) * multiple;
+        }
+
+        int mRows;              // Rows of the matrix
+        int mColumns;           // Columns of the matrix
+        int mKc;                // Rows in a packed block
+        int mNc;                // Columns in a packed block
+        int mNr;                // Columns in a panel
+        KernelIsa mIsa;         // Instruction set of the kernels the panels are for
+        double mPackSeconds;    // Time spent packing
+        MatrixT<T> mPanels;     // The packed blocks, as one unpadded buffer
+};
+
+typedef PackedMatrixT<double> PackedMatrix;
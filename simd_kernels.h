@@ -0,0 +1,660 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MATRIX_SIMD_X86
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+/**
+ * Largest register tile used by any micro-kernel, for any element type.
+ * Used to size the scratch tile for the edges of C.
+ */
+static const int GEMM_MAX_MR = 8;
+static const int GEMM_MAX_NR = 32;
+
+/**
+ * Number of small problems the batch kernels compute at once.  The values of the
+ * problems are interleaved, so element (m, k) of all the problems is one vector.
+ */
+static const int BATCH_LANES = 8;
+
+/**
+ * Instruction sets that have hand written kernels.
+ * Ordered from slowest to fastest.
+ */
+enum KernelIsa {
+    ISA_SCALAR = 0,
+    ISA_SSE2 = 1,
+    ISA_AVX2 = 2,
+    ISA_AVX512 = 3
+};
+
+/**
+ * Micro-kernel.  Multiply a packed mr x kc panel of A by a packed kc x nr panel
+ * of B and add it to a full mr x nr tile of C.
+ */
+typedef void (*MicroKernelFunction)(int kc, const double* a, const double* b, double* C, int ldc);
+
+/**
+ * Transpose a full block x block square from src into dst.
+ */
+typedef void (*TransposeBlockFunction)(const double* src, int lds, double* dst, int ldd);
+
+/**
+ * The kernels for one instruction set and element type, and the tile sizes they use.
+ */
+template<typename T>
+struct KernelTableT {
+    KernelIsa isa;                                                          // Instruction set
+    const char* name;                                                       // Name used when printing
+    int mr;                                                                 // Rows in the register tile
+    int nr;                                                                 // Columns in the register tile
+    void (*microKernel)(int kc, const T* a, const T* b, T* C, int ldc);     // GEMM micro-kernel
+    int transposeBlock;                                                     // Size of the transpose block
+    void (*transposeKernel)(const T* src, int lds, T* dst, int ldd);        // Transpose block kernel
+    void (*batchKernel)(int M, int N, int K, const T* a, const T* b, T* c); // Interleaved batch kernel
+    T (*dotKernel)(int n, const T* a, const T* x);                          // Sum of a[i] * x[i]
+    void (*axpyKernel)(int n, T alpha, const T* x, T* y);                   // y += alpha * x
+};
+
+/**
+ * The kernels for doubles.
+ */
+typedef KernelTableT<double> KernelTable;
+
+/**
+ * Hand written vector kernels with runtime CPU dispatch.
+ *
+ * Each kernel is compiled for its own instruction set with a target attribute,
+ * so the library is built for the base x86-64 instruction set and one binary runs
+ * on every host.  The first time the kernels are used, CPUID is checked and the
+ * fastest supported set is picked.  Other compilers and CPUs use the portable
+ * scalar kernels.
+ */
+class SimdKernels {
+
+    public:
+        /**
+         * Check if this CPU can run the kernels for the instruction set.
+         *
+         * :param isa: Instruction set to check.
+         * :return: True if the kernels can be used.
+         */
+        static bool isSupported(KernelIsa isa)
+        {
+            switch(isa)
+            {
+                case ISA_SCALAR:
+                    return true;
+        #ifdef MATRIX_SIMD_X86
+                case ISA_SSE2:
+                    return __builtin_cpu_supports("sse2");
+                case ISA_AVX2:
+                    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+                case ISA_AVX512:
+                    return __builtin_cpu_supports("avx512f");
+        #endif
+                default:
+                    return false;
+            }
+        }
+
+        /**
+         * Fastest instruction set this CPU supports.
+         */
+        static KernelIsa bestIsa()
+        {
+            for(int isa = ISA_AVX512; isa > ISA_SCALAR; isa--)
+            {
+                if(isSupported((KernelIsa)isa))
+                {
+                    return (KernelIsa)isa;
+                }
+            }
+            return ISA_SCALAR;
+        }
+
+        /**
+         * Kernel table for an instruction set.  The instruction set
+         * must be supported by the CPU to call the kernels.
+         *
+         * :param isa: Instruction set.
+         * :return: The kernels for the instruction set.
+         */
+        static const KernelTable& table(KernelIsa isa)
+        {
+            static const KernelTable tables[] = {
+                { ISA_SCALAR, "scalar", 4, 8, microKernelScalar<4, 8>, 4, transposeBlockScalar<4>, batchKernelScalar, dotScalar, axpyScalar },
+        #ifdef MATRIX_SIMD_X86
+                { ISA_SSE2, "sse2", 4, 4, microKernelSse2, 2, transposeBlockSse2, batchKernelScalar, dotSse2, axpySse2 },
+                { ISA_AVX2, "avx2", 6, 8, microKernelAvx2, 4, transposeBlockAvx2, batchKernelAvx2, dotAvx2, axpyAvx2 },
+                { ISA_AVX512, "avx512", 8, 16, microKernelAvx512, 8, transposeBlockAvx512, batchKernelAvx512, dotAvx512, axpyAvx512 },
+        #endif
+            };
+        #ifdef MATRIX_SIMD_X86
+            return tables[isa];
+        #else
+            (void)isa;
+            return tables[0];
+        #endif
+        }
+
+        /**
+         * Kernels used by the library.  Picked from CPUID the first time.
+         */
+        static const KernelTable& active()
+        {
+            return *activeTable().load(memory_order_acquire);
+        }
+
+        /**
+         * Force the kernels for an instruction set.  Used by tests and tuning
+         * to compare the kernels.  Do not call while a multiply is running.
+         *
+         * :param isa: Instruction set to use.
+         * :return: False if the CPU does not support the instruction set.
+         */
+        static bool select(KernelIsa isa)
+        {
+            if(!isSupported(isa))
+            {
+                return false;
+            }
+            activeTable().store(&table(isa), memory_order_release);
+            return true;
+        }
+
+    private:
+        static atomic<const KernelTable*>& activeTable()
+        {
+            static atomic<const KernelTable*> current(&table(bestIsa()));
+            return current;
+        }
+
+        /**
+         * Portable micro-kernel.  The loops have fixed bounds so the compiler
+         * can keep the tile in registers.
+         */
+        template<int MR, int NR>
+        static void microKernelScalar(int kc, const double* a, const double* b, double* C, int ldc)
+        {
+            double acc[MR][NR];
+            for(int r = 0; r < MR; r++)
+            {
+                for(int c = 0; c < NR; c++)
+                {
+                    acc[r][c] = C[(size_t)r * ldc + c];
+                }
+            }
+
+            for(int k = 0; k < kc; k++)
+            {
+                for(int r = 0; r < MR; r++)
+                {
+                    const double aValue = a[r];
+                    for(int c = 0; c < NR; c++)
+                    {
+                        acc[r][c] += aValue * b[c];
+                    }
+                }
+                a += MR;
+                b += NR;
+            }
+
+            for(int r = 0; r < MR; r++)
+            {
+                for(int c = 0; c < NR; c++)
+                {
+                    C[(size_t)r * ldc + c] = acc[r][c];
+                }
+            }
+        }
+
+        /**
+         * Portable transpose of a BLOCK x BLOCK square.
+         */
+        template<int BLOCK>
+        static void transposeBlockScalar(const double* src, int lds, double* dst, int ldd)
+        {
+            for(int r = 0; r < BLOCK; r++)
+            {
+                for(int c = 0; c < BLOCK; c++)
+                {
+                    dst[(size_t)c * ldd + r] = src[(size_t)r * lds + c];
+                }
+            }
+        }
+
+        /**
+         * Portable batch kernel.  c = a * b for BATCH_LANES problems of M x K times
+         * K x N.  Element (m, k) of problem l is a[(m * K + k) * BATCH_LANES + l], and
+         * the same for b and c.
+         */
+        static void batchKernelScalar(int M, int N, int K, const double* a, const double* b, double* c)
+        {
+            for(int m = 0; m < M; m++)
+            {
+                for(int n = 0; n < N; n++)
+                {
+                    double acc[BATCH_LANES] = { 0.0 };
+                    for(int k = 0; k < K; k++)
+                    {
+                        const double* aValue = a + (size_t)(m * K + k) * BATCH_LANES;
+                        const double* bValue = b + (size_t)(k * N + n) * BATCH_LANES;
+                        for(int l = 0; l < BATCH_LANES; l++)
+                        {
+                            acc[l] += aValue[l] * bValue[l];
+                        }
+                    }
+                    for(int l = 0; l < BATCH_LANES; l++)
+                    {
+                        c[(size_t)(m * N + n) * BATCH_LANES + l] = acc[l];
+                    }
+                }
+            }
+        }
+
+        /**
+         * Portable dot product.  4 sums hide the latency of the adds.
+         */
+        static double dotScalar(int n, const double* a, const double* x)
+        {
+            double acc0 = 0.0, acc1 = 0.0, acc2 = 0.0, acc3 = 0.0;
+            int i = 0;
+            for(; i + 4 <= n; i += 4)
+            {
+                acc0 += a[i] * x[i];
+                acc1 += a[i + 1] * x[i + 1];
+                acc2 += a[i + 2] * x[i + 2];
+                acc3 += a[i + 3] * x[i + 3];
+            }
+            for(; i < n; i++)
+            {
+                acc0 += a[i] * x[i];
+            }
+            return (acc0 + acc1) + (acc2 + acc3);
+        }
+
+        /**
+         * Portable y += alpha * x.
+         */
+        static void axpyScalar(int n, double alpha, const double* x, double* y)
+        {
+            for(int i = 0; i < n; i++)
+            {
+                y[i] += alpha * x[i];
+            }
+        }
+
+    #ifdef MATRIX_SIMD_X86
+        /**
+         * SSE2 4x4 micro-kernel.  Each row of the tile is 2 registers.
+         */
+        __attribute__((target("sse2")))
+        static void microKernelSse2(int kc, const double* a, const double* b, double* C, int ldc)
+        {
+            __m128d c00 = _mm_loadu_pd(C), c01 = _mm_loadu_pd(C + 2);
+            __m128d c10 = _mm_loadu_pd(C + ldc), c11 = _mm_loadu_pd(C + ldc + 2);
+            __m128d c20 = _mm_loadu_pd(C + 2 * ldc), c21 = _mm_loadu_pd(C + 2 * ldc + 2);
+            __m128d c30 = _mm_loadu_pd(C + 3 * ldc), c31 = _mm_loadu_pd(C + 3 * ldc + 2);
+
+            for(int k = 0; k < kc; k++)
+            {
+                const __m128d b0 = _mm_load_pd(b);
+                const __m128d b1 = _mm_load_pd(b + 2);
+                __m128d a0 = _mm_set1_pd(a[0]);
+                c00 = _mm_add_pd(c00, _mm_mul_pd(a0, b0));
+                c01 = _mm_add_pd(c01, _mm_mul_pd(a0, b1));
+                a0 = _mm_set1_pd(a[1]);
+                c10 = _mm_add_pd(c10, _mm_mul_pd(a0, b0));
+                c11 = _mm_add_pd(c11, _mm_mul_pd(a0, b1));
+                a0 = _mm_set1_pd(a[2]);
+                c20 = _mm_add_pd(c20, _mm_mul_pd(a0, b0));
+                c21 = _mm_add_pd(c21, _mm_mul_pd(a0, b1));
+                a0 = _mm_set1_pd(a[3]);
+                c30 = _mm_add_pd(c30, _mm_mul_pd(a0, b0));
+                c31 = _mm_add_pd(c31, _mm_mul_pd(a0, b1));
+                a += 4;
+                b += 4;
+            }
+
+            _mm_storeu_pd(C, c00); _mm_storeu_pd(C + 2, c01);
+            _mm_storeu_pd(C + ldc, c10); _mm_storeu_pd(C + ldc + 2, c11);
+            _mm_storeu_pd(C + 2 * ldc, c20); _mm_storeu_pd(C + 2 * ldc + 2, c21);
+            _mm_storeu_pd(C + 3 * ldc, c30); _mm_storeu_pd(C + 3 * ldc + 2, c31);
+        }
+
+        /**
+         * SSE2 2x2 transpose block.
+         */
+        __attribute__((target("sse2")))
+        static void transposeBlockSse2(const double* src, int lds, double* dst, int ldd)
+        {
+            const __m128d r0 = _mm_loadu_pd(src);
+            const __m128d r1 = _mm_loadu_pd(src + lds);
+            _mm_storeu_pd(dst, _mm_unpacklo_pd(r0, r1));
+            _mm_storeu_pd(dst + ldd, _mm_unpackhi_pd(r0, r1));
+        }
+
+        /**
+         * AVX2 6x8 micro-kernel with FMA.  The tile is 12 registers, which
+         * leaves room for 2 rows of B and the broadcast of A.
+         */
+        __attribute__((target("avx2,fma")))
+        static void microKernelAvx2(int kc, const double* a, const double* b, double* C, int ldc)
+        {
+            __m256d c[6][2];
+            for(int r = 0; r < 6; r++)
+            {
+                c[r][0] = _mm256_loadu_pd(C + (size_t)r * ldc);
+                c[r][1] = _mm256_loadu_pd(C + (size_t)r * ldc + 4);
+            }
+
+            for(int k = 0; k < kc; k++)
+            {
+                const __m256d b0 = _mm256_load_pd(b);
+                const __m256d b1 = _mm256_load_pd(b + 4);
+                for(int r = 0; r < 6; r++)
+                {
+                    const __m256d aValue = _mm256_broadcast_sd(a + r);
+                    c[r][0] = _mm256_fmadd_pd(aValue, b0, c[r][0]);
+                    c[r][1] = _mm256_fmadd_pd(aValue, b1, c[r][1]);
+                }
+                a += 6;
+                b += 8;
+            }
+
+            for(int r = 0; r < 6; r++)
+            {
+                _mm256_storeu_pd(C + (size_t)r * ldc, c[r][0]);
+                _mm256_storeu_pd(C + (size_t)r * ldc + 4, c[r][1]);
+            }
+        }
+
+        /**
+         * SSE2 dot product with 2 registers of sums.
+         */
+        __attribute__((target("sse2")))
+        static double dotSse2(int n, const double* a, const double* x)
+        {
+            __m128d acc0 = _mm_setzero_pd();
+            __m128d acc1 = _mm_setzero_pd();
+            int i = 0;
+            for(; i + 4 <= n; i += 4)
+            {
+                acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(x + i)));
+                acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(x + i + 2)));
+            }
+            acc0 = _mm_add_pd(acc0, acc1);
+            double sum = _mm_cvtsd_f64(acc0) + _mm_cvtsd_f64(_mm_unpackhi_pd(acc0, acc0));
+            for(; i < n; i++)
+            {
+                sum += a[i] * x[i];
+            }
+            return sum;
+        }
+
+        /**
+         * SSE2 y += alpha * x.
+         */
+        __attribute__((target("sse2")))
+        static void axpySse2(int n, double alpha, const double* x, double* y)
+        {
+            const __m128d a = _mm_set1_pd(alpha);
+            int i = 0;
+            for(; i + 4 <= n; i += 4)
+            {
+                _mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), _mm_mul_pd(a, _mm_loadu_pd(x + i))));
+                _mm_storeu_pd(y + i + 2, _mm_add_pd(_mm_loadu_pd(y + i + 2), _mm_mul_pd(a, _mm_loadu_pd(x + i + 2))));
+            }
+            for(; i < n; i++)
+            {
+                y[i] += alpha * x[i];
+            }
+        }
+
+        /**
+         * AVX2 dot product with FMA.  4 registers of sums cover the latency of the FMA.
+         */
+        __attribute__((target("avx2,fma")))
+        static double dotAvx2(int n, const double* a, const double* x)
+        {
+            __m256d acc[4] = { _mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd() };
+            int i = 0;
+            for(; i + 16 <= n; i += 16)
+            {
+                for(int j = 0; j < 4; j++)
+                {
+                    acc[j] = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 4 * j), _mm256_loadu_pd(x + i + 4 * j), acc[j]);
+                }
+            }
+            for(; i + 4 <= n; i += 4)
+            {
+                acc[0] = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(x + i), acc[0]);
+            }
+            const __m256d total = _mm256_add_pd(_mm256_add_pd(acc[0], acc[1]), _mm256_add_pd(acc[2], acc[3]));
+            __m128d half = _mm_add_pd(_mm256_castpd256_pd128(total), _mm256_extractf128_pd(total, 1));
+            double sum = _mm_cvtsd_f64(half) + _mm_cvtsd_f64(_mm_unpackhi_pd(half, half));
+            for(; i < n; i++)
+            {
+                sum += a[i] * x[i];
+            }
+            return sum;
+        }
+
+        /**
+         * AVX2 y += alpha * x with FMA.
+         */
+        __attribute__((target("avx2,fma")))
+        static void axpyAvx2(int n, double alpha, const double* x, double* y)
+        {
+            const __m256d a = _mm256_set1_pd(alpha);
+            int i = 0;
+            for(; i + 8 <= n; i += 8)
+            {
+                _mm256_storeu_pd(y + i, _mm256_fmadd_pd(a, _mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+                _mm256_storeu_pd(y + i + 4, _mm256_fmadd_pd(a, _mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4)));
+            }
+            for(; i < n; i++)
+            {
+                y[i] += alpha * x[i];
+            }
+        }
+
+        /**
+         * AVX2 4x4 transpose block.  Swap the pairs inside each 128 bit lane
+         * then swap the lanes.
+         */
+        __attribute__((target("avx2")))
+        static void transposeBlockAvx2(const double* src, int lds, double* dst, int ldd)
+        {
+            const __m256d r0 = _mm256_loadu_pd(src);
+            const __m256d r1 = _mm256_loadu_pd(src + lds);
+            const __m256d r2 = _mm256_loadu_pd(src + 2 * lds);
+            const __m256d r3 = _mm256_loadu_pd(src + 3 * lds);
+
+            const __m256d t0 = _mm256_unpacklo_pd(r0, r1);
+            const __m256d t1 = _mm256_unpackhi_pd(r0, r1);
+            const __m256d t2 = _mm256_unpacklo_pd(r2, r3);
+            const __m256d t3 = _mm256_unpackhi_pd(r2, r3);
+
+            _mm256_storeu_pd(dst, _mm256_permute2f128_pd(t0, t2, 0x20));
+            _mm256_storeu_pd(dst + ldd, _mm256_permute2f128_pd(t1, t3, 0x20));
+            _mm256_storeu_pd(dst + 2 * ldd, _mm256_permute2f128_pd(t0, t2, 0x31));
+            _mm256_storeu_pd(dst + 3 * ldd, _mm256_permute2f128_pd(t1, t3, 0x31));
+        }
+
+        /**
+         * AVX-512 8x16 micro-kernel with FMA.  The tile is 16 of the 32 registers.
+         */
+        __attribute__((target("avx512f")))
+        static void microKernelAvx512(int kc, const double* a, const double* b, double* C, int ldc)
+        {
+            __m512d c[8][2];
+            for(int r = 0; r < 8; r++)
+            {
+                c[r][0] = _mm512_loadu_pd(C + (size_t)r * ldc);
+                c[r][1] = _mm512_loadu_pd(C + (size_t)r * ldc + 8);
+            }
+
+            for(int k = 0; k < kc; k++)
+            {
+                const __m512d b0 = _mm512_load_pd(b);
+                const __m512d b1 = _mm512_load_pd(b + 8);
+                for(int r = 0; r < 8; r++)
+                {
+                    const __m512d aValue = _mm512_set1_pd(a[r]);
+                    c[r][0] = _mm512_fmadd_pd(aValue, b0, c[r][0]);
+                    c[r][1] = _mm512_fmadd_pd(aValue, b1, c[r][1]);
+                }
+                a += 8;
+                b += 16;
+            }
+
+            for(int r = 0; r < 8; r++)
+            {
+                _mm512_storeu_pd(C + (size_t)r * ldc, c[r][0]);
+                _mm512_storeu_pd(C + (size_t)r * ldc + 8, c[r][1]);
+            }
+        }
+
+        // GCC 12 headers set the unused half of some AVX-512 shuffles from an
+        // uninitialized value and warn about it
+        #pragma GCC diagnostic push
+        #pragma GCC diagnostic ignored "-Wuninitialized"
+
+        /**
+         * AVX-512 dot product with FMA.  The tail is done with a mask.
+         */
+        __attribute__((target("avx512f")))
+        static double dotAvx512(int n, const double* a, const double* x)
+        {
+            __m512d acc[4] = { _mm512_setzero_pd(), _mm512_setzero_pd(), _mm512_setzero_pd(), _mm512_setzero_pd() };
+            int i = 0;
+            for(; i + 32 <= n; i += 32)
+            {
+                for(int j = 0; j < 4; j++)
+                {
+                    acc[j] = _mm512_fmadd_pd(_mm512_loadu_pd(a + i + 8 * j), _mm512_loadu_pd(x + i + 8 * j), acc[j]);
+                }
+            }
+            for(; i < n; i += 8)
+            {
+                const __mmask8 mask = n - i >= 8 ? (__mmask8)0xFF : (__mmask8)((1u << (n - i)) - 1);
+                acc[0] = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, a + i), _mm512_maskz_loadu_pd(mask, x + i), acc[0]);
+            }
+            return _mm512_reduce_add_pd(_mm512_add_pd(_mm512_add_pd(acc[0], acc[1]), _mm512_add_pd(acc[2], acc[3])));
+        }
+
+        /**
+         * AVX-512 y += alpha * x with FMA.  The tail is done with a mask.
+         */
+        __attribute__((target("avx512f")))
+        static void axpyAvx512(int n, double alpha, const double* x, double* y)
+        {
+            const __m512d a = _mm512_set1_pd(alpha);
+            for(int i = 0; i < n; i += 8)
+            {
+                const __mmask8 mask = n - i >= 8 ? (__mmask8)0xFF : (__mmask8)((1u << (n - i)) - 1);
+                _mm512_mask_storeu_pd(y + i, mask, _mm512_fmadd_pd(a, _mm512_maskz_loadu_pd(mask, x + i), _mm512_maskz_loadu_pd(mask, y + i)));
+            }
+        }
+
+        /**
+         * AVX-512 8x8 transpose block.  Interleave pairs of rows, then
+         * 128 bit lanes, then 256 bit halves.
+         */
+        __attribute__((target("avx512f")))
+        static void transposeBlockAvx512(const double* src, int lds, double* dst, int ldd)
+        {
+            __m512d r[8];
+            for(int i = 0; i < 8; i++)
+            {
+                r[i] = _mm512_loadu_pd(src + (size_t)i * lds);
+            }
+
+            // Pairs of rows: t0 holds the even columns of rows 0 and 1, t1 the odd columns
+            __m512d t[8];
+            for(int i = 0; i < 4; i++)
+            {
+                t[2 * i] = _mm512_unpacklo_pd(r[2 * i], r[2 * i + 1]);
+                t[2 * i + 1] = _mm512_unpackhi_pd(r[2 * i], r[2 * i + 1]);
+            }
+
+            // 128 bit lanes: 4 rows of columns (0,4), (2,6), (1,5) and (3,7)
+            const __m512i lanesLow = _mm512_set_epi64(13, 12, 5, 4, 9, 8, 1, 0);
+            const __m512i lanesHigh = _mm512_set_epi64(15, 14, 7, 6, 11, 10, 3, 2);
+            __m512d u[8];
+            for(int i = 0; i < 2; i++)
+            {
+                u[4 * i + 0] = _mm512_permutex2var_pd(t[4 * i + 0], lanesLow, t[4 * i + 2]);
+                u[4 * i + 1] = _mm512_permutex2var_pd(t[4 * i + 0], lanesHigh, t[4 * i + 2]);
+                u[4 * i + 2] = _mm512_permutex2var_pd(t[4 * i + 1], lanesLow, t[4 * i + 3]);
+                u[4 * i + 3] = _mm512_permutex2var_pd(t[4 * i + 1], lanesHigh, t[4 * i + 3]);
+            }
+
+            // 256 bit halves: join rows 0-3 and rows 4-7 of each column
+            // u[0] holds columns 0 and 4, u[1] columns 2 and 6, u[2] columns 1 and 5, u[3] columns 3 and 7
+            const int columns[4][2] = { {0, 4}, {2, 6}, {1, 5}, {3, 7} };
+            for(int i = 0; i < 4; i++)
+            {
+                _mm512_storeu_pd(dst + (size_t)columns[i][0] * ldd, _mm512_shuffle_f64x2(u[i], u[4 + i], 0x44));
+                _mm512_storeu_pd(dst + (size_t)columns[i][1] * ldd, _mm512_shuffle_f64x2(u[i], u[4 + i], 0xEE));
+            }
+        }
+
+        /**
+         * AVX2 batch kernel.  The 8 problems of an element are 2 registers.
+         */
+        __attribute__((target("avx2,fma")))
+        static void batchKernelAvx2(int M, int N, int K, const double* a, const double* b, double* c)
+        {
+            for(int m = 0; m < M; m++)
+            {
+                for(int n = 0; n < N; n++)
+                {
+                    __m256d acc0 = _mm256_setzero_pd();
+                    __m256d acc1 = _mm256_setzero_pd();
+                    for(int k = 0; k < K; k++)
+                    {
+                        const double* aValue = a + (size_t)(m * K + k) * BATCH_LANES;
+                        const double* bValue = b + (size_t)(k * N + n) * BATCH_LANES;
+                        acc0 = _mm256_fmadd_pd(_mm256_load_pd(aValue), _mm256_load_pd(bValue), acc0);
+                        acc1 = _mm256_fmadd_pd(_mm256_load_pd(aValue + 4), _mm256_load_pd(bValue + 4), acc1);
+                    }
+                    double* cValue = c + (size_t)(m * N + n) * BATCH_LANES;
+                    _mm256_store_pd(cValue, acc0);
+                    _mm256_store_pd(cValue + 4, acc1);
+                }
+            }
+        }
+
+        /**
+         * AVX-512 batch kernel.  The 8 problems of an element are 1 register.
+         */
+        __attribute__((target("avx512f")))
+        static void batchKernelAvx512(int M, int N, int K, const double* a, const double* b, double* c)
+        {
+            for(int m = 0; m < M; m++)
+            {
+                for(int n = 0; n < N; n++)
+                {
+                    __m512d acc = _mm512_setzero_pd();
+                    for(int k = 0; k < K; k++)
+                    {
+                        acc = _mm512_fmadd_pd(_mm512_load_pd(a + (size_t)(m * K + k) * BATCH_LANES),
+                                              _mm512_load_pd(b + (size_t)(k * N + n) * BATCH_LANES), acc);
+                    }
+                    _mm512_store_pd(c + (size_t)(m * N + n) * BATCH_LANES, acc);
+                }
+            }
+        }
+
+        #pragma GCC diagnostic pop
+    #endif
+};
@@ -0,0 +1,383 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include "common.h"
+#include "element_kernels.h"
+
+using namespace std;
+
+/**
+ * How the nonzeros of a sparse matrix are grouped.
+ */
+enum SparseFormat {
+    SPARSE_CSR = 0,     // Compressed sparse row, the nonzeros row by row
+    SPARSE_CSC = 1      // Compressed sparse column, the nonzeros column by column
+};
+
+/**
+ * Sparse matrix that only stores its nonzeros, in CSR or CSC form.
+ *
+ * The nonzeros are grouped by row (CSR) or by column (CSC), which is the outer
+ * dimension.  Group i has the nonzeros offsets()[i] to offsets()[i + 1] - 1.  For
+ * each nonzero, indices() has its column (CSR) or row (CSC) and values() its value.
+ * Inside a group the indices are in increasing order.  The memory is about
+ * nonZeros() * (sizeof(T) + sizeof(int)) plus one offset per row or column.
+ *
+ * The multiplies are MatrixAlgebra::matrixMultiply() with a sparse first matrix.
+ * A CSR matrix has the same arrays as the CSC form of its transpose, so converting
+ * between CSR and CSC is the same work as a transpose, see SparseKernels.
+ */
+template<typename T>
+class SparseMatrixT {
+
+    public:
+        /**
+         * Create an empty CSR matrix with no rows or columns.
+         */
+        SparseMatrixT() : mRows(0), mColumns(0), mFormat(SPARSE_CSR), mOffsets(1, 0)
+        {
+        }
+
+        /**
+         * Create a matrix from its arrays.  The arrays are taken over, not copied.
+         *
+         * :param rows: The number of rows.
+         * :param columns: The number of columns.
+         * :param format: How the nonzeros are grouped.
+         * :param offsets: Start of each group and the number of nonzeros, outer size + 1 values.
+         * :param indices: Column (CSR) or row (CSC) of each nonzero, increasing in each group.
+         * :param values: Value of each nonzero.
+         */
+        SparseMatrixT(int rows, int columns, SparseFormat format, vector<size_t>&& offsets, vector<int>&& indices, vector<T>&& values)
+            : mRows(rows), mColumns(columns), mFormat(format), mOffsets(move(offsets)), mIndices(move(indices)), mValues(move(values))
+        {
+        }
+
+        /**
+         * Create a matrix with the nonzeros of a dense matrix.
+         *
+         * :param dense: Matrix to compress.  Values equal to 0 are left out.
+         * :param format: How the nonzeros are grouped.
+         */
+        explicit SparseMatrixT(const MatrixT<T>& dense, SparseFormat format = SPARSE_CSR)
+            : mRows(dense.rows()), mColumns(dense.columns()), mFormat(format)
+        {
+            const int outer = outerSize();
+            mOffsets.assign(outer + 1, 0);
+
+            // Count first so the arrays are allocated once
+            for(int m = 0; m < mRows; m++)
+            {
+                const T* row = dense.row(m);
+                for(int n = 0; n < mColumns; n++)
+                {
+                    if(!(row[n] == T()))
+                    {
+                        mOffsets[(format == SPARSE_CSR ? m : n) + 1]++;
+                    }
+                }
+            }
+            for(int i = 0; i < outer; i++)
+            {
+                mOffsets[i + 1] += mOffsets[i];
+            }
+
+            mIndices.resize(mOffsets[outer]);
+            mValues.resize(mOffsets[outer]);
+            vector<size_t> next(mOffsets.begin(), mOffsets.end() - 1);
+            for(int m = 0; m < mRows; m++)
+            {
+                const T* row = dense.row(m);
+                for(int n = 0; n < mColumns; n++)
+                {
+                    if(!(row[n] == T()))
+                    {
+                        const size_t at = next[format == SPARSE_CSR ? m : n]++;
+                        mIndices[at] = format == SPARSE_CSR ? n : m;
+                        mValues[at] = row[n];
+                    }
+                }
+            }
+        }
+
+        /**
+         * Copy the values into a new dense Matrix.
+         */
+        MatrixT<T> toMatrix() const
+        {
+            MatrixT<T> dense(mRows, mColumns);
+            for(int i = 0; i < outerSize(); i++)
+            {
+                for(size_t at = mOffsets[i]; at < mOffsets[i + 1]; at++)
+                {
+                    if(mFormat == SPARSE_CSR)
+                    {
+                        dense(i, mIndices[at]) = mValues[at];
+                    }
+                    else
+                    {
+                        dense(mIndices[at], i) = mValues[at];
+                    }
+                }
+            }
+            return dense;
+        }
+
+        int rows() const { return mRows; }
+        int columns() const { return mColumns; }
+        SparseFormat format() const { return mFormat; }
+
+        /**
+         * Number of rows (CSR) or columns (CSC), the groups of the nonzeros.
+         */
+        int outerSize() const { return mFormat == SPARSE_CSR ? mRows : mColumns; }
+
+        size_t nonZeros() const { return mValues.size(); }
+
+        const vector<size_t>& offsets() const { return mOffsets; }
+        const vector<int>& indices() const { return mIndices; }
+        const vector<T>& values() const { return mValues; }
+
+        /**
+         * Bytes used by the arrays.
+         */
+        size_t sizeInBytes() const
+        {
+            return mOffsets.size() * sizeof(size_t) + mIndices.size() * sizeof(int) + mValues.size() * sizeof(T);
+        }
+
+    private:
+        int mRows;                  // Number of rows
+        int mColumns;               // Number of columns
+        SparseFormat mFormat;       // How the nonzeros are grouped
+        vector<size_t> mOffsets;    // Start of each row (CSR) or column (CSC), and the number of nonzeros
+        vector<int> mIndices;       // Column (CSR) or row (CSC) of each nonzero
+        vector<T> mValues;          // Value of each nonzero
+};
+
+typedef SparseMatrixT<double> SparseMatrix;
+
+/**
+ * Kernels for sparse matrices.  The multiplies work on a range of rows of the result,
+ * so MatrixAlgebra can run the ranges on the thread pool.
+ */
+class SparseKernels {
+
+    public:
+        /**
+         * The same matrix with its nonzeros grouped as format.  Going from CSR to CSC
+         * or back is a counting sort of the nonzeros by their index, so it takes time
+         * in the number of nonzeros plus the rows and columns.
+         *
+         * :param matrix: Matrix to convert.
+         * :param format: Format of the result.  The same format returns a copy.
+         * :return: The converted matrix.
+         */
+        template<typename T>
+        static SparseMatrixT<T> convert(const SparseMatrixT<T>& matrix, SparseFormat format)
+        {
+            if(format == matrix.format())
+            {
+                return matrix;
+            }
+            return regroup(matrix, matrix.rows(), matrix.columns(), format);
+        }
+
+        /**
+         * The transpose, in the same format as the matrix.  The nonzeros of row i of a
+         * CSR matrix are column i of its transpose, so this is the same counting sort
+         * as convert() with the shape swapped.
+         */
+        template<typename T>
+        static SparseMatrixT<T> transpose(const SparseMatrixT<T>& matrix)
+        {
+            return regroup(matrix, matrix.columns(), matrix.rows(), matrix.format());
+        }
+
+        /**
+         * Rows [rowBegin, rowEnd) of C = A * B with A sparse CSR and B dense.  Each row
+         * of C is the sum of the rows of B picked by the nonzeros of the row of A, so only
+         * the nonzeros are multiplied.
+         *
+         * :param A: Sparse CSR matrix, M x K.
+         * :param B: First element of the dense K x N matrix.
+         * :param ldb: Stride of B.
+         * :param N: Number of columns of B and C.
+         * :param C: First element of the dense M x N result.  The rows are overwritten.
+         * :param ldc: Stride of C.
+         */
+        template<typename T>
+        static void multiplyDenseRows(const SparseMatrixT<T>& A, int rowBegin, int rowEnd, const T* B, int ldb, int N, T* C, int ldc)
+        {
+            const vector<size_t>& offsets = A.offsets();
+            const int* indices = A.indices().data();
+            const T* values = A.values().data();
+
+            for(int m = rowBegin; m < rowEnd; m++)
+            {
+                T* c = C + (size_t)m * ldc;
+                for(int n = 0; n < N; n++)
+                {
+                    c[n] = T();
+                }
+                for(size_t at = offsets[m]; at < offsets[m + 1]; at++)
+                {
+                    const T a = values[at];
+                    const T* b = B + (size_t)indices[at] * ldb;
+                    for(int n = 0; n < N; n++)
+                    {
+                        PortableKernels::multiplyAdd(c[n], a, b[n]);
+                    }
+                }
+            }
+        }
+
+        /**
+         * Rows [rowBegin, rowEnd) of C = A * B with A and B sparse CSR (Gustavson's
+         * algorithm).  The products of a row are summed in a dense accumulator with a
+         * marker per column, so each nonzero product costs O(1).  The columns of each
+         * row are then put in order.
+         *
+         * :param A: Sparse CSR matrix, M x K.
+         * :param B: Sparse CSR matrix, K x N.
+         * :param counts: Set to the number of nonzeros of each row, rowEnd - rowBegin values.
+         * :param indices: The columns of the nonzeros of the rows are added to it.
+         * :param values: The values of the nonzeros of the rows are added to it.
+         */
+        template<typename T>
+        static void multiplySparseRows(const SparseMatrixT<T>& A, const SparseMatrixT<T>& B, int rowBegin, int rowEnd,
+                                       vector<size_t>& counts, vector<int>& indices, vector<T>& values)
+        {
+            const vector<size_t>& aOffsets = A.offsets();
+            const vector<size_t>& bOffsets = B.offsets();
+            const int* aIndices = A.indices().data();
+            const int* bIndices = B.indices().data();
+            const T* aValues = A.values().data();
+            const T* bValues = B.values().data();
+
+            vector<T> accumulator(B.columns());
+            vector<int> marker(B.columns(), -1);
+            vector<int> columns;
+            counts.assign(rowEnd - rowBegin, 0);
+
+            for(int m = rowBegin; m < rowEnd; m++)
+            {
+                columns.clear();
+                for(size_t at = aOffsets[m]; at < aOffsets[m + 1]; at++)
+                {
+                    const int k = aIndices[at];
+                    const T a = aValues[at];
+                    for(size_t bAt = bOffsets[k]; bAt < bOffsets[k + 1]; bAt++)
+                    {
+                        const int n = bIndices[bAt];
+                        if(marker[n] != m)
+                        {
+                            marker[n] = m;
+                            accumulator[n] = T();
+                            columns.push_back(n);
+                        }
+                        PortableKernels::multiplyAdd(accumulator[n], a, bValues[bAt]);
+                    }
+                }
+
+                // A row with many nonzeros is read back in order from the markers,
+                // which is faster than sorting its columns
+                const size_t count = columns.size();
+                if(count * 16 > (size_t)B.columns())
+                {
+                    for(int n = 0; n < B.columns(); n++)
+                    {
+                        if(marker[n] == m)
+                        {
+                            indices.push_back(n);
+                            values.push_back(accumulator[n]);
+                        }
+                    }
+                }
+                else
+                {
+                    sort(columns.begin(), columns.end());
+                    for(int n : columns)
+                    {
+                        indices.push_back(n);
+                        values.push_back(accumulator[n]);
+                    }
+                }
+                counts[m - rowBegin] = count;
+            }
+        }
+
+        /**
+         * Split the rows of a CSR matrix into ranges with about the same number of
+         * nonzeros, so the ranges take about the same time.
+         *
+         * :param A: Sparse CSR matrix.
+         * :param numRanges: Number of ranges wanted.
+         * :return: numRanges + 1 row numbers.  Range i is rows [result[i], result[i + 1]).
+         */
+        template<typename T>
+        static vector<int> balancedRows(const SparseMatrixT<T>& A, int numRanges)
+        {
+            const vector<size_t>& offsets = A.offsets();
+            vector<int> bounds(numRanges + 1, A.rows());
+            bounds[0] = 0;
+            for(int i = 1; i < numRanges; i++)
+            {
+                // First row that starts at or after the share of the nonzeros of range i,
+                // plus an equal share of the rows so empty rows are split too
+                const size_t target = (size_t)((double)A.nonZeros() * i / numRanges);
+                const int byNonZeros = (int)(lower_bound(offsets.begin(), offsets.end() - 1, target) - offsets.begin());
+                const int byRows = (int)((long long)A.rows() * i / numRanges);
+                bounds[i] = max(bounds[i - 1], (byNonZeros + byRows) / 2);
+            }
+            return bounds;
+        }
+
+    private:
+        /**
+         * Counting sort of the nonzeros of a matrix by their index.  The groups of
+         * the result are the inner dimension of the matrix, and the indices come out
+         * in increasing order because the groups of the matrix are read in order.
+         *
+         * :param matrix: Matrix to regroup.
+         * :param rows: Rows of the result.
+         * :param columns: Columns of the result.
+         * :param format: Format of the result.
+         */
+        template<typename T>
+        static SparseMatrixT<T> regroup(const SparseMatrixT<T>& matrix, int rows, int columns, SparseFormat format)
+        {
+            const int outer = matrix.outerSize();
+            const int inner = matrix.format() == SPARSE_CSR ? matrix.columns() : matrix.rows();
+            const vector<size_t>& offsets = matrix.offsets();
+            const vector<int>& indices = matrix.indices();
+            const vector<T>& values = matrix.values();
+
+            vector<size_t> newOffsets(inner + 1, 0);
+            for(size_t at = 0; at < indices.size(); at++)
+            {
+                newOffsets[indices[at] + 1]++;
+            }
+            for(int i = 0; i < inner; i++)
+            {
+                newOffsets[i + 1] += newOffsets[i];
+            }
+
+            vector<int> newIndices(indices.size());
+            vector<T> newValues(values.size());
+            vector<size_t> next(newOffsets.begin(), newOffsets.end() - 1);
+            for(int i = 0; i < outer; i++)
+            {
+                for(size_t at = offsets[i]; at < offsets[i + 1]; at++)
+                {
+                    const size_t to = next[indices[at]]++;
+                    newIndices[to] = i;
+                    newValues[to] = values[at];
+                }
+            }
+            return SparseMatrixT<T>(rows, columns, format, move(newOffsets), move(newIndices), move(newValues));
+        }
+};
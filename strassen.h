@@ -0,0 +1,240 @@
+#pragma once
+
+#include <cstddef>
+#include "common.h"
+#include "instrumentation.h"
+#include "matrix_kernels.h"
+
+using namespace std;
+
+/**
+ * Runs the tasks of a Strassen step one after the other on the calling thread.
+ */
+struct StrassenSerialRunner {
+    ThreadStats* stats;     // Stats of the calling thread, or null
+
+    template<typename Function>
+    void operator()(int numTasks, const Function& function) const
+    {
+        for(int task = 0; task < numTasks; task++)
+        {
+            function(task, stats);
+        }
+    }
+};
+
+/**
+ * Strassen-Winograd multiply, C = A * B with 7 half size products instead of 8.
+ *
+ * Each step cuts A, B and C into 2 x 2 blocks and computes the product with 7
+ * multiplies and 15 additions of blocks (Winograd's form of Strassen).  The
+ * multiplies recurse until a side is no longer than the crossover, then the blocked
+ * multiply of MatrixKernels is used.  An odd row, column or shared index is peeled
+ * off before the step and added back with the blocked multiply, so any size works
+ * without padding.
+ *
+ * The result is not rounded like the classic multiply.  With n x n matrices, a
+ * crossover n0 and unit roundoff u, the classic multiply has the element-wise bound
+ * |C - fl(C)| <= n u |A| |B|.  Strassen-Winograd only has a bound on the largest
+ * element (Higham, Accuracy and Stability of Numerical Algorithms, chapter 23):
+ *
+ *     max|C - fl(C)| <= [(n / n0)^log2(18) (n0^2 + 6 n0) - 6 n] u max|A| max|B|
+ *
+ * Each level of the recursion multiplies the bound by about 18 where the classic
+ * bound only doubles, so every halving of the crossover costs about 3 more bits.
+ * Matrices with values of very different size lose the most, since small values
+ * are added to large ones in the block sums.
+ */
+class StrassenKernels {
+
+    public:
+        /**
+         * C = A * B.  The old values of C are not read.
+         *
+         * :param M: Number of rows in A and C.
+         * :param N: Number of columns in B and C.
+         * :param K: Number of columns in A and rows in B.
+         * :param A: First element of A.
+         * :param lda: Stride of A.
+         * :param B: First element of B.
+         * :param ldb: Stride of B.
+         * :param C: First element of C.
+         * :param ldc: Stride of C.
+         * :param crossover: Products with a side no longer than this use the blocked multiply.
+         * :param blockSizes: Cache block sizes for the blocked multiply.
+         * :param kernels: Kernels to use.  The CPU must support them.
+         * :param run: Called as run(numTasks, function) to run function(int task, ThreadStats*)
+         *             for every task.  The 7 products of this step are run with it, the
+         *             steps below run on the thread of their product.
+         */
+        template<typename T, typename Runner>
+        static void multiply(int M, int N, int K, const T* A, int lda, const T* B, int ldb, T* C, int ldc, int crossover,
+                             const BlockSizes& blockSizes, const KernelTableT<T>& kernels, const Runner& run)
+        {
+            if(M <= crossover || N <= crossover || K <= crossover)
+            {
+                run(1, [&](int, ThreadStats* stats)
+                {
+                    classic(M, N, K, A, lda, B, ldb, C, ldc, blockSizes, kernels, stats);
+                });
+                return;
+            }
+
+            const int m = M / 2;
+            const int n = N / 2;
+            const int k = K / 2;
+
+            const T* A11 = A;
+            const T* A12 = A + k;
+            const T* A21 = A + (size_t)m * lda;
+            const T* A22 = A21 + k;
+            const T* B11 = B;
+            const T* B12 = B + n;
+            const T* B21 = B + (size_t)k * ldb;
+            const T* B22 = B21 + n;
+            T* C11 = C;
+            T* C12 = C + n;
+            T* C21 = C + (size_t)m * ldc;
+            T* C22 = C21 + n;
+
+            // Sums of the blocks of A and B
+            MatrixT<T> S1, S2, S3, S4, T1, T2, T3, T4, Q1, Q5, Q6;
+            run(1, [&](int, ThreadStats* stats)
+            {
+                {
+                    PhaseTimer timer(stats != nullptr ? &stats->allocateSeconds : nullptr);
+                    S1 = MatrixT<T>(m, k);
+                    S2 = MatrixT<T>(m, k);
+                    S3 = MatrixT<T>(m, k);
+                    S4 = MatrixT<T>(m, k);
+                    T1 = MatrixT<T>(k, n);
+                    T2 = MatrixT<T>(k, n);
+                    T3 = MatrixT<T>(k, n);
+                    T4 = MatrixT<T>(k, n);
+                    Q1 = MatrixT<T>(m, n);
+                    Q5 = MatrixT<T>(m, n);
+                    Q6 = MatrixT<T>(m, n);
+                }
+
+                PhaseTimer timer(stats != nullptr ? &stats->computeSeconds : nullptr);
+                add(m, k, A21, lda, A22, lda, S1.data(), S1.stride());
+                subtract(m, k, S1.data(), S1.stride(), A11, lda, S2.data(), S2.stride());
+                subtract(m, k, A11, lda, A21, lda, S3.data(), S3.stride());
+                subtract(m, k, A12, lda, S2.data(), S2.stride(), S4.data(), S4.stride());
+                subtract(k, n, B12, ldb, B11, ldb, T1.data(), T1.stride());
+                subtract(k, n, B22, ldb, T1.data(), T1.stride(), T2.data(), T2.stride());
+                subtract(k, n, B22, ldb, B12, ldb, T3.data(), T3.stride());
+                subtract(k, n, T2.data(), T2.stride(), B21, ldb, T4.data(), T4.stride());
+            });
+
+            // The 7 products.  Each writes its own block, so they can run at the same time.
+            run(7, [&](int product, ThreadStats* stats)
+            {
+                StrassenSerialRunner serial = { stats };
+                switch(product)
+                {
+                    case 0:
+                        multiply(m, n, k, A11, lda, B11, ldb, Q1.data(), Q1.stride(), crossover, blockSizes, kernels, serial);
+                        break;
+                    case 1:
+                        multiply(m, n, k, A12, lda, B21, ldb, C11, ldc, crossover, blockSizes, kernels, serial);
+                        break;
+                    case 2:
+                        multiply(m, n, k, S4.data(), S4.stride(), B22, ldb, C12, ldc, crossover, blockSizes, kernels, serial);
+                        break;
+                    case 3:
+                        multiply(m, n, k, A22, lda, T4.data(), T4.stride(), C21, ldc, crossover, blockSizes, kernels, serial);
+                        break;
+                    case 4:
+                        multiply(m, n, k, S1.data(), S1.stride(), T1.data(), T1.stride(), Q5.data(), Q5.stride(), crossover, blockSizes, kernels, serial);
+                        break;
+                    case 5:
+                        multiply(m, n, k, S2.data(), S2.stride(), T2.data(), T2.stride(), Q6.data(), Q6.stride(), crossover, blockSizes, kernels, serial);
+                        break;
+                    default:
+                        multiply(m, n, k, S3.data(), S3.stride(), T3.data(), T3.stride(), C22, ldc, crossover, blockSizes, kernels, serial);
+                        break;
+                }
+            });
+
+            run(1, [&](int, ThreadStats* stats)
+            {
+                {
+                    // C11 = P1 + P2, C12 = P1 + P6 + P5 + P3, C21 = P1 + P6 + P7 - P4, C22 = P1 + P6 + P7 + P5
+                    PhaseTimer timer(stats != nullptr ? &stats->computeSeconds : nullptr);
+                    add(m, n, C11, ldc, Q1.data(), Q1.stride(), C11, ldc);
+                    add(m, n, Q6.data(), Q6.stride(), Q1.data(), Q1.stride(), Q6.data(), Q6.stride());
+                    add(m, n, C22, ldc, Q6.data(), Q6.stride(), C22, ldc);
+                    subtract(m, n, C22, ldc, C21, ldc, C21, ldc);
+                    add(m, n, C22, ldc, Q5.data(), Q5.stride(), C22, ldc);
+                    add(m, n, Q6.data(), Q6.stride(), Q5.data(), Q5.stride(), Q6.data(), Q6.stride());
+                    add(m, n, C12, ldc, Q6.data(), Q6.stride(), C12, ldc);
+                }
+
+                // The peeled last index of the shared dimension, then the last column and row of C
+                if(K > 2 * k)
+                {
+                    MatrixKernels::gemm(2 * m, 2 * n, 1, A + (K - 1), lda, B + (size_t)(K - 1) * ldb, ldb, C, ldc, blockSizes, kernels, stats);
+                }
+                if(N > 2 * n)
+                {
+                    classic(M, 1, K, A, lda, B + (N - 1), ldb, C + (N - 1), ldc, blockSizes, kernels, stats);
+                }
+                if(M > 2 * m)
+                {
+                    classic(1, 2 * n, K, A + (size_t)(M - 1) * lda, lda, B, ldb, C + (size_t)(M - 1) * ldc, ldc, blockSizes, kernels, stats);
+                }
+            });
+        }
+
+    private:
+        /**
+         * C = A * B with the blocked multiply.
+         */
+        template<typename T>
+        static void classic(int M, int N, int K, const T* A, int lda, const T* B, int ldb, T* C, int ldc,
+                            const BlockSizes& blockSizes, const KernelTableT<T>& kernels, ThreadStats* stats)
+        {
+            {
+                PhaseTimer timer(stats != nullptr ? &stats->computeSeconds : nullptr);
+                MatrixKernels::scale(M, N, T(), C, ldc);
+            }
+            MatrixKernels::gemm(M, N, K, A, lda, B, ldb, C, ldc, blockSizes, kernels, stats);
+        }
+
+        /**
+         * Z = X + Y, all rows x columns.  Z can be X or Y.
+         */
+        template<typename T>
+        static void add(int rows, int columns, const T* X, int ldx, const T* Y, int ldy, T* Z, int ldz)
+        {
+            for(int r = 0; r < rows; r++)
+            {
+                const T* x = X + (size_t)r * ldx;
+                const T* y = Y + (size_t)r * ldy;
+                T* z = Z + (size_t)r * ldz;
+                for(int c = 0; c < columns; c++)
+                {
+                    z[c] = x[c] + y[c];
+                }
+            }
+        }
+
+        /**
+         * Z = X - Y, all rows x columns.  Z can be X or Y.
+         */
+        template<typename T>
+        static void subtract(int rows, int columns, const T* X, int ldx, const T* Y, int ldy, T* Z, int ldz)
+        {
+            for(int r = 0; r < rows; r++)
+            {
+                const T* x = X + (size_t)r * ldx;
+                const T* y = Y + (size_t)r * ldy;
+                T* z = Z + (size_t)r * ldz;
+                for(int c = 0; c < columns; c++)
+                {
+                    z[c] = x[c] - y[c];
+                }
+            }
+        }
+};
@@ -0,0 +1,707 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#define THREAD_POOL_AFFINITY
+#endif
+
+using namespace std;
+
+/**
+ * Largest number of threads that can work on one parallelFor().
+ */
+static const int THREAD_POOL_MAX_THREADS = 64;
+
+/**
+ * Splits a rows x columns output into a grid of 2D tiles.
+ *
+ * The tiles start at the largest size and are halved, larger side first, until
+ * there are enough tiles to balance the load over the threads or the tiles reach
+ * the smallest size.  Splitting both sides lets short, wide outputs use all the threads.
+ */
+struct TileGrid {
+    int rows;           // Rows in the output
+    int columns;        // Columns in the output
+    int tileRows;       // Rows in a tile
+    int tileColumns;    // Columns in a tile
+    int rowTiles;       // Number of tiles down
+    int columnTiles;    // Number of tiles across
+
+    /**
+     * Create the grid.
+     *
+     * :param rows: Rows in the output.
+     * :param columns: Columns in the output.
+     * :param maxTileRows: Rows in the largest tile.
+     * :param maxTileColumns: Columns in the largest tile.
+     * :param minTileRows: Rows in the smallest tile.  Tile rows stay a multiple of this.
+     * :param minTileColumns: Columns in the smallest tile.  Tile columns stay a multiple of this.
+     * :param targetTiles: Number of tiles wanted.
+     */
+    TileGrid(int rows, int columns, int maxTileRows, int maxTileColumns, int minTileRows, int minTileColumns, int targetTiles)
+        : rows(rows), columns(columns)
+    {
+        tileRows = roundUp(max(1, min(maxTileRows, rows)), minTileRows);
+        tileColumns = roundUp(max(1, min(maxTileColumns, columns)), minTileColumns);
+        update();
+
+        while(count() < targetTiles)
+        {
+            bool canSplitRows = tileRows > minTileRows;
+            bool canSplitColumns = tileColumns > minTileColumns;
+            if(canSplitRows && (!canSplitColumns || tileRows >= tileColumns))
+            {
+                tileRows = roundUp(tileRows / 2, minTileRows);
+            }
+            else if(canSplitColumns)
+            {
+                tileColumns = roundUp(tileColumns / 2, minTileColumns);
+            }
+            else
+            {
+                break;
+            }
+            update();
+        }
+    }
+
+    /**
+     * Number of tiles.
+     */
+    int count() const
+    {
+        return rowTiles * columnTiles;
+    }
+
+    /**
+     * Bounds of a tile.  Tiles are numbered across the rows first.
+     *
+     * :param index: Tile number.
+     * :param rowBegin: First row of the tile.
+     * :param rowEnd: One past the last row of the tile.
+     * :param columnBegin: First column of the tile.
+     * :param columnEnd: One past the last column of the tile.
+     */
+    void tile(int index, int& rowBegin, int& rowEnd, int& columnBegin, int& columnEnd) const
+    {
+        rowBegin = (index / columnTiles) * tileRows;
+        rowEnd = min(rowBegin + tileRows, rows);
+        columnBegin = (index % columnTiles) * tileColumns;
+        columnEnd = min(columnBegin + tileColumns, columns);
+    }
+
+    private:
+        void update()
+        {
+            rowTiles = (rows + tileRows - 1) / tileRows;
+            columnTiles = (columns + tileColumns - 1) / tileColumns;
+        }
+
+        static int roundUp(int value, int multiple)
+        {
+            return ((value + multiple - 1) / multiple) * multiple;
+        }
+};
+
+/**
+ * Long lived worker threads shared by the multiply and the transpose.
+ *
+ * Creating and joining threads on every call made the threaded multiply slower
+ * than the serial one for anything below about 1000 x 1000.  The pool creates its
+ * workers once.  Idle workers sleep on a condition variable until work is posted.
+ *
+ * Work is posted with parallelFor().  The calling thread always takes part in the
+ * work, so a parallelFor() called from inside a task still finishes even when every
+ * worker is busy.  Posting work does not allocate memory.
+ *
+ * The tasks are scheduled with work stealing.  Each participant starts with an equal,
+ * contiguous range of tasks and takes tasks from the front of it.  A participant that
+ * runs out steals the back half of the range of another participant.  This keeps the
+ * threads busy when tasks take different amounts of time, and the range of a worker
+ * that never woke up is taken over by the others.
+ *
+ * Work that should not block the caller, like the async calls of MatrixAlgebra, is
+ * posted with post().  A worker runs it when there is no parallelFor() to join, and
+ * it can call parallelFor() itself.
+ *
+ * With setAffinity(true) each worker is pinned to one CPU, and worker i is always
+ * participant i + 1.  The CPUs are taken in the order of their NUMA nodes, so
+ * participants next to each other are on the same node.  Since Linux places a page
+ * on the node of the thread that first writes it, a buffer that is first written by
+ * the participant that later computes on it stays on the node of that thread (see
+ * MatrixAlgebra::allocateMatrix()).  Work stealing still moves tasks between the
+ * threads, so this only holds for the tasks that are not stolen.
+ */
+class ThreadPool {
+
+    public:
+        /**
+         * Create the pool.
+         *
+         * :param numWorkers: Number of worker threads to start.  The pool grows later
+         *                    if a call asks for more threads.
+         */
+        explicit ThreadPool(int numWorkers = 0) : mStop(false), mAffinity(false), mJobs(nullptr)
+        {
+#if defined(THREAD_POOL_AFFINITY)
+            mHaveProcessCpus = processCpus(mProcessCpus);
+#endif
+            ensureWorkers(numWorkers);
+        }
+
+        /**
+         * Run the posted tasks that are left, then stop and join all the workers.
+         */
+        ~ThreadPool()
+        {
+            {
+                lock_guard<mutex> lock(mMutex);
+                mStop = true;
+            }
+            mWorkAvailable.notify_all();
+
+            for(auto& t: mWorkers)
+            {
+                t.join();
+            }
+        }
+
+        /**
+         * Number of worker threads.  The caller of parallelFor() is not counted.
+         */
+        int numWorkers()
+        {
+            lock_guard<mutex> lock(mMutex);
+            return (int)mWorkers.size();
+        }
+
+        /**
+         * Start more workers if there are less than count.  Threads are only
+         * created the first time a larger count is seen.
+         *
+         * :param count: Number of workers needed.
+         */
+        void ensureWorkers(int count)
+        {
+            lock_guard<mutex> lock(mMutex);
+            while((int)mWorkers.size() < count)
+            {
+                const int index = (int)mWorkers.size();
+                mWorkers.emplace_back(&ThreadPool::workerLoop, this, index);
+                if(mAffinity)
+                {
+                    pinWorker(index);
+                }
+            }
+        }
+
+        /**
+         * Run a task on a worker and return right away.  Tasks run in the order they
+         * were posted, when a worker has no parallelFor() to join.  The tasks still
+         * queued when the pool is destroyed are run before the workers stop.
+         *
+         * :param task: Function to run.
+         */
+        void post(function<void()> task)
+        {
+            ensureWorkers(1);
+            {
+                lock_guard<mutex> lock(mMutex);
+                mTasks.push_back(move(task));
+            }
+            mWorkAvailable.notify_all();
+        }
+
+        /**
+         * Run the oldest posted task on the calling thread, if there is one.  A thread
+         * that waits for a posted task to finish can call this so the wait does not
+         * hold up the tasks queued behind.
+         *
+         * :return: True if a task was run.
+         */
+        bool runPostedTask()
+        {
+            function<void()> task;
+            {
+                lock_guard<mutex> lock(mMutex);
+                if(mTasks.empty())
+                {
+                    return false;
+                }
+                task = move(mTasks.front());
+                mTasks.pop_front();
+            }
+            task();
+            return true;
+        }
+
+        /**
+         * Pin the workers to CPUs and give each worker a fixed participant number, or
+         * let them move between CPUs and join jobs in any order again.  Worker i is
+         * pinned to cpuOrder()[(i + 1) % count], so participant p runs on
+         * cpuOrder()[p] when there are enough CPUs.  The caller of parallelFor() is
+         * not pinned.
+         *
+         * :param enable: True to pin the workers.
+         * :return: False if the CPUs can not be set on this platform.  The participant
+         *          numbers are still fixed.
+         */
+        bool setAffinity(bool enable)
+        {
+            lock_guard<mutex> lock(mMutex);
+            mAffinity = enable;
+            bool pinned = true;
+            for(int index = 0; index < (int)mWorkers.size(); index++)
+            {
+                pinned = (enable ? pinWorker(index) : unpinWorker(index)) && pinned;
+            }
+            return pinned;
+        }
+
+        /**
+         * True if the workers are pinned with setAffinity().
+         */
+        bool affinity()
+        {
+            lock_guard<mutex> lock(mMutex);
+            return mAffinity;
+        }
+
+        /**
+         * CPUs in the affinity mask of the process, grouped by NUMA node.  The mask
+         * is the one of the main thread, so it does not depend on the CPUs of the
+         * calling thread.  The nodes are read from /sys/devices/system/node.  Without
+         * them the CPUs are in number order.
+         */
+        static vector<int> cpuOrder()
+        {
+            vector<int> cpus;
+#if defined(THREAD_POOL_AFFINITY)
+            cpu_set_t allowed;
+            if(!processCpus(allowed))
+            {
+                return cpus;
+            }
+
+            vector<bool> added(CPU_SETSIZE, false);
+            for(int node = 0; node < CPU_SETSIZE; node++)
+            {
+                char path[64];
+                snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+                FILE* file = fopen(path, "r");
+                if(file == nullptr)
+                {
+                    // Node numbers can have gaps, but not many
+                    if(node > 8 && cpus.size() > 0)
+                    {
+                        break;
+                    }
+                    continue;
+                }
+
+                // A list of ranges like "0-7,16-23"
+                int first, last;
+                while(fscanf(file, "%d", &first) == 1)
+                {
+                    last = first;
+                    int separator = fgetc(file);
+                    if(separator == '-')
+                    {
+                        if(fscanf(file, "%d", &last) != 1)
+                        {
+                            break;
+                        }
+                        separator = fgetc(file);
+                    }
+                    for(int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+                    {
+                        if(CPU_ISSET(cpu, &allowed) && !added[cpu])
+                        {
+                            cpus.push_back(cpu);
+                            added[cpu] = true;
+                        }
+                    }
+                    if(separator != ',')
+                    {
+                        break;
+                    }
+                }
+                fclose(file);
+            }
+
+            // CPUs that are not listed in any node
+            for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            {
+                if(CPU_ISSET(cpu, &allowed) && !added[cpu])
+                {
+                    cpus.push_back(cpu);
+                }
+            }
+#endif
+            return cpus;
+        }
+
+        /**
+         * Run function(task, participant) for every task in [0, numTasks).  Blocks until
+         * all the tasks are done.
+         *
+         * At most numThreads threads work on the tasks.  The calling thread is
+         * participant 0.  Workers that join are numbered 1 to numThreads - 1.  The
+         * participant number can be used to index per thread scratch space.
+         *
+         * :param numTasks: Number of tasks.
+         * :param numThreads: Maximum number of threads, including the caller.
+         * :param function: Called as function(int task, int participant).
+         */
+        template<typename Function>
+        void parallelFor(int numTasks, int numThreads, const Function& function)
+        {
+            if(numTasks <= 0)
+            {
+                return;
+            }
+
+            numThreads = max(1, min(min(numThreads, numTasks), THREAD_POOL_MAX_THREADS));
+            if(numThreads == 1)
+            {
+                // No reason to wake a worker
+                for(int task = 0; task < numTasks; task++)
+                {
+                    function(task, 0);
+                }
+                return;
+            }
+
+            ensureWorkers(numThreads - 1);
+
+            Job job;
+            job.run = &invoke<Function>;
+            job.context = &function;
+            job.numThreads = numThreads;
+            for(int participant = 0; participant < numThreads; participant++)
+            {
+                // Equal contiguous ranges to start with
+                int begin = (int)((long long)numTasks * participant / numThreads);
+                int end = (int)((long long)numTasks * (participant + 1) / numThreads);
+                job.ranges[participant].value.store(packRange(begin, end), memory_order_relaxed);
+            }
+            job.openSlots = numThreads - 1;
+            job.joined = 0;
+            job.activeWorkers = 0;
+            job.next = nullptr;
+
+            // Post the job to the end of the queue
+            {
+                lock_guard<mutex> lock(mMutex);
+                Job** tail = &mJobs;
+                while(*tail != nullptr)
+                {
+                    tail = &(*tail)->next;
+                }
+                *tail = &job;
+            }
+            mWorkAvailable.notify_all();
+
+            // Work on the tasks from this thread too
+            runTasks(job, 0);
+
+            // All ranges are empty.  Take the job out of the queue so no other worker
+            // joins, then wait for the workers still running tasks.
+            unique_lock<mutex> lock(mMutex);
+            removeJob(&job);
+            mJobDone.wait(lock, [&job]() { return job.activeWorkers == 0; });
+        }
+
+        /**
+         * Pool shared by every MatrixAlgebra that was not given its own pool.
+         * The workers are started the first time they are needed.
+         */
+        static shared_ptr<ThreadPool> defaultPool()
+        {
+            static shared_ptr<ThreadPool> pool = make_shared<ThreadPool>(0);
+            return pool;
+        }
+
+    private:
+        /**
+         * Work posted by parallelFor().  The job lives on the stack of the caller.
+         * Workers only touch it while they are counted in activeWorkers.
+         */
+        struct alignas(64) TaskRange {
+            atomic<unsigned long long> value;   // Begin in the high 32 bits, end in the low 32 bits
+        };
+
+        struct Job {
+            void (*run)(const void* context, int task, int participant);   // Calls the function
+            const void* context;            // Function to call
+            int numThreads;                 // Number of participants
+            TaskRange ranges[THREAD_POOL_MAX_THREADS];  // Tasks left for each participant
+            int openSlots;                  // Workers that can still join (guarded by mMutex)
+            unsigned long long joined;      // Bit p is set when participant p joined (guarded by mMutex)
+            int activeWorkers;              // Workers running tasks (guarded by mMutex)
+            Job* next;                      // Next job in the queue (guarded by mMutex)
+        };
+
+        ThreadPool(const ThreadPool&);
+        ThreadPool& operator=(const ThreadPool&);
+
+#if defined(THREAD_POOL_AFFINITY)
+        /**
+         * Affinity mask of the process.  sched_getaffinity() of 0 is the mask of the
+         * calling thread, which may be pinned itself, so this asks for the main
+         * thread, whose id is the process id.
+         */
+        static bool processCpus(cpu_set_t& allowed)
+        {
+            CPU_ZERO(&allowed);
+            return sched_getaffinity(getpid(), sizeof(allowed), &allowed) == 0;
+        }
+#endif
+
+        /**
+         * Pin worker index to its CPU.  Must hold mMutex.
+         */
+        bool pinWorker(int index)
+        {
+#if defined(THREAD_POOL_AFFINITY)
+            if(mCpus.empty())
+            {
+                mCpus = cpuOrder();
+                if(mCpus.empty())
+                {
+                    return false;
+                }
+            }
+
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(mCpus[(index + 1) % mCpus.size()], &set);
+            return pthread_setaffinity_np(mWorkers[index].native_handle(), sizeof(set), &set) == 0;
+#else
+            (void)index;
+            return false;
+#endif
+        }
+
+        /**
+         * Let worker index run on any CPU of the process again, as read when the pool
+         * was created.  Must hold mMutex.
+         */
+        bool unpinWorker(int index)
+        {
+#if defined(THREAD_POOL_AFFINITY)
+            if(!mHaveProcessCpus)
+            {
+                return false;
+            }
+            return pthread_setaffinity_np(mWorkers[index].native_handle(), sizeof(mProcessCpus), &mProcessCpus) == 0;
+#else
+            (void)index;
+            return false;
+#endif
+        }
+
+        template<typename Function>
+        static void invoke(const void* context, int task, int participant)
+        {
+            (*static_cast<const Function*>(context))(task, participant);
+        }
+
+        static unsigned long long packRange(int begin, int end)
+        {
+            return ((unsigned long long)(unsigned int)begin << 32) | (unsigned int)end;
+        }
+
+        static int rangeBegin(unsigned long long range) { return (int)(range >> 32); }
+        static int rangeEnd(unsigned long long range) { return (int)(range & 0xFFFFFFFFu); }
+
+        /**
+         * Take the task at the front of the participant's own range.
+         *
+         * :return: The task or -1 if the range is empty.
+         */
+        static int popTask(TaskRange& range)
+        {
+            unsigned long long current = range.value.load(memory_order_acquire);
+            while(rangeBegin(current) < rangeEnd(current))
+            {
+                if(range.value.compare_exchange_weak(current, packRange(rangeBegin(current) + 1, rangeEnd(current)), memory_order_acq_rel))
+                {
+                    return rangeBegin(current);
+                }
+            }
+            return -1;
+        }
+
+        /**
+         * Steal the back half of the range of another participant.  The first
+         * stolen task is returned and the rest becomes the thief's own range.
+         *
+         * :return: A task or -1 if every range is empty.
+         */
+        static int stealTask(Job& job, int participant)
+        {
+            for(int offset = 1; offset < job.numThreads; offset++)
+            {
+                TaskRange& victim = job.ranges[(participant + offset) % job.numThreads];
+                unsigned long long current = victim.value.load(memory_order_acquire);
+                while(rangeBegin(current) < rangeEnd(current))
+                {
+                    int begin = rangeBegin(current);
+                    int end = rangeEnd(current);
+                    int middle = begin + (end - begin) / 2;
+                    if(victim.value.compare_exchange_weak(current, packRange(begin, middle), memory_order_acq_rel))
+                    {
+                        // Keep [middle + 1, end) and run middle now
+                        job.ranges[participant].value.store(packRange(middle + 1, end), memory_order_release);
+                        return middle;
+                    }
+                }
+            }
+            return -1;
+        }
+
+        /**
+         * Run tasks from the participant's own range, then steal from the others
+         * until every range is empty.
+         */
+        static void runTasks(Job& job, int participant)
+        {
+            while(true)
+            {
+                int task = popTask(job.ranges[participant]);
+                if(task < 0)
+                {
+                    task = stealTask(job, participant);
+                    if(task < 0)
+                    {
+                        return;
+                    }
+                }
+                job.run(job.context, task, participant);
+            }
+        }
+
+        /**
+         * Take the job out of the queue if it is still there.  Must hold mMutex.
+         */
+        void removeJob(Job* job)
+        {
+            for(Job** entry = &mJobs; *entry != nullptr; entry = &(*entry)->next)
+            {
+                if(*entry == job)
+                {
+                    *entry = job->next;
+                    return;
+                }
+            }
+        }
+
+        /**
+         * First job in the queue that the worker can join.  Without affinity that is
+         * the first job.  With affinity the worker only joins a job with a participant
+         * for it that has not joined yet.  Must hold mMutex.
+         */
+        Job* findJob(int index)
+        {
+            if(!mAffinity)
+            {
+                return mJobs;
+            }
+            for(Job* job = mJobs; job != nullptr; job = job->next)
+            {
+                if(index + 1 < job->numThreads && (job->joined & (1ULL << (index + 1))) == 0)
+                {
+                    return job;
+                }
+            }
+            return nullptr;
+        }
+
+        /**
+         * Worker thread.  Sleep until a job or a task is posted.  Join a job and run
+         * its tasks, or run one posted task, then go back to sleep.  Jobs go first,
+         * since their caller is waiting.
+         *
+         * :param index: Index of the worker in mWorkers.
+         */
+        void workerLoop(int index)
+        {
+            unique_lock<mutex> lock(mMutex);
+            while(true)
+            {
+                Job* job = nullptr;
+                mWorkAvailable.wait(lock, [this, index, &job]() { return (job = findJob(index)) != nullptr || !mTasks.empty() || mStop; });
+                if(job == nullptr)
+                {
+                    if(mTasks.empty())
+                    {
+                        return;
+                    }
+
+                    function<void()> task = move(mTasks.front());
+                    mTasks.pop_front();
+                    lock.unlock();
+                    task();
+                    task = nullptr;
+                    lock.lock();
+                    continue;
+                }
+
+                // Join the job.  Take it off the queue when it is full.
+                int participant = index + 1;
+                if(!mAffinity)
+                {
+                    // The lowest number that has not joined
+                    participant = 1;
+                    while((job->joined & (1ULL << participant)) != 0)
+                    {
+                        participant++;
+                    }
+                }
+                job->joined |= 1ULL << participant;
+                job->activeWorkers++;
+                if(--job->openSlots == 0)
+                {
+                    removeJob(job);
+                }
+
+                lock.unlock();
+                runTasks(*job, participant);
+                lock.lock();
+
+                // The caller may return as soon as the last worker leaves
+                if(--job->activeWorkers == 0)
+                {
+                    mJobDone.notify_all();
+                }
+            }
+        }
+
+        mutex mMutex;                           // Guards the queue and the workers
+        condition_variable mWorkAvailable;      // Signaled when a job is posted
+        condition_variable mJobDone;            // Signaled when a worker leaves a job
+        bool mStop;                             // Set when the pool is destroyed
+        bool mAffinity;                         // Workers are pinned and have fixed participant numbers
+        vector<int> mCpus;                      // CPUs of the workers, see cpuOrder()
+#if defined(THREAD_POOL_AFFINITY)
+        cpu_set_t mProcessCpus;                 // Affinity mask of the process when the pool was created
+        bool mHaveProcessCpus;                  // mProcessCpus could be read
+#endif
+        Job* mJobs;                             // Queue of jobs with open slots
+        deque<function<void()> > mTasks;        // Tasks from post() not started yet
+        vector<thread> mWorkers;                // Worker threads
+};